@@ -3,12 +3,28 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <aclapi.h>
+#include <sddl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <winsvc.h>
 #include <io.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <winioctl.h>
+#include <math.h>
+#include <mmsystem.h>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include "vbicap_protocol.h"
+#include "vbicap_delta.h"
+#include "vbicap_average.h"
+#include "vbicap_levels.h"
+#include "vbicap_decimate.h"
+#include "vbicap_preview.h"
+
+#pragma comment(lib, "winmm.lib")
 
 // ---------------------------------------------------------------------------
 // Brooktree 848 registers
@@ -28,6 +44,7 @@
 #define BT848_IFORM_MUX0       (2<<5)
 #define BT848_IFORM_MUX1       (3<<5)
 #define BT848_IFORM_MUX2       (1<<5)
+#define BT848_IFORM_MUX3       (0<<5)
 #define BT848_IFORM_XTSEL      (3<<3)
 #define BT848_IFORM_XT0        (1<<3)
 #define BT848_IFORM_XT1        (2<<3)
@@ -149,6 +166,7 @@
 
 #define BT848_COLOR_FMT             0x0D4
 #define BT848_COLOR_FMT_RAW         0xee
+#define BT848_COLOR_FMT_YUY2        0x44
 
 #define BT848_COLOR_CTL                0x0D8
 #define BT848_COLOR_CTL_EXT_FRMRATE    (1<<7)
@@ -180,6 +198,7 @@
 #define BT848_INT_ETBF         (1<<23)
 
 #define BT848_INT_RISCS   (0xf<<28)
+#define BT848_INT_RISCS_SHIFT 28
 #define BT848_INT_RISC_EN (1<<27)
 #define BT848_INT_RACK    (1<<25)
 #define BT848_INT_FIELD   (1<<24)
@@ -256,6 +275,11 @@
 #define BT848_RISC_BYTE_NONE   0
 /* cause RISCI */
 #define BT848_RISC_IRQ         (1<<24)
+/* set the RISCS bits of INT_STAT to the given value when executed */
+#define BT848_RISC_SET_STATUS_SHIFT   16
+#define BT848_RISC_RESET_STATUS_SHIFT 20
+#define BT848_RISC_STATUS(s)   ((((~(s)) & 0x0f) << BT848_RISC_RESET_STATUS_SHIFT) | \
+                                (((s) & 0x0f) << BT848_RISC_SET_STATUS_SHIFT))
 /* RISC command is last one in this line */
 #define BT848_RISC_EOL         (1<<26)
 /* RISC command is first one in this line */
@@ -267,6 +291,19 @@
 #define BT848_RISC_JUMP        (0x07<<28)
 #define BT848_RISC_SYNC        (0x08<<28)
 
+/* Bt878 audio function (PCI function 1). INT_STAT, GPIO_DMA_CTL and
+   RISC_STRT_ADD are at the same offsets as the video function's, and its
+   RISC engine runs the same instructions. */
+#define BT878_A_PACKET_LEN     0x110
+
+#define BT878_A_DMA_CTL_ACAP_EN       (1<<4)
+#define BT878_A_DMA_CTL_DA_IOM_AFE    (0<<6)
+#define BT878_A_DMA_CTL_DA_SDR_SHIFT  8
+#define BT878_A_DMA_CTL_DA_ES2        (1<<13)
+#define BT878_A_DMA_CTL_A_SEL_SHIFT   24
+#define BT878_A_DMA_CTL_A_PWRDN       (1<<26)
+#define BT878_A_DMA_CTL_A_GAIN_SHIFT  28
+
 
 class ServiceHandle : Uncopyable
 {
@@ -497,6 +534,174 @@ void AndDataDword (DWORD Offset, DWORD Data);
 void OrDataByte(DWORD Offset, BYTE Data);
 void OrDataWord (DWORD Offset, WORD Data);
 void OrDataDword (DWORD Offset, DWORD Data);
+DWORD AudioReadDword(DWORD Offset);
+void AudioWriteDword(DWORD Offset, DWORD Data);
+
+// ---------------------------------------------------------------------------
+// Typed register access
+//
+// Every register access is a DeviceIoControl() round trip to the driver, and
+// MaskDataByte() and friends are two. A Bt848Register describes a register:
+// its offset, width in bytes, how it can be accessed, its value after a
+// reset and, for the registers the decoder has a copy of for each field, the
+// offset of the odd field's copy (the offset is the even field's). A
+// Bt848Field is some of the bits of a register.
+//
+// bt848Update<Register>() starts a change to a register, set<Field>(value)
+// changes a field, and apply() writes the result. The bits changed are part
+// of the type, so a change to the whole register is a single write, and
+// otherwise one read-modify-write covers all the fields. Both copies of a
+// paired register are written by the same call, from a read of the even
+// copy (this program always gives the copies the same value). The width
+// comes from the description, and setting a field of another register or
+// that doesn't fit, writing a read-only register, or changing part of a
+// write-only one doesn't compile. (There's no constexpr in VS2013, so the
+// descriptions are template parameters.)
+
+#define BT848_READ_WRITE   0
+#define BT848_READ_ONLY    1
+#define BT848_WRITE_ONLY   2
+#define BT848_WRITE_CLEAR  3   // readable; writing 1s clears bits
+
+template<DWORD Offset, int Bytes, int Access, DWORD Reset, DWORD OddOffset = 0> struct Bt848Register
+{
+    static_assert(Bytes == 1 || Bytes == 2 || Bytes == 4, "Registers are 1, 2 or 4 bytes.");
+    static const DWORD offset = Offset;
+    static const int bytes = Bytes;
+    static const int access = Access;
+    static const DWORD reset = Reset;
+    static const DWORD oddOffset = OddOffset;
+    static const DWORD all = (Bytes == 4 ? 0xffffffff : (1u << ((Bytes*8) & 31)) - 1);
+    static const int function = 0;
+};
+
+// A register of the Bt878's audio function, which has its own registers
+// (mapped separately, see AudioReadDword()), all accessed as dwords
+template<DWORD Offset, int Access> struct Bt878AudioRegister : Bt848Register<Offset, 4, Access, 0>
+{
+    static const int function = 1;
+};
+
+template<class R, int Shift, int Bits> struct Bt848Field
+{
+    static_assert(Shift >= 0 && Bits > 0 && Shift + Bits <= R::bytes*8, "The field doesn't fit in the register.");
+    typedef R Register;
+    static const int shift = Shift;
+    static const DWORD mask = (Bits == 32 ? 0xffffffff : (1u << (Bits & 31)) - 1) << (Shift & 31);
+};
+
+template<class Register> DWORD bt848Read()
+{
+    static_assert(Register::access != BT848_WRITE_ONLY, "The register is write-only.");
+    if (Register::function != 0)
+        return AudioReadDword(Register::offset);
+    if (Register::bytes == 1)
+        return ReadByte(Register::offset);
+    if (Register::bytes == 2)
+        return ReadWord(Register::offset);
+    return ReadDword(Register::offset);
+}
+
+// Write the whole of a register, and its odd field's copy if it has one
+template<class Register> void bt848Write(DWORD value)
+{
+    static_assert(Register::access != BT848_READ_ONLY, "The register is read-only.");
+    if (Register::function != 0) {
+        AudioWriteDword(Register::offset, value);
+        return;
+    }
+    DWORD offsets[2] = { Register::offset, Register::oddOffset };
+    for (int i = 0; i < (Register::oddOffset != 0 ? 2 : 1); ++i) {
+        if (Register::bytes == 1)
+            WriteByte(offsets[i], static_cast<BYTE>(value));
+        else if (Register::bytes == 2)
+            WriteWord(offsets[i], static_cast<WORD>(value));
+        else
+            WriteDword(offsets[i], value);
+    }
+}
+
+template<class Register, DWORD Changed = 0> class Bt848Update
+{
+public:
+    explicit Bt848Update(DWORD value = 0) : _value(value) { }
+
+    template<class Field> Bt848Update<Register, Changed | Field::mask> set(DWORD value) const
+    {
+        static_assert(std::is_same<typename Field::Register, Register>::value,
+            "The field is in a different register.");
+        return Bt848Update<Register, Changed | Field::mask>(
+            (_value & ~Field::mask) | ((value << Field::shift) & Field::mask));
+    }
+
+    void apply() const
+    {
+        static_assert(Changed != 0, "Nothing to change.");
+        static_assert(Changed == Register::all || Register::access == BT848_READ_WRITE,
+            "Only part of the register is changed, but it can't be read back.");
+        DWORD value = _value;
+        if (Changed != Register::all)
+            value |= bt848Read<Register>() & ~Changed;
+        bt848Write<Register>(value);
+    }
+
+private:
+    DWORD _value;
+};
+
+template<class Register> Bt848Update<Register> bt848Update() { return Bt848Update<Register>(); }
+
+typedef Bt848Register<BT848_DSTATUS,       1, BT848_READ_WRITE, 0x00>  Bt848Dstatus;
+typedef Bt848Register<BT848_IFORM,         1, BT848_READ_WRITE, 0x58>  Bt848Iform;
+typedef Bt848Register<BT848_TDEC,          1, BT848_READ_WRITE, 0x00>  Bt848Tdec;
+typedef Bt848Register<BT848_E_CROP,        1, BT848_READ_WRITE, 0x12, BT848_O_CROP>       Bt848Crop;
+typedef Bt848Register<BT848_E_VDELAY_LO,   1, BT848_READ_WRITE, 0x16, BT848_O_VDELAY_LO>  Bt848VdelayLo;
+typedef Bt848Register<BT848_E_VACTIVE_LO,  1, BT848_READ_WRITE, 0xe0, BT848_O_VACTIVE_LO> Bt848VactiveLo;
+typedef Bt848Register<BT848_E_HDELAY_LO,   1, BT848_READ_WRITE, 0x78, BT848_O_HDELAY_LO>  Bt848HdelayLo;
+typedef Bt848Register<BT848_E_HACTIVE_LO,  1, BT848_READ_WRITE, 0x80, BT848_O_HACTIVE_LO> Bt848HactiveLo;
+typedef Bt848Register<BT848_E_HSCALE_HI,   1, BT848_READ_WRITE, 0x02, BT848_O_HSCALE_HI>  Bt848HscaleHi;
+typedef Bt848Register<BT848_E_HSCALE_LO,   1, BT848_READ_WRITE, 0xac, BT848_O_HSCALE_LO>  Bt848HscaleLo;
+typedef Bt848Register<BT848_BRIGHT,        1, BT848_READ_WRITE, 0x00>  Bt848Bright;
+typedef Bt848Register<BT848_E_CONTROL,     1, BT848_READ_WRITE, 0x20, BT848_O_CONTROL>    Bt848Control;
+typedef Bt848Register<BT848_CONTRAST_LO,   1, BT848_READ_WRITE, 0xd8>  Bt848ContrastLo;
+typedef Bt848Register<BT848_SAT_U_LO,      1, BT848_READ_WRITE, 0xfe>  Bt848SatULo;
+typedef Bt848Register<BT848_SAT_V_LO,      1, BT848_READ_WRITE, 0xb4>  Bt848SatVLo;
+typedef Bt848Register<BT848_HUE,           1, BT848_READ_WRITE, 0x00>  Bt848Hue;
+typedef Bt848Register<BT848_E_SCLOOP,      1, BT848_READ_WRITE, 0x00, BT848_O_SCLOOP>     Bt848Scloop;
+typedef Bt848Register<BT848_OFORM,         1, BT848_READ_WRITE, 0x00>  Bt848Oform;
+typedef Bt848Register<BT848_E_VSCALE_HI,   1, BT848_READ_WRITE, 0x60, BT848_O_VSCALE_HI>  Bt848VscaleHi;
+typedef Bt848Register<BT848_E_VSCALE_LO,   1, BT848_READ_WRITE, 0x00, BT848_O_VSCALE_LO>  Bt848VscaleLo;
+typedef Bt848Register<BT848_ADELAY,        1, BT848_READ_WRITE, 0x68>  Bt848Adelay;
+typedef Bt848Register<BT848_BDELAY,        1, BT848_READ_WRITE, 0x5d>  Bt848Bdelay;
+typedef Bt848Register<BT848_ADC,           1, BT848_READ_WRITE, 0x82>  Bt848Adc;
+typedef Bt848Register<BT848_E_VTC,         1, BT848_READ_WRITE, 0x00, BT848_O_VTC>        Bt848Vtc;
+typedef Bt848Register<BT848_SRESET,        1, BT848_WRITE_ONLY, 0x00>  Bt848Sreset;
+typedef Bt848Register<BT848_TGCTRL,        1, BT848_READ_WRITE, 0x00>  Bt848Tgctrl;
+typedef Bt848Register<BT848_COLOR_FMT,     1, BT848_READ_WRITE, 0x00>  Bt848ColorFmt;
+typedef Bt848Register<BT848_COLOR_CTL,     1, BT848_READ_WRITE, 0x00>  Bt848ColorCtl;
+typedef Bt848Register<BT848_CAP_CTL,       1, BT848_READ_WRITE, 0x00>  Bt848CapCtl;
+typedef Bt848Register<BT848_VBI_PACK_SIZE, 1, BT848_READ_WRITE, 0x00>  Bt848VbiPackSize;
+typedef Bt848Register<BT848_VBI_PACK_DEL,  1, BT848_READ_WRITE, 0x00>  Bt848VbiPackDel;
+typedef Bt848Register<BT848_PLL_XCI,       1, BT848_READ_WRITE, 0x00>  Bt848PllXci;
+typedef Bt848Register<BT848_INT_STAT,      4, BT848_WRITE_CLEAR, 0x00> Bt848IntStat;
+typedef Bt848Register<BT848_INT_MASK,      4, BT848_READ_WRITE, 0x00>  Bt848IntMask;
+typedef Bt848Register<BT848_GPIO_DMA_CTL,  2, BT848_READ_WRITE, 0x00>  Bt848GpioDmaCtl;
+typedef Bt848Register<BT848_RISC_STRT_ADD, 4, BT848_READ_WRITE, 0x00>  Bt848RiscStrtAdd;
+// the low byte of the 24-bit GPIO_REG_INP
+typedef Bt848Register<BT848_GPIO_REG_INP,  1, BT848_READ_WRITE, 0x00>  Bt848GpioRegInp;
+
+typedef Bt848Field<Bt848Iform, 5, 2>        Bt848IformMuxsel;
+typedef Bt848Field<Bt848Iform, 3, 2>        Bt848IformXtsel;
+typedef Bt848Field<Bt848Iform, 0, 3>        Bt848IformFormat;
+typedef Bt848Field<Bt848Control, 6, 1>      Bt848ControlComp;
+typedef Bt848Field<Bt848Control, 2, 1>      Bt848ControlConMsb;
+typedef Bt848Field<Bt848CapCtl, 0, 4>       Bt848CapCtlCapture;
+typedef Bt848Field<Bt848GpioDmaCtl, 0, 2>   Bt848GpioDmaCtlEnable;
+
+typedef Bt878AudioRegister<BT848_INT_STAT,      BT848_WRITE_CLEAR> Bt878AudioIntStat;
+typedef Bt878AudioRegister<BT848_GPIO_DMA_CTL,  BT848_READ_WRITE>  Bt878AudioDmaCtl;
+typedef Bt878AudioRegister<BT878_A_PACKET_LEN,  BT848_READ_WRITE>  Bt878AudioPacketLen;
+typedef Bt878AudioRegister<BT848_RISC_STRT_ADD, BT848_READ_WRITE>  Bt878AudioRiscStrtAdd;
 
 void HwPci_RestoreState( void );
 void ManageDword(DWORD Offset);
@@ -532,23 +737,494 @@ typedef enum
 // ----------------------------------------------------------------------------
 // Declaration of internal variables
 //
+// Default capture geometry, overridable on the command line (see CaptureConfig)
 #define VBI_LINES_PER_FIELD      450
-#define VBI_LINES_PER_FRAME     (VBI_LINES_PER_FIELD * 2)
 #define VBI_LINE_SIZE            2048
-#define VBI_DATA_SIZE           (VBI_LINE_SIZE * VBI_LINES_PER_FRAME)
 #define VBI_DMA_PAGE_SIZE        4096
 #define VBI_SPL                  1028
+#define VBI_OUTPUT_LINE_SIZE     1024
 #define VDELAY                   2
 #define HDELAY                   2
 
+// Defaults with video=1 (see CaptureConfig::video): whole scanlines of raw
+// samples for the 12 lines of the vertical blanking interval before the
+// picture, which is decoded at 640 square pixels by 240 lines per field
+#define VBI_VIDEO_LINES_PER_FIELD  12
+#define VBI_VIDEO_SPL              1820
+#define VBI_VIDEO_VDELAY           0x1a
+#define VBI_VIDEO_WIDTH            640
+#define VBI_VIDEO_LINES            240
+// NTSC horizontal scaling: HDELAY at 640 pixels, and the pixels in the
+// picture's width and in a whole line at 640 pixels
+#define VBI_VIDEO_HDELAY           135
+#define VBI_VIDEO_SCALED_WIDTH     780
+#define VBI_VIDEO_TOTAL_WIDTH      910
+// the widest picture that doesn't need a negative HSCALE
+#define VBI_VIDEO_MAX_WIDTH        746
+
+// The input used by default (MUX3), and the most inputs that can be switched
+// between
+#define VBI_DEFAULT_INPUT         3
+#define VBI_MAX_INPUTS            4
+
+// With audio=1 (see AudioCapture): the clock divided by audio_divider to
+// give the sample rate, the defaults for audio_divider and audio_input (2,
+// the line input), and the ring the card writes the samples to, in blocks
+// of half a page (it can only report which of 16 blocks it's writing)
+#define VBI_AUDIO_CLOCK           1792000
+#define VBI_AUDIO_DIVIDER         15
+#define VBI_AUDIO_INPUT           2
+#define VBI_AUDIO_BLOCKS          16
+#define VBI_AUDIO_BLOCK_BYTES     2048
+#define VBI_AUDIO_RING_BYTES      (VBI_AUDIO_BLOCKS*VBI_AUDIO_BLOCK_BYTES)
+
+// A block is one RISC WRITE and one packet of PACKET_LEN, whose byte counts
+// are 12 bits
+#if VBI_AUDIO_BLOCK_BYTES > 0xfff
+#error The audio blocks must be smaller than 4096 bytes.
+#endif
+// The RISCS bits of INT_STAT hold the number of the block being written
+#if VBI_AUDIO_BLOCKS > 16
+#error There can be at most 16 audio blocks.
+#endif
+
 #define VBI_FRAME_CAPTURE_COUNT   5
 #define VBI_FIELD_CAPTURE_COUNT  (VBI_FRAME_CAPTURE_COUNT * 2)
 
-
-#define RISC_CODE_LENGTH         (4096 + VBI_LINES_PER_FIELD*8*VBI_FIELD_CAPTURE_COUNT) // currently apx. 36 DWORDs per field, total 1488
+// The RISC program stamps the number of the last completed field plus one
+// into the 4 RISCS bits of INT_STAT (0 meaning none yet), so there can be at
+// most 15 fields in the ring.
+#if VBI_FIELD_CAPTURE_COUNT > 15
+#error Too many fields to identify with the RISC status bits
+#endif
 typedef DWORD PHYS;
 
+// ----------------------------------------------------------------------------
+// Capture geometry
+//
+class CaptureConfig
+{
+public:
+    CaptureConfig()
+      : linesPerField(0),
+        samplesPerLine(0),
+        vdelay(-1),
+        hdelay(-1),
+        lineStride(VBI_LINE_SIZE),
+        outputBytesPerLine(0),
+        roiTop(0),
+        roiLines(0),
+        roiLeft(0),
+        roiSamples(0),
+        averageFields(0),
+        averageReject(0),
+        levels(0),
+        autoLevel(0),
+        contrast(0x1d8),
+        brightness(0),
+        crush(1),
+        agc(1),
+        burst(0),
+        warm(1),
+        decimate(0),
+        preview(0),
+        previewLine(1824),
+        previewBudget(200),
+        video(0),
+        videoWidth(VBI_VIDEO_WIDTH),
+        videoLines(VBI_VIDEO_LINES),
+        inputCount(1),
+        dwell(2),
+        settle(3),
+        audio(0),
+        audioDivider(VBI_AUDIO_DIVIDER),
+        audioInput(VBI_AUDIO_INPUT),
+        audioGain(0)
+    {
+        inputs[0] = VBI_DEFAULT_INPUT;
+    }
+
+    // Parse a "name=value" command line argument. Returns false if the name
+    // isn't one of ours.
+    bool parse(String argument)
+    {
+        static const struct
+        {
+            const char* name;
+            int CaptureConfig::* member;
+        } options[] = {
+            { "lines", &CaptureConfig::linesPerField },
+            { "spl", &CaptureConfig::samplesPerLine },
+            { "vdelay", &CaptureConfig::vdelay },
+            { "hdelay", &CaptureConfig::hdelay },
+            { "stride", &CaptureConfig::lineStride },
+            { "out", &CaptureConfig::outputBytesPerLine },
+            { "roi_top", &CaptureConfig::roiTop },
+            { "roi_lines", &CaptureConfig::roiLines },
+            { "roi_left", &CaptureConfig::roiLeft },
+            { "roi_samples", &CaptureConfig::roiSamples },
+            { "average", &CaptureConfig::averageFields },
+            { "reject", &CaptureConfig::averageReject },
+            { "levels", &CaptureConfig::levels },
+            { "autolevel", &CaptureConfig::autoLevel },
+            { "contrast", &CaptureConfig::contrast },
+            { "bright", &CaptureConfig::brightness },
+            { "crush", &CaptureConfig::crush },
+            { "agc", &CaptureConfig::agc },
+            { "burst", &CaptureConfig::burst },
+            { "warm", &CaptureConfig::warm },
+            { "decimate", &CaptureConfig::decimate },
+            { "preview", &CaptureConfig::preview },
+            { "preview_line", &CaptureConfig::previewLine },
+            { "preview_budget", &CaptureConfig::previewBudget },
+            { "video", &CaptureConfig::video },
+            { "video_width", &CaptureConfig::videoWidth },
+            { "video_lines", &CaptureConfig::videoLines },
+            { "dwell", &CaptureConfig::dwell },
+            { "settle", &CaptureConfig::settle },
+            { "audio", &CaptureConfig::audio },
+            { "audio_divider", &CaptureConfig::audioDivider },
+            { "audio_input", &CaptureConfig::audioInput },
+            { "audio_gain", &CaptureConfig::audioGain }};
+
+        NullTerminatedString s(argument);
+        const char* p = s;
+        if (strncmp(p, "inputs=", 7) == 0) {
+            // a comma-separated list of inputs to take turns with
+            p += 7;
+            inputCount = 0;
+            do {
+                char* end;
+                long value = strtol(p, &end, 0);
+                if (end == p || (*end != 0 && *end != ',') || inputCount == VBI_MAX_INPUTS)
+                    throw Exception("Invalid value for inputs.");
+                inputs[inputCount++] = static_cast<int>(value);
+                p = (*end == ',' ? end + 1 : end);
+            } while (*p != 0);
+            return true;
+        }
+        for (int i = 0; i < sizeof(options)/sizeof(options[0]); ++i) {
+            size_t n = strlen(options[i].name);
+            if (strncmp(p, options[i].name, n) != 0 || p[n] != '=')
+                continue;
+            char* end;
+            long value = strtol(p + n + 1, &end, 0);
+            if (end == p + n + 1 || *end != 0)
+                throw Exception(String("Invalid value for ") + options[i].name + ".");
+            this->*(options[i].member) = static_cast<int>(value);
+            return true;
+        }
+        return false;
+    }
+
+    // Check the geometry against the hardware limits and fill in the
+    // defaults that depend on other settings.
+    void validate()
+    {
+        // The defaults for the geometry depend on whether the picture is
+        // decoded as well
+        if (linesPerField == 0)
+            linesPerField = (video != 0 ? VBI_VIDEO_LINES_PER_FIELD : VBI_LINES_PER_FIELD);
+        if (samplesPerLine == 0)
+            samplesPerLine = (video != 0 ? VBI_VIDEO_SPL : VBI_SPL);
+        if (vdelay == -1)
+            vdelay = (video != 0 ? VBI_VIDEO_VDELAY : VDELAY);
+        if (hdelay == -1)
+            hdelay = (video != 0 ? (VBI_VIDEO_HDELAY*videoWidth/VBI_VIDEO_WIDTH) & 0x3fe : HDELAY);
+
+        // VACTIVE, VDELAY and HDELAY are 10 bits, with the top 2 in CROP
+        if (linesPerField < 1 || linesPerField > 0x3ff)
+            throw Exception("lines must be between 1 and 1023.");
+        if (vdelay < 0 || vdelay > 0x3ff)
+            throw Exception("vdelay must be between 0 and 1023.");
+        if (hdelay < 0 || hdelay > 0x3ff)
+            throw Exception("hdelay must be between 0 and 1023.");
+        // In VBI frame output mode the line length is set by the RISC WRITE
+        // byte count (12 bits) rather than HACTIVE, which is programmed from
+        // the low 10 bits, as it always has been for the default of 1028.
+        // The FIFO delivers whole DWORDs.
+        if (samplesPerLine < 4 || samplesPerLine > 0xffc || (samplesPerLine & 3) != 0)
+            throw Exception("spl must be a multiple of 4 between 4 and 4092.");
+
+        // The region of interest defaults to the whole field. Lines and
+        // samples outside it are SKIPped by the RISC program.
+        if (roiLines == 0)
+            roiLines = linesPerField - roiTop;
+        if (roiSamples == 0)
+            roiSamples = samplesPerLine - roiLeft;
+        if (roiTop < 0 || roiLines < 1 || roiTop + roiLines > linesPerField)
+            throw Exception("roi_top and roi_lines must be within the field.");
+        if (roiLeft < 0 || roiSamples < 4 || roiLeft + roiSamples > samplesPerLine ||
+            (roiLeft & 3) != 0 || (roiSamples & 3) != 0)
+            throw Exception("roi_left and roi_samples must be multiples of 4 within the line.");
+
+        if (lineStride < roiSamples || (lineStride & 3) != 0)
+            throw Exception("stride must be a multiple of 4 no smaller than the line.");
+        // Clients get the first 1024 samples of full lines (the last 4 are
+        // in the next line's sync) and the whole window otherwise
+        if (outputBytesPerLine == 0)
+            outputBytesPerLine = (roiSamples == VBI_SPL ? VBI_OUTPUT_LINE_SIZE : roiSamples);
+        if (outputBytesPerLine < 1 || outputBytesPerLine > roiSamples)
+            throw Exception("out must be between 1 and the line width.");
+
+        // 16-bit counts of the samples kept
+        if (averageFields < 0 || averageFields > 0xffff)
+            throw Exception("average must be between 0 and 65535.");
+        if (averageReject < 0 || averageReject > 255)
+            throw Exception("reject must be between 0 and 255.");
+        if (decimate != 0 && decimate != 8 && decimate != 16)
+            throw Exception("decimate must be 0, 8 or 16.");
+        if (decimate == 16 && averageFields > 1)
+            throw Exception("Averages are already 16-bit, so use decimate=8 with average.");
+        if (preview < 0)
+            throw Exception("preview must be 0 or more.");
+        if (previewLine < VBI_PREVIEW_BOX_SAMPLES || previewLine > 0x10000)
+            throw Exception("preview_line must be between 16 and 65536.");
+        if (previewBudget < 1)
+            throw Exception("preview_budget must be at least 1.");
+
+        // In VBI line output mode the card sends raw samples for the lines
+        // of the vertical blanking interval, up to VDELAY (in half lines),
+        // and decoded pixels for the rest. VBI_PACK_SIZE is 9 bits of
+        // DWORDs, and VACTIVE counts the lines of both fields.
+        if (video != 0) {
+            if (samplesPerLine > 0x7fc)
+                throw Exception("With video=1, spl must be at most 2044.");
+            if (linesPerField*2 > vdelay)
+                throw Exception("With video=1, lines must be at most vdelay/2.");
+            if (videoWidth < 2 || videoWidth > VBI_VIDEO_MAX_WIDTH || (videoWidth & 1) != 0)
+                throw Exception("video_width must be an even number between 2 and 746.");
+            if (videoLines < 1 || videoLines*2 > 0x3ff)
+                throw Exception("video_lines must be between 1 and 511.");
+        }
+
+        for (int i = 0; i < inputCount; ++i)
+            if (inputs[i] < 0 || inputs[i] >= VBI_MAX_INPUTS)
+                throw Exception("inputs must be between 0 and 3.");
+        // The field in progress when the input is switched is torn, so at
+        // least one field is always thrown away
+        if (dwell < 1 || settle < 1)
+            throw Exception("dwell and settle must be at least 1.");
+        if (inputCount > 1 && averageFields > 1)
+            throw Exception("Fields from different inputs can't be averaged.");
+
+        // The audio ADC's decimation filter takes dividers of 4 to 15, A_SEL
+        // is 2 bits and A_GAIN 4
+        if (audio != 0) {
+            if (audioDivider < 4 || audioDivider > 15)
+                throw Exception("audio_divider must be between 4 and 15.");
+            if (audioInput < 0 || audioInput > 3)
+                throw Exception("audio_input must be between 0 and 3.");
+            if (audioGain < 0 || audioGain > 15)
+                throw Exception("audio_gain must be between 0 and 15.");
+            if (averageFields > 1)
+                throw Exception("Audio can't be captured with averaged fields.");
+        }
+
+        // CONTRAST is 9 bits, with the top one in E_CONTROL and O_CONTROL,
+        // and BRIGHT is signed
+        if (contrast < 0 || contrast > 0x1ff)
+            throw Exception("contrast must be between 0 and 511.");
+        if (brightness < -128 || brightness > 127)
+            throw Exception("bright must be between -128 and 127.");
+    }
+
+    // Whether each field's signal levels are measured
+    bool measureLevels() const { return levels != 0 || autoLevel != 0; }
+
+    bool fullField() const { return roiLines == linesPerField && roiSamples == samplesPerLine; }
+    int fieldBytes() const { return lineStride*roiLines; }
+    int outputFieldBytes() const { return outputBytesPerLine*roiLines; }
+    int videoLineBytes() const { return video != 0 ? videoWidth*2 : 0; }
+    int videoFieldBytes() const { return videoLineBytes()*videoLines; }
+    // the nominal audio sample rate, or 0 without audio
+    int audioRate() const { return audio != 0 ? VBI_AUDIO_CLOCK/audioDivider : 0; }
+    // Up to 6 DWORDs per line: SKIP, two WRITEs (if the window crosses a
+    // page boundary) and SKIP, and for the picture a SYNC and up to two
+    // WRITEs per line.
+    int riscCodeLength() const
+    {
+        int fieldBytes = linesPerField*24 + (video != 0 ? 8 + videoLines*16 : 0);
+        return 4096 + fieldBytes*VBI_FIELD_CAPTURE_COUNT;
+    }
+
+    // HSCALE for the decoded picture (bttv's formula for NTSC)
+    int videoHscale() const
+    {
+        int scaledWidth = videoWidth*VBI_VIDEO_SCALED_WIDTH/VBI_VIDEO_WIDTH;
+        return VBI_VIDEO_TOTAL_WIDTH*4096/scaledWidth - 4096;
+    }
+
+    // The CAP_CTL bits that start capturing
+    int captureBits() const
+    {
+        if (video == 0)
+            return BT848_CAP_CTL_CAPTURE_EVEN | BT848_CAP_CTL_CAPTURE_ODD;
+        return BT848_CAP_CTL_CAPTURE_VBI_EVEN | BT848_CAP_CTL_CAPTURE_VBI_ODD |
+            BT848_CAP_CTL_CAPTURE_EVEN | BT848_CAP_CTL_CAPTURE_ODD;
+    }
+
+    int linesPerField;
+    int samplesPerLine;
+    int vdelay;
+    int hdelay;
+    int lineStride;
+    int outputBytesPerLine;
+    int roiTop;
+    int roiLines;
+    int roiLeft;
+    int roiSamples;
+    // Fields of each parity averaged into each field sent (0 or 1 to not
+    // average), and the threshold for leaving samples out of the average
+    int averageFields;
+    int averageReject;
+    // Send each field's signal levels to tagged clients and recordings, and
+    // adjust contrast and brightness between sessions to fit the signal to
+    // the ADC's range (see LevelControl)
+    int levels;
+    int autoLevel;
+    // Initial luma gain and offset (CONTRAST and BRIGHT), and whether the
+    // ADC's AGC and its white crush adjustment are used
+    int contrast;
+    int brightness;
+    int crush;
+    int agc;
+    // Send the colour burst of each line with each field (see vbicap_burst.h)
+    int burst;
+    // Keep the card's state if it's already set up for this configuration
+    // (see RegisterSetup)
+    int warm;
+    // Send 4 samples per carrier cycle of this many bits instead of 8 (see
+    // vbicap_decimate.h), or 0 not to decimate
+    int decimate;
+    // Publish a preview of every nth field (0 for none) with scanlines of
+    // previewLine samples, spending previewBudget microseconds per field on
+    // them on average (see PreviewBoard)
+    int preview;
+    int previewLine;
+    int previewBudget;
+    // Capture the card's decoding of the picture, videoLines lines of
+    // videoWidth pixels in YUV 4:2:2, alongside raw samples of the lines
+    // before it (see VBICAP_VIDEO_MAGIC). Only tagged clients and sinks get
+    // the pictures.
+    int video;
+    int videoWidth;
+    int videoLines;
+    // The inputs (0-3 for MUX0-MUX3) to capture from. With more than one,
+    // the card takes turns of dwell fields with each, throwing away settle
+    // fields after each switch (see InputScheduler).
+    int inputs[VBI_MAX_INPUTS];
+    int inputCount;
+    int dwell;
+    int settle;
+    // Capture the audio function of a Bt878 as well, at VBI_AUDIO_CLOCK/
+    // audioDivider samples per second from audio input audioInput with gain
+    // audioGain (see AudioCapture). Only tagged clients and sinks get the
+    // samples.
+    int audio;
+    int audioDivider;
+    int audioInput;
+    int audioGain;
+};
+
+
+// ----------------------------------------------------------------------------
+// Line copy
+//
+// Copy the first width bytes of each line of a field from the DMA buffer to
+// a packed output buffer, in one go if the lines are already packed. A copy
+// with the width as a compile-time constant was no faster: memcpy of a line
+// of this size isn't inlined either way.
+static void copyLines(Byte* out, const Byte* in, int lines, int inStride, int width)
+{
+    if (inStride == width) {
+        memcpy(out, in, width*lines);
+        return;
+    }
+    for (int row = 0; row < lines; ++row, in += inStride, out += width)
+        memcpy(out, in, width);
+}
+
+// The copy loop the daemon had before the geometry could be configured
+static void copyLinesOriginal(Byte* out, const Byte* in, int, int, int)
+{
+    for (int row = 0; row < VBI_LINES_PER_FIELD; row++, in += VBI_LINE_SIZE, out += 1024)
+        memcpy(out, in, 1024);
+}
+
+// Compare the copy for the given geometry against the original copy loop for
+// the default geometry, and the copy of the default geometry.
+static void benchmarkCopyKernels(const CaptureConfig& config)
+{
+    const int fields = 2000;
+    int inBytes = config.fieldBytes();
+    if (inBytes < VBI_LINE_SIZE*VBI_LINES_PER_FIELD)
+        inBytes = VBI_LINE_SIZE*VBI_LINES_PER_FIELD;
+    int outBytes = config.outputFieldBytes();
+    if (outBytes < VBI_OUTPUT_LINE_SIZE*VBI_LINES_PER_FIELD)
+        outBytes = VBI_OUTPUT_LINE_SIZE*VBI_LINES_PER_FIELD;
+    Array<Byte> in(inBytes);
+    Array<Byte> out(outBytes);
+    memset(&in[0], 0x55, in.count());
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    struct
+    {
+        const char* name;
+        void (*kernel)(Byte* out, const Byte* in, int lines, int inStride, int width);
+        int lines;
+        int inStride;
+        int width;
+    } cases[] = {
+        { "original loop", copyLinesOriginal,
+          VBI_LINES_PER_FIELD, VBI_LINE_SIZE, VBI_OUTPUT_LINE_SIZE },
+        { "default geometry", copyLines,
+          VBI_LINES_PER_FIELD, VBI_LINE_SIZE, VBI_OUTPUT_LINE_SIZE },
+        { "configured geometry", copyLines,
+          config.roiLines, config.lineStride, config.outputBytesPerLine }};
+
+    for (int i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        for (int field = 0; field < fields; ++field)
+            cases[i].kernel(&out[0], &in[0], cases[i].lines, cases[i].inStride, cases[i].width);
+        QueryPerformanceCounter(&end);
+        double seconds = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        int microseconds = static_cast<int>(seconds*1000000/fields);
+        int bytes = cases[i].lines*cases[i].width;
+        console.write(String(cases[i].name) + ": " + decimal(microseconds) + "us per field, " +
+            decimal(static_cast<int>(bytes*fields/seconds/1000000)) + "MB/s\n");
+    }
+
+    // Decimation straight out of the DMA buffers (see vbicap_decimate.h)
+    // does the copy's job as well
+    for (int bits = 8; bits <= 16; bits += 8) {
+        VbiDecimator decimator(bits);
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        for (int field = 0; field < fields; ++field) {
+            decimator.decimate(&out[0], &in[0], config.roiLines, config.lineStride,
+                config.outputBytesPerLine & ~1);
+        }
+        QueryPerformanceCounter(&end);
+        double seconds = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+        int microseconds = static_cast<int>(seconds*1000000/fields);
+        int bytes = config.roiLines*config.outputBytesPerLine;
+        console.write(String("decimate to ") + decimal(bits) + " bits: " + decimal(microseconds) +
+            "us per field, " + decimal(static_cast<int>(bytes*fields/seconds/1000000)) + "MB/s in\n");
+    }
+}
+
+
 AutoHandle m_hFile;
+
+// the fault injection scenario being run, if any
+class FaultInjector;
+static FaultInjector* m_faults = NULL;
+static void injectRegisterLatency();
+
 DWORD HwDrv_SendCommandEx( DWORD dwIOCommand,
                            LPVOID pvInput,
                            DWORD dwInputLength,
@@ -557,6 +1233,7 @@ DWORD HwDrv_SendCommandEx( DWORD dwIOCommand,
                            LPDWORD pdwReturnedLength
                          )
 {
+    injectRegisterLatency();
     if (DeviceIoControl(
                         m_hFile,
                         dwIOCommand,
@@ -584,6 +1261,8 @@ DWORD HwDrv_SendCommand( DWORD dwIOCommand,
 {
     DWORD dwDummy;
 
+    injectRegisterLatency();
+
     if(DeviceIoControl(
                         m_hFile,
                         dwIOCommand,
@@ -616,7 +1295,7 @@ typedef struct
 class HardwareMemory
 {
 public:
-    HardwareMemory() : _valid(false) { }
+    HardwareMemory() : _valid(false), pMemStruct(NULL), AllocatedBlock(NULL) { }
 
     void* GetUserPointer()
     {
@@ -733,9 +1412,6 @@ public:
         if (AllocatedBlock != NULL)
             free((void*)AllocatedBlock);
     }
-
-private:
-    bool _valid;
 };
 
 
@@ -766,6 +1442,7 @@ public:
         if(status != ERROR_SUCCESS || pMemStruct->dwUser == 0)
         {
             free(pMemStruct);
+            pMemStruct = NULL;
             return FALSE;
         }
         _valid = true;
@@ -783,15 +1460,59 @@ public:
             free(pMemStruct);
         }
     }
-private:
-    bool _valid;
 };
 
 
 
+// Emit the RISC instructions to write bytes bytes of a line to pUser, the
+// first with the given SOL bit and the last with the given EOL bit. Returns
+// the new end of the program.
+static DWORD* riscWrite(DWORD* pRiscCode, HardwareMemory& memory, BYTE* pUser, DWORD bytes, DWORD sol, DWORD eol)
+{
+    while (bytes > 0) {
+        // a window that crosses a page boundary may not be contiguous in
+        // physical memory, so is written in two pieces
+        DWORD GotBytes;
+        PHYS pPhysical = memory.TranslateToPhysical(pUser, bytes, &GotBytes);
+        if (pPhysical == 0)
+            throw Exception("Memory error.");
+        if (GotBytes > bytes)
+            GotBytes = bytes;
+        *(pRiscCode++) = BT848_RISC_WRITE | sol | (GotBytes == bytes ? eol : 0) | GotBytes;
+        *(pRiscCode++) = pPhysical;
+        sol = 0;
+        pUser += GotBytes;
+        bytes -= GotBytes;
+    }
+    return pRiscCode;
+}
+
+// Emit the RISC instructions for one line of the field: skip the samples
+// outside the region of interest and write the rest to pUser (or skip the
+// whole line if pUser is NULL). Returns the new end of the program.
+static DWORD* riscLine(DWORD* pRiscCode, const CaptureConfig& config, HardwareMemory& memory, BYTE* pUser)
+{
+    if (pUser == NULL) {
+        *(pRiscCode++) = BT848_RISC_SKIP | BT848_RISC_SOL | BT848_RISC_EOL | config.samplesPerLine;
+        return pRiscCode;
+    }
+    DWORD sol = BT848_RISC_SOL;
+    if (config.roiLeft > 0) {
+        *(pRiscCode++) = BT848_RISC_SKIP | sol | config.roiLeft;
+        sol = 0;
+    }
+    int after = config.samplesPerLine - config.roiLeft - config.roiSamples;
+    pRiscCode = riscWrite(pRiscCode, memory, pUser, config.roiSamples, sol, after == 0 ? BT848_RISC_EOL : 0);
+    if (after > 0)
+        *(pRiscCode++) = BT848_RISC_SKIP | BT848_RISC_EOL | after;
+    return pRiscCode;
+}
+
+
 static DWORD  m_BusNumber;
 static DWORD  m_SlotNumber;
 static DWORD  m_MemoryBase;
+static DWORD  m_AudioMemoryBase;  // the audio function's registers, with audio=1
 static DWORD  m_InitialACPIStatus;
 
 // forward declarations
@@ -1109,6 +1830,54 @@ BOOL HwPci_SetPCIConfigOffset(BYTE* pbPCIConfig, DWORD Offset, DWORD Bus, DWORD
     return TRUE;
 }
 
+// ----------------------------------------------------------------------------
+// Waiting for the card
+//
+// Rather than sleeping for as long as the slowest card might take, poll
+// something that shows the card is ready every millisecond, up to a timeout.
+// Returns false if the timeout passed first.
+static bool pollUntil(bool (*ready)(), DWORD timeoutMs)
+{
+    DWORD start = timeGetTime();
+    while (!ready()) {
+        if (timeGetTime() - start >= timeoutMs)
+            return false;
+        Sleep(1);
+    }
+    return true;
+}
+
+// Memory space and bus mastering are enabled in the PCI command register
+static bool pciCommandReady()
+{
+    BYTE command = 0;
+    return HwPci_GetPCIConfigOffset(&command, 0x04, m_BusNumber, m_SlotNumber) &&
+        (command & 0x06) == 0x06;
+}
+
+// The power management status register says D0
+static bool pciPoweredUp()
+{
+    BYTE status = 3;
+    return HwPci_GetPCIConfigOffset(&status, 0x50, m_BusNumber, m_SlotNumber) &&
+        (status & 3) == 0;
+}
+
+// After a software reset the registers read back their reset values (a
+// card that isn't responding yet reads as all 1s)
+static bool chipReset()
+{
+    return bt848Read<Bt848Iform>() == Bt848Iform::reset &&
+        bt848Read<Bt848VactiveLo>() == Bt848VactiveLo::reset &&
+        bt848Read<Bt848ContrastLo>() == Bt848ContrastLo::reset;
+}
+
+#define VBI_PCI_TIMEOUT_MS    500
+#define VBI_RESET_TIMEOUT_MS  50
+// PCI power management requires this long after D3hot to D0 before the
+// device is accessed
+#define VBI_D3_RECOVERY_MS    10
+
 // ----------------------------------------------------------------------------
 // Initialize PCI card
 // - callback, invoked by the PCI driver during initial card setup
@@ -1128,11 +1897,14 @@ static void Bt8x8_ResetChip( DWORD m_BusNumber, DWORD m_SlotNumber )
       {
          Command |= 0x06;
          HwPci_SetPCIConfigOffset(&Command, 0x04, m_BusNumber, m_SlotNumber);
-         Sleep(500);
+         if (!pollUntil(pciCommandReady, VBI_PCI_TIMEOUT_MS))
+            console.write("PCI command register didn't take the new value.\n");
       }
    }
 
    WriteByte(BT848_SRESET, 0);
+   if (!pollUntil(chipReset, VBI_RESET_TIMEOUT_MS))
+      console.write("Card didn't finish its software reset in time.\n");
 }
 
 
@@ -1151,7 +1923,9 @@ static void HwPci_SetACPIStatus(int ACPIStatus)
 
         if(ACPIStatus == 0)
         {
-            Sleep(500);
+            if (!pollUntil(pciPoweredUp, VBI_PCI_TIMEOUT_MS))
+                console.write("Card didn't report powering up.\n");
+            Sleep(VBI_D3_RECOVERY_MS);
             Bt8x8_ResetChip(m_BusNumber, m_SlotNumber);
         }
     }
@@ -1238,141 +2012,3243 @@ void OrDataDword (DWORD Offset, DWORD Data)
     HwPci_OrDataDword(Offset, Data);
 }
 
+DWORD AudioReadDword(DWORD Offset)
+{
+    if (!CardOpened || m_AudioMemoryBase == 0) return 0;
+    TDSDrvParam hwParam;
+    DWORD dwReturnedLength;
+    DWORD dwValue = 0;
+    hwParam.dwAddress = m_AudioMemoryBase + Offset;
+    HwDrv_SendCommandEx(IOCTL_DSDRV_READMEMORYDWORD, &hwParam, sizeof(hwParam.dwAddress),
+        &dwValue, sizeof(dwValue), &dwReturnedLength);
+    return dwValue;
+}
+void AudioWriteDword(DWORD Offset, DWORD Data)
+{
+    if (!CardOpened || m_AudioMemoryBase == 0) return;
+    TDSDrvParam hwParam;
+    hwParam.dwAddress = m_AudioMemoryBase + Offset;
+    hwParam.dwValue = Data;
+    HwDrv_SendCommand(IOCTL_DSDRV_WRITEMEMORYDWORD, &hwParam, sizeof(hwParam));
+}
 
-class DMAEnable
+
+// ----------------------------------------------------------------------------
+// DMA error monitoring
+//
+// INT_STAT bits after which the data in the current field can't be trusted,
+// though the RISC engine keeps running
+#define VBI_INT_FIELD_ERRORS  (BT848_INT_OFLOW | BT848_INT_FDSR)
+// INT_STAT bits after which the RISC engine has to be restarted
+#define VBI_INT_RISC_ERRORS   (BT848_INT_PPERR | BT848_INT_RIPERR | BT848_INT_PABORT | BT848_INT_OCERR | BT848_INT_SCERR)
+// if no field completes for this long while a video signal is present, the
+// RISC engine is assumed to have stalled (about 6 field periods)
+#define VBI_STALL_TIMEOUT_MS  100
+
+class DmaErrorMonitor
 {
 public:
-    DMAEnable()
+    DmaErrorMonitor() : _lastProgressToken(0), _stalls(0), _restarts(0), _laps(0)
     {
-        MaskDataByte(BT848_CAP_CTL, BT848_CAP_CTL_CAPTURE_EVEN | BT848_CAP_CTL_CAPTURE_ODD, 0x0f);
-        OrDataWord (BT848_GPIO_DMA_CTL, 3);
+        for (int i = 0; i < errorClassCount; ++i)
+            _counts[i] = 0;
+        _lastProgress = GetTickCount();
     }
-    ~DMAEnable()
+
+    // Count and clear the error bits in the given INT_STAT value. The RISCS
+    // bits of INT_STAT change with every field, so they show whether the RISC
+    // engine is making progress. Returns the error bits that were set.
+    DWORD check(DWORD status)
     {
-        AndDataWord (BT848_GPIO_DMA_CTL, ~3);
-        MaskDataByte(BT848_CAP_CTL, 0, 0x0f);      
+        DWORD errors = status & (VBI_INT_FIELD_ERRORS | VBI_INT_RISC_ERRORS);
+        if (errors != 0) {
+            // INT_STAT bits are cleared by writing 1s to them
+            bt848Write<Bt848IntStat>(errors);
+            for (int i = 0; i < errorClassCount; ++i)
+                if ((errors & _errorBits[i]) != 0)
+                    ++_counts[i];
+        }
+        DWORD progressToken = status & BT848_INT_RISCS;
+        if (progressToken != _lastProgressToken) {
+            _lastProgressToken = progressToken;
+            _lastProgress = GetTickCount();
+        }
+        return errors;
     }
-};
 
+    // True if no field has completed for VBI_STALL_TIMEOUT_MS. Without a
+    // video signal the RISC engine legitimately waits at a SYNC instruction,
+    // so that doesn't count.
+    bool stalled()
+    {
+        if (GetTickCount() - _lastProgress < VBI_STALL_TIMEOUT_MS)
+            return false;
+        if ((bt848Read<Bt848Dstatus>() & BT848_DSTATUS_PRES) == 0) {
+            _lastProgress = GetTickCount();
+            return false;
+        }
+        ++_stalls;
+        return true;
+    }
 
-class Program : public ProgramBase
-{
-public:
-    void run()
+    void restarted()
     {
-        ServiceHandle m_hService;
-        {
-            ServiceHandle hSCManager(OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT));
-            IF_NULL_THROW(hSCManager);
+        ++_restarts;
+        _lastProgress = GetTickCount();
+    }
 
-            String driverName("DSDrv4");
-            const WCHAR* arch = _wgetenv(L"PROCESSOR_ARCHITEW6432");
-            if (arch != nullptr)
-                driverName += String(arch);
-            NullTerminatedWideString name(driverName);
+    int errors()
+    {
+        int total = 0;
+        for (int i = 0; i < errorClassCount; ++i)
+            total += _counts[i];
+        return total;
+    }
+    int restarts() { return _restarts; }
 
-            m_hService = OpenService(hSCManager, name, SERVICE_START | SERVICE_STOP);
-            IF_NULL_THROW(m_hService);
-        }
+    // The card went round the whole ring laps times without us seeing it
+    void lapped(int laps) { _laps += laps; }
 
-        if (StartService(m_hService, 0, NULL) == FALSE)
-        {
-            IF_FALSE_THROW(GetLastError() == ERROR_SERVICE_ALREADY_RUNNING);
-        }
+    // The INT_STAT bit for an error name from report(), or 0
+    static DWORD errorBit(const char* name)
+    {
+        for (int i = 0; i < errorClassCount; ++i)
+            if (strcmp(name, _errorNames[i]) == 0)
+                return _errorBits[i];
+        return 0;
+    }
 
-        m_hFile = CreateFile(
-                             L"\\\\.\\DSDrv4",
-                             GENERIC_READ | GENERIC_WRITE,
-                             FILE_SHARE_READ | FILE_SHARE_WRITE,
-                             NULL,
-                             OPEN_EXISTING,
-                             0,
-                             INVALID_HANDLE_VALUE
-                            );
-        IF_FALSE_THROW(m_hFile != INVALID_HANDLE_VALUE);
+    String report()
+    {
+        String r;
+        for (int i = 0; i < errorClassCount; ++i)
+            r += String(_errorNames[i]) + " " + decimal(_counts[i]) + ", ";
+        return r + "stalls " + decimal(_stalls) + ", restarts " + decimal(_restarts) +
+            ", ring laps lost " + decimal(_laps);
+    }
 
-        // OK so we've loaded the driver
-        // we had better check that it's the same version as we are
-        // otherwise all sorts of nasty things could happen
-        // n.b. note that if someone else has already loaded our driver this may
-        // happen.
+private:
+    enum { errorClassCount = 7 };
+    static const DWORD _errorBits[errorClassCount];
+    static const char* const _errorNames[errorClassCount];
+
+    int _counts[errorClassCount];
+    DWORD _lastProgressToken;
+    DWORD _lastProgress;
+    int _stalls;
+    int _restarts;
+    int _laps;
+};
 
-        DWORD dwReturnedLength;
-        DWORD dwVersion = 0;
-        HwDrv_SendCommandEx(
-                    IOCTL_DSDRV_GETVERSION,
-                    NULL,
-                    0,
-                    &dwVersion,
-                    sizeof(dwVersion),
-                    &dwReturnedLength
-                   );
-        if ( (dwVersion < DSDRV_COMPAT_MIN_VERSION) ||
-             ((dwVersion & DSDRV_COMPAT_MASK) != DSDRV_COMPAT_MAJ_VERSION) )
-            throw Exception("Incompatible driver version.");
+const DWORD DmaErrorMonitor::_errorBits[errorClassCount] = {
+    BT848_INT_OFLOW, BT848_INT_FDSR, BT848_INT_PPERR, BT848_INT_RIPERR,
+    BT848_INT_PABORT, BT848_INT_OCERR, BT848_INT_SCERR};
+const char* const DmaErrorMonitor::_errorNames[errorClassCount] = {
+    "OFLOW", "FDSR", "PPERR", "RIPERR", "PABORT", "OCERR", "SCERR"};
 
-        m_MemoryBase = 0;
-        m_InitialACPIStatus = 0;
 
-        bool foundCard = false;
-        int deviceId;
-        DWORD dwBusNumber;
-        DWORD dwSlotNumber;
+class DMAEnable
+{
+public:
+    // captureBits are the CAP_CTL bits to set (see CaptureConfig::captureBits())
+    DMAEnable(int captureBits) : _captureBits(captureBits) { start(); }
+    ~DMAEnable() { stop(); }
 
-        static const int deviceIds[] = {
-            0x036e,   // Brooktree Bt878
-            0x036f,   // Brooktree Bt878A
-            0x0350,   // Brooktree Bt848
-            0x0351};  // Brooktree Bt849
+    // Stop the RISC engine and restart it from the top of the program, which
+    // begins by waiting for the next even field.
+    void restart(PHYS riscStart)
+    {
+        stop();
+        bt848Write<Bt848IntStat>(VBI_INT_FIELD_ERRORS | VBI_INT_RISC_ERRORS);
+        bt848Write<Bt848RiscStrtAdd>(riscStart);
+        start();
+    }
 
-        for (int chipIdx = 0; chipIdx < 4; ++chipIdx) {
-            TDSDrvParam hwParam;
-            DWORD dwStatus;
-            DWORD dwLength;
-            TPCICARDINFO PCICardInfo;
-
-            hwParam.dwAddress = PCI_ID_BROOKTREE;
-            deviceId = deviceIds[chipIdx];
-            hwParam.dwValue = deviceId;
-            hwParam.dwFlags = 0;
-
-            dwStatus = HwDrv_SendCommandEx(
-                                    IOCTL_DSDRV_GETPCIINFO,
-                                    &hwParam,
-                                    sizeof(hwParam),
-                                    &PCICardInfo,
-                                    sizeof(TPCICARDINFO),
-                                    &dwLength
-                                  );
-
-            if (dwStatus == ERROR_SUCCESS) {
-                dwBusNumber   = PCICardInfo.dwBusNumber;
-                dwSlotNumber  = PCICardInfo.dwSlotNumber;
-                foundCard = true;
-                break;
-            }
-        }
-        if (!foundCard)
-            throw Exception("No Bt8x8 capture card found on PCI bus.");
+private:
+    void start()
+    {
+        bt848Update<Bt848CapCtl>().set<Bt848CapCtlCapture>(_captureBits).apply();
+        bt848Update<Bt848GpioDmaCtl>().set<Bt848GpioDmaCtlEnable>(3).apply();
+    }
+    void stop()
+    {
+        bt848Update<Bt848GpioDmaCtl>().set<Bt848GpioDmaCtlEnable>(0).apply();
+        bt848Update<Bt848CapCtl>().set<Bt848CapCtlCapture>(0).apply();
+    }
 
-        BOOL supportsAcpi;
+    int _captureBits;
+};
 
-        // TRUE if BT878 or BT878A is present
-        supportsAcpi = (deviceId == 0x036E || deviceId == 0x036F);
 
-        TDSDrvParam hwParam;
-        DWORD dwStatus;
-        DWORD dwLength;
-        TPCICARDINFO PCICardInfo;
+// ----------------------------------------------------------------------------
+// Field clock recovery
+//
+// Fields arrive at about 59.94Hz, but the source may drift from that (or be
+// unstable, like a VCR). FieldClock is a second-order PLL that tracks the
+// completion time of each field from the transitions we see when polling the
+// RISC engine, so that we can sleep until just after the next one completes
+// instead of polling at a fixed rate.
+#define VBI_NOMINAL_FIELD_PERIOD  (1001.0/60000.0)
+// how long after the predicted completion time to wake up
+#define VBI_WAKE_MARGIN           0.0005
+// poll interval while the clock isn't locked or a prediction was missed
+#define VBI_SHORT_POLL            0.001
+// PLL gains for phase and period
+#define VBI_CLOCK_ALPHA           0.25
+#define VBI_CLOCK_BETA            0.02
+// number of consecutive good predictions before the clock counts as locked
+#define VBI_CLOCK_LOCK_COUNT      4
+// how far to pull the phase in when we only know a field completed while
+// we were asleep
+#define VBI_CLOCK_PROBE           0.0002
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
 
-        hwParam.dwAddress = PCI_ID_BROOKTREE;
-        hwParam.dwValue = deviceId;
-        hwParam.dwFlags = 0;
+class FieldClock
+{
+public:
+    FieldClock() : _timer(NULL), _period(0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerSecond = static_cast<double>(frequency.QuadPart);
+        timeBeginPeriod(1);
+        // the high resolution timer is only available on Windows 10 1803
+        // and later - elsewhere timeBeginPeriod() gives us 1ms resolution
+        _timer = CreateWaitableTimerExW(NULL, NULL,
+            CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (_timer == NULL)
+            _timer = CreateWaitableTimer(NULL, TRUE, NULL);
+        IF_NULL_THROW(_timer);
+        reset();
+    }
+    ~FieldClock()
+    {
+        CloseHandle(_timer);
+        timeEndPeriod(1);
+    }
 
-        dwStatus = HwDrv_SendCommandEx(IOCTL_DSDRV_GETPCIINFO,
-                                            &hwParam,
-                                            sizeof(hwParam),
-                                            &PCICardInfo,
+    // Start a new session, which counts its own misses. The period estimate
+    // is kept, so the clock locks again within a few fields.
+    void beginSession()
+    {
+        _misses = 0;
+        reset();
+    }
+
+    // Forget the phase, e.g. after the RISC engine has been restarted. The
+    // period estimate is kept.
+    void reset()
+    {
+        _next = 0;
+        _lastPoll = now();
+        _good = 0;
+        _missed = false;
+        if (_period == 0) {
+            _period = VBI_NOMINAL_FIELD_PERIOD;
+            _meanSquareError = 0;
+            _misses = 0;
+        }
+    }
+
+    double now()
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return static_cast<double>(counter.QuadPart) / _ticksPerSecond;
+    }
+
+    // Called after each poll of the RISC engine with the number of fields
+    // that completed since the previous poll.
+    void observe(int fields)
+    {
+        double t = now();
+        double sincePoll = t - _lastPoll;
+        _lastPoll = t;
+        if (fields == 0) {
+            // woke up for a field that hasn't completed yet - we'll fall back
+            // to short polls until it does
+            if (locked() && !_missed && t > _next + VBI_WAKE_MARGIN) {
+                ++_misses;
+                _missed = true;
+            }
+            return;
+        }
+        _missed = false;
+        if (_next == 0) {
+            _next = t + _period;
+            return;
+        }
+        double predicted = _next + (fields - 1)*_period;
+        bool precise = (sincePoll <= 2*VBI_SHORT_POLL);
+        double error;
+        if (precise) {
+            // the field completed during a short poll
+            error = t - sincePoll/2 - predicted;
+        }
+        else {
+            // we slept through the completion, so all we know is that it
+            // happened before now. Nudge the phase earlier so that we
+            // eventually wake before a completion and measure it precisely.
+            error = (t < predicted ? t - predicted : 0) - VBI_CLOCK_PROBE;
+        }
+        if (fabs(error) > _period/2) {
+            // lost lock (signal change or we fell behind) - start again from
+            // this field, keeping the period
+            _next = t + _period;
+            _good = 0;
+            return;
+        }
+        if (precise) {
+            _period += VBI_CLOCK_BETA*error/fields;
+            if (_period < VBI_NOMINAL_FIELD_PERIOD*0.9)
+                _period = VBI_NOMINAL_FIELD_PERIOD*0.9;
+            if (_period > VBI_NOMINAL_FIELD_PERIOD*1.1)
+                _period = VBI_NOMINAL_FIELD_PERIOD*1.1;
+            _meanSquareError += (error*error - _meanSquareError)/16;
+            if (_good < VBI_CLOCK_LOCK_COUNT)
+                ++_good;
+        }
+        _next = predicted + VBI_CLOCK_ALPHA*error + _period;
+    }
+
+    // Sleep until just after the next field is predicted to complete, or for
+    // a short poll interval if we don't have a usable prediction.
+    void wait()
+    {
+        double delay = VBI_SHORT_POLL;
+        if (locked()) {
+            double untilNext = _next + VBI_WAKE_MARGIN - now();
+            if (untilNext > delay)
+                delay = untilNext;
+        }
+        LARGE_INTEGER dueTime;
+        // negative means relative, in 100ns units
+        dueTime.QuadPart = -static_cast<LONGLONG>(delay*10000000.0);
+        if (SetWaitableTimer(_timer, &dueTime, 0, NULL, NULL, FALSE))
+            WaitForSingleObject(_timer, INFINITE);
+        else
+            Sleep(1);
+    }
+
+    // The estimated completion time of the field fieldsAgo fields before the
+    // last one observed, or 0 if there's no estimate yet.
+    double completion(int fieldsAgo)
+    {
+        return (_next == 0 ? 0 : _next - (fieldsAgo + 1)*_period);
+    }
+
+    // The number of fields that should have completed since the last one
+    // observed, going by the clock, or 0 if it isn't locked.
+    int expected()
+    {
+        if (!locked())
+            return 0;
+        double t = now();
+        return (t < _next ? 0 : static_cast<int>((t - _next)/_period) + 1);
+    }
+
+    bool locked() { return _good >= VBI_CLOCK_LOCK_COUNT; }
+    double fieldRate() { return 1/_period; }
+    double jitter() { return sqrt(_meanSquareError); }
+    int misses() { return _misses; }
+
+private:
+    HANDLE _timer;
+    double _ticksPerSecond;
+    double _period;
+    double _next;
+    double _lastPoll;
+    double _meanSquareError;
+    int _good;
+    bool _missed;
+    int _misses;
+};
+
+
+// Write to the client pipe. Returns false if the client has gone away.
+static bool writePipe(HANDLE h, const void* data, DWORD bytes)
+{
+    DWORD bytesWritten;
+    if (WriteFile(h, data, bytes, &bytesWritten, NULL) == 0) {
+        DWORD error = GetLastError();
+        if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA)
+            return false;
+    }
+    return true;
+}
+
+// True if the client at the other end of the pipe is still there.
+static bool pipeConnected(HANDLE h)
+{
+    if (PeekNamedPipe(h, NULL, 0, NULL, NULL, NULL) != 0)
+        return true;
+    DWORD error = GetLastError();
+    return error != ERROR_BROKEN_PIPE && error != ERROR_NO_DATA;
+}
+
+// The daemon serves one client at a time, so while a session is running the
+// pipe it was waiting on is taken and other clients get ERROR_PIPE_BUSY, as
+// they always have. For the length of a session StatsPipe listens on a pipe
+// of its own (VBICAP_STATS_PIPE_NAME), and the session polls it between
+// batches of fields, so that VBICAP_COMMAND_STATS can be answered with the
+// statistics so far. Nothing on it ever blocks the capture: the command is
+// read and the reply written with overlapped I/O, and the client is only
+// disconnected once it has gone. Other commands sent to it are refused by
+// disconnecting.
+//
+// The pipe has a single instance, created first by the daemon, local clients
+// only, and a DACL giving everyone but SYSTEM and administrators just enough
+// access to read and write it. In particular they can't create instances of
+// their own (FILE_CREATE_PIPE_INSTANCE), so nothing else can be listening
+// under its name.
+#define VBI_STATS_PIPE_SDDL "D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x12018b;;;AU)"
+
+class StatsPipe : Uncopyable
+{
+public:
+    // Listen for clients wanting stats, which the session keeps up to date
+    StatsPipe(const String& pipeName, VbiCaptureStats* stats)
+      : _stats(stats), _pipe(INVALID_HANDLE_VALUE), _state(idle)
+    {
+        memset(&_overlapped, 0, sizeof(OVERLAPPED));
+        _overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        IF_NULL_THROW(_overlapped.hEvent);
+        PSECURITY_DESCRIPTOR descriptor = NULL;
+        if (ConvertStringSecurityDescriptorToSecurityDescriptorA(VBI_STATS_PIPE_SDDL,
+            SDDL_REVISION_1, &descriptor, NULL) != 0) {
+            SECURITY_ATTRIBUTES attributes;
+            attributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+            attributes.lpSecurityDescriptor = descriptor;
+            attributes.bInheritHandle = FALSE;
+            NullTerminatedString name(pipeName);
+            _pipe = CreateNamedPipeA(name,
+                PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                1, 512, 512, 0, &attributes);
+            LocalFree(descriptor);
+        }
+        if (_pipe == INVALID_HANDLE_VALUE)
+            console.write("Stats will only be available between sessions.\n");
+        else
+            listen();
+    }
+    ~StatsPipe()
+    {
+        if (_pipe != INVALID_HANDLE_VALUE) {
+            if (_state == connecting || _state == reading) {
+                // the cancelled operation still writes to _overlapped
+                DWORD bytes;
+                CancelIo(_pipe);
+                GetOverlappedResult(_pipe, &_overlapped, &bytes, TRUE);
+            }
+            CloseHandle(_pipe);
+        }
+        CloseHandle(_overlapped.hEvent);
+    }
+
+    VbiCaptureStats* stats() { return _stats; }
+
+    // Move the client on, if there is one. Returns true if it has asked for
+    // the stats, which answer() then sends.
+    bool poll()
+    {
+        if (_state == answered) {
+            if (!pipeConnected(_pipe))
+                hangUp();
+            return false;
+        }
+        if (_state == idle || WaitForSingleObject(_overlapped.hEvent, 0) != WAIT_OBJECT_0)
+            return false;
+        DWORD bytes;
+        BOOL done = GetOverlappedResult(_pipe, &_overlapped, &bytes, FALSE);
+        if (_state == connecting) {
+            if (done)
+                read();
+            else
+                hangUp();
+            return false;
+        }
+        if (done && bytes == sizeof(int) && _command == VBICAP_COMMAND_STATS)
+            return true;
+        hangUp();
+        return false;
+    }
+
+    // Send the stats to the client which asked for them. The reply fits in
+    // the pipe's buffer, so this doesn't wait for the client to read it.
+    void answer()
+    {
+        ResetEvent(_overlapped.hEvent);
+        DWORD bytes;
+        if (WriteFile(_pipe, _stats, sizeof(VbiCaptureStats), NULL, &_overlapped) == 0 &&
+            GetLastError() != ERROR_IO_PENDING) {
+            hangUp();
+            return;
+        }
+        GetOverlappedResult(_pipe, &_overlapped, &bytes, TRUE);
+        _state = answered;
+    }
+
+private:
+    enum State { idle, connecting, reading, answered };
+
+    void listen()
+    {
+        ResetEvent(_overlapped.hEvent);
+        _state = connecting;
+        if (ConnectNamedPipe(_pipe, &_overlapped) != 0)
+            return;
+        DWORD error = GetLastError();
+        if (error == ERROR_PIPE_CONNECTED)
+            read();
+        else if (error != ERROR_IO_PENDING)
+            _state = idle;
+    }
+
+    void read()
+    {
+        ResetEvent(_overlapped.hEvent);
+        _state = reading;
+        if (ReadFile(_pipe, &_command, sizeof(int), NULL, &_overlapped) == 0 &&
+            GetLastError() != ERROR_IO_PENDING)
+            hangUp();
+    }
+
+    void hangUp()
+    {
+        DisconnectNamedPipe(_pipe);
+        listen();
+    }
+
+    VbiCaptureStats* _stats;
+    HANDLE _pipe;
+    OVERLAPPED _overlapped;
+    State _state;
+    int _command;
+};
+
+
+// ----------------------------------------------------------------------------
+// Fault injection
+//
+// Started with faults=<file>, vbicap runs the scenario in that file against
+// every capture session, to reproduce overruns and stuck captures on demand.
+// Each line of the scenario is one of:
+//   at <field> <action>     do the action when field <field> of the session
+//                           is about to be delivered
+//   every <n> <action>      do the action before every <n>th field
+//   expect <stat> <op> <n>  check a statistic of the session when it ends
+// where the actions are:
+//   latency <us>            add <us> microseconds to every driver call
+//                           (register reads and writes) from now on
+//   stall <ms>              hide the RISC engine's progress for <ms> ms
+//   drop <n>                hide the completion of the next <n> fields
+//   error <bits>            set INT_STAT error bits (e.g. OFLOW|PPERR)
+//   slow <ms>               delay every write to the client by <ms> ms
+//   disconnect              disconnect the client half way through a field
+//   pause <ms>              sleep the capture loop for <ms> ms
+//   starve <ms>             run a time-critical busy thread on every CPU for
+//                           <ms> ms
+// and the statistics are those of VbiCaptureStats: fields, discontinuities,
+// damaged, dropped, restarts, dmaerrors, misses, maxlatency and meanlatency
+// (latencies in microseconds from the field's completion to its delivery).
+// The op is one of <, <=, >, >=, ==, !=. Lines starting with # are comments.
+// The register faults only apply when capturing from a card.
+
+class FaultInjector : Uncopyable
+{
+public:
+    FaultInjector(const String& path)
+    {
+        FILE* f = fopen(NullTerminatedString(path), "r");
+        if (f == NULL)
+            throw Exception(String("Can't open ") + path + ".");
+        char line[256];
+        int lineNumber = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            ++lineNumber;
+            char words[4][64];
+            int n = sscanf(line, "%63s %63s %63s %63s", words[0], words[1], words[2], words[3]);
+            if (n <= 0 || words[0][0] == '#')
+                continue;
+            if (!parseLine(words, n)) {
+                fclose(f);
+                throw Exception(path + " line " + decimal(lineNumber) + ": can't parse.");
+            }
+        }
+        fclose(f);
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerSecond = static_cast<double>(frequency.QuadPart);
+        begin();
+    }
+
+    // Start the scenario again for a new session
+    void begin()
+    {
+        _latency = 0;
+        _stallUntil = 0;
+        _drop = 0;
+        _frozen = notFrozen;
+        _lastRiscs = 0;
+        _errors = 0;
+        _slow = 0;
+        _disconnect = false;
+        for (int i = 0; i < static_cast<int>(_events.size()); ++i)
+            _events[i].lastFired = notFired;
+    }
+
+    // Called by the capture loops on every iteration with the number of
+    // fields delivered so far, to do the actions that are due.
+    void poll(DWORD sequence)
+    {
+        for (int i = 0; i < static_cast<int>(_events.size()); ++i) {
+            Event* e = &_events[i];
+            bool due;
+            if (e->every != 0)
+                due = (sequence != 0 && sequence % e->every == 0 && e->lastFired != sequence);
+            else
+                due = (sequence == e->field && e->lastFired != sequence);
+            if (!due)
+                continue;
+            e->lastFired = sequence;
+            fire(*e);
+        }
+    }
+
+    // Called around every driver call
+    void registerAccess()
+    {
+        if (_latency == 0)
+            return;
+        double until = now() + _latency/1000000.0;
+        while (now() < until)
+            ;
+    }
+
+    // Apply the RISC and error faults to a value read from INT_STAT
+    DWORD filterStatus(DWORD status)
+    {
+        status |= _errors;
+        _errors = 0;
+        DWORD riscs = status & BT848_INT_RISCS;
+        if (riscs != _lastRiscs && _drop > 0 && _frozen != notFrozen)
+            --_drop;
+        _lastRiscs = riscs;
+        if (now() < _stallUntil || _drop > 0) {
+            if (_frozen == notFrozen)
+                _frozen = riscs;
+            return (status & ~BT848_INT_RISCS) | _frozen;
+        }
+        _frozen = notFrozen;
+        return status;
+    }
+
+    // Client transport faults: delays each write to the client and returns
+    // true if the client should be disconnected during this field
+    bool beforeClientWrite()
+    {
+        if (_slow != 0)
+            Sleep(_slow);
+        bool disconnect = _disconnect;
+        _disconnect = false;
+        return disconnect;
+    }
+
+    // Check the expectations against the statistics of a session. Returns
+    // the number that failed.
+    int check(const VbiCaptureStats& stats)
+    {
+        int failures = 0;
+        for (int i = 0; i < static_cast<int>(_expectations.size()); ++i) {
+            const Expectation& e = _expectations[i];
+            DWORD value = stats.*(e.stat);
+            bool ok;
+            switch (e.op) {
+                case '<': ok = value < e.value; break;
+                case 'l': ok = value <= e.value; break;
+                case '>': ok = value > e.value; break;
+                case 'g': ok = value >= e.value; break;
+                case '=': ok = value == e.value; break;
+                default: ok = value != e.value; break;
+            }
+            if (!ok) {
+                console.write(String("Expectation failed: ") + e.text + " (" + decimal(value) + ")\n");
+                ++failures;
+            }
+        }
+        console.write(String("Scenario ") + (failures == 0 ? "passed" : "FAILED") + "\n");
+        return failures;
+    }
+
+private:
+    static const DWORD notFrozen = 0xffffffff;
+    static const DWORD notFired = 0xffffffff;
+    enum Action { latency, stall, drop, error, slow, disconnect, pause, starve };
+    struct Event
+    {
+        DWORD field;
+        DWORD every;
+        Action action;
+        DWORD value;
+        DWORD lastFired;
+    };
+    struct Expectation
+    {
+        uint32_t VbiCaptureStats::* stat;
+        char op;
+        DWORD value;
+        String text;
+    };
+
+    bool parseLine(char words[4][64], int n)
+    {
+        if (strcmp(words[0], "expect") == 0) {
+            static const struct
+            {
+                const char* name;
+                uint32_t VbiCaptureStats::* stat;
+            } stats[] = {
+                { "fields", &VbiCaptureStats::fields },
+                { "discontinuities", &VbiCaptureStats::discontinuities },
+                { "damaged", &VbiCaptureStats::damagedFields },
+                { "dropped", &VbiCaptureStats::droppedFields },
+                { "restarts", &VbiCaptureStats::restarts },
+                { "dmaerrors", &VbiCaptureStats::dmaErrors },
+                { "misses", &VbiCaptureStats::missedWakeups },
+                { "maxlatency", &VbiCaptureStats::maxLatencyMicroseconds },
+                { "meanlatency", &VbiCaptureStats::meanLatencyMicroseconds }};
+            static const char* const ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+            static const char opCodes[] = "<l>g=!";
+            if (n != 4)
+                return false;
+            Expectation e;
+            e.stat = NULL;
+            for (int i = 0; i < sizeof(stats)/sizeof(stats[0]); ++i)
+                if (strcmp(words[1], stats[i].name) == 0)
+                    e.stat = stats[i].stat;
+            e.op = 0;
+            for (int i = 0; i < 6; ++i)
+                if (strcmp(words[2], ops[i]) == 0)
+                    e.op = opCodes[i];
+            if (e.stat == NULL || e.op == 0)
+                return false;
+            e.value = strtoul(words[3], NULL, 0);
+            e.text = String(words[1]) + " " + words[2] + " " + words[3];
+            _expectations.push_back(e);
+            return true;
+        }
+
+        static const char* const actions[] = {
+            "latency", "stall", "drop", "error", "slow", "disconnect", "pause", "starve" };
+        Event e;
+        if (strcmp(words[0], "at") == 0)
+            e.every = 0;
+        else if (strcmp(words[0], "every") == 0)
+            e.every = 1;
+        else
+            return false;
+        if (n < 3)
+            return false;
+        DWORD count = strtoul(words[1], NULL, 0);
+        if (e.every != 0) {
+            if (count == 0)
+                return false;
+            e.every = count;
+            e.field = 0;
+        }
+        else
+            e.field = count;
+        int action = -1;
+        for (int i = 0; i < sizeof(actions)/sizeof(actions[0]); ++i)
+            if (strcmp(words[2], actions[i]) == 0)
+                action = i;
+        if (action == -1)
+            return false;
+        e.action = static_cast<Action>(action);
+        e.value = 0;
+        if (e.action == error) {
+            if (n < 4)
+                return false;
+            // names separated by |
+            char* context;
+            for (char* name = strtok_s(words[3], "|", &context); name != NULL;
+                name = strtok_s(NULL, "|", &context)) {
+                DWORD bit = DmaErrorMonitor::errorBit(name);
+                if (bit == 0)
+                    return false;
+                e.value |= bit;
+            }
+        }
+        else if (e.action != disconnect) {
+            if (n < 4)
+                return false;
+            e.value = strtoul(words[3], NULL, 0);
+        }
+        e.lastFired = notFired;
+        _events.push_back(e);
+        return true;
+    }
+
+    void fire(const Event& e)
+    {
+        switch (e.action) {
+            case latency: _latency = e.value; break;
+            case stall: _stallUntil = now() + e.value/1000.0; break;
+            case drop: _drop += e.value; break;
+            case error: _errors |= e.value; break;
+            case slow: _slow = e.value; break;
+            case disconnect: _disconnect = true; break;
+            case pause: Sleep(e.value); break;
+            case starve: starveCpus(e.value); break;
+        }
+    }
+
+    static DWORD WINAPI hog(LPVOID parameter)
+    {
+        DWORD until = GetTickCount() + *static_cast<DWORD*>(parameter);
+        while (static_cast<int>(until - GetTickCount()) > 0)
+            ;
+        return 0;
+    }
+
+    // Keep every CPU busy with a higher priority thread than ours
+    void starveCpus(DWORD ms)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        _starveMs = ms;
+        for (DWORD i = 0; i < info.dwNumberOfProcessors; ++i) {
+            HANDLE thread = CreateThread(NULL, 0, hog, &_starveMs, CREATE_SUSPENDED, NULL);
+            if (thread == NULL)
+                continue;
+            SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL);
+            ResumeThread(thread);
+            CloseHandle(thread);
+        }
+    }
+
+    double now()
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return static_cast<double>(counter.QuadPart) / _ticksPerSecond;
+    }
+
+    std::vector<Event> _events;
+    std::vector<Expectation> _expectations;
+    double _ticksPerSecond;
+
+    DWORD _latency;
+    double _stallUntil;
+    DWORD _drop;
+    DWORD _frozen;
+    DWORD _lastRiscs;
+    DWORD _errors;
+    DWORD _slow;
+    bool _disconnect;
+    DWORD _starveMs;
+};
+
+// Called by HwDrv_SendCommand[Ex]
+static void injectRegisterLatency()
+{
+    if (m_faults != NULL)
+        m_faults->registerAccess();
+}
+
+
+// ----------------------------------------------------------------------------
+// Field sinks
+//
+// In record and shared modes a session hands its fields to a FieldSink,
+// which owns the memory they go into. The session copies each field from the
+// DMA buffers (or its averager) straight into the memory acquire() returns.
+
+class FieldSink : Uncopyable
+{
+public:
+    virtual ~FieldSink() { }
+
+    // Returns where to put the samples of the next field, or NULL (and the
+    // field is dropped) if there's nowhere to put it.
+    virtual Byte* acquire() = 0;
+
+    // Deliver the field acquired last, preceded by the records (of the size
+    // given to the constructor) at records. Returns false if the sink can't
+    // take any more.
+    virtual bool submit(const VbiFieldHeader& header, const Byte* records) = 0;
+
+    virtual int dropped() const = 0;
+};
+
+
+// ----------------------------------------------------------------------------
+// Recording straight to disk
+//
+// Each field is copied out of the DMA buffers into a page-aligned record
+// (any levels and burst records, field header, samples and a padding record
+// up to the next page) and
+// written with unbuffered overlapped I/O into a preallocated segment file, so
+// the capture loop never waits for the disk. If all the records are still
+// being written when a field completes, the field is dropped and the next
+// one recorded is marked as a discontinuity.
+
+// unbuffered writes must be multiples of the sector size at aligned offsets
+#define VBI_RECORD_ALIGNMENT         4096
+#define VBI_RECORD_WRITES_IN_FLIGHT  8
+#define VBI_RECORD_DEFAULT_SEGMENT_MB 1024
+
+// The daemon runs with more rights than its clients, so it only records
+// where it has been told it may: under one of the directories given with
+// record_dirs=<dir>[;<dir>...], or else under its working directory.
+class RecordDirectories
+{
+public:
+    // Allow recording under each directory of a ';'-separated list
+    void add(const char* list)
+    {
+        while (*list != 0) {
+            const char* end = strchr(list, ';');
+            if (end == NULL)
+                end = list + strlen(list);
+            if (end != list)
+                addDirectory(std::string(list, end));
+            list = (*end != 0 ? end + 1 : end);
+        }
+    }
+
+    // Allow the working directory if nothing else was
+    void addDefault()
+    {
+        if (!_directories.empty())
+            return;
+        char directory[MAX_PATH];
+        DWORD length = GetCurrentDirectoryA(MAX_PATH, directory);
+        if (length == 0 || length >= MAX_PATH)
+            throw Exception("Can't find the working directory.");
+        addDirectory(directory);
+    }
+
+    // true if the files of a client's path prefix would be in an allowed
+    // directory
+    bool allows(const char* pathPrefix) const
+    {
+        char path[MAX_PATH];
+        DWORD length = GetFullPathNameA(pathPrefix, MAX_PATH, path, NULL);
+        if (length == 0 || length >= MAX_PATH)
+            return false;
+        for (size_t i = 0; i < _directories.size(); ++i) {
+            const std::string& d = _directories[i];
+            if (length > d.size() && _strnicmp(path, d.c_str(), d.size()) == 0)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    void addDirectory(const std::string& directory)
+    {
+        char path[MAX_PATH];
+        DWORD length = GetFullPathNameA(directory.c_str(), MAX_PATH, path, NULL);
+        if (length == 0 || length >= MAX_PATH - 1)
+            throw Exception(String("Invalid record directory ") + directory.c_str() + ".");
+        // so that C:\rec doesn't allow C:\records
+        if (path[length - 1] != '\\')
+            strcpy(path + length, "\\");
+        _directories.push_back(path);
+    }
+
+    std::vector<std::string> _directories;
+};
+
+class FieldRecorder : public FieldSink
+{
+public:
+    // Each field is preceded by recordsBytes of records (see submit()).
+    FieldRecorder(const VbiStreamHeader& streamHeader, const VbiRecordRequest& request, DWORD recordsBytes)
+      : _segmentSeconds(request.segmentSeconds),
+        _segmentNumber(0),
+        _current(NULL),
+        _previous(NULL),
+        _acquired(-1),
+        _dropped(0),
+        _discontinuity(false),
+        _failed(false)
+    {
+        memcpy(_pathPrefix, request.pathPrefix, MAX_PATH);
+        _pathPrefix[MAX_PATH - 1] = 0;
+        _dataBytes = streamHeader.linesPerField*streamHeader.bytesPerLine;
+        _prefixBytes = recordsBytes + sizeof(VbiFieldHeader);
+        _recordBytes = align(_prefixBytes + sizeof(VbiFieldHeader) + _dataBytes);
+        LONGLONG segmentBytes = static_cast<LONGLONG>(request.segmentMegabytes != 0 ?
+            request.segmentMegabytes : VBI_RECORD_DEFAULT_SEGMENT_MB) << 20;
+        _segmentRecords = static_cast<int>((segmentBytes - VBI_RECORD_ALIGNMENT)/_recordBytes);
+        if (_segmentRecords < 1)
+            _segmentRecords = 1;
+
+        _header = static_cast<Byte*>(VirtualAlloc(NULL, VBI_RECORD_ALIGNMENT, MEM_COMMIT, PAGE_READWRITE));
+        IF_NULL_THROW(_header);
+        memcpy(_header, &streamHeader, sizeof(VbiStreamHeader));
+        // readers skip the rest of the page
+        reinterpret_cast<VbiStreamHeader*>(_header)->headerBytes = VBI_RECORD_ALIGNMENT;
+        initBuffer(&_headerBuffer, _header);
+        for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i) {
+            Buffer* b = &_buffers[i];
+            initBuffer(b, static_cast<Byte*>(VirtualAlloc(NULL, _recordBytes, MEM_COMMIT, PAGE_READWRITE)));
+            VbiFieldHeader* pad = reinterpret_cast<VbiFieldHeader*>(b->data + _prefixBytes + _dataBytes);
+            pad->magic = VBICAP_PAD_MAGIC;
+            pad->sequence = 0;
+            pad->flags = 0;
+            pad->dataBytes = _recordBytes - (_prefixBytes + sizeof(VbiFieldHeader) + _dataBytes);
+        }
+        _segments[0].file = INVALID_HANDLE_VALUE;
+        _segments[1].file = INVALID_HANDLE_VALUE;
+        _current = &_segments[0];
+        _previous = &_segments[1];
+        openSegment();
+    }
+
+    ~FieldRecorder()
+    {
+        for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i)
+            complete(&_buffers[i], true);
+        closeSegment(_previous);
+        closeSegment(_current);
+        for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i) {
+            CloseHandle(_buffers[i].overlapped.hEvent);
+            VirtualFree(_buffers[i].data, 0, MEM_RELEASE);
+        }
+        CloseHandle(_headerBuffer.overlapped.hEvent);
+        VirtualFree(_header, 0, MEM_RELEASE);
+    }
+
+    // The field is dropped if every record is still being written.
+    Byte* acquire()
+    {
+        for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i) {
+            Buffer* b = &_buffers[i];
+            if (b->segment != NULL && HasOverlappedIoCompleted(&b->overlapped))
+                complete(b, false);
+        }
+        if (_previous->file != INVALID_HANDLE_VALUE && _previous->pending == 0)
+            closeSegment(_previous);
+        for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i) {
+            if (_buffers[i].segment == NULL) {
+                _acquired = i;
+                return _buffers[i].data + _prefixBytes;
+            }
+        }
+        ++_dropped;
+        _discontinuity = true;
+        return NULL;
+    }
+
+    // Start writing the field acquired last. Returns false if the disk
+    // can't keep up.
+    bool submit(const VbiFieldHeader& header, const Byte* records)
+    {
+        if (_current->records == _segmentRecords ||
+            (_segmentSeconds != 0 && GetTickCount64() - _current->startTicks >= _segmentSeconds*1000ULL))
+            rotate();
+        if (_failed)
+            return false;
+        Buffer* b = &_buffers[_acquired];
+        memcpy(b->data, records, _prefixBytes - sizeof(VbiFieldHeader));
+        VbiFieldHeader* h = reinterpret_cast<VbiFieldHeader*>(b->data + _prefixBytes - sizeof(VbiFieldHeader));
+        *h = header;
+        if (_discontinuity)
+            h->flags |= VBICAP_FIELD_DISCONTINUITY;
+        _discontinuity = false;
+        write(b, _current, b->data, _recordBytes);
+        ++_current->records;
+        return !_failed;
+    }
+
+    // false if a file couldn't be created or written
+    bool ok() const { return !_failed; }
+    int dropped() const { return _dropped; }
+    int segments() const { return _segmentNumber; }
+
+private:
+    struct Segment
+    {
+        HANDLE file;
+        LONGLONG written;
+        int records;
+        int pending;
+        ULONGLONG startTicks;
+    };
+    struct Buffer
+    {
+        Byte* data;
+        OVERLAPPED overlapped;
+        Segment* segment;  // NULL if not being written
+    };
+
+    static DWORD align(DWORD bytes)
+    {
+        return (bytes + VBI_RECORD_ALIGNMENT - 1) & ~(VBI_RECORD_ALIGNMENT - 1);
+    }
+
+    static void initBuffer(Buffer* b, Byte* data)
+    {
+        IF_NULL_THROW(data);
+        b->data = data;
+        memset(&b->overlapped, 0, sizeof(OVERLAPPED));
+        b->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        IF_NULL_THROW(b->overlapped.hEvent);
+        b->segment = NULL;
+    }
+
+    bool openSegment()
+    {
+        char name[MAX_PATH + 16];
+        _snprintf(name, sizeof(name), "%s_%06d.vbi", _pathPrefix, _segmentNumber);
+        name[sizeof(name) - 1] = 0;
+        HANDLE file = CreateFileA(name, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+            FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            console.write(String("Can't create ") + name + "\n");
+            _failed = true;
+            return false;
+        }
+        console.write(String("Recording to ") + name + "\n");
+        ++_segmentNumber;
+        _current->file = file;
+        _current->written = 0;
+        _current->records = 0;
+        _current->pending = 0;
+        _current->startTicks = GetTickCount64();
+
+        // Preallocate the whole segment so it isn't fragmented. The space
+        // not written yet reads as zeros; since the writes are sequential
+        // the file system only has to move the end of the valid data along
+        // behind them.
+        LARGE_INTEGER size;
+        size.QuadPart = VBI_RECORD_ALIGNMENT + static_cast<LONGLONG>(_segmentRecords)*_recordBytes;
+        if (SetFilePointerEx(file, size, NULL, FILE_BEGIN) != 0)
+            SetEndOfFile(file);
+        // The header has its own buffer: it's written once per segment, long
+        // before it's needed again.
+        complete(&_headerBuffer, true);
+        write(&_headerBuffer, _current, _header, VBI_RECORD_ALIGNMENT);
+        return true;
+    }
+
+    // Start a new segment. The previous one is closed once its writes are done.
+    void rotate()
+    {
+        if (_previous->file != INVALID_HANDLE_VALUE) {
+            for (int i = 0; i < VBI_RECORD_WRITES_IN_FLIGHT; ++i) {
+                if (_buffers[i].segment == _previous)
+                    complete(&_buffers[i], true);
+            }
+            closeSegment(_previous);
+        }
+        Segment* s = _previous;
+        _previous = _current;
+        _current = s;
+        openSegment();
+    }
+
+    void write(Buffer* b, Segment* segment, Byte* data, DWORD bytes)
+    {
+        HANDLE event = b->overlapped.hEvent;
+        memset(&b->overlapped, 0, sizeof(OVERLAPPED));
+        b->overlapped.hEvent = event;
+        ResetEvent(event);
+        LARGE_INTEGER offset;
+        offset.QuadPart = segment->written;
+        b->overlapped.Offset = offset.LowPart;
+        b->overlapped.OffsetHigh = offset.HighPart;
+        segment->written += bytes;
+        if (WriteFile(segment->file, data, bytes, NULL, &b->overlapped) == 0 &&
+            GetLastError() != ERROR_IO_PENDING) {
+            _failed = true;
+            return;
+        }
+        b->segment = segment;
+        ++segment->pending;
+    }
+
+    void complete(Buffer* b, bool wait)
+    {
+        if (b->segment == NULL)
+            return;
+        DWORD bytes;
+        if (GetOverlappedResult(b->segment->file, &b->overlapped, &bytes, wait ? TRUE : FALSE) == 0) {
+            if (!wait && GetLastError() == ERROR_IO_INCOMPLETE)
+                return;
+            _failed = true;
+        }
+        --b->segment->pending;
+        b->segment = NULL;
+    }
+
+    // Cut the preallocated space down to what was written and close
+    void closeSegment(Segment* segment)
+    {
+        if (segment->file == INVALID_HANDLE_VALUE)
+            return;
+        if (_headerBuffer.segment == segment)
+            complete(&_headerBuffer, true);
+        LARGE_INTEGER size;
+        size.QuadPart = segment->written;
+        if (SetFilePointerEx(segment->file, size, NULL, FILE_BEGIN) != 0)
+            SetEndOfFile(segment->file);
+        CloseHandle(segment->file);
+        segment->file = INVALID_HANDLE_VALUE;
+    }
+
+    char _pathPrefix[MAX_PATH];
+    DWORD _segmentSeconds;
+    int _segmentNumber;
+    int _segmentRecords;
+    DWORD _dataBytes;
+    DWORD _prefixBytes;  // records and field header
+    DWORD _recordBytes;
+    Byte* _header;
+    Buffer _headerBuffer;
+    Buffer _buffers[VBI_RECORD_WRITES_IN_FLIGHT];
+    Segment _segments[2];
+    Segment* _current;
+    Segment* _previous;
+    int _acquired;
+    int _dropped;
+    bool _discontinuity;
+    bool _failed;
+};
+
+
+// ----------------------------------------------------------------------------
+// Shared memory rings
+//
+// For VBICAP_COMMAND_CAPTURE_SHARED the fields go into a ring of slots in a
+// file mapping that the client maps as well (see vbicap_protocol.h), so the
+// client reads each field where the session copied it out of the DMA
+// buffers. The client releases slots by writing to the mapping, and only
+// needs the event when it has caught up, so a client that keeps up makes no
+// system calls per field. If the client hasn't released the slot the next
+// field would go in, the field is dropped as if the disk had fallen behind.
+
+#define VBI_RING_DEFAULT_SLOTS  8
+#define VBI_RING_MAX_SLOTS      64
+#define VBI_RING_SLOT_ALIGNMENT 4096
+
+class SharedRing : public FieldSink
+{
+public:
+    // Each field is preceded by recordsBytes of records (see submit()).
+    SharedRing(const VbiStreamHeader& streamHeader, const VbiSharedRequest& request, DWORD recordsBytes)
+      : _mapping(NULL),
+        _event(NULL),
+        _view(NULL),
+        _published(0),
+        _acquired(NULL),
+        _dropped(0),
+        _discontinuity(false)
+    {
+        static LONG rings = 0;
+        _slotCount = (request.slots != 0 ? request.slots : VBI_RING_DEFAULT_SLOTS);
+        if (_slotCount > VBI_RING_MAX_SLOTS)
+            _slotCount = VBI_RING_MAX_SLOTS;
+        _prefixBytes = recordsBytes + sizeof(VbiFieldHeader);
+        DWORD dataBytes = streamHeader.linesPerField*streamHeader.bytesPerLine;
+        _firstSlot = align(sizeof(VbiRingHeader) + _slotCount*sizeof(VbiRingSlot), VBICAP_RING_ALIGNMENT);
+        _slotBytes = align(_prefixBytes + dataBytes, VBI_RING_SLOT_ALIGNMENT);
+
+        LONG ring = InterlockedIncrement(&rings);
+        _snprintf(_mappingName, sizeof(_mappingName), "Local\\vbicap_%lu_%ld_ring", GetCurrentProcessId(), ring);
+        _mappingName[sizeof(_mappingName) - 1] = 0;
+        _snprintf(_eventName, sizeof(_eventName), "Local\\vbicap_%lu_%ld_event", GetCurrentProcessId(), ring);
+        _eventName[sizeof(_eventName) - 1] = 0;
+        _mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+            _firstSlot + _slotCount*_slotBytes, _mappingName);
+        _event = CreateEventA(NULL, FALSE, FALSE, _eventName);
+        if (_mapping != NULL)
+            _view = static_cast<Byte*>(MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 0));
+        if (_view == NULL || _event == NULL) {
+            console.write("Can't create the shared ring\n");
+            return;
+        }
+        // The mapping starts zeroed, so every slot starts released
+        _header = reinterpret_cast<VbiRingHeader*>(_view);
+        _header->magic = VBICAP_RING_MAGIC;
+        _header->slots = _slotCount;
+        _header->firstSlot = _firstSlot;
+        _header->slotBytes = _slotBytes;
+        _header->fieldOffset = recordsBytes;
+        _header->streamHeader = streamHeader;
+        _slots = reinterpret_cast<VbiRingSlot*>(_header + 1);
+    }
+
+    // Tells the client that the session is over. The client's views keep the
+    // mapping alive until it's done with the last fields.
+    ~SharedRing()
+    {
+        if (_view != NULL) {
+            _header->over = 1;
+            SetEvent(_event);
+            UnmapViewOfFile(_view);
+        }
+        if (_event != NULL)
+            CloseHandle(_event);
+        if (_mapping != NULL)
+            CloseHandle(_mapping);
+    }
+
+    // The field is dropped if the client still has the next slot.
+    Byte* acquire()
+    {
+        VbiRingSlot* slot = &_slots[_published % _slotCount];
+        if (slot->released != slot->published) {
+            ++_dropped;
+            _discontinuity = true;
+            return NULL;
+        }
+        _acquired = _view + _firstSlot + (_published % _slotCount)*_slotBytes;
+        return _acquired + _prefixBytes;
+    }
+
+    // Publish the field acquired last. The client can't slow the daemon
+    // down, so this always succeeds.
+    bool submit(const VbiFieldHeader& header, const Byte* records)
+    {
+        memcpy(_acquired, records, _prefixBytes - sizeof(VbiFieldHeader));
+        VbiFieldHeader* h = reinterpret_cast<VbiFieldHeader*>(_acquired + _prefixBytes - sizeof(VbiFieldHeader));
+        *h = header;
+        if (_discontinuity)
+            h->flags |= VBICAP_FIELD_DISCONTINUITY;
+        _discontinuity = false;
+        VbiRingSlot* slot = &_slots[_published % _slotCount];
+        ++_published;
+        // the client mustn't see the count before the field
+        MemoryBarrier();
+        slot->published = _published;
+        _header->published = _published;
+        SetEvent(_event);
+        return true;
+    }
+
+    bool ok() const { return _view != NULL; }
+    int dropped() const { return _dropped; }
+    DWORD slots() const { return _slotCount; }
+    const char* mappingName() const { return _mappingName; }
+    const char* eventName() const { return _eventName; }
+
+private:
+    static DWORD align(DWORD bytes, DWORD alignment)
+    {
+        return (bytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    char _mappingName[64];
+    char _eventName[64];
+    HANDLE _mapping;
+    HANDLE _event;
+    Byte* _view;
+    VbiRingHeader* _header;  // in _view
+    VbiRingSlot* _slots;
+    DWORD _slotCount;
+    DWORD _firstSlot;
+    DWORD _slotBytes;
+    DWORD _prefixBytes;  // records and field header
+    DWORD _published;
+    Byte* _acquired;
+    int _dropped;
+    bool _discontinuity;
+};
+
+
+// ----------------------------------------------------------------------------
+// Previews
+//
+// With preview=<n> the daemon makes a small luma image of every nth field
+// from the source (see vbicap_preview.h) and publishes it in shared memory
+// for monitors (see VbiPreviewHeader). Monitors can't hold up the capture:
+// the daemon never waits for them or makes system calls on their behalf,
+// and previews are skipped when they've taken more than preview_budget
+// microseconds per field on average, with up to VBI_PREVIEW_SAVED_FIELDS
+// fields' worth saved up.
+
+#define VBI_PREVIEW_SAVED_FIELDS  30
+
+class PreviewBoard : Uncopyable
+{
+public:
+    PreviewBoard(int card, const VbiStreamHeader& source, const CaptureConfig& config)
+      : _previewer(source.linesPerField*source.bytesPerLine, config.previewLine),
+        _interval(config.preview),
+        _budget(config.previewBudget),
+        _credit(0),
+        _fields(0),
+        _mapping(NULL),
+        _header(NULL)
+    {
+        resetStats();
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerMicrosecond = static_cast<double>(frequency.QuadPart)/1000000;
+        if (_previewer.width() == 0 || _previewer.height() == 0) {
+            console.write("Fields are too small to preview\n");
+            return;
+        }
+        char name[64];
+        _snprintf(name, sizeof(name), card == 0 ? "%s" : "%s%d", VBICAP_PREVIEW_NAME, card);
+        name[sizeof(name) - 1] = 0;
+        DWORD bytes = sizeof(VbiPreviewHeader) + _previewer.width()*_previewer.height();
+        _mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, bytes, name);
+        // a monitor still holding the board of an earlier run keeps its
+        // section, with that run's size, in place of a new one
+        bool existed = (_mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS);
+        if (_mapping != NULL)
+            _header = static_cast<VbiPreviewHeader*>(MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 0));
+        if (_header == NULL) {
+            console.write(String("Can't create ") + name + "\n");
+            return;
+        }
+        MEMORY_BASIC_INFORMATION information;
+        if (existed && (VirtualQuery(_header, &information, sizeof(information)) == 0 ||
+            information.RegionSize < bytes)) {
+            console.write(String(name) + " is still held open with a smaller image by a monitor; "
+                "not publishing previews\n");
+            UnmapViewOfFile(_header);
+            _header = NULL;
+            return;
+        }
+        // monitors see the image being replaced while the geometry changes,
+        // and only trust it once the magic is there
+        _header->sequence = 1;
+        MemoryBarrier();
+        _header->width = _previewer.width();
+        _header->height = _previewer.height();
+        _header->boxSamples = VBI_PREVIEW_BOX_SAMPLES;
+        _header->boxLines = VBI_PREVIEW_BOX_LINES;
+        _header->lineSamples = config.previewLine;
+        _header->magic = VBICAP_PREVIEW_MAGIC;
+        MemoryBarrier();
+        _header->sequence = 0;
+        console.write(String("Publishing ") + decimal(_previewer.width()) + "x" +
+            decimal(_previewer.height()) + " previews as " + name + "\n");
+    }
+
+    ~PreviewBoard()
+    {
+        if (_header != NULL)
+            UnmapViewOfFile(_header);
+        if (_mapping != NULL)
+            CloseHandle(_mapping);
+    }
+
+    // Called with every field from the source, whose lines are stride bytes
+    // apart. Makes a preview of it if one is due and within the budget.
+    void offer(const Byte* field, int lines, int stride, int width, DWORD flags)
+    {
+        if (_header == NULL)
+            return;
+        _credit += _budget;
+        if (_credit > _budget*VBI_PREVIEW_SAVED_FIELDS)
+            _credit = _budget*VBI_PREVIEW_SAVED_FIELDS;
+        if (_fields++ % _interval != 0)
+            return;
+        if (_credit < 0) {
+            ++_skipped;
+            return;
+        }
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        DWORD sequence = _header->sequence;
+        _header->sequence = sequence + 1;
+        MemoryBarrier();
+        _previewer.make(field, lines, stride, width, reinterpret_cast<Byte*>(_header + 1));
+        _header->flags = flags;
+        MemoryBarrier();
+        _header->sequence = sequence + 2;
+        QueryPerformanceCounter(&end);
+        double microseconds = static_cast<double>(end.QuadPart - start.QuadPart)/_ticksPerMicrosecond;
+        _credit -= microseconds;
+        _microseconds += microseconds;
+        ++_published;
+    }
+
+    // Print what happened since the last report
+    void report()
+    {
+        if (_header == NULL)
+            return;
+        console.write(String("Previews: ") + decimal(_published) + " published, " + decimal(_skipped) +
+            " skipped to stay within budget, " +
+            decimal(_published == 0 ? 0 : static_cast<int>(_microseconds/_published + 0.5)) + "us each\n");
+        resetStats();
+    }
+
+private:
+    void resetStats()
+    {
+        _published = 0;
+        _skipped = 0;
+        _microseconds = 0;
+    }
+
+    VbiPreviewer _previewer;
+    int _interval;
+    double _budget;       // microseconds per field
+    double _credit;       // microseconds that can be spent now
+    DWORD _fields;
+    double _ticksPerMicrosecond;
+    HANDLE _mapping;
+    VbiPreviewHeader* _header;
+    int _published;
+    int _skipped;
+    double _microseconds;
+};
+
+
+// ----------------------------------------------------------------------------
+// Audio
+//
+// A Bt878 has a second PCI function for audio, with registers and a RISC
+// engine of its own. With audio=1 the daemon runs it alongside the video
+// during each capture session: its ADC samples audio input audio_input and
+// its RISC program (see audioRisc()) writes the samples round a ring of
+// VBI_AUDIO_BLOCKS blocks, stamping the number of each block it starts in
+// the RISCS bits of the function's INT_STAT, as the video RISC program does
+// with fields. Each field delivered is preceded by the blocks finished since
+// the one before, with the number in the session of the first sample (see
+// VBICAP_AUDIO_MAGIC), which is what lines the samples up with the fields.
+// The ring holds several fields' worth of samples, so the capture loop
+// normally empties it in plenty of time. If it falls further behind than
+// that (which is seen from the time since the last field), the blocks the
+// card went round and overwrote are lost but still counted in the position.
+
+// The RISC program: a preamble which clears the block number, then a
+// packet for each block (a SYNC and a WRITE, which is split in two if the
+// block crosses a page) and a SYNC and a jump back to the first.
+#define VBI_AUDIO_RISC_BYTES  ((1 + VBI_AUDIO_BLOCKS*3 + 2)*2*sizeof(DWORD))
+
+// Write the audio RISC program, for a ring in memory, to riscMemory and
+// return its start address
+static PHYS audioRisc(ContigMemory& riscMemory, UserMemory& memory)
+{
+    DWORD* pRiscCode = static_cast<DWORD*>(riscMemory.GetUserPointer());
+    PHYS pRiscBase = riscMemory.TranslateToPhysical(pRiscCode, VBI_AUDIO_RISC_BYTES, NULL);
+    PHYS pRiscLoop = pRiscBase + 2*sizeof(DWORD);
+    *(pRiscCode++) = BT848_RISC_JUMP | BT848_RISC_STATUS(0);
+    *(pRiscCode++) = pRiscLoop;
+    BYTE* pUser = static_cast<BYTE*>(memory.GetUserPointer());
+    for (int block = 0; block < VBI_AUDIO_BLOCKS; ++block) {
+        // each packet (of PACKET_LEN bytes) starts with FM1
+        *(pRiscCode++) = BT848_RISC_SYNC | BT848_FIFO_STATUS_FM1;
+        *(pRiscCode++) = 0;
+        pRiscCode = riscWrite(pRiscCode, memory, pUser, VBI_AUDIO_BLOCK_BYTES,
+            BT848_RISC_SOL | BT848_RISC_STATUS(block), BT848_RISC_EOL);
+        pUser += VBI_AUDIO_BLOCK_BYTES;
+    }
+    // and the last packet of the ring ends with VRO
+    *(pRiscCode++) = BT848_RISC_SYNC | BT848_FIFO_STATUS_VRO;
+    *(pRiscCode++) = 0;
+    *(pRiscCode++) = BT848_RISC_JUMP;
+    *(pRiscCode++) = pRiscLoop;
+    return pRiscBase;
+}
+
+class AudioCapture : Uncopyable
+{
+public:
+    // Start the audio function's DMA into memory, with the program from
+    // audioRisc() at riscStart
+    AudioCapture(const CaptureConfig& config, UserMemory* memory, PHYS riscStart)
+      : _ring(static_cast<const Byte*>(memory->GetUserPointer())),
+        _rate(config.audioRate()),
+        _next(0),
+        _position(0),
+        _lost(0),
+        _errors(0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerSecond = static_cast<double>(frequency.QuadPart);
+        // 16-bit samples from the ADC, through both stages of the
+        // decimation filter
+        _control = BT878_A_DMA_CTL_DA_IOM_AFE | BT878_A_DMA_CTL_DA_ES2 | BT848_GPIO_DMA_CTL_PKTP_16 |
+            (config.audioDivider << BT878_A_DMA_CTL_DA_SDR_SHIFT) |
+            (config.audioInput << BT878_A_DMA_CTL_A_SEL_SHIFT) |
+            (config.audioGain << BT878_A_DMA_CTL_A_GAIN_SHIFT);
+        bt848Write<Bt878AudioDmaCtl>(_control);
+        bt848Write<Bt878AudioIntStat>(0x0fffffff);
+        bt848Write<Bt878AudioPacketLen>(VBI_AUDIO_BLOCK_BYTES | (VBI_AUDIO_BLOCKS << 16));
+        bt848Write<Bt878AudioRiscStrtAdd>(riscStart);
+        bt848Write<Bt878AudioDmaCtl>(_control | BT878_A_DMA_CTL_ACAP_EN | BT848_GPIO_DMA_CTL_RISC_ENABLE |
+            BT848_GPIO_DMA_CTL_FIFO_ENABLE);
+        QueryPerformanceCounter(&_start);
+        _last = _start;
+    }
+
+    // Stop the DMA and power the ADC down
+    ~AudioCapture() { bt848Write<Bt878AudioDmaCtl>(_control | BT878_A_DMA_CTL_A_PWRDN); }
+
+    // Write the blocks finished since the last call, after a VbiAudioHeader,
+    // to data, which must have room for VBI_AUDIO_RING_BYTES of samples
+    void collect(Byte* data)
+    {
+        DWORD status = bt848Read<Bt878AudioIntStat>();
+        DWORD errors = status & (VBI_INT_FIELD_ERRORS | VBI_INT_RISC_ERRORS);
+        if (errors != 0) {
+            ++_errors;
+            bt848Write<Bt878AudioIntStat>(errors);
+        }
+        // the block being written isn't finished
+        int current = static_cast<int>((status & BT848_INT_RISCS) >> BT848_INT_RISCS_SHIFT);
+        int blocks = (current + VBI_AUDIO_BLOCKS - _next) % VBI_AUDIO_BLOCKS;
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        double elapsed = static_cast<double>(now.QuadPart - _last.QuadPart)/_ticksPerSecond;
+        _last = now;
+        int laps = static_cast<int>((elapsed*_rate*2/VBI_AUDIO_BLOCK_BYTES - blocks)/VBI_AUDIO_BLOCKS + 0.5);
+        if (laps > 0) {
+            _lost += laps*VBI_AUDIO_BLOCKS;
+            _position += laps*VBI_AUDIO_RING_BYTES/2;
+        }
+        VbiAudioHeader header;
+        header.position = _position;
+        header.samples = blocks*VBI_AUDIO_BLOCK_BYTES/2;
+        memcpy(data, &header, sizeof(VbiAudioHeader));
+        Byte* samples = data + sizeof(VbiAudioHeader);
+        for (int i = 0; i < blocks; ++i) {
+            memcpy(samples, _ring + _next*VBI_AUDIO_BLOCK_BYTES, VBI_AUDIO_BLOCK_BYTES);
+            samples += VBI_AUDIO_BLOCK_BYTES;
+            _next = (_next + 1) % VBI_AUDIO_BLOCKS;
+        }
+        _position += header.samples;
+    }
+
+    // Print the samples captured in the session and the rate they came at
+    void report()
+    {
+        double seconds = static_cast<double>(_last.QuadPart - _start.QuadPart)/_ticksPerSecond;
+        console.write(String("Audio: ") + decimal(static_cast<int>(_position)) + " samples at " +
+            decimal(seconds > 0 ? static_cast<int>(_position/seconds + 0.5) : 0) + "/s (nominal " +
+            decimal(_rate) + "), " + decimal(_lost) + " blocks lost, " + decimal(_errors) + " DMA errors\n");
+    }
+
+private:
+    const Byte* _ring;
+    int _rate;
+    DWORD _control;   // GPIO_DMA_CTL without the enables
+    int _next;        // the next block to collect
+    uint32_t _position;
+    int _lost;
+    int _errors;
+    double _ticksPerSecond;
+    LARGE_INTEGER _start;
+    LARGE_INTEGER _last;
+};
+
+
+// ----------------------------------------------------------------------------
+// Capture sessions
+//
+// A session starts when a client asks for fields and ends when it
+// disconnects (or the recording it asked for is complete). The fields come
+// from a FieldSource (the card, or a file being replayed) and FieldSession
+// numbers them and sends them to the client's pipe or, in record and shared
+// modes, to a FieldSink. If the daemon was started with decimate=<bits>, the
+// fields are decimated to 4 samples per carrier cycle. If it was started with
+// average=<n>, each field sent is the average of n fields of the same parity
+// from the source (after decimation). With levels=1 or autolevel=1 the signal
+// levels of each field from the source are measured as well, and with
+// burst=1 the colour burst of each line. Tagged streams and recordings carry
+// them as records before each field, as they do the decoded picture of each
+// field with video=1 and the audio with audio=1.
+
+// The stream header for the fields sent by a session whose source has the
+// given stream header
+static VbiStreamHeader sessionStreamHeader(const VbiStreamHeader& source, const CaptureConfig& config)
+{
+    VbiStreamHeader streamHeader = source;
+    if (config.decimate != 0)
+        streamHeader = vbiDecimatedStreamHeader(streamHeader, config.decimate);
+    if (config.averageFields > 1)
+        streamHeader = vbiAveragedStreamHeader(streamHeader, config.averageFields);
+    return streamHeader;
+}
+
+class FieldSession : Uncopyable
+{
+public:
+    // streamHeader describes the fields of the source.
+    FieldSession(HANDLE pipe, bool tagged, FieldSink* sink, DWORD recordFields,
+        const VbiStreamHeader& streamHeader, const CaptureConfig& config, PreviewBoard* preview,
+        StatsPipe* statsPipe)
+      : _pipe(pipe),
+        _tagged(tagged),
+        _sink(sink),
+        _recordFields(recordFields),
+        _preview(preview),
+        _statsPipe(statsPipe),
+        _lines(streamHeader.linesPerField),
+        _width(streamHeader.bytesPerLine),
+        _outputFieldBytes(fieldBytes(sessionStreamHeader(streamHeader, config))),
+        _measureLevels(config.measureLevels()),
+        _records(tagged || sink != NULL),
+        _headerBytes((_records ? recordsBytes(streamHeader, config) : 0) + sizeof(VbiFieldHeader)),
+        _data(_headerBytes + _outputFieldBytes),
+        _levelsHeader(NULL),
+        _burstHeader(NULL),
+        _burstCapacity(0),
+        _videoHeader(NULL),
+        _audioHeader(NULL),
+        _sequence(0),
+        _over(false),
+        _discontinuities(0),
+        _damaged(0),
+        _maxLatency(0),
+        _totalLatency(0),
+        _timedFields(0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerSecond = static_cast<double>(frequency.QuadPart);
+        int samples = _lines*_width;
+        if (config.decimate != 0) {
+            _decimator.reset(new VbiDecimator(config.decimate));
+            if (_measureLevels || (_records && config.burst != 0))
+                _fullRate.resize(samples);
+            samples /= 2;
+        }
+        if (config.averageFields > 1) {
+            _averager.reset(new VbiFieldAverager(samples, config.averageFields, config.averageReject));
+            _samples.resize(samples);
+        }
+        memset(&_levels, 0, sizeof(_levels));
+        Byte* record = &_data[0];
+        if (_records && config.levels != 0) {
+            _levelsHeader = reinterpret_cast<VbiFieldHeader*>(record);
+            _levelsHeader->magic = VBICAP_LEVELS_MAGIC;
+            _levelsHeader->flags = 0;
+            _levelsHeader->dataBytes = sizeof(VbiFieldLevels);
+            record += sizeof(VbiFieldHeader) + sizeof(VbiFieldLevels);
+        }
+        if (_records && config.burst != 0) {
+            _burstCapacity = vbiBurstCapacity(_lines*_width);
+            _burstHeader = reinterpret_cast<VbiFieldHeader*>(record);
+            _burstHeader->magic = VBICAP_BURST_MAGIC;
+            _burstHeader->flags = 0;
+            _burstHeader->dataBytes = static_cast<uint32_t>(sizeof(uint32_t) + _burstCapacity*sizeof(VbiBurstLine));
+            record += sizeof(VbiFieldHeader) + _burstHeader->dataBytes;
+        }
+        if (_records && videoBytes(streamHeader) != 0) {
+            _videoHeader = reinterpret_cast<VbiFieldHeader*>(record);
+            _videoHeader->magic = VBICAP_VIDEO_MAGIC;
+            _videoHeader->flags = 0;
+            _videoHeader->dataBytes = videoBytes(streamHeader);
+            record += sizeof(VbiFieldHeader) + _videoHeader->dataBytes;
+        }
+        if (_records && streamHeader.audioRate != 0) {
+            _audioHeader = reinterpret_cast<VbiFieldHeader*>(record);
+            _audioHeader->magic = VBICAP_AUDIO_MAGIC;
+            _audioHeader->flags = 0;
+            _audioHeader->dataBytes = audioBytes;
+        }
+    }
+
+    // The size of the records before each field of a tagged stream or
+    // recording of a source with the given stream header
+    static DWORD recordsBytes(const VbiStreamHeader& streamHeader, const CaptureConfig& config)
+    {
+        DWORD bytes = 0;
+        if (config.levels != 0)
+            bytes += sizeof(VbiFieldHeader) + sizeof(VbiFieldLevels);
+        if (config.burst != 0) {
+            bytes += sizeof(VbiFieldHeader) + sizeof(uint32_t) +
+                vbiBurstCapacity(streamHeader.linesPerField*streamHeader.bytesPerLine)*sizeof(VbiBurstLine);
+        }
+        if (videoBytes(streamHeader) != 0)
+            bytes += sizeof(VbiFieldHeader) + videoBytes(streamHeader);
+        if (streamHeader.audioRate != 0)
+            bytes += sizeof(VbiFieldHeader) + audioBytes;
+        return bytes;
+    }
+
+    // Deliver the next field, whose lines are stride bytes apart and which
+    // completed at time completed (in seconds on the performance counter, or
+    // 0 if not known), with the decoded picture of the same field if the
+    // source has one, and the audio captured since the last field if it has
+    // audio. Returns false once the session is over.
+    bool deliver(const Byte* field, int stride, DWORD flags, double completed, const Byte* video = NULL,
+        AudioCapture* audio = NULL)
+    {
+        if ((flags & VBICAP_FIELD_DISCONTINUITY) != 0)
+            ++_discontinuities;
+        if ((flags & VBICAP_FIELD_DAMAGED) != 0)
+            ++_damaged;
+        if (_preview != NULL)
+            _preview->offer(field, _lines, stride, _width, flags);
+        VbiFieldHeader* fieldHeader = reinterpret_cast<VbiFieldHeader*>(&_data[_headerBytes - sizeof(VbiFieldHeader)]);
+        Byte* fieldData = &_data[_headerBytes];
+        if (_averager) {
+            // nothing is sent until an average is complete
+            convert(&_samples[0], field, stride);
+            uint32_t averageFlags;
+            if (!_averager->add(&_samples[0], flags, reinterpret_cast<uint16_t*>(fieldData), &averageFlags))
+                return !_over;
+            flags = averageFlags;
+        }
+        if (_videoHeader != NULL && video != NULL) {
+            // the pixels are already packed, so the picture is copied whole
+            _videoHeader->sequence = _sequence;
+            memcpy(_videoHeader + 1, video, _videoHeader->dataBytes);
+        }
+        if (_audioHeader != NULL && audio != NULL) {
+            _audioHeader->sequence = _sequence;
+            audio->collect(reinterpret_cast<Byte*>(_audioHeader + 1));
+        }
+        fieldHeader->magic = VBICAP_FIELD_MAGIC;
+        fieldHeader->sequence = _sequence;
+        fieldHeader->flags = flags;
+        fieldHeader->dataBytes = _outputFieldBytes;
+        if (_sink != NULL) {
+            Byte* output = _sink->acquire();
+            if (output != NULL) {
+                if (_averager)
+                    memcpy(output, fieldData, _outputFieldBytes);
+                else
+                    convert(output, field, stride);
+                if (!_sink->submit(*fieldHeader, &_data[0])) {
+                    console.write("Write to disk failed\n");
+                    _over = true;
+                }
+            }
+            if (_sequence + 1 == _recordFields)
+                _over = true;
+        }
+        else {
+            if (!_averager)
+                convert(fieldData, field, stride);
+            const Byte* data = (_tagged ? &_data[0] : fieldData);
+            DWORD bytes = (_tagged ? _headerBytes : 0) + _outputFieldBytes;
+            bool written;
+            if (m_faults != NULL && m_faults->beforeClientWrite()) {
+                writePipe(_pipe, data, bytes/2);
+                DisconnectNamedPipe(_pipe);
+                written = false;
+            }
+            else
+                written = writePipe(_pipe, data, bytes);
+            if (!written)
+                _over = true;
+        }
+        if (completed != 0 && !_over) {
+            LARGE_INTEGER counter;
+            QueryPerformanceCounter(&counter);
+            double latency = static_cast<double>(counter.QuadPart)/_ticksPerSecond - completed;
+            if (latency > _maxLatency)
+                _maxLatency = latency;
+            _totalLatency += latency;
+            ++_timedFields;
+        }
+        ++_sequence;
+        return !_over;
+    }
+
+    // Fill in the statistics that are the same whatever the source
+    void fillStats(VbiCaptureStats* stats)
+    {
+        stats->fields = _sequence;
+        stats->discontinuities = _discontinuities;
+        stats->damagedFields = _damaged;
+        stats->maxLatencyMicroseconds = static_cast<uint32_t>(_maxLatency*1000000 + 0.5);
+        stats->meanLatencyMicroseconds = (_timedFields == 0 ? 0 :
+            static_cast<uint32_t>(_totalLatency*1000000/_timedFields + 0.5));
+    }
+
+    // In record and shared modes nothing is written to the pipe, so the
+    // sources call this between batches of fields to see if the client has
+    // gone. It's also where clients asking for the stats so far are served.
+    bool check()
+    {
+        if (_sink != NULL && !pipeConnected(_pipe))
+            _over = true;
+        if (_statsPipe != NULL && _statsPipe->poll()) {
+            VbiCaptureStats* stats = _statsPipe->stats();
+            fillStats(stats);
+            stats->droppedFields = (_sink != NULL ? _sink->dropped() : 0);
+            _statsPipe->answer();
+        }
+        return !_over;
+    }
+
+    bool over() const { return _over; }
+    // the number of fields delivered so far
+    DWORD sequence() const { return _sequence; }
+
+    // The signal levels of the session's fields, if they were measured
+    bool levels(VbiFieldLevels* levels) const { return _measureLevels && _meter.total(levels); }
+
+private:
+    static int fieldBytes(const VbiStreamHeader& streamHeader)
+    {
+        return streamHeader.linesPerField*streamHeader.bytesPerLine;
+    }
+
+    static DWORD videoBytes(const VbiStreamHeader& streamHeader)
+    {
+        return streamHeader.videoWidth*2*streamHeader.videoLines;
+    }
+
+    // an audio record has room for the whole ring
+    static const DWORD audioBytes = sizeof(VbiAudioHeader) + VBI_AUDIO_RING_BYTES;
+
+    // Copy a field from the source to output, decimating it if asked to, and
+    // measure it. Levels and bursts are measured before decimation.
+    void convert(Byte* output, const Byte* field, int stride)
+    {
+        if (!_decimator) {
+            copyLines(output, field, _lines, stride, _width);
+            measure(output);
+        }
+        else if (!_fullRate.empty()) {
+            int count = _lines*_width;
+            copyLines(&_fullRate[0], field, _lines, stride, _width);
+            measure(&_fullRate[0]);
+            _decimator->decimate(output, &_fullRate[0], 1, count, count);
+        }
+        else
+            _decimator->decimate(output, field, _lines, stride, _width);
+    }
+
+    // Measure a field from the source and fill in the records for the next
+    // field sent
+    void measure(const Byte* samples)
+    {
+        int count = _lines*_width;
+        if (_measureLevels)
+            _meter.measure(samples, count, &_levels);
+        if (_levelsHeader != NULL) {
+            _levelsHeader->sequence = _sequence;
+            memcpy(_levelsHeader + 1, &_levels, sizeof(VbiFieldLevels));
+        }
+        if (_burstHeader != NULL) {
+            if (_measureLevels)
+                _tracker.track(samples, count, vbiSyncThreshold(_levels.histogram, count), &_bursts);
+            else
+                _tracker.track(samples, count, &_bursts);
+            uint32_t lines = static_cast<uint32_t>(_bursts.size() < _burstCapacity ? _bursts.size() : _burstCapacity);
+            if (_decimator && lines != 0)
+                vbiDecimateBursts(&_bursts[0], lines);
+            _burstHeader->sequence = _sequence;
+            Byte* table = reinterpret_cast<Byte*>(_burstHeader + 1);
+            memcpy(table, &lines, sizeof(uint32_t));
+            if (lines != 0)
+                memcpy(table + sizeof(uint32_t), &_bursts[0], lines*sizeof(VbiBurstLine));
+        }
+    }
+
+    HANDLE _pipe;
+    bool _tagged;
+    FieldSink* _sink;
+    DWORD _recordFields;
+    PreviewBoard* _preview;
+    StatsPipe* _statsPipe;  // clients asking for stats during the session
+    int _lines;
+    int _width;
+    int _outputFieldBytes;
+    bool _measureLevels;
+    bool _records;       // whether the fields sent have records before them
+    DWORD _headerBytes;  // records and field header
+    Array<Byte> _data;
+    VbiFieldHeader* _levelsHeader;  // in _data, if sent
+    VbiFieldHeader* _burstHeader;
+    size_t _burstCapacity;
+    VbiFieldHeader* _videoHeader;
+    VbiFieldHeader* _audioHeader;
+    std::unique_ptr<VbiDecimator> _decimator;
+    std::vector<uint8_t> _fullRate;  // a field from the source, to be measured and decimated
+    std::unique_ptr<VbiFieldAverager> _averager;
+    std::vector<uint8_t> _samples;  // a field from the source, to be averaged
+    VbiLevelMeter _meter;
+    VbiFieldLevels _levels;  // of the last field measured
+    VbiBurstTracker _tracker;
+    std::vector<VbiBurstLine> _bursts;
+    DWORD _sequence;
+    bool _over;
+    double _ticksPerSecond;
+    int _discontinuities;
+    int _damaged;
+    double _maxLatency;
+    double _totalLatency;
+    int _timedFields;
+};
+
+// The stream header describing fields captured with config
+static VbiStreamHeader configStreamHeader(const CaptureConfig& config)
+{
+    VbiStreamHeader streamHeader;
+    streamHeader.magic = VBICAP_STREAM_MAGIC;
+    streamHeader.version = VBICAP_STREAM_VERSION;
+    streamHeader.headerBytes = sizeof(VbiStreamHeader);
+    streamHeader.linesPerField = config.roiLines;
+    streamHeader.bytesPerLine = config.outputBytesPerLine;
+    streamHeader.firstLine = config.roiTop;
+    streamHeader.firstSample = config.roiLeft;
+    streamHeader.fieldLines = config.linesPerField;
+    streamHeader.fieldSamples = config.samplesPerLine;
+    // with video=1 VDELAY and HDELAY place the picture, and the raw lines
+    // are the ones before it, from the start of each line
+    streamHeader.vdelay = (config.video != 0 ? 0 : config.vdelay);
+    streamHeader.hdelay = (config.video != 0 ? 0 : config.hdelay);
+    streamHeader.sampleBits = 8;
+    streamHeader.averagedFields = 1;
+    streamHeader.samplesPerCycle = 8;
+    streamHeader.videoWidth = (config.video != 0 ? config.videoWidth : 0);
+    streamHeader.videoLines = (config.video != 0 ? config.videoLines : 0);
+    streamHeader.audioRate = config.audioRate();
+    return streamHeader;
+}
+
+class FieldSource
+{
+public:
+    virtual ~FieldSource() { }
+    // the geometry of the fields, as sent to tagged clients
+    virtual VbiStreamHeader streamHeader() = 0;
+    // Deliver fields to the session until it's over, then fill in the
+    // statistics that depend on the source (the rest are filled in by
+    // the session and by serve()).
+    virtual void capture(FieldSession* session, VbiCaptureStats* stats) = 0;
+    // Called between sessions with the signal levels of the last one
+    virtual void levelsMeasured(const VbiFieldLevels& levels) { }
+};
+
+
+// ----------------------------------------------------------------------------
+// Automatic level control
+//
+// With autolevel=1 the luma gain (CONTRAST) and offset (BRIGHT) are adjusted
+// after each capture session, from the levels measured during it, to put the
+// sync tips at VBI_LEVEL_BOTTOM and the brightest samples (the 99.99th
+// percentile) at VBI_LEVEL_TOP in the next session, using as much of the
+// ADC's range as possible without clipping. Nothing changes during a
+// session, so all the fields of a capture have the same settings. Each
+// adjustment is a damped step. If one doesn't move the levels measured in
+// the next session, that setting is left alone from then on, so a signal
+// path that bypasses it doesn't send it to its limit.
+
+#define VBI_LEVEL_BOTTOM           16
+#define VBI_LEVEL_TOP              239
+#define VBI_LEVEL_GAIN_STEP        0.125  // the most the gain changes per session
+#define VBI_LEVEL_OFFSET_STEP      16     // and the offset
+#define VBI_LEVEL_GAIN_DEADBAND    0.02
+#define VBI_LEVEL_UNRESPONSIVE     1.0    // levels, as a change that did nothing
+
+class LevelControl
+{
+public:
+    LevelControl(const CaptureConfig& config)
+      : _contrast(config.contrast),
+        _brightness(config.brightness),
+        _adjustGain(true),
+        _adjustOffset(true),
+        _changedGain(false),
+        _changedOffset(false),
+        _span(0),
+        _bottom(0)
+    { }
+
+    void update(const VbiFieldLevels& levels)
+    {
+        long long count = 0;
+        for (int i = 0; i < 256; ++i)
+            count += levels.histogram[i];
+        if (count == 0)
+            return;
+        double bottom = (levels.syncPulses != 0 ? levels.syncTip/256.0 : percentile(levels, count/10000));
+        double span = percentile(levels, count - count/10000) - bottom;
+
+        if (_changedGain && fabs(span - _span) < VBI_LEVEL_UNRESPONSIVE) {
+            console.write("Contrast doesn't change the samples, leaving it alone.\n");
+            _adjustGain = false;
+        }
+        if (_changedOffset && fabs(bottom - _bottom) < VBI_LEVEL_UNRESPONSIVE) {
+            console.write("Brightness doesn't change the samples, leaving it alone.\n");
+            _adjustOffset = false;
+        }
+        _span = span;
+        _bottom = bottom;
+
+        int contrast = _contrast;
+        if (_adjustGain && span > 0) {
+            double gain = (VBI_LEVEL_TOP - VBI_LEVEL_BOTTOM)/span;
+            gain = (gain < 1 - VBI_LEVEL_GAIN_STEP ? 1 - VBI_LEVEL_GAIN_STEP :
+                (gain > 1 + VBI_LEVEL_GAIN_STEP ? 1 + VBI_LEVEL_GAIN_STEP : gain));
+            if (fabs(gain - 1) > VBI_LEVEL_GAIN_DEADBAND)
+                contrast = clamp(static_cast<int>(floor(_contrast*gain + 0.5)), 1, 0x1ff);
+        }
+        int brightness = _brightness;
+        if (_adjustOffset) {
+            int step = static_cast<int>(floor((VBI_LEVEL_BOTTOM - bottom)/2 + 0.5));
+            step = clamp(step, -VBI_LEVEL_OFFSET_STEP, VBI_LEVEL_OFFSET_STEP);
+            brightness = clamp(_brightness + step, -128, 127);
+        }
+        _changedGain = (contrast != _contrast);
+        _changedOffset = (brightness != _brightness);
+        if (!_changedGain && !_changedOffset)
+            return;
+        console.write(String("Signal from ") + decimal(static_cast<int>(bottom)) + " to " +
+            decimal(static_cast<int>(bottom + span)) + ": contrast " + decimal(_contrast) + " -> " +
+            decimal(contrast) + ", bright " + decimal(_brightness) + " -> " + decimal(brightness) + "\n");
+        _contrast = contrast;
+        _brightness = brightness;
+        bt848Write<Bt848ContrastLo>(_contrast & 0xff);
+        bt848Update<Bt848Control>().set<Bt848ControlConMsb>(_contrast >> 8).apply();
+        bt848Write<Bt848Bright>(static_cast<BYTE>(_brightness));
+    }
+
+private:
+    static int clamp(int v, int lo, int hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+    // The lowest level with more than below samples under or at it
+    static int percentile(const VbiFieldLevels& levels, long long below)
+    {
+        long long n = 0;
+        for (int i = 0; i < 256; ++i) {
+            n += levels.histogram[i];
+            if (n > below)
+                return i;
+        }
+        return 255;
+    }
+
+    int _contrast;
+    int _brightness;
+    bool _adjustGain;
+    bool _adjustOffset;
+    bool _changedGain;    // by the last update
+    bool _changedOffset;
+    double _span;         // measured by the last update
+    double _bottom;
+};
+
+
+// ----------------------------------------------------------------------------
+// Switching between inputs
+//
+// With inputs=<n>,<n>... the card takes turns capturing from each of the
+// inputs, so that one card can watch several sources that don't change
+// much. The RISC program can't write registers, so the input is switched by
+// the capture loop between polls, once the current input's turn of dwell
+// fields has been delivered. The field in progress at that moment is torn
+// between the inputs and the decoder needs a field or two to lock to the
+// new signal, so the next settle fields are thrown away. Fields that
+// complete after the end of a turn but before the switch (because the loop
+// was late to poll) are thrown away too. Each field delivered is tagged with
+// its input in its flags, and the first of each turn is marked as a
+// discontinuity.
+
+// The IFORM MUXSEL bits that select input (0-3 for MUX0-MUX3)
+static int muxsel(int input)
+{
+    static const int values[VBI_MAX_INPUTS] = {
+        BT848_IFORM_MUX0, BT848_IFORM_MUX1, BT848_IFORM_MUX2, BT848_IFORM_MUX3};
+    return values[input];
+}
+
+class InputScheduler : Uncopyable
+{
+public:
+    // Starts the first turn, with the first input
+    InputScheduler(const CaptureConfig& config)
+      : _config(config),
+        _turn(0),
+        _discard(config.inputCount > 1 ? config.settle : 0),
+        _left(config.dwell),
+        _first(true),
+        _switches(0),
+        _settling(0),
+        _overrun(0),
+        _switchTicks(0)
+    {
+        memset(_fields, 0, sizeof(_fields));
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerSecond = static_cast<double>(frequency.QuadPart);
+        QueryPerformanceCounter(&_start);
+        // the last session may have ended on another input
+        if (config.inputCount > 1)
+            select(config.inputs[0]);
+    }
+
+    // Leave the card on the first input, so that the registers match the
+    // configuration on a warm start
+    ~InputScheduler()
+    {
+        if (_config.inputCount > 1 && _turn != 0)
+            select(_config.inputs[0]);
+    }
+
+    // Called for each field the card completes, in order. Returns false if
+    // the field is to be thrown away, and otherwise adds its input to flags.
+    bool field(DWORD* flags)
+    {
+        if (_config.inputCount == 1)
+            return true;
+        if (_discard > 0) {
+            --_discard;
+            ++_settling;
+            return false;
+        }
+        if (_left == 0) {
+            ++_overrun;
+            return false;
+        }
+        --_left;
+        int input = _config.inputs[_turn];
+        ++_fields[input];
+        *flags |= input << VBICAP_FIELD_INPUT_SHIFT;
+        if (_first)
+            *flags |= VBICAP_FIELD_DISCONTINUITY;
+        _first = false;
+        return true;
+    }
+
+    // Called after each batch of fields: starts the next turn if this one
+    // is over
+    void poll()
+    {
+        if (_config.inputCount == 1 || _left != 0)
+            return;
+        _turn = (_turn + 1) % _config.inputCount;
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        select(_config.inputs[_turn]);
+        QueryPerformanceCounter(&end);
+        _switchTicks += end.QuadPart - start.QuadPart;
+        ++_switches;
+        _discard = _config.settle;
+        _left = _config.dwell;
+        _first = true;
+    }
+
+    // The card has been restarted and may have lost lock, so the fields
+    // after it are thrown away as after a switch
+    void restarted()
+    {
+        if (_config.inputCount > 1)
+            _discard = _config.settle;
+    }
+
+    // Print the fields per second delivered from each input and what the
+    // switches cost
+    void report()
+    {
+        if (_config.inputCount == 1)
+            return;
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        double seconds = static_cast<double>(now.QuadPart - _start.QuadPart)/_ticksPerSecond;
+        if (seconds <= 0)
+            return;
+        String report = "Inputs:";
+        int delivered = 0;
+        for (int i = 0; i < _config.inputCount; ++i) {
+            int input = _config.inputs[i];
+            // an input listed twice is only reported once
+            bool seen = false;
+            for (int j = 0; j < i; ++j)
+                seen = seen || _config.inputs[j] == input;
+            if (seen)
+                continue;
+            int tenths = static_cast<int>(_fields[input]/seconds*10 + 0.5);
+            report += String(" MUX") + decimal(input) + " " + decimal(tenths/10) + "." + decimal(tenths%10) +
+                " fields/s";
+            delivered += _fields[input];
+        }
+        int thrown = _settling + _overrun;
+        int total = delivered + thrown;
+        console.write(report + "\n" + decimal(_switches) + " switches, " +
+            decimal(_switches == 0 ? 0 : static_cast<int>(_switchTicks*1000000/_ticksPerSecond/_switches + 0.5)) +
+            "us each; " + decimal(_settling) + " fields settling and " + decimal(_overrun) +
+            " late switches thrown away (" + decimal(total == 0 ? 0 : thrown*100/total) + "% of fields)\n");
+    }
+
+private:
+    void select(int input)
+    {
+        bt848Update<Bt848Iform>().set<Bt848IformMuxsel>(muxsel(input) >> Bt848IformMuxsel::shift).apply();
+    }
+
+    const CaptureConfig& _config;
+    int _turn;       // index in _config.inputs of the current input
+    int _discard;    // fields still to be thrown away while settling
+    int _left;       // fields left in the current turn
+    bool _first;     // the next field delivered is the first of its turn
+    int _fields[VBI_MAX_INPUTS];  // fields delivered from each input
+    int _switches;
+    int _settling;
+    int _overrun;
+    LONGLONG _switchTicks;
+    double _ticksPerSecond;
+    LARGE_INTEGER _start;
+};
+
+
+// Fields captured by the card into the DMA ring
+class CardSource : public FieldSource
+{
+public:
+    // videoMemory holds the decoded pictures if config.video is set, and
+    // audioMemory the audio ring (with its program at audioRiscStart) if
+    // config.audio is set, and is NULL otherwise
+    CardSource(const CaptureConfig& config, UserMemory* userMemory, UserMemory* videoMemory, PHYS riscStart,
+        UserMemory* audioMemory, PHYS audioRiscStart)
+      : _config(config), _userMemory(userMemory), _videoMemory(videoMemory), _riscStart(riscStart),
+        _audioMemory(audioMemory), _audioRiscStart(audioRiscStart)
+    {
+        if (config.autoLevel != 0)
+            _levelControl.reset(new LevelControl(config));
+    }
+
+    VbiStreamHeader streamHeader() { return configStreamHeader(_config); }
+
+    void levelsMeasured(const VbiFieldLevels& levels)
+    {
+        if (_levelControl)
+            _levelControl->update(levels);
+    }
+
+    void capture(FieldSession* session, VbiCaptureStats* stats)
+    {
+        InputScheduler inputs(_config);
+        std::unique_ptr<AudioCapture> audio;
+        if (_config.audio != 0)
+            audio.reset(new AudioCapture(_config, _audioMemory, _audioRiscStart));
+        DMAEnable dma(_config.captureBits());
+        DmaErrorMonitor monitor;
+        FieldClock& clock = _clock;
+        clock.beginSession();
+
+        int oldFrame = -1;
+        int frame;
+        // flags to apply to the next field delivered
+        DWORD pendingFlags = 0;
+        // the field that was being captured when a FIFO error was seen
+        int damagedFrame = -1;
+
+        do {
+            if (m_faults != NULL)
+                m_faults->poll(session->sequence());
+            // A single read of INT_STAT gives both the error bits and the
+            // number of the last completed field, which the RISC program
+            // stamps into the RISCS bits.
+            DWORD status = bt848Read<Bt848IntStat>();
+            if (m_faults != NULL)
+                status = m_faults->filterStatus(status);
+            DWORD errors = monitor.check(status);
+
+            if ((errors & VBI_INT_RISC_ERRORS) != 0 || monitor.stalled()) {
+                // the fields in flight are lost, but the session continues
+                // with the next field the card captures
+                dma.restart(_riscStart);
+                monitor.restarted();
+                inputs.restarted();
+                clock.reset();
+                oldFrame = -1;
+                damagedFrame = -1;
+                pendingFlags = (session->sequence() != 0 ? VBICAP_FIELD_DISCONTINUITY : 0);
+                continue;
+            }
+
+            // -1 if no field has completed since the RISC engine was started
+            // (the preamble clears the status bits)
+            frame = static_cast<int>((status & BT848_INT_RISCS) >> BT848_INT_RISCS_SHIFT) - 1;
+            //console.write(String(decimal(frame)) + ", ");
+
+            if ((errors & VBI_INT_FIELD_ERRORS) != 0) {
+                // the error may have hit the field in progress or any of
+                // those completed since the last poll
+                damagedFrame = (frame + 1) % VBI_FIELD_CAPTURE_COUNT;
+                pendingFlags |= VBICAP_FIELD_DAMAGED;
+            }
+
+            if (frame == -1) {
+                // also discards a stale field number left in the status bits
+                // by the previous session
+                oldFrame = -1;
+            }
+            // The field number only counts round the ring, so if we were held
+            // up for a whole lap of it the same number comes back. The clock
+            // says how many laps there should have been; the buffers then
+            // hold the last lap's fields, and the ones before are lost.
+            int laps = 0;
+            if (oldFrame != -1 && frame != -1) {
+                int seen = (frame + VBI_FIELD_CAPTURE_COUNT - oldFrame) % VBI_FIELD_CAPTURE_COUNT;
+                int missing = clock.expected() - seen;
+                if (missing > VBI_FIELD_CAPTURE_COUNT/2)
+                    laps = (missing + VBI_FIELD_CAPTURE_COUNT/2)/VBI_FIELD_CAPTURE_COUNT;
+            }
+            if (frame == oldFrame && laps == 0) {
+                clock.observe(0);
+                //DWORD startSleep = GetTickCount();
+                clock.wait();
+                //console.write(String("Slept ") + decimal(GetTickCount() - startSleep) + "ms\n");
+                continue;
+            }
+            if (oldFrame == -1) {
+                clock.observe(1);
+                oldFrame = frame;
+                continue;
+            }
+            int completed = (frame + VBI_FIELD_CAPTURE_COUNT - oldFrame) % VBI_FIELD_CAPTURE_COUNT +
+                laps*VBI_FIELD_CAPTURE_COUNT;
+            clock.observe(completed);
+            if (laps > 0) {
+                // deliver the whole ring, starting after the newest field
+                oldFrame = frame;
+                completed = VBI_FIELD_CAPTURE_COUNT;
+                pendingFlags |= VBICAP_FIELD_DISCONTINUITY;
+                monitor.lapped(laps);
+            }
+
+            //DWORD startWrite = GetTickCount();
+            int framesWritten = 0;
+            DWORD batchFlags = pendingFlags;
+            pendingFlags = 0;
+            do {
+                oldFrame = (oldFrame + 1) % VBI_FIELD_CAPTURE_COUNT;
+                BYTE* pVBI = static_cast<BYTE*>(_userMemory[oldFrame / 2].GetUserPointer());
+                if ((oldFrame & 1) != 0)
+                    pVBI += _config.fieldBytes();
+                if (oldFrame == damagedFrame) {
+                    batchFlags |= VBICAP_FIELD_DAMAGED;
+                    damagedFrame = -1;
+                }
+                const BYTE* pVideo = NULL;
+                if (_config.video != 0) {
+                    pVideo = static_cast<BYTE*>(_videoMemory[oldFrame / 2].GetUserPointer()) +
+                        ((oldFrame & 1) != 0 ? _config.videoFieldBytes() : 0);
+                }
+                DWORD flags = batchFlags | ((oldFrame & 1) != 0 ? VBICAP_FIELD_ODD : 0);
+                double completion = clock.completion(completed - 1 - framesWritten);
+                ++framesWritten;
+                if (!inputs.field(&flags))
+                    continue;
+                if (!session->deliver(pVBI, _config.lineStride, flags, completion, pVideo, audio.get()))
+                    break;
+                // a discontinuity only applies to the first field
+                batchFlags &= ~VBICAP_FIELD_DISCONTINUITY;
+            } while (oldFrame != frame);
+            inputs.poll();
+            if (framesWritten > 5)
+                console.write("*");
+            //console.write(String("Wrote ") + decimal(framesWritten) + " frames in " + decimal(GetTickCount() - startWrite) + "ms\n");
+            sourceStats(stats, monitor);
+            session->check();
+        } while (!session->over());
+        console.write(String("DMA errors: ") + monitor.report() + "\n");
+        inputs.report();
+        if (audio)
+            audio->report();
+        sourceStats(stats, monitor);
+    }
+
+private:
+    // The stats that come from the card, kept up to date during the session
+    // for clients asking for them
+    void sourceStats(VbiCaptureStats* stats, DmaErrorMonitor& monitor)
+    {
+        stats->fieldRateMilliHz = static_cast<uint32_t>(_clock.fieldRate()*1000 + 0.5);
+        stats->jitterMicroseconds = static_cast<uint32_t>(_clock.jitter()*1000000 + 0.5);
+        stats->missedWakeups = _clock.misses();
+        stats->dmaErrors = monitor.errors();
+        stats->restarts = monitor.restarts();
+    }
+
+    const CaptureConfig& _config;
+    UserMemory* _userMemory;
+    UserMemory* _videoMemory;
+    PHYS _riscStart;
+    UserMemory* _audioMemory;
+    PHYS _audioRiscStart;
+    std::unique_ptr<LevelControl> _levelControl;  // if autolevel=1
+    FieldClock _clock;  // kept from session to session for its period estimate
+};
+
+
+// ----------------------------------------------------------------------------
+// Replaying a recording
+//
+// Instead of driving a card, the daemon can serve the fields of a raw capture
+// (taken to have the configured geometry) or a .vbi file, so that clients can
+// be tested without one. The file is mapped into memory and fields are
+// delivered straight from the mapping at the NTSC field rate times rate, or
+// as fast as the clients take them if rate is 0. When paced, a client that
+// falls more than a ring's worth of fields behind loses fields just as it
+// would with a card.
+
+#define VBI_REPLAY_VIEW_BYTES  (64 << 20)
+
+class ReplaySource : public FieldSource, Uncopyable
+{
+public:
+    ReplaySource(const String& path, const CaptureConfig& config, double rate, bool loop)
+      : _rate(rate),
+        _loop(loop),
+        _mapping(NULL),
+        _view(NULL),
+        _viewOffset(0),
+        _viewBytes(0),
+        _fields(0),
+        _deltas(false),
+        _decoder(0, 0)
+    {
+        _file = CreateFileA(NullTerminatedString(path), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (_file == INVALID_HANDLE_VALUE)
+            throw Exception(String("Can't open ") + path + ".");
+        LARGE_INTEGER size;
+        IF_FALSE_THROW(GetFileSizeEx(_file, &size) != 0);
+        _fileBytes = size.QuadPart;
+        if (_fileBytes == 0)
+            throw Exception(path + " is empty.");
+        _mapping = CreateFileMapping(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        IF_NULL_THROW(_mapping);
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        _granularity = info.dwAllocationGranularity;
+
+        memset(&_header, 0, sizeof(VbiStreamHeader));
+        const VbiStreamHeader* header = reinterpret_cast<const VbiStreamHeader*>(map(0, sizeof(uint32_t)*5));
+        if (header != NULL && header->magic == VBICAP_STREAM_MAGIC) {
+            // older versions have shorter headers
+            DWORD bytes = header->headerBytes;
+            DWORD keep = (bytes < sizeof(VbiStreamHeader) ? bytes : sizeof(VbiStreamHeader));
+            const Byte* p = map(0, keep);
+            if (bytes < sizeof(uint32_t)*5 || p == NULL)
+                throw Exception(path + " has a bad header.");
+            memcpy(&_header, p, keep);
+            if (_header.fieldLines == 0) {
+                _header.fieldLines = _header.linesPerField;
+                _header.fieldSamples = _header.bytesPerLine;
+            }
+            if (_header.sampleBits == 0) {
+                _header.sampleBits = 8;
+                _header.averagedFields = 1;
+            }
+            if (_header.samplesPerCycle == 0)
+                _header.samplesPerCycle = 8;
+            _raw = false;
+            _firstField = bytes;
+        }
+        else {
+            _header = configStreamHeader(config);
+            _raw = true;
+            _firstField = 0;
+        }
+        _header.headerBytes = sizeof(VbiStreamHeader);
+        _header.version = VBICAP_STREAM_VERSION;
+        // only the raw fields are replayed
+        _header.videoWidth = 0;
+        _header.videoLines = 0;
+        _header.audioRate = 0;
+        _fieldBytes = _header.linesPerField*_header.bytesPerLine;
+        if (_fieldBytes == 0)
+            throw Exception(path + " has a bad header.");
+
+        // Count the fields, and see if any need to be reconstructed from
+        // deltas (only the headers are touched)
+        if (_raw)
+            _fields = static_cast<int>(_fileBytes/_fieldBytes);
+        else {
+            rewind();
+            const VbiFieldHeader* h;
+            while ((h = nextHeader()) != NULL) {
+                if ((h->flags & VBICAP_FIELD_DELTA) != 0)
+                    _deltas = true;
+                _position += h->dataBytes;
+                ++_fields;
+            }
+        }
+        if (_fields == 0)
+            throw Exception(path + " has no complete fields.");
+        console.write(String("Replaying ") + decimal(_fields) + " fields from " + path + "\n");
+    }
+
+    ~ReplaySource()
+    {
+        if (_view != NULL)
+            UnmapViewOfFile(_view);
+        if (_mapping != NULL)
+            CloseHandle(_mapping);
+        CloseHandle(_file);
+    }
+
+    VbiStreamHeader streamHeader() { return _header; }
+
+    void capture(FieldSession* session, VbiCaptureStats* stats)
+    {
+        LARGE_INTEGER frequency;
+        LARGE_INTEGER start;
+        LARGE_INTEGER now;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        double period = (_rate > 0 ? VBI_NOMINAL_FIELD_PERIOD/_rate : 0);
+        timeBeginPeriod(1);
+        rewind();
+        // fields taken from the file, delivered or not
+        LONGLONG consumed = 0;
+        DWORD pendingFlags = 0;
+        double startSeconds = static_cast<double>(start.QuadPart)/frequency.QuadPart;
+        while (!session->over()) {
+            if (m_faults != NULL)
+                m_faults->poll(session->sequence());
+            DWORD flags;
+            const Byte* field;
+            if (period > 0) {
+                QueryPerformanceCounter(&now);
+                double elapsed = static_cast<double>(now.QuadPart - start.QuadPart)/frequency.QuadPart;
+                LONGLONG due = static_cast<LONGLONG>(elapsed/period);
+                if (due <= consumed) {
+                    Sleep(static_cast<DWORD>(((consumed + 1)*period - elapsed)*1000) + 1);
+                    continue;
+                }
+                // fields that a card would have overwritten by now are lost
+                while (due - consumed > VBI_FIELD_CAPTURE_COUNT) {
+                    if (next(&flags) == NULL)
+                        break;
+                    ++consumed;
+                    pendingFlags |= VBICAP_FIELD_DISCONTINUITY;
+                }
+            }
+            field = next(&flags);
+            if (field == NULL)
+                break;
+            ++consumed;
+            // when paced, each field "completes" when it's due
+            double completed = (period > 0 ? startSeconds + consumed*period : 0);
+            session->deliver(field, _header.bytesPerLine, flags | pendingFlags, completed);
+            pendingFlags = 0;
+            session->check();
+        }
+        timeEndPeriod(1);
+        QueryPerformanceCounter(&now);
+        double elapsed = static_cast<double>(now.QuadPart - start.QuadPart)/frequency.QuadPart;
+        stats->fieldRateMilliHz = (elapsed > 0 ? static_cast<uint32_t>(consumed*1000/elapsed + 0.5) : 0);
+        stats->jitterMicroseconds = 0;
+        stats->missedWakeups = 0;
+        stats->dmaErrors = 0;
+        stats->restarts = 0;
+    }
+
+private:
+    // Get a pointer to bytes bytes of the file at offset, or NULL if they're
+    // past the end.
+    const Byte* map(LONGLONG offset, DWORD bytes)
+    {
+        if (offset + bytes > _fileBytes)
+            return NULL;
+        if (_view == NULL || offset < _viewOffset || offset + bytes > _viewOffset + _viewBytes) {
+            if (_view != NULL)
+                UnmapViewOfFile(_view);
+            _viewOffset = offset - offset % _granularity;
+            LONGLONG end = _viewOffset + VBI_REPLAY_VIEW_BYTES;
+            if (end < offset + bytes)
+                end = offset + bytes;
+            if (end > _fileBytes)
+                end = _fileBytes;
+            _viewBytes = static_cast<DWORD>(end - _viewOffset);
+            _view = static_cast<const Byte*>(MapViewOfFile(_mapping, FILE_MAP_READ,
+                static_cast<DWORD>(_viewOffset >> 32), static_cast<DWORD>(_viewOffset), _viewBytes));
+            IF_NULL_THROW(_view);
+        }
+        return _view + (offset - _viewOffset);
+    }
+
+    void rewind()
+    {
+        _position = _firstField;
+        _index = 0;
+        _decoder = VbiDeltaDecoder(_header.linesPerField, _header.bytesPerLine);
+        _decoded.resize(_fieldBytes);
+    }
+
+    // The header of the next field in a .vbi file, skipping padding, levels
+    // and bursts, with _position left at its data. NULL at the end of the file.
+    const VbiFieldHeader* nextHeader()
+    {
+        while (true) {
+            const VbiFieldHeader* h = reinterpret_cast<const VbiFieldHeader*>(map(_position, sizeof(VbiFieldHeader)));
+            if (h == NULL)
+                return NULL;
+            _position += sizeof(VbiFieldHeader);
+            if (h->magic == VBICAP_FIELD_MAGIC)
+                return (_position + h->dataBytes <= _fileBytes ? h : NULL);
+            if (h->magic != VBICAP_PAD_MAGIC && h->magic != VBICAP_LEVELS_MAGIC &&
+                h->magic != VBICAP_BURST_MAGIC && h->magic != VBICAP_VIDEO_MAGIC &&
+                h->magic != VBICAP_AUDIO_MAGIC)
+                return NULL;
+            _position += h->dataBytes;
+        }
+    }
+
+    // The next field of the file, going back to the start at the end if
+    // we're looping. NULL when there are no more fields.
+    const Byte* next(DWORD* flags)
+    {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            const Byte* field = nextInFile(flags);
+            if (field != NULL) {
+                if (_index == 1 && attempt == 1)
+                    *flags |= VBICAP_FIELD_DISCONTINUITY;
+                return field;
+            }
+            if (!_loop)
+                return NULL;
+            rewind();
+        }
+        return NULL;
+    }
+
+    const Byte* nextInFile(DWORD* flags)
+    {
+        if (_raw) {
+            if (_index == _fields)
+                return NULL;
+            const Byte* field = map(_position, _fieldBytes);
+            *flags = ((_index & 1) != 0 ? VBICAP_FIELD_ODD : 0);
+            _position += _fieldBytes;
+            ++_index;
+            return field;
+        }
+        const VbiFieldHeader* h = nextHeader();
+        if (h == NULL)
+            return NULL;
+        VbiFieldHeader header = *h;
+        const Byte* data = map(_position, header.dataBytes);
+        _position += header.dataBytes;
+        ++_index;
+        *flags = header.flags & ~VBICAP_FIELD_DELTA;
+        if (!_deltas) {
+            if (header.dataBytes != static_cast<uint32_t>(_fieldBytes))
+                return NULL;
+            return data;
+        }
+        // the decoder needs to see every field to keep its references
+        if (!_decoder.decode(header, data, &_decoded[0]))
+            return NULL;
+        return &_decoded[0];
+    }
+
+    double _rate;
+    bool _loop;
+    HANDLE _file;
+    HANDLE _mapping;
+    LONGLONG _fileBytes;
+    DWORD _granularity;
+    const Byte* _view;
+    LONGLONG _viewOffset;
+    DWORD _viewBytes;
+
+    VbiStreamHeader _header;
+    bool _raw;
+    LONGLONG _firstField;
+    int _fieldBytes;
+    int _fields;
+    bool _deltas;
+    LONGLONG _position;
+    int _index;
+    VbiDeltaDecoder _decoder;
+    std::vector<uint8_t> _decoded;
+};
+
+
+// Accept connections from clients and serve them fields from source until
+// one of them tells us to stop.
+static void serve(FieldSource* source, int card, const String& pipeName, const CaptureConfig& config,
+    const RecordDirectories& recordDirectories)
+{
+    bool averaging = config.averageFields > 1;
+    if (averaging && source->streamHeader().sampleBits != 8)
+        throw Exception("Can't average fields which are already averages.");
+    if (config.decimate != 0 && (source->streamHeader().sampleBits != 8 ||
+        source->streamHeader().samplesPerCycle != 8 || (source->streamHeader().bytesPerLine & 1) != 0))
+        throw Exception("Only 8-bit lines of an even number of samples at 8 per cycle can be decimated.");
+    std::unique_ptr<PreviewBoard> preview;
+    if (config.preview != 0) {
+        if (source->streamHeader().sampleBits != 8)
+            throw Exception("Only 8-bit fields can be previewed.");
+        preview.reset(new PreviewBoard(card, source->streamHeader(), config));
+    }
+    String statsPipeName = VBICAP_STATS_PIPE_NAME;
+    if (card != 0)
+        statsPipeName += decimal(card);
+    VbiCaptureStats stats;
+    memset(&stats, 0, sizeof(stats));
+    while (true) {
+        console.write("Waiting for connection\n");
+        AutoHandle h = File(pipeName, true).createPipe();
+
+        bool connected = (ConnectNamedPipe(h, NULL) != 0) ? true :
+            (GetLastError() == ERROR_PIPE_CONNECTED);
+        if (!connected)
+            continue;
+
+        console.write("Connected\n");
+
+        int command = h.read<int>();
+        if (command == VBICAP_COMMAND_STOP) {
+            // Stop vbicap command
+            break;
+        }
+        if (command == VBICAP_COMMAND_STATS) {
+            writePipe(h, &stats, sizeof(stats));
+            continue;
+        }
+        if (command != VBICAP_COMMAND_CAPTURE && command != VBICAP_COMMAND_CAPTURE_TAGGED &&
+            command != VBICAP_COMMAND_RECORD && command != VBICAP_COMMAND_CAPTURE_SHARED)
+            continue;
+        bool tagged = (command == VBICAP_COMMAND_CAPTURE_TAGGED);
+
+        VbiStreamHeader sourceHeader = source->streamHeader();
+        VbiStreamHeader streamHeader = sessionStreamHeader(sourceHeader, config);
+        if (tagged) {
+            if (!writePipe(h, &streamHeader, sizeof(streamHeader)))
+                continue;
+        }
+
+        // In record mode the fields go to disk instead of the pipe
+        std::unique_ptr<FieldRecorder> recorder;
+        DWORD recordFields = 0;
+        if (command == VBICAP_COMMAND_RECORD) {
+            VbiRecordRequest request;
+            h.read(reinterpret_cast<Byte*>(&request), sizeof(request));
+            request.pathPrefix[sizeof(request.pathPrefix) - 1] = 0;
+            if (!recordDirectories.allows(request.pathPrefix)) {
+                console.write(String("Refusing to record to ") + request.pathPrefix +
+                    ", which isn't in a record directory.\n");
+                continue;
+            }
+            recordFields = request.fields;
+            recorder.reset(new FieldRecorder(streamHeader, request,
+                FieldSession::recordsBytes(sourceHeader, config)));
+            if (!recorder->ok())
+                continue;
+        }
+
+        // In shared mode they go to a ring which the client maps
+        std::unique_ptr<SharedRing> ring;
+        if (command == VBICAP_COMMAND_CAPTURE_SHARED) {
+            VbiSharedRequest request;
+            h.read(reinterpret_cast<Byte*>(&request), sizeof(request));
+            ring.reset(new SharedRing(streamHeader, request, FieldSession::recordsBytes(sourceHeader, config)));
+            VbiSharedReply reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.ok = ring->ok() ? 1 : 0;
+            if (ring->ok()) {
+                strcpy(reply.mapping, ring->mappingName());
+                strcpy(reply.event, ring->eventName());
+            }
+            if (!writePipe(h, &reply, sizeof(reply)) || !ring->ok())
+                continue;
+        }
+        FieldSink* sink = (recorder ? static_cast<FieldSink*>(recorder.get()) : ring.get());
+
+        // the stats are kept up to date during the session, for clients
+        // asking for them on the stats pipe
+        memset(&stats, 0, sizeof(stats));
+        StatsPipe statsPipe(statsPipeName, &stats);
+        FieldSession session(h, tagged, sink, recordFields, sourceHeader, config, preview.get(), &statsPipe);
+        if (m_faults != NULL)
+            m_faults->begin();
+        source->capture(&session, &stats);
+        session.fillStats(&stats);
+        stats.droppedFields = (sink != NULL ? sink->dropped() : 0);
+        stats.scenarioFailures = (m_faults != NULL ? m_faults->check(stats) : 0);
+        if (recorder) {
+            console.write(String("Recorded ") + decimal(stats.fields - stats.droppedFields) +
+                " fields in " + decimal(recorder->segments()) + " files, " +
+                decimal(stats.droppedFields) + " dropped\n");
+            // finish writing before telling the client
+            recorder.reset();
+            writePipe(h, &stats, sizeof(stats));
+        }
+        if (ring) {
+            console.write(String("Published ") + decimal(stats.fields - stats.droppedFields) +
+                " fields in a ring of " + decimal(ring->slots()) + " slots, " +
+                decimal(stats.droppedFields) + " dropped\n");
+        }
+        console.write(String("Field rate ") + decimal(stats.fieldRateMilliHz) +
+            "mHz, jitter " + decimal(stats.jitterMicroseconds) + "us, " +
+            decimal(stats.missedWakeups) + " missed wakeups, latency " +
+            decimal(stats.meanLatencyMicroseconds) + "us mean, " +
+            decimal(stats.maxLatencyMicroseconds) + "us max\n");
+        VbiFieldLevels levels;
+        if (session.levels(&levels)) {
+            console.write(String("Levels: sync tip ") + decimal(levels.syncTip >> 8) + ", blanking " +
+                decimal(levels.blanking >> 8) + ", burst amplitude " + decimal(levels.burstAmplitude >> 8) +
+                ", clipped samples per field " + decimal(levels.clippedLow) + " low, " +
+                decimal(levels.clippedHigh) + " high\n");
+            source->levelsMeasured(levels);
+        }
+        if (preview)
+            preview->report();
+        console.write("Capture complete.\n");
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Register setup
+//
+// The card keeps its registers while the daemon isn't running, and a
+// software reset makes the decoder lose lock on the signal, so that it takes
+// a few fields to settle. On a warm start the registers are first read and
+// compared with the ones for the configuration, and the card is only reset
+// and set up from scratch if one differs (including DMA being left enabled).
+// Registers that are always written (INT_STAT, RISC_STRT_ADD) aren't
+// compared, nor the odd field's copies (which are always written with the
+// even field's).
+
+class RegisterSetup
+{
+public:
+    RegisterSetup(bool compare) : _compare(compare), _differences(0) { }
+
+    template<class Register> void set(DWORD value)
+    {
+        if (!_compare)
+            bt848Write<Register>(value);
+        else if (bt848Read<Register>() != (value & Register::all))
+            ++_differences;
+    }
+
+    int differences() const { return _differences; }
+
+private:
+    bool _compare;
+    int _differences;
+};
+
+static void setupRegisters(RegisterSetup* r, const CaptureConfig& config)
+{
+    r->set<Bt848Tdec>(0x00);
+    r->set<Bt848ColorCtl>(BT848_COLOR_CTL_GAMMA);
+    r->set<Bt848Adelay>(0x7f);
+    r->set<Bt848Bdelay>(0x72);
+    // capturing is off until a session starts
+    r->set<Bt848CapCtl>(0x00);
+    if (config.video == 0) {
+        // VBI frame output mode: raw samples for the whole field, in lines
+        // of the maximum length
+        r->set<Bt848VbiPackSize>(0xff);
+        r->set<Bt848VbiPackDel>(BT848_VBI_PACK_DEL_VBI_PKT_HI | BT848_VBI_PACK_DEL_EXT_FRAME);
+        r->set<Bt848ColorFmt>(BT848_COLOR_FMT_RAW);
+    }
+    else {
+        // VBI line output mode: raw samples for the lines of the vertical
+        // blanking interval, in lines of spl samples, and YUV 4:2:2 pixels
+        // for the picture
+        int dwords = config.samplesPerLine/4;
+        r->set<Bt848VbiPackSize>(dwords & 0xff);
+        r->set<Bt848VbiPackDel>((dwords >> 8) & BT848_VBI_PACK_DEL_VBI_PKT_HI);
+        r->set<Bt848ColorFmt>(BT848_COLOR_FMT_YUY2);
+    }
+
+    // the registers for both fields are written together. In VBI frame
+    // output mode HACTIVE and VACTIVE are the raw lines; otherwise they're
+    // the picture's (VACTIVE counting the lines of both fields).
+    int hactive = (config.video != 0 ? config.videoWidth : config.samplesPerLine);
+    int vactive = (config.video != 0 ? config.videoLines*2 : config.linesPerField);
+    int hscale = (config.video != 0 ? config.videoHscale() : 0);
+    r->set<Bt848VdelayLo>(config.vdelay & 0xff);
+    int crop = ((hactive >> 8) & 3) |
+               (((config.hdelay >> 8) & 3) << 2) |
+               (((vactive >> 8) & 3) << 4) |
+               (((config.vdelay >> 8) & 3) << 6);
+    r->set<Bt848Crop>(crop);
+    r->set<Bt848VactiveLo>(vactive & 0xff);
+    r->set<Bt848HscaleLo>(hscale & 0xff);
+    r->set<Bt848HscaleHi>(hscale >> 8);
+    r->set<Bt848HdelayLo>(config.hdelay & 0xff);
+    r->set<Bt848HactiveLo>(hactive & 0xff);
+
+    // FIFO and RISC DMA are off until a session starts
+    r->set<Bt848GpioDmaCtl>(BT848_GPIO_DMA_CTL_PKTP_32 |
+                            BT848_GPIO_DMA_CTL_PLTP1_16 |
+                            BT848_GPIO_DMA_CTL_PLTP23_16 |
+                            BT848_GPIO_DMA_CTL_GPINTC |
+                            BT848_GPIO_DMA_CTL_GPINTI);
+    r->set<Bt848GpioRegInp>(0x00);
+    // input format (PAL, NTSC etc.) and input source (the first input, MUX3
+    // by default)
+    r->set<Bt848Iform>(muxsel(config.inputs[0]) | BT848_IFORM_XTBOTH | BT848_IFORM_NTSC);
+
+    r->set<Bt848ContrastLo>(config.contrast & 0xff);
+    r->set<Bt848Bright>(static_cast<BYTE>(config.brightness));
+    r->set<Bt848VscaleHi>(0x20);
+    r->set<Bt848VscaleLo>(0x00);
+    r->set<Bt848SatULo>(0xfe);
+    r->set<Bt848SatVLo>(0xb4);
+    r->set<Bt848Hue>(0);
+    r->set<Bt848Oform>(0x00);
+    r->set<Bt848Vtc>(BT848_VTC_HSFMT);
+
+    // AGC_EN is active low
+    r->set<Bt848Adc>(BT848_ADC_RESERVED | (config.crush != 0 ? BT848_ADC_CRUSH : 0) |
+        (config.agc != 0 ? 0 : BT848_ADC_AGC_EN));
+    // composite input, so COMP is off
+    r->set<Bt848Control>(BT848_CONTROL_LDEC | BT848_CONTROL_LNOTCH |
+        ((config.contrast & 0x100) != 0 ? BT848_CONTROL_CON_MSB : 0));
+
+    r->set<Bt848Scloop>(BT848_SCLOOP_CKILL);
+
+    r->set<Bt848IntMask>((1 << 23) | BT848_INT_RISCI);
+
+    r->set<Bt848Tgctrl>(BT848_TGCTRL_TGCKI_NOPLL);
+    r->set<Bt848PllXci>(0x00);
+}
+
+// Times the phases of bringing the daemon up, which are reported on every
+// start
+class StartupTimer
+{
+public:
+    StartupTimer()
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _ticksPerMicrosecond = static_cast<double>(frequency.QuadPart)/1000000.0;
+        QueryPerformanceCounter(&_start);
+        _last = _start;
+        _separator = "";
+    }
+
+    // The phase called name has just finished
+    void phase(const char* name)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        _report += String(_separator) + name + " " + microseconds(_last, now) + "us";
+        _separator = ", ";
+        _last = now;
+    }
+
+    String report(bool warm)
+    {
+        return String("Startup (") + (warm ? "warm" : "cold") + "): " + _report + ", total " +
+            microseconds(_start, _last) + "us\n";
+    }
+
+private:
+    String microseconds(LARGE_INTEGER from, LARGE_INTEGER to)
+    {
+        return decimal(static_cast<int>(static_cast<double>(to.QuadPart - from.QuadPart)/_ticksPerMicrosecond));
+    }
+
+    double _ticksPerMicrosecond;
+    LARGE_INTEGER _start;
+    LARGE_INTEGER _last;
+    String _report;
+    const char* _separator;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        CaptureConfig config;
+        bool benchmark = false;
+        // which card to use, if there are several
+        int card = 0;
+        // serve the fields of a file instead of a card
+        bool replay = false;
+        String replayFile;
+        double replayRate = 1;
+        bool replayLoop = false;
+        // fault injection scenario
+        std::unique_ptr<FaultInjector> faults;
+        // where clients may record
+        RecordDirectories recordDirectories;
+        for (int i = 1; i < _arguments.count(); ++i) {
+            if (config.parse(_arguments[i]))
+                continue;
+            NullTerminatedString argument(_arguments[i]);
+            const char* a = argument;
+            if (strncmp(a, "card=", 5) == 0) {
+                card = atoi(a + 5);
+                if (card < 0)
+                    throw Exception("Invalid value for card.");
+            }
+            else if (strncmp(a, "replay=", 7) == 0) {
+                replay = true;
+                replayFile = String(a + 7);
+            }
+            else if (strncmp(a, "rate=", 5) == 0) {
+                replayRate = atof(a + 5);
+                if (replayRate < 0)
+                    throw Exception("Invalid value for rate.");
+            }
+            else if (_arguments[i] == "loop")
+                replayLoop = true;
+            else if (strncmp(a, "faults=", 7) == 0)
+                faults.reset(new FaultInjector(String(a + 7)));
+            else if (strncmp(a, "record_dirs=", 12) == 0)
+                recordDirectories.add(a + 12);
+            else if (_arguments[i] == "bench")
+                benchmark = true;
+            else
+                throw Exception(String("Unknown argument ") + _arguments[i] + ".");
+        }
+        config.validate();
+        recordDirectories.addDefault();
+        if (!config.fullField()) {
+            console.write(String("Capturing lines ") + decimal(config.roiTop) + "-" +
+                decimal(config.roiTop + config.roiLines - 1) + ", samples " +
+                decimal(config.roiLeft) + "-" + decimal(config.roiLeft + config.roiSamples - 1) + "\n");
+        }
+        if (benchmark) {
+            benchmarkCopyKernels(config);
+            return;
+        }
+        m_faults = faults.get();
+        String pipeName = VBICAP_PIPE_NAME;
+        if (card != 0)
+            pipeName += decimal(card);
+        if (replay) {
+            ReplaySource source(replayFile, config, replayRate, replayLoop);
+            serve(&source, card, pipeName, config, recordDirectories);
+            return;
+        }
+
+        StartupTimer startup;
+        ServiceHandle m_hService;
+        {
+            ServiceHandle hSCManager(OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT));
+            IF_NULL_THROW(hSCManager);
+
+            String driverName("DSDrv4");
+            const WCHAR* arch = _wgetenv(L"PROCESSOR_ARCHITEW6432");
+            if (arch != nullptr)
+                driverName += String(arch);
+            NullTerminatedWideString name(driverName);
+
+            m_hService = OpenService(hSCManager, name, SERVICE_START | SERVICE_STOP);
+            IF_NULL_THROW(m_hService);
+        }
+
+        if (StartService(m_hService, 0, NULL) == FALSE)
+        {
+            IF_FALSE_THROW(GetLastError() == ERROR_SERVICE_ALREADY_RUNNING);
+        }
+
+        m_hFile = CreateFile(
+                             L"\\\\.\\DSDrv4",
+                             GENERIC_READ | GENERIC_WRITE,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             NULL,
+                             OPEN_EXISTING,
+                             0,
+                             INVALID_HANDLE_VALUE
+                            );
+        IF_FALSE_THROW(m_hFile != INVALID_HANDLE_VALUE);
+
+        // OK so we've loaded the driver
+        // we had better check that it's the same version as we are
+        // otherwise all sorts of nasty things could happen
+        // n.b. note that if someone else has already loaded our driver this may
+        // happen.
+
+        DWORD dwReturnedLength;
+        DWORD dwVersion = 0;
+        HwDrv_SendCommandEx(
+                    IOCTL_DSDRV_GETVERSION,
+                    NULL,
+                    0,
+                    &dwVersion,
+                    sizeof(dwVersion),
+                    &dwReturnedLength
+                   );
+        if ( (dwVersion < DSDRV_COMPAT_MIN_VERSION) ||
+             ((dwVersion & DSDRV_COMPAT_MASK) != DSDRV_COMPAT_MAJ_VERSION) )
+            throw Exception("Incompatible driver version.");
+        startup.phase("driver");
+
+        m_MemoryBase = 0;
+        m_InitialACPIStatus = 0;
+
+        bool foundCard = false;
+        int deviceId;
+        // index of the card among those with the same device ID
+        DWORD deviceIndex;
+        int cardsSeen = 0;
+        DWORD dwBusNumber;
+        DWORD dwSlotNumber;
+
+        static const int deviceIds[] = {
+            0x036e,   // Brooktree Bt878
+            0x036f,   // Brooktree Bt878A
+            0x0350,   // Brooktree Bt848
+            0x0351};  // Brooktree Bt849
+
+        for (int chipIdx = 0; chipIdx < 4 && !foundCard; ++chipIdx) {
+            for (deviceIndex = 0; ; ++deviceIndex) {
+                TDSDrvParam hwParam;
+                DWORD dwStatus;
+                DWORD dwLength;
+                TPCICARDINFO PCICardInfo;
+
+                hwParam.dwAddress = PCI_ID_BROOKTREE;
+                deviceId = deviceIds[chipIdx];
+                hwParam.dwValue = deviceId;
+                hwParam.dwFlags = deviceIndex;
+
+                dwStatus = HwDrv_SendCommandEx(
+                                        IOCTL_DSDRV_GETPCIINFO,
+                                        &hwParam,
+                                        sizeof(hwParam),
+                                        &PCICardInfo,
+                                        sizeof(TPCICARDINFO),
+                                        &dwLength
+                                      );
+
+                if (dwStatus != ERROR_SUCCESS)
+                    break;
+                if (cardsSeen++ == card) {
+                    dwBusNumber   = PCICardInfo.dwBusNumber;
+                    dwSlotNumber  = PCICardInfo.dwSlotNumber;
+                    foundCard = true;
+                    break;
+                }
+            }
+        }
+        if (!foundCard) {
+            if (cardsSeen == 0)
+                throw Exception("No Bt8x8 capture card found on PCI bus.");
+            throw Exception(String("Only ") + decimal(cardsSeen) + " Bt8x8 capture cards found on PCI bus.");
+        }
+
+        BOOL supportsAcpi;
+
+        // TRUE if BT878 or BT878A is present
+        supportsAcpi = (deviceId == 0x036E || deviceId == 0x036F);
+
+        TDSDrvParam hwParam;
+        DWORD dwStatus;
+        DWORD dwLength;
+        TPCICARDINFO PCICardInfo;
+
+        hwParam.dwAddress = PCI_ID_BROOKTREE;
+        hwParam.dwValue = deviceId;
+        hwParam.dwFlags = deviceIndex;
+
+        dwStatus = HwDrv_SendCommandEx(IOCTL_DSDRV_GETPCIINFO,
+                                            &hwParam,
+                                            sizeof(hwParam),
+                                            &PCICardInfo,
                                             sizeof(TPCICARDINFO),
                                             &dwLength);
         if (dwStatus != ERROR_SUCCESS)
@@ -1394,7 +5270,62 @@ public:
                                             &dwReturnedLength);
         if (dwStatus != ERROR_SUCCESS)
             throw Exception("Could not open capture card.");
+        // the registers are mapped, so can be accessed from here on
+        CardOpened = TRUE;
+
+        // With audio=1, also map the registers of the card's audio function,
+        // which is function 1 in the same slot (the DScaler driver's slot
+        // numbers have the device in the low 5 bits and the function above)
+        m_AudioMemoryBase = 0;
+        DWORD audioMemoryAddress = 0;
+        DWORD audioMemoryLength = 0;
+        if (config.audio != 0) {
+            if (!supportsAcpi)
+                throw Exception("Audio can only be captured from a Bt878 or Bt878A.");
+            static const int audioDeviceIds[] = {
+                0x0878,   // Brooktree Bt878 audio
+                0x0879};  // Brooktree Bt879 audio
+            for (int chipIdx = 0; chipIdx < 2 && audioMemoryAddress == 0; ++chipIdx) {
+                for (DWORD audioIndex = 0; ; ++audioIndex) {
+                    TPCICARDINFO audioInfo;
+                    hwParam.dwAddress = PCI_ID_BROOKTREE;
+                    hwParam.dwValue = audioDeviceIds[chipIdx];
+                    hwParam.dwFlags = audioIndex;
+                    dwStatus = HwDrv_SendCommandEx(IOCTL_DSDRV_GETPCIINFO,
+                                                        &hwParam,
+                                                        sizeof(hwParam),
+                                                        &audioInfo,
+                                                        sizeof(TPCICARDINFO),
+                                                        &dwLength);
+                    if (dwStatus != ERROR_SUCCESS)
+                        break;
+                    if (audioInfo.dwBusNumber == m_BusNumber &&
+                        (audioInfo.dwSlotNumber & 0x1f) == (m_SlotNumber & 0x1f)) {
+                        audioMemoryAddress = audioInfo.dwMemoryAddress;
+                        audioMemoryLength = audioInfo.dwMemoryLength;
+                        break;
+                    }
+                }
+            }
+            if (audioMemoryAddress == 0)
+                throw Exception("The card's audio function wasn't found.");
+            hwParam.dwAddress = m_BusNumber;
+            hwParam.dwValue = audioMemoryAddress;
+            hwParam.dwFlags = audioMemoryLength;
+            dwStatus = HwDrv_SendCommandEx(IOCTL_DSDRV_MAPMEMORY,
+                                                &hwParam,
+                                                sizeof(hwParam),
+                                                &(m_AudioMemoryBase),
+                                                sizeof(DWORD),
+                                                &dwReturnedLength);
+            if (dwStatus != ERROR_SUCCESS)
+                throw Exception("Could not open the card's audio function.");
+        }
+        startup.phase("card");
 
+        // A warm start needs the card to have been left powered up and
+        // enabled on the bus
+        bool warm = config.warm != 0 && pciCommandReady();
         m_InitialACPIStatus = 0;
         if (supportsAcpi) {
             // this functions returns 0 if the card is in ACPI state D0 or on error
@@ -1406,96 +5337,59 @@ public:
                 m_InitialACPIStatus = ACPIStatus;
             }
             // if the chip is powered down we need to power it up
-            if(m_InitialACPIStatus != 0)
+            if(m_InitialACPIStatus != 0) {
                 HwPci_SetACPIStatus(0);
+                warm = false;
+            }
         }
-
-        CardOpened = TRUE;
+        startup.phase("power");
 
         ContigMemory riscMemory;
-        if (riscMemory.alloc(RISC_CODE_LENGTH) == FALSE)
+        if (riscMemory.alloc(config.riscCodeLength()) == FALSE)
            throw Exception("Failed to allocate RISC memory.");
 
         UserMemory userMemory[VBI_FRAME_CAPTURE_COUNT];
         for (int idx=0; idx < VBI_FRAME_CAPTURE_COUNT; idx++)
-           if (userMemory[idx].alloc(VBI_LINE_SIZE * VBI_LINES_PER_FIELD * 2) == FALSE)
+           if (userMemory[idx].alloc(config.fieldBytes() * 2) == FALSE)
               throw Exception("Failed to allocate frame buffer memory.");
+        // the decoded pictures, with video=1
+        UserMemory videoMemory[VBI_FRAME_CAPTURE_COUNT];
+        if (config.video != 0) {
+            for (int idx = 0; idx < VBI_FRAME_CAPTURE_COUNT; idx++)
+                if (videoMemory[idx].alloc(config.videoFieldBytes() * 2) == FALSE)
+                    throw Exception("Failed to allocate video buffer memory.");
+        }
+        // the audio ring and its RISC program, only with audio=1
+        std::unique_ptr<UserMemory> audioMemory;
+        std::unique_ptr<ContigMemory> audioRiscMemory;
+        PHYS audioRiscStart = 0;
+        if (config.audio != 0) {
+            audioMemory.reset(new UserMemory);
+            audioRiscMemory.reset(new ContigMemory);
+            if (audioMemory->alloc(VBI_AUDIO_RING_BYTES) == FALSE ||
+                audioRiscMemory->alloc(VBI_AUDIO_RISC_BYTES) == FALSE)
+                throw Exception("Failed to allocate audio buffer memory.");
+            audioRiscStart = audioRisc(*audioRiscMemory, *audioMemory);
+        }
+        startup.phase("memory");
 
-        Bt8x8_ResetChip(dwBusNumber, dwSlotNumber);
-
+        if (warm) {
+            RegisterSetup compare(true);
+            setupRegisters(&compare, config);
+            warm = (compare.differences() == 0);
+        }
         // software reset, sets all registers to reset default values
-        WriteByte (BT848_SRESET, 0);
-        Sleep(50);
-
-        WriteByte (BT848_TDEC, 0x00);
-        WriteByte (BT848_COLOR_CTL, BT848_COLOR_CTL_GAMMA);
-        WriteByte (BT848_ADELAY, 0x7f);
-        // disable capturing
-        WriteByte (BT848_BDELAY, 0x72);
-        WriteByte (BT848_CAP_CTL, 0x00);
-        // max length of a VBI line
-        WriteByte (BT848_VBI_PACK_SIZE, 0xff);
-        WriteByte (BT848_VBI_PACK_DEL, 1 | BT848_VBI_PACK_DEL_EXT_FRAME);
-
-        // YUV 4:2:2 linear pixel format
-        WriteByte(BT848_COLOR_FMT, BT848_COLOR_FMT_RAW);
-
-        WriteByte (BT848_E_VDELAY_LO, VDELAY & 0xff);
-        WriteByte (BT848_O_VDELAY_LO, VDELAY & 0xff);
-        int crop = ((VBI_SPL >> 8) & 3) |
-                   (((HDELAY >> 8) & 3) << 2) |
-                   (((VBI_LINES_PER_FIELD >> 8) & 3) << 4) |
-                   (((VDELAY >> 8) & 3) << 6);
-        WriteByte (BT848_E_CROP, crop);
-        WriteByte (BT848_O_CROP, crop);
-        WriteByte (BT848_E_VACTIVE_LO, VBI_LINES_PER_FIELD & 0xff);
-        WriteByte (BT848_O_VACTIVE_LO, VBI_LINES_PER_FIELD & 0xff);
-        WriteByte (BT848_E_HSCALE_LO, 0x00);
-        WriteByte (BT848_O_HSCALE_LO, 0x00);
-        WriteByte (BT848_E_HSCALE_HI, 0x00);
-        WriteByte (BT848_O_HSCALE_HI, 0x00);
-        WriteByte (BT848_E_HDELAY_LO, HDELAY & 0xff);
-        WriteByte (BT848_O_HDELAY_LO, HDELAY & 0xff);
-        WriteByte (BT848_E_HACTIVE_LO, VBI_SPL & 0xff);
-        WriteByte (BT848_O_HACTIVE_LO, VBI_SPL & 0xff);
-
-        WriteWord (BT848_GPIO_DMA_CTL, BT848_GPIO_DMA_CTL_PKTP_32 |
-                                       BT848_GPIO_DMA_CTL_PLTP1_16 |
-                                       BT848_GPIO_DMA_CTL_PLTP23_16 |
-                                       BT848_GPIO_DMA_CTL_GPINTC |
-                                       BT848_GPIO_DMA_CTL_GPINTI);
-        WriteByte (BT848_GPIO_REG_INP, 0x00);
-        // input format (PAL, NTSC etc.) and input source
-        WriteByte (BT848_IFORM, BT848_IFORM_MUX1 | BT848_IFORM_XTBOTH | BT848_IFORM_NTSC);
-
-        WriteByte (BT848_CONTRAST_LO, 0xd8);
-        WriteByte (BT848_BRIGHT, 0x00 /*0x10*/);
-        WriteByte (BT848_E_VSCALE_HI, 0x20);
-        WriteByte (BT848_O_VSCALE_HI, 0x20);
-        WriteByte (BT848_E_VSCALE_LO, 0x00);
-        WriteByte (BT848_O_VSCALE_LO, 0x00);
-        WriteByte (BT848_SAT_U_LO, 0xfe);
-        WriteByte (BT848_SAT_V_LO, 0xb4);
-        WriteByte (BT848_HUE, 0);
-        WriteByte (BT848_OFORM, 0x00);
-        WriteByte (BT848_E_VTC, BT848_VTC_HSFMT);
-        WriteByte (BT848_O_VTC, BT848_VTC_HSFMT);
-
-        WriteByte (BT848_ADC, BT848_ADC_RESERVED | BT848_ADC_CRUSH);
-        WriteByte (BT848_O_CONTROL, BT848_CONTROL_LDEC | BT848_CONTROL_LNOTCH | BT848_CONTROL_CON_MSB);
-        WriteByte (BT848_E_CONTROL, BT848_CONTROL_LDEC | BT848_CONTROL_LNOTCH | BT848_CONTROL_CON_MSB);
-
-        WriteByte (BT848_E_SCLOOP, BT848_SCLOOP_CKILL);
-        WriteByte (BT848_O_SCLOOP, BT848_SCLOOP_CKILL);
-
-        // interrupt mask; reset the status before enabling the interrupts
-        WriteDword (BT848_INT_STAT, (DWORD) 0x0fffffffUL);
-        WriteDword (BT848_INT_MASK, (1 << 23) | BT848_INT_RISCI);
-
-#if 1
-        WriteByte (BT848_TGCTRL, BT848_TGCTRL_TGCKI_NOPLL);
-        WriteByte (BT848_PLL_XCI, 0x00);
-#else
+        if (!warm)
+            Bt8x8_ResetChip(dwBusNumber, dwSlotNumber);
+        // reset the status before enabling the interrupts
+        bt848Write<Bt848IntStat>(0x0fffffff);
+        if (!warm) {
+            RegisterSetup setup(false);
+            setupRegisters(&setup, config);
+        }
+        startup.phase("registers");
+
+#if 0
         // Start PLL at PAL frequency
         WriteByte (BT848_PLL_F_LO, 0xf9);
         WriteByte (BT848_PLL_F_HI, 0xdc);
@@ -1512,30 +5406,34 @@ public:
         }
 #endif
 
-        AndDataByte(BT848_IFORM, (BYTE)~BT848_IFORM_MUXSEL);
-
-        AndDataByte(BT848_E_CONTROL, ~BT848_CONTROL_COMP);
-        AndDataByte(BT848_O_CONTROL, ~BT848_CONTROL_COMP);
-
-        MaskDataByte(BT848_IFORM, 0, BT848_IFORM_MUXSEL);
-
 //        Sleep(5000);
 
-        // disable capturing while the RISC program is changed to avoid a crash
-        MaskDataByte(BT848_CAP_CTL, 0, 0x0f);
+        // disable capturing while the RISC program is changed to avoid a
+        // crash (nothing else in CAP_CTL has been set, so no need to read it)
+        bt848Write<Bt848CapCtl>(0x00);
 
         DWORD* pRiscCode = static_cast<DWORD*>(riscMemory.GetUserPointer());
-        PHYS pRiscBasePhysical = riscMemory.TranslateToPhysical(pRiscCode, RISC_CODE_LENGTH, NULL);
+        PHYS pRiscBasePhysical = riscMemory.TranslateToPhysical(pRiscCode, config.riscCodeLength(), NULL);
+
+        // Preamble, only executed when the RISC engine is (re)started: clear
+        // the field number in the status bits and jump to the first field.
+        *(pRiscCode++) = BT848_RISC_JUMP | BT848_RISC_STATUS(0);
+        *(pRiscCode++) = pRiscBasePhysical + 2*sizeof(DWORD);
+        PHYS pRiscLoopPhysical = pRiscBasePhysical + 2*sizeof(DWORD);
 
         // create the RISC code for 10 fields
         // the first one (0) is even, last one (9) is odd
         for (int nField = 0; nField < VBI_FIELD_CAPTURE_COUNT; nField++)
         {
-            // First we sync onto either the odd or even field
+            // First we sync onto either the odd or even field. Executing this
+            // means that the previous field is complete, so record that in
+            // the status bits (the wrap from the last field to the first one
+            // is recorded by the JUMP at the end).
+            DWORD status = (nField == 0 ? 0 : BT848_RISC_STATUS(nField));
             if (nField & 1)
-                *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_RISC_RESYNC | BT848_FIFO_STATUS_VRO);
+                *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_RISC_RESYNC | BT848_FIFO_STATUS_VRO | status);
             else
-                *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_RISC_RESYNC | BT848_FIFO_STATUS_VRE);
+                *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_RISC_RESYNC | BT848_FIFO_STATUS_VRE | status);
             *(pRiscCode++) = 0;
 
             *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_FIFO_STATUS_FM1);
@@ -1544,115 +5442,46 @@ public:
             BYTE* pVbiUser = static_cast<BYTE*>(userMemory[nField / 2].GetUserPointer());
 
             if (nField & 1)
-                pVbiUser += VBI_LINES_PER_FIELD * VBI_LINE_SIZE;
-
-            for (int nLine = 0; nLine < VBI_LINES_PER_FIELD; nLine++) {
-                DWORD GotBytesPerLine;
-                PHYS pVbiPhysical = userMemory[nField / 2].TranslateToPhysical(pVbiUser, VBI_SPL, &GotBytesPerLine);
-                if ((pVbiPhysical == 0) || (VBI_SPL > GotBytesPerLine))
-                    throw Exception("Memory error.");
-                *(pRiscCode++) = BT848_RISC_WRITE | BT848_RISC_SOL | BT848_RISC_EOL | VBI_SPL;
-                *(pRiscCode++) = pVbiPhysical;
-                pVbiUser += VBI_LINE_SIZE;
+                pVbiUser += config.fieldBytes();
+
+            for (int nLine = 0; nLine < config.linesPerField; nLine++) {
+                if (nLine < config.roiTop || nLine >= config.roiTop + config.roiLines)
+                    pRiscCode = riscLine(pRiscCode, config, userMemory[nField / 2], NULL);
+                else {
+                    pRiscCode = riscLine(pRiscCode, config, userMemory[nField / 2], pVbiUser);
+                    pVbiUser += config.lineStride;
+                }
             }
-        }
 
-        int BytesPerRISCField = ((long)pRiscCode - (long)riscMemory.GetUserPointer()) / VBI_FIELD_CAPTURE_COUNT;
+            if (config.video != 0) {
+                // then the picture, once the FIFO starts on its pixels
+                *(pRiscCode++) = (DWORD) (BT848_RISC_SYNC | BT848_FIFO_STATUS_FM1);
+                *(pRiscCode++) = 0;
+                BYTE* pVideoUser = static_cast<BYTE*>(videoMemory[nField / 2].GetUserPointer());
+                if (nField & 1)
+                    pVideoUser += config.videoFieldBytes();
+                for (int nLine = 0; nLine < config.videoLines; nLine++) {
+                    pRiscCode = riscWrite(pRiscCode, videoMemory[nField / 2], pVideoUser, config.videoLineBytes(),
+                        BT848_RISC_SOL, BT848_RISC_EOL);
+                    pVideoUser += config.videoLineBytes();
+                }
+            }
+        }
 
-        *(pRiscCode++) = BT848_RISC_JUMP;
-        *(pRiscCode++) = pRiscBasePhysical;
+        *(pRiscCode++) = BT848_RISC_JUMP | BT848_RISC_STATUS(VBI_FIELD_CAPTURE_COUNT);
+        *(pRiscCode++) = pRiscLoopPhysical;
 
         int totalRISCBytes = ((long)pRiscCode - (long)riscMemory.GetUserPointer());
         console.write(String("Total RISC bytes = ") + decimal(totalRISCBytes) + "\n");
 
         // start address for the DMA RISC code
-        WriteDword(BT848_RISC_STRT_ADD, pRiscBasePhysical);
+        bt848Write<Bt848RiscStrtAdd>(pRiscBasePhysical);
+        startup.phase("risc");
+        console.write(startup.report(warm));
 
         try {
-            Array<Byte> data(VBI_LINES_PER_FIELD*1024);
-            while (true) {
-                console.write("Waiting for connection\n");
-                AutoHandle h = File("\\\\.\\pipe\\vbicap", true).createPipe();
-
-                bool connected = (ConnectNamedPipe(h, NULL) != 0) ? true :
-                    (GetLastError() == ERROR_PIPE_CONNECTED);
-                if (!connected)
-                    continue;
-
-                console.write("Connected\n");
-
-                int command = h.read<int>();
-                if (command == 0) {
-                    // Stop vbicap command
-                    break;
-                }
-                if (command != 1)
-                    continue;
-
-                DMAEnable dma;
-
-                int oldFrame = -1;
-                int frame;
-                bool broken = false;
-
-                do {
-                    // read the RISC program counter, i.e. pointer into the RISC code
-                    PHYS CurrentRiscPos;
-                    do {
-                        CurrentRiscPos = ReadDword(BT848_RISC_COUNT) - pRiscBasePhysical;
-                        //console.write(String("pos = ") + decimal(CurrentRiscPos) + "\n");
-                        if (CurrentRiscPos >= totalRISCBytes) {
-                            //console.write("retrying\n");
-                            continue;
-                        }
-                        break;
-                    } while (true);
-                    
-
-                    int CurrentPos = (CurrentRiscPos) / BytesPerRISCField;
-
-                    // the current position lies in the field which is currently being filled
-                    // calculate the index of the previous (i.e. completed) frame
-                    frame = (CurrentPos + VBI_FIELD_CAPTURE_COUNT - 1) % VBI_FIELD_CAPTURE_COUNT;
-                    //console.write(String(decimal(frame)) + ", ");
-
-                    if (frame == oldFrame) {
-                        //DWORD startSleep = GetTickCount();
-                        Sleep(5);
-                        //console.write(String("Slept ") + decimal(GetTickCount() - startSleep) + "ms\n");
-                        continue;
-                    }
-                    if (oldFrame == -1) {
-                        oldFrame = frame;
-                        continue;
-                    }
-
-                    //DWORD startWrite = GetTickCount();
-                    int framesWritten = 0;
-                    do {
-                        oldFrame = (oldFrame + 1) % VBI_FIELD_CAPTURE_COUNT;
-                        BYTE* pVBI = static_cast<BYTE*>(userMemory[oldFrame / 2].GetUserPointer());
-                        Byte* pOut = &data[0];
-                        if ((oldFrame & 1) != 0)
-                            pVBI += VBI_LINES_PER_FIELD * VBI_LINE_SIZE;
-                        for (int row = 0; row < VBI_LINES_PER_FIELD; row++, pVBI += VBI_LINE_SIZE, pOut += 1024)
-                            memcpy(pOut, pVBI, 1024);
-                        DWORD bytesWritten;
-                        if (WriteFile(h, &data[0], 1024*VBI_LINES_PER_FIELD, &bytesWritten, NULL) == 0) {
-                            DWORD error = GetLastError();
-                            if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA) {
-                                broken = true;
-                                break;
-                            }
-                        }
-                        ++framesWritten;
-                    } while (oldFrame != frame && !broken);
-                    if (framesWritten > 5)
-                        console.write("*");
-                    //console.write(String("Wrote ") + decimal(framesWritten) + " frames in " + decimal(GetTickCount() - startWrite) + "ms\n");
-                } while (!broken);
-                console.write("Capture complete.\n");
-            }
+            CardSource source(config, userMemory, videoMemory, pRiscBasePhysical, audioMemory.get(), audioRiscStart);
+            serve(&source, card, pipeName, config, recordDirectories);
         }
         catch (...)
         {
@@ -1673,6 +5502,13 @@ public:
 
             HwDrv_SendCommand(IOCTL_DSDRV_UNMAPMEMORY, &hwParam, sizeof(hwParam));
         }
+        if (m_AudioMemoryBase != 0) {
+            TDSDrvParam hwParam;
+            hwParam.dwAddress = m_AudioMemoryBase;
+            hwParam.dwValue = audioMemoryLength;
+            HwDrv_SendCommand(IOCTL_DSDRV_UNMAPMEMORY, &hwParam, sizeof(hwParam));
+            m_AudioMemoryBase = 0;
+        }
 
         CardOpened = FALSE;
     }
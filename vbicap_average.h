@@ -0,0 +1,209 @@
+#ifndef INCLUDED_VBICAP_AVERAGE_H
+#define INCLUDED_VBICAP_AVERAGE_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Temporal averaging of fields
+//
+// On a static screen the only difference between fields of the same parity
+// is noise, so averaging n of them reduces the noise by a factor of sqrt(n).
+// VbiFieldAverager keeps a running sum for each parity rather than the
+// fields themselves, so n can be in the hundreds. The sums are kept in
+// 16-bit lanes, which can take 257 fields of 8-bit samples, and added to
+// 32-bit totals every 256 fields.
+//
+// Optionally, samples which differ from the average so far by more than a
+// threshold (a glitch, or a line that tore when the signal was disturbed)
+// are left out of the average. The average so far starts as the median of
+// the first three fields of each parity (so that a glitch in the first field
+// doesn't throw out everything else) and is brought up to date whenever the
+// sums are added to the totals, and after the first 16 fields.
+//
+// Averages are 16-bit values with 8 fractional bits.
+
+class VbiFieldAverager
+{
+public:
+    // fields is the number of fields of each parity in each average, and
+    // rejectThreshold the largest difference from the average so far of a
+    // sample that's kept (0 to keep them all). Rejection needs at least 3
+    // fields.
+    VbiFieldAverager(int fieldBytes, int fields, int rejectThreshold = 0)
+      : _fieldBytes(fieldBytes), _fields(fields), _threshold(fields >= 3 ? rejectThreshold : 0)
+    {
+        int padded = (fieldBytes + 15) & ~15;
+        for (int i = 0; i < 2; ++i) {
+            Parity* p = &_parities[i];
+            p->sum.resize(padded);
+            p->total.resize(padded);
+            if (_threshold > 0) {
+                p->count.resize(padded);
+                p->reference.resize(padded);
+                p->first[0].resize(padded);
+                p->first[1].resize(padded);
+            }
+            p->added = 0;
+            p->pending = 0;
+            p->flags = 0;
+            p->firstFlags = 0;
+        }
+    }
+
+    // Add a field. If it completes an average of fields of its parity,
+    // the average is written to output (fieldBytes values), the flags of
+    // all the fields averaged to *averageFlags, and true is returned.
+    bool add(const uint8_t* field, uint32_t flags, uint16_t* output, uint32_t* averageFlags)
+    {
+        Parity* p = &_parities[(flags & VBICAP_FIELD_ODD) != 0 ? 1 : 0];
+        if (p->added == 0)
+            p->firstFlags = flags;
+        p->flags |= flags;
+        if (_threshold == 0)
+            accumulate(p, field);
+        else if (p->added < 2) {
+            // wait for the third field to find the median
+            memcpy(&p->first[p->added][0], field, _fieldBytes);
+        }
+        else {
+            if (p->added == 2) {
+                median(&p->reference[0], &p->first[0][0], &p->first[1][0], field);
+                memset(&p->count[0], 0, p->count.size()*sizeof(uint16_t));
+                accumulate(p, &p->first[0][0]);
+                accumulate(p, &p->first[1][0]);
+            }
+            accumulate(p, field);
+        }
+        ++p->added;
+        if (p->added == 16 || p->added == _fields)
+            flush(p);
+        if (p->added < _fields)
+            return false;
+
+        for (int i = 0; i < _fieldBytes; ++i) {
+            int n = (_threshold > 0 ? p->count[i] : _fields);
+            output[i] = static_cast<uint16_t>(n == 0 ? p->reference[i] << 8 :
+                ((static_cast<uint64_t>(p->total[i]) << 8) + n/2)/n);
+        }
+        // the first field's discontinuity (if any) is the one that matters
+        // to the client
+        *averageFlags = p->flags & ~VBICAP_FIELD_DISCONTINUITY;
+        if ((p->firstFlags & VBICAP_FIELD_DISCONTINUITY) != 0)
+            *averageFlags |= VBICAP_FIELD_DISCONTINUITY;
+        memset(&p->total[0], 0, p->total.size()*sizeof(uint32_t));
+        p->added = 0;
+        p->flags = 0;
+        return true;
+    }
+
+private:
+    struct Parity
+    {
+        std::vector<uint16_t> sum;
+        std::vector<uint32_t> total;
+        std::vector<uint16_t> count;      // samples kept, if rejecting
+        std::vector<uint8_t> reference;   // the average so far, if rejecting
+        std::vector<uint8_t> first[2];    // the first two fields, if rejecting
+        int added;
+        int pending;
+        uint32_t flags;
+        uint32_t firstFlags;
+    };
+
+    void median(uint8_t* out, const uint8_t* a, const uint8_t* b, const uint8_t* c)
+    {
+        int i = 0;
+        for (; i + 16 <= _fieldBytes; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + i));
+            __m128i m = _mm_max_epu8(_mm_min_epu8(x, y), _mm_min_epu8(_mm_max_epu8(x, y), z));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), m);
+        }
+        for (; i < _fieldBytes; ++i) {
+            int lo = a[i] < b[i] ? a[i] : b[i];
+            int hi = a[i] < b[i] ? b[i] : a[i];
+            int m = hi < c[i] ? hi : c[i];
+            out[i] = static_cast<uint8_t>(lo > m ? lo : m);
+        }
+    }
+
+    void accumulate(Parity* p, const uint8_t* field)
+    {
+        int whole = _fieldBytes & ~15;
+        const __m128i zero = _mm_setzero_si128();
+        __m128i* s = reinterpret_cast<__m128i*>(&p->sum[0]);
+        if (_threshold == 0) {
+            for (int i = 0; i < whole; i += 16, s += 2) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(field + i));
+                _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(x, zero)));
+                _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(x, zero)));
+            }
+            for (int i = whole; i < _fieldBytes; ++i)
+                p->sum[i] += field[i];
+        }
+        else {
+            const __m128i threshold = _mm_set1_epi8(static_cast<char>(_threshold));
+            const __m128i one = _mm_set1_epi8(1);
+            __m128i* c = reinterpret_cast<__m128i*>(&p->count[0]);
+            for (int i = 0; i < whole; i += 16, s += 2, c += 2) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(field + i));
+                __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&p->reference[i]));
+                __m128i d = _mm_or_si128(_mm_subs_epu8(x, r), _mm_subs_epu8(r, x));
+                // 0xff for the samples to keep
+                __m128i keep = _mm_cmpeq_epi8(_mm_subs_epu8(d, threshold), zero);
+                x = _mm_and_si128(x, keep);
+                __m128i k = _mm_and_si128(keep, one);
+                _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(x, zero)));
+                _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(x, zero)));
+                _mm_storeu_si128(c, _mm_add_epi16(_mm_loadu_si128(c), _mm_unpacklo_epi8(k, zero)));
+                _mm_storeu_si128(c + 1, _mm_add_epi16(_mm_loadu_si128(c + 1), _mm_unpackhi_epi8(k, zero)));
+            }
+            for (int i = whole; i < _fieldBytes; ++i) {
+                int d = field[i] - p->reference[i];
+                if (d <= _threshold && -d <= _threshold) {
+                    p->sum[i] += field[i];
+                    ++p->count[i];
+                }
+            }
+        }
+        if (++p->pending == 256)
+            flush(p);
+    }
+
+    void flush(Parity* p)
+    {
+        for (int i = 0; i < _fieldBytes; ++i)
+            p->total[i] += p->sum[i];
+        memset(&p->sum[0], 0, p->sum.size()*sizeof(uint16_t));
+        p->pending = 0;
+        if (_threshold > 0) {
+            for (int i = 0; i < _fieldBytes; ++i) {
+                if (p->count[i] != 0)
+                    p->reference[i] = static_cast<uint8_t>((p->total[i] + p->count[i]/2)/p->count[i]);
+            }
+        }
+    }
+
+    int _fieldBytes;
+    int _fields;
+    int _threshold;
+    Parity _parities[2];
+};
+
+// The stream header for averages of fields of an 8-bit source
+inline VbiStreamHeader vbiAveragedStreamHeader(const VbiStreamHeader& source, int fields)
+{
+    VbiStreamHeader streamHeader = source;
+    streamHeader.bytesPerLine = source.bytesPerLine*2;
+    streamHeader.sampleBits = 16;
+    streamHeader.averagedFields = fields;
+    return streamHeader;
+}
+
+#endif // INCLUDED_VBICAP_AVERAGE_H
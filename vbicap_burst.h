@@ -0,0 +1,186 @@
+#ifndef INCLUDED_VBICAP_BURST_H
+#define INCLUDED_VBICAP_BURST_H
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Sync pulses and colour bursts
+//
+// Horizontal sync pulses are runs of samples at or below a threshold an
+// eighth of the way from the 1st percentile of the field to its median,
+// found 16 samples at a time. (Sync is 40 IRE deep and the burst 20 IRE
+// either side of blanking, so the threshold must be less than 20 IRE above
+// the tip.) Runs of hsync length (equalising and broad pulses are shorter or
+// longer) that are followed by a back porch above the threshold are taken to
+// be hsyncs. The burst is measured over the 8 carrier cycles starting
+// VBI_BURST_START samples after the pulse ends, against references with a
+// period of 8 samples, so phases are relative to the samples whose index in
+// the field is a multiple of 8.
+
+#define VBI_SYNC_MIN_WIDTH  96   // samples; an hsync is 4.7us, or 134
+#define VBI_SYNC_MAX_WIDTH  200
+#define VBI_BURST_START     20   // the burst starts 0.6us after sync
+#define VBI_BURST_SAMPLES   64   // and lasts 9 cycles, of which we use 8
+
+// The sync threshold for a field with the given histogram
+inline int vbiSyncThreshold(const uint32_t* histogram, int count)
+{
+    int low = 255, median = 255;
+    int n = 0;
+    for (int i = 0; i < 256; ++i) {
+        n += histogram[i];
+        if (n > count/100 && low == 255)
+            low = i;
+        if (n > count/2) {
+            median = i;
+            break;
+        }
+    }
+    int step = (median - low)/8;
+    int threshold = low + (step > 8 ? step : 8);
+    return threshold < 254 ? threshold : 254;
+}
+
+// The first sample from from on which is at or below the threshold (or, if
+// below is false, above it), or end if there isn't one
+inline int vbiFindLevel(const uint8_t* samples, int from, int end, int threshold, bool below)
+{
+    const __m128i t = _mm_set1_epi8(static_cast<char>(threshold));
+    int i = from;
+    for (; i + 16 <= end; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, t), t));
+        if (!below)
+            mask ^= 0xffff;
+        if (mask != 0) {
+            int bit = 0;
+            while ((mask & (1 << bit)) == 0)
+                ++bit;
+            return i + bit;
+        }
+    }
+    for (; i < end; ++i) {
+        if ((samples[i] <= threshold) == below)
+            return i;
+    }
+    return end;
+}
+
+// Find the next hsync starting at or after from. Returns the index of the
+// first sample after it, with the start of the pulse in *start, or -1 if
+// there are no more.
+inline int vbiNextSync(const uint8_t* samples, int from, int count, int threshold, int* start)
+{
+    while (true) {
+        int s = vbiFindLevel(samples, from, count, threshold, true);
+        if (s == count)
+            return -1;
+        int end = vbiFindLevel(samples, s, count, threshold, false);
+        from = end;
+        int width = end - s;
+        int burstEnd = end + VBI_BURST_START + VBI_BURST_SAMPLES;
+        if (width < VBI_SYNC_MIN_WIDTH || width > VBI_SYNC_MAX_WIDTH || burstEnd > count ||
+            vbiFindLevel(samples, end, burstEnd, threshold, true) != burstEnd)
+            continue;
+        *start = s;
+        return end;
+    }
+}
+
+// Correlate VBI_BURST_SAMPLES samples starting at index in the field with
+// the carrier: *re = sum(v*cos(2*pi*i/8)), *im = sum(v*sin(2*pi*i/8)) for
+// each sample v at index i. For a burst a*cos(2*pi*i/8 - phase) these are
+// a*n/2*cos(phase) and a*n/2*sin(phase).
+inline void vbiCorrelateBurst(const uint8_t* samples, int index, double* re, double* im)
+{
+    // two periods, with 14 fractional bits, so that 8 can be loaded at any phase
+    static const int16_t cosTable[16] = {
+        16384, 11585, 0, -11585, -16384, -11585, 0, 11585,
+        16384, 11585, 0, -11585, -16384, -11585, 0, 11585 };
+    static const int16_t sinTable[16] = {
+        0, 11585, 16384, 11585, 0, -11585, -16384, -11585,
+        0, 11585, 16384, 11585, 0, -11585, -16384, -11585 };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cosTable + (index & 7)));
+    const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sinTable + (index & 7)));
+    __m128i i = zero, q = zero;
+    for (int n = 0; n < VBI_BURST_SAMPLES; n += 8) {
+        __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(samples + index + n)), zero);
+        i = _mm_add_epi32(i, _mm_madd_epi16(x, c));
+        q = _mm_add_epi32(q, _mm_madd_epi16(x, s));
+    }
+    i = _mm_add_epi32(i, _mm_shuffle_epi32(i, _MM_SHUFFLE(1, 0, 3, 2)));
+    i = _mm_add_epi32(i, _mm_shuffle_epi32(i, _MM_SHUFFLE(2, 3, 0, 1)));
+    q = _mm_add_epi32(q, _mm_shuffle_epi32(q, _MM_SHUFFLE(1, 0, 3, 2)));
+    q = _mm_add_epi32(q, _mm_shuffle_epi32(q, _MM_SHUFFLE(2, 3, 0, 1)));
+    *re = _mm_cvtsi128_si32(i)/16384.0;
+    *im = _mm_cvtsi128_si32(q)/16384.0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Per-line burst tracking
+//
+// VbiBurstTracker finds the hsync of each line of a field and measures the
+// phase and amplitude of its colour burst, giving a table of VbiBurstLine
+// (see vbicap_protocol.h) that can be stored with the field so that decoders
+// and calibration don't have to find the burst themselves. The threshold is
+// found from a histogram of every 61st sample.
+
+#define VBI_BURST_HISTOGRAM_STEP  61
+// no line is shorter than this many samples, which bounds the lines in a field
+#define VBI_BURST_MIN_LINE        512
+
+// The most lines a field of count samples can have
+inline int vbiBurstCapacity(int count) { return count/VBI_BURST_MIN_LINE + 1; }
+
+class VbiBurstTracker
+{
+public:
+    // Measure the lines of a field, replacing the contents of lines.
+    void track(const uint8_t* samples, int count, std::vector<VbiBurstLine>* lines)
+    {
+        uint32_t histogram[256];
+        memset(histogram, 0, sizeof(histogram));
+        int sampled = 0;
+        for (int i = 0; i < count; i += VBI_BURST_HISTOGRAM_STEP, ++sampled)
+            ++histogram[samples[i]];
+        track(samples, count, vbiSyncThreshold(histogram, sampled), lines);
+    }
+
+    // The same, with a sync threshold from vbiSyncThreshold()
+    void track(const uint8_t* samples, int count, int threshold, std::vector<VbiBurstLine>* lines)
+    {
+        lines->clear();
+        int start;
+        for (int end = 0; (end = vbiNextSync(samples, end, count, threshold, &start)) >= 0;) {
+            double re, im;
+            vbiCorrelateBurst(samples, end + VBI_BURST_START, &re, &im);
+            VbiBurstLine line;
+            line.position = end;
+            line.phase = phaseUnits(atan2(im, re));
+            double amplitude = 2*sqrt(re*re + im*im)/VBI_BURST_SAMPLES;
+            line.amplitude = static_cast<uint16_t>(amplitude*256 < 65535 ? amplitude*256 + 0.5 : 65535);
+            lines->push_back(line);
+        }
+    }
+
+    // The phase of a line's burst in radians
+    static double radians(const VbiBurstLine& line) { return line.phase*(2*3.14159265358979/65536); }
+
+private:
+    static uint16_t phaseUnits(double radians)
+    {
+        double turns = radians/(2*3.14159265358979);
+        turns -= floor(turns);
+        return static_cast<uint16_t>(static_cast<int>(floor(turns*65536 + 0.5)) & 0xffff);
+    }
+};
+
+#endif // INCLUDED_VBICAP_BURST_H
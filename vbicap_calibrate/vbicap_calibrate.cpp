@@ -0,0 +1,566 @@
+#include "alfe/main.h"
+#include "../vbicap_file.h"
+#include "../vbicap_calibration.h"
+#include "../vbicap_burst.h"
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// The part of each field to measure. The pattern region must be filled with
+// the pattern's colour; the burst region (if used) must be within the colour
+// burst on every line of the pattern region. With BURST_TRACK the burst of
+// every line is found instead (see vbicap_burst.h).
+struct Region
+{
+    int samplesPerLine;
+    int top;
+    int lines;
+    int left;
+    int samples;
+    int burst;      // -1 to not line the phases up with the burst
+};
+
+#define BURST_SAMPLES 32
+#define BURST_TRACK   -2
+
+#define FIELDS_PER_BATCH  16  // fields handed to a worker at a time
+
+// The measurements of one test pattern capture
+struct Pattern
+{
+    int colour;
+    std::vector<char> path;
+    bool ok;
+    int fields;
+    double levels[VBI_CALIBRATION_PHASES];  // raw sample levels
+    double residual;                        // raw RMS difference from the levels
+    double noise;                           // raw RMS difference of each field's levels
+    double burstPhase;
+};
+
+// Averages the fields of a capture. The sums are kept in 16-bit lanes, which
+// can take 257 fields of 8-bit samples, and added to 32-bit totals every 256
+// fields. Each worker thread averages the fields it's given, and the sums
+// of the workers are merged at the end of each capture.
+class FieldAverager
+{
+public:
+    FieldAverager(const Region& region)
+      : _region(region), _pending(0), _fields(0), _burstRe(0), _burstIm(0)
+    {
+        _sum16.resize(region.lines*region.samples);
+        _total.resize(region.lines*region.samples);
+        _burst16.resize(region.lines*BURST_SAMPLES);
+        _burstTotal.resize(region.lines*BURST_SAMPLES);
+        for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p) {
+            _phaseSum[p] = 0;
+            _phaseSquares[p] = 0;
+        }
+    }
+
+    // bursts is the field's burst table, if tracking the burst
+    void add(const uint8_t* field, const std::vector<VbiBurstLine>* bursts)
+    {
+        if (bursts != NULL) {
+            // weight each line by its burst amplitude
+            for (size_t i = 0; i < bursts->size(); ++i) {
+                const VbiBurstLine& line = (*bursts)[i];
+                double a = VbiBurstTracker::radians(line);
+                _burstRe += line.amplitude*cos(a);
+                _burstIm += line.amplitude*sin(a);
+            }
+        }
+        const __m128i zero = _mm_setzero_si128();
+        int spl = _region.samplesPerLine;
+        double fieldPhase[VBI_CALIBRATION_PHASES] = { 0 };
+        for (int r = 0; r < _region.lines; ++r) {
+            int line = (_region.top + r)*spl;
+            const uint8_t* p = field + line + _region.left;
+            uint16_t* a = &_sum16[r*_region.samples];
+            // lanes 0-7 of the low and high halves of each 16 samples have
+            // the same phases, so they can be summed together per line. Each
+            // 16 samples add up to 510 to a lane, so the 16-bit sums are
+            // added to 32-bit ones every 128 (2048 samples).
+            __m128i phase = zero;
+            __m128i phaseLo = zero;
+            __m128i phaseHi = zero;
+            for (int c = 0; c < _region.samples; c += 16) {
+                if ((c & 2047) == 0 && c != 0) {
+                    phaseLo = _mm_add_epi32(phaseLo, _mm_unpacklo_epi16(phase, zero));
+                    phaseHi = _mm_add_epi32(phaseHi, _mm_unpackhi_epi16(phase, zero));
+                    phase = zero;
+                }
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + c));
+                __m128i lo = _mm_unpacklo_epi8(v, zero);
+                __m128i hi = _mm_unpackhi_epi8(v, zero);
+                __m128i* s = reinterpret_cast<__m128i*>(a + c);
+                _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), lo));
+                _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), hi));
+                phase = _mm_add_epi16(phase, _mm_add_epi16(lo, hi));
+            }
+            phaseLo = _mm_add_epi32(phaseLo, _mm_unpacklo_epi16(phase, zero));
+            phaseHi = _mm_add_epi32(phaseHi, _mm_unpackhi_epi16(phase, zero));
+            uint32_t lanes[8];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), phaseLo);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes + 4), phaseHi);
+            for (int j = 0; j < 8; ++j)
+                fieldPhase[(line + _region.left + j) & 7] += lanes[j];
+
+            if (_region.burst >= 0) {
+                const uint8_t* b = field + line + _region.burst;
+                __m128i* s = reinterpret_cast<__m128i*>(&_burst16[r*BURST_SAMPLES]);
+                for (int c = 0; c < BURST_SAMPLES; c += 16) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + c));
+                    _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(v, zero)));
+                    _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(v, zero)));
+                    s += 2;
+                }
+            }
+        }
+        double count = static_cast<double>(_region.lines)*_region.samples/VBI_CALIBRATION_PHASES;
+        for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p) {
+            double level = fieldPhase[p]/count;
+            _phaseSum[p] += level;
+            _phaseSquares[p] += level*level;
+        }
+        ++_fields;
+        if (++_pending == 256)
+            flush();
+    }
+
+    // Add the fields averaged by another FieldAverager of the same region
+    void merge(FieldAverager& other)
+    {
+        flush();
+        other.flush();
+        for (size_t i = 0; i < _total.size(); ++i)
+            _total[i] += other._total[i];
+        for (size_t i = 0; i < _burstTotal.size(); ++i)
+            _burstTotal[i] += other._burstTotal[i];
+        for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p) {
+            _phaseSum[p] += other._phaseSum[p];
+            _phaseSquares[p] += other._phaseSquares[p];
+        }
+        _fields += other._fields;
+        _burstRe += other._burstRe;
+        _burstIm += other._burstIm;
+    }
+
+    // Work out the levels of the pattern from the average of its fields
+    void finish(Pattern* pattern)
+    {
+        flush();
+        pattern->fields = _fields;
+        if (_fields == 0)
+            return;
+        int spl = _region.samplesPerLine;
+        double sum[VBI_CALIBRATION_PHASES] = { 0 };
+        for (int r = 0; r < _region.lines; ++r) {
+            int start = (_region.top + r)*spl + _region.left;
+            for (int c = 0; c < _region.samples; ++c)
+                sum[(start + c) & 7] += _total[r*_region.samples + c];
+        }
+        double count = static_cast<double>(_region.lines)*_region.samples/VBI_CALIBRATION_PHASES;
+        double noise = 0;
+        for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p) {
+            pattern->levels[p] = sum[p]/count/_fields;
+            double mean = _phaseSum[p]/_fields;
+            double variance = _phaseSquares[p]/_fields - mean*mean;
+            noise += variance > 0 ? variance : 0;
+        }
+        pattern->noise = sqrt(noise/VBI_CALIBRATION_PHASES);
+
+        double squares = 0;
+        for (int r = 0; r < _region.lines; ++r) {
+            int start = (_region.top + r)*spl + _region.left;
+            for (int c = 0; c < _region.samples; ++c) {
+                double d = static_cast<double>(_total[r*_region.samples + c])/_fields -
+                    pattern->levels[(start + c) & 7];
+                squares += d*d;
+            }
+        }
+        pattern->residual = sqrt(squares/(static_cast<double>(_region.lines)*_region.samples));
+
+        pattern->burstPhase = 0;
+        if (_region.burst == BURST_TRACK) {
+            pattern->burstPhase = atan2(_burstIm, _burstRe);
+            vbiRotateCycle(pattern->levels, pattern->burstPhase);
+        }
+        else if (_region.burst >= 0) {
+            const double pi = 3.14159265358979;
+            double re = 0, im = 0;
+            for (int r = 0; r < _region.lines; ++r) {
+                int start = (_region.top + r)*spl + _region.burst;
+                for (int c = 0; c < BURST_SAMPLES; ++c) {
+                    double v = _burstTotal[r*BURST_SAMPLES + c];
+                    double a = 2*pi*((start + c) & 7)/8;
+                    re += v*cos(a);
+                    im -= v*sin(a);
+                }
+            }
+            pattern->burstPhase = -atan2(im, re);
+            vbiRotateCycle(pattern->levels, pattern->burstPhase);
+        }
+    }
+
+private:
+    void flush()
+    {
+        for (size_t i = 0; i < _sum16.size(); ++i)
+            _total[i] += _sum16[i];
+        for (size_t i = 0; i < _burst16.size(); ++i)
+            _burstTotal[i] += _burst16[i];
+        memset(&_sum16[0], 0, _sum16.size()*sizeof(uint16_t));
+        memset(&_burst16[0], 0, _burst16.size()*sizeof(uint16_t));
+        _pending = 0;
+    }
+
+    Region _region;
+    std::vector<uint16_t> _sum16;
+    std::vector<uint32_t> _total;
+    std::vector<uint16_t> _burst16;
+    std::vector<uint32_t> _burstTotal;
+    double _phaseSum[VBI_CALIBRATION_PHASES];
+    double _phaseSquares[VBI_CALIBRATION_PHASES];
+    int _pending;
+    int _fields;
+    double _burstRe;
+    double _burstIm;
+};
+
+// A batch of fields read from a capture, waiting for or being averaged by a
+// worker
+struct Batch
+{
+    std::vector<std::vector<uint8_t> > fields;
+    // the burst tables stored with the fields, if tracking the burst and
+    // the capture has them
+    std::vector<std::vector<VbiBurstLine> > bursts;
+    std::vector<bool> haveBursts;
+    int count;
+    int fieldBytes;
+};
+
+// The reader fills empty batches and queues them for the workers, which give
+// them back once they're done with them. Reading a capture can't be shared
+// out (delta coded fields depend on the ones before), so the captures are
+// read one at a time and their fields shared out between the workers.
+class BatchQueue
+{
+public:
+    BatchQueue(int batches) : _batches(batches), _count(batches)
+    {
+        InitializeCriticalSection(&_lock);
+        _emptySemaphore = CreateSemaphore(NULL, batches, batches, NULL);
+        IF_NULL_THROW(_emptySemaphore);
+        _fullSemaphore = CreateSemaphore(NULL, 0, batches + MAXIMUM_WAIT_OBJECTS, NULL);
+        IF_NULL_THROW(_fullSemaphore);
+        for (int i = 0; i < batches; ++i)
+            _empty.push_back(&_batches[i]);
+    }
+    ~BatchQueue()
+    {
+        CloseHandle(_fullSemaphore);
+        CloseHandle(_emptySemaphore);
+        DeleteCriticalSection(&_lock);
+    }
+
+    // Wait for a batch to fill
+    Batch* empty() { return take(_emptySemaphore, &_empty); }
+    void fill(Batch* batch) { give(_fullSemaphore, &_full, batch); }
+
+    // Wait for a batch to average. NULL means there are no more.
+    Batch* full() { return take(_fullSemaphore, &_full); }
+    void done(Batch* batch) { give(_emptySemaphore, &_empty, batch); }
+
+    // Wait for the workers to give back all the batches, so that they're
+    // done with the capture
+    void drain()
+    {
+        std::vector<Batch*> batches;
+        for (int i = 0; i < _count; ++i)
+            batches.push_back(empty());
+        for (int i = 0; i < _count; ++i)
+            give(_emptySemaphore, &_empty, batches[i]);
+    }
+
+private:
+    Batch* take(HANDLE semaphore, std::vector<Batch*>* list)
+    {
+        WaitForSingleObject(semaphore, INFINITE);
+        EnterCriticalSection(&_lock);
+        Batch* batch = list->front();
+        list->erase(list->begin());
+        LeaveCriticalSection(&_lock);
+        return batch;
+    }
+    void give(HANDLE semaphore, std::vector<Batch*>* list, Batch* batch)
+    {
+        EnterCriticalSection(&_lock);
+        list->push_back(batch);
+        LeaveCriticalSection(&_lock);
+        ReleaseSemaphore(semaphore, 1, NULL);
+    }
+
+    std::vector<Batch> _batches;
+    int _count;
+    std::vector<Batch*> _empty;
+    std::vector<Batch*> _full;
+    CRITICAL_SECTION _lock;
+    HANDLE _emptySemaphore;
+    HANDLE _fullSemaphore;
+};
+
+// Each worker averages the fields it's given with an averager of its own,
+// which is merged into the capture's and started again after each capture.
+struct Worker
+{
+    BatchQueue* queue;
+    FieldAverager* averager;
+    int burst;
+};
+
+static DWORD WINAPI worker(LPVOID parameter)
+{
+    Worker* work = static_cast<Worker*>(parameter);
+    VbiBurstTracker tracker;
+    std::vector<VbiBurstLine> lines;
+    for (;;) {
+        Batch* batch = work->queue->full();
+        if (batch == NULL)
+            break;
+        for (int i = 0; i < batch->count; ++i) {
+            const std::vector<VbiBurstLine>* bursts = NULL;
+            if (work->burst == BURST_TRACK) {
+                // use the daemon's table if the capture has one
+                if (batch->haveBursts[i])
+                    bursts = &batch->bursts[i];
+                else {
+                    tracker.track(&batch->fields[i][0], batch->fieldBytes, &lines);
+                    bursts = &lines;
+                }
+            }
+            work->averager->add(&batch->fields[i][0], bursts);
+        }
+        work->queue->done(batch);
+    }
+    return 0;
+}
+
+// Read the fields of a pattern's capture and share them out between the
+// workers, then merge their sums
+static void measure(const Region& region, Pattern* pattern, BatchQueue* queue,
+    std::vector<FieldAverager>* averagers)
+{
+    pattern->ok = false;
+    VbiFileReader reader;
+    if (!reader.open(&pattern->path[0]) || reader.streamHeader().sampleBits != 8 ||
+        reader.streamHeader().samplesPerCycle != 8)
+        return;
+    if ((region.top + region.lines)*region.samplesPerLine > reader.fieldBytes())
+        return;
+    for (size_t i = 0; i < averagers->size(); ++i)
+        (*averagers)[i] = FieldAverager(region);
+    VbiFieldHeader header;
+    bool more = true;
+    while (more) {
+        Batch* batch = queue->empty();
+        batch->fields.resize(FIELDS_PER_BATCH);
+        batch->bursts.resize(FIELDS_PER_BATCH);
+        batch->haveBursts.resize(FIELDS_PER_BATCH);
+        batch->fieldBytes = reader.fieldBytes();
+        batch->count = 0;
+        while (batch->count < FIELDS_PER_BATCH) {
+            if (!reader.next(&header, &batch->fields[batch->count])) {
+                more = false;
+                break;
+            }
+            const std::vector<VbiBurstLine>* bursts = reader.bursts();
+            batch->haveBursts[batch->count] = (region.burst == BURST_TRACK && bursts != NULL);
+            if (batch->haveBursts[batch->count])
+                batch->bursts[batch->count] = *bursts;
+            ++batch->count;
+        }
+        queue->fill(batch);
+    }
+    queue->drain();
+    FieldAverager& averager = (*averagers)[0];
+    for (size_t i = 1; i < averagers->size(); ++i)
+        averager.merge((*averagers)[i]);
+    averager.finish(pattern);
+    pattern->ok = pattern->fields > 0;
+}
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        // vbicap_calibrate <table> <colour>:<capture> [<colour>:<capture>...]
+        //     [line=<samples>] [top=<line>] [lines=<n>] [left=<sample>]
+        //     [samples=<n>] [burst=<sample>|track] [black=<level>] [white=<level>]
+        //     [threads=<n>]
+        // Each capture is of the whole screen filled with CGA colour
+        // <colour> (0-15). The fields of each are averaged over the region
+        // given by top, lines, left and samples (in lines of line=<samples>
+        // samples, default 1824 for a CGA), which must be inside the
+        // pattern, and the average level at each of the 8 phases of the
+        // carrier is written to the table (see vbicap_calibration.h). With
+        // burst=<sample> the phases are measured from the colour burst, 32
+        // samples of which start that many samples into each line, and with
+        // burst=track from the burst found on every line of every field
+        // (or stored with the capture by vbicap burst=1). Levels
+        // are normalised to colours 0 and 15 if they were measured, and to
+        // black= and white= otherwise.
+        if (_arguments.count() < 3) {
+            console.write("Usage: vbicap_calibrate <table> <colour>:<capture> [<colour>:<capture>...]\n"
+                "    [line=<samples>] [top=<line>] [lines=<n>] [left=<sample>] [samples=<n>]\n"
+                "    [burst=<sample>|track] [black=<level>] [white=<level>] [threads=<n>]\n");
+            return;
+        }
+        NullTerminatedString tableName(_arguments[1]);
+        Region region;
+        region.samplesPerLine = 1824;
+        region.top = 16;
+        region.lines = 160;
+        region.left = 256;
+        region.samples = 1280;
+        region.burst = -1;
+        double black = 60;
+        double white = 200;
+        int threads = 0;
+        std::vector<Pattern> patterns;
+        for (int i = 2; i < _arguments.count(); ++i) {
+            NullTerminatedString argument(_arguments[i]);
+            const char* a = argument;
+            char* end;
+            long colour = strtol(a, &end, 10);
+            if (end != a && *end == ':') {
+                if (colour < 0 || colour >= VBI_CALIBRATION_COLOURS)
+                    throw Exception("Colours are 0 to 15.");
+                Pattern pattern;
+                pattern.colour = colour;
+                pattern.path.assign(end + 1, end + strlen(end + 1) + 2);
+                patterns.push_back(pattern);
+            }
+            else if (strncmp(a, "line=", 5) == 0)
+                region.samplesPerLine = atoi(a + 5);
+            else if (strncmp(a, "top=", 4) == 0)
+                region.top = atoi(a + 4);
+            else if (strncmp(a, "lines=", 6) == 0)
+                region.lines = atoi(a + 6);
+            else if (strncmp(a, "left=", 5) == 0)
+                region.left = atoi(a + 5);
+            else if (strncmp(a, "samples=", 8) == 0)
+                region.samples = atoi(a + 8);
+            else if (strcmp(a, "burst=track") == 0)
+                region.burst = BURST_TRACK;
+            else if (strncmp(a, "burst=", 6) == 0)
+                region.burst = atoi(a + 6);
+            else if (strncmp(a, "black=", 6) == 0)
+                black = atof(a + 6);
+            else if (strncmp(a, "white=", 6) == 0)
+                white = atof(a + 6);
+            else if (strncmp(a, "threads=", 8) == 0)
+                threads = atoi(a + 8);
+            else
+                throw Exception(String("Unknown option ") + _arguments[i]);
+        }
+        if (patterns.empty())
+            throw Exception("No test pattern captures given.");
+        if (region.samples <= 0 || (region.samples & 15) != 0)
+            throw Exception("samples must be a positive multiple of 16.");
+        if (region.burst < BURST_TRACK)
+            throw Exception("burst must be a sample within the line, or track.");
+        if (region.top < 0 || region.lines <= 0 || region.left < 0 ||
+            region.left + region.samples > region.samplesPerLine ||
+            region.burst + BURST_SAMPLES > region.samplesPerLine)
+            throw Exception("The region must be within a line.");
+        if (white <= black)
+            throw Exception("White level must be above black level.");
+
+        if (threads <= 0) {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            threads = info.dwNumberOfProcessors;
+        }
+        if (threads > MAXIMUM_WAIT_OBJECTS)
+            threads = MAXIMUM_WAIT_OBJECTS;
+
+        LARGE_INTEGER frequency, start, end;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        // The captures are read one after another, and the fields of each
+        // are shared out between the workers
+        std::vector<FieldAverager> averagers(threads, FieldAverager(region));
+        // enough batches for each worker to have one while the next is read
+        BatchQueue queue(threads*2);
+        std::vector<Worker> work(threads);
+        std::vector<HANDLE> handles;
+        for (int i = 0; i < threads; ++i) {
+            work[i].queue = &queue;
+            work[i].averager = &averagers[i];
+            work[i].burst = region.burst;
+            HANDLE thread = CreateThread(NULL, 0, worker, &work[i], 0, NULL);
+            IF_NULL_THROW(thread);
+            handles.push_back(thread);
+        }
+        for (size_t i = 0; i < patterns.size(); ++i)
+            measure(region, &patterns[i], &queue, &averagers);
+        for (int i = 0; i < threads; ++i)
+            queue.fill(NULL);
+        WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], TRUE, INFINITE);
+        for (size_t i = 0; i < handles.size(); ++i)
+            CloseHandle(handles[i]);
+        QueryPerformanceCounter(&end);
+        double seconds = static_cast<double>(end.QuadPart - start.QuadPart)/static_cast<double>(frequency.QuadPart);
+
+        // Fit the offset and gain, and normalise
+        VbiCalibration table;
+        double level[VBI_CALIBRATION_COLOURS];
+        bool measured[VBI_CALIBRATION_COLOURS] = { false };
+        int fields = 0;
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            const Pattern& p = patterns[i];
+            if (!p.ok)
+                throw Exception(String("Can't measure ") + &p.path[0]);
+            if (measured[p.colour])
+                throw Exception(String("Colour ") + decimal(p.colour) + " given twice.");
+            measured[p.colour] = true;
+            level[p.colour] = 0;
+            for (int j = 0; j < VBI_CALIBRATION_PHASES; ++j)
+                level[p.colour] += p.levels[j]/VBI_CALIBRATION_PHASES;
+            fields += p.fields;
+        }
+        if (measured[0])
+            black = level[0];
+        if (measured[15])
+            white = level[15];
+        if (white <= black)
+            throw Exception("White pattern isn't brighter than the black one.");
+        table.offset = black;
+        table.gain = 1.0/(white - black);
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            const Pattern& p = patterns[i];
+            table.present[p.colour] = true;
+            for (int j = 0; j < VBI_CALIBRATION_PHASES; ++j)
+                table.levels[p.colour][j] = (p.levels[j] - table.offset)*table.gain;
+            table.residual[p.colour] = p.residual*table.gain;
+            console.write(String("Colour ") + decimal(p.colour) + ": " + decimal(p.fields) +
+                " fields, residual " + decimal(static_cast<int>(p.residual*1000)) +
+                "/1000, noise " + decimal(static_cast<int>(p.noise*1000)) + "/1000 levels");
+            if (region.burst != -1)
+                console.write(String(", burst at ") + decimal(static_cast<int>(p.burstPhase*180/3.14159265358979)) + " degrees");
+            console.write("\n");
+        }
+        if (!table.save(tableName))
+            throw Exception(String("Can't write ") + _arguments[1]);
+        console.write(decimal(fields) + " fields of " + decimal(static_cast<int>(patterns.size())) +
+            " patterns measured in " + decimal(static_cast<int>(seconds*1000)) + "ms on " +
+            decimal(threads) + " threads (" + decimal(static_cast<int>(fields/(seconds > 0 ? seconds : 1))) +
+            " fields/s)\n");
+    }
+};
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef INCLUDED_VBICAP_CALIBRATION_H
+#define INCLUDED_VBICAP_CALIBRATION_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+// Composite CGA calibration tables
+//
+// vbicap_calibrate measures the composite waveform of each of the 16 CGA
+// colours from captures of solid test patterns, and writes it as a text
+// file which decoders load with VbiCalibration::load(). The file is:
+//   # comments
+//   offset <raw sample level of black>
+//   gain <1/(raw level of white - raw level of black)>
+//   colour <n> <level at phase 0> ... <level at phase 7> <residual>
+// with one colour line for each colour measured. Levels are normalised so
+// that black is 0 and white is 1 (i.e. level = (raw - offset)*gain). Phase p
+// is p/8 of a carrier cycle after a peak of the colour burst (or after a
+// sample whose index in the field is a multiple of 8, if the burst wasn't
+// measured). The residual is the RMS difference,
+// after averaging, between the samples of the pattern and the 8 levels,
+// normalised in the same way.
+
+#define VBI_CALIBRATION_COLOURS  16
+#define VBI_CALIBRATION_PHASES   8
+
+class VbiCalibration
+{
+public:
+    VbiCalibration() : offset(0), gain(1)
+    {
+        for (int c = 0; c < VBI_CALIBRATION_COLOURS; ++c) {
+            present[c] = false;
+            residual[c] = 0;
+            for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p)
+                levels[c][p] = 0;
+        }
+    }
+
+    bool load(const char* path)
+    {
+        FILE* f = fopen(path, "r");
+        if (f == NULL)
+            return false;
+        bool ok = true;
+        char line[512];
+        while (ok && fgets(line, sizeof(line), f) != NULL) {
+            char* p = line;
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+                continue;
+            int colour;
+            double l[VBI_CALIBRATION_PHASES + 1];
+            if (sscanf(p, "offset %lf", &offset) == 1 || sscanf(p, "gain %lf", &gain) == 1)
+                continue;
+            if (sscanf(p, "colour %i %lf %lf %lf %lf %lf %lf %lf %lf %lf", &colour,
+                &l[0], &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7], &l[8]) == 10 &&
+                colour >= 0 && colour < VBI_CALIBRATION_COLOURS) {
+                for (int i = 0; i < VBI_CALIBRATION_PHASES; ++i)
+                    levels[colour][i] = l[i];
+                residual[colour] = l[VBI_CALIBRATION_PHASES];
+                present[colour] = true;
+                continue;
+            }
+            ok = false;
+        }
+        fclose(f);
+        return ok && gain != 0;
+    }
+
+    bool save(const char* path) const
+    {
+        FILE* f = fopen(path, "w");
+        if (f == NULL)
+            return false;
+        fprintf(f, "# vbicap composite CGA calibration\noffset %.4f\ngain %.8f\n", offset, gain);
+        for (int c = 0; c < VBI_CALIBRATION_COLOURS; ++c) {
+            if (!present[c])
+                continue;
+            fprintf(f, "colour %i", c);
+            for (int p = 0; p < VBI_CALIBRATION_PHASES; ++p)
+                fprintf(f, " %.5f", levels[c][p]);
+            fprintf(f, " %.5f\n", residual[c]);
+        }
+        return fclose(f) == 0;
+    }
+
+    // Raw sample level of a colour at a phase
+    double raw(int colour, int phase) const { return levels[colour][phase & 7]/gain + offset; }
+
+    double offset;
+    double gain;
+    bool present[VBI_CALIBRATION_COLOURS];
+    double levels[VBI_CALIBRATION_COLOURS][VBI_CALIBRATION_PHASES];
+    double residual[VBI_CALIBRATION_COLOURS];
+};
+
+// Shift a cycle of 8 levels so that what was at phase radians of the carrier
+// is at 0, by rotating each harmonic. Used to line measurements up with the
+// burst.
+inline void vbiRotateCycle(double levels[VBI_CALIBRATION_PHASES], double phase)
+{
+    const double pi = 3.14159265358979;
+    double re[5], im[5];
+    for (int k = 0; k <= 4; ++k) {
+        re[k] = 0;
+        im[k] = 0;
+        for (int n = 0; n < 8; ++n) {
+            re[k] += levels[n]*cos(2*pi*k*n/8);
+            im[k] -= levels[n]*sin(2*pi*k*n/8);
+        }
+        double a = k*phase;
+        double r = re[k]*cos(a) - im[k]*sin(a);
+        double i = re[k]*sin(a) + im[k]*cos(a);
+        re[k] = r;
+        im[k] = i;
+    }
+    for (int n = 0; n < 8; ++n) {
+        double v = re[0] + re[4]*cos(pi*n);
+        for (int k = 1; k < 4; ++k)
+            v += 2*(re[k]*cos(2*pi*k*n/8) - im[k]*sin(2*pi*k*n/8));
+        levels[n] = v/8;
+    }
+}
+
+#endif // INCLUDED_VBICAP_CALIBRATION_H
@@ -1,22 +1,241 @@
 #include "alfe/main.h"
+#include "../vbicap_protocol.h"
+#include "../vbicap_file.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 class Program : public ProgramBase
 {
 public:
     void run()
     {
-        String process = "0";
-        if (_arguments.count() > 1)
-            process = _arguments[1];
-
-        AutoHandle h = File("\\\\.\\pipe\\vbicap", true).openPipe();
-        h.write<int>(1);                
-
-        AutoHandle out = File("output.dat").openWrite();
-        Byte buffer[1024];
-        for (int i = 0; i < 450 * 8; ++i) {
-            h.read(buffer, 1024);
-            out.write(buffer, 1024);
+        // vbicap_capture [fields [filename]] [delta=<threshold>] [card=<n>]
+        // A filename ending in .vbi gets the tagged stream with its headers,
+        // which records the capture geometry. Anything else gets just the
+        // samples. With delta=, fields in a .vbi file are stored as the lines
+        // that changed since the previous field of the same parity (by more
+        // than threshold in some sample, so delta=0 is lossless).
+        //
+        // vbicap_capture record <prefix> [fields] [segment_mb=<n>]
+        //     [segment_seconds=<n>] [card=<n>]
+        // has the daemon write the fields to <prefix>_000000.vbi etc. itself,
+        // until that many fields have been recorded (forever if 0 or
+        // omitted) or this program is stopped.
+        //
+        // vbicap_capture stats [card=<n>]
+        // prints the statistics of the session in progress (or, between
+        // sessions, of the last one), and fails if it didn't meet the
+        // expectations of the daemon's fault injection scenario.
+        int deltaThreshold = -1;
+        int card = 0;
+        VbiRecordRequest request;
+        memset(&request, 0, sizeof(request));
+        Array<String> positional(_arguments.count());
+        int positionalCount = 0;
+        for (int i = 1; i < _arguments.count(); ++i) {
+            NullTerminatedString argument(_arguments[i]);
+            const char* a = argument;
+            if (strncmp(a, "delta=", 6) == 0) {
+                deltaThreshold = atoi(a + 6);
+                if (deltaThreshold < 0 || deltaThreshold > 255)
+                    throw Exception("Delta threshold must be between 0 and 255.");
+            }
+            else if (strncmp(a, "card=", 5) == 0)
+                card = atoi(a + 5);
+            else if (strncmp(a, "segment_mb=", 11) == 0)
+                request.segmentMegabytes = atoi(a + 11);
+            else if (strncmp(a, "segment_seconds=", 16) == 0)
+                request.segmentSeconds = atoi(a + 16);
+            else if (strchr(a, '=') != NULL)
+                throw Exception(String("Unknown option ") + _arguments[i]);
+            else
+                positional[positionalCount++] = _arguments[i];
+        }
+        String pipeName = VBICAP_PIPE_NAME;
+        if (card != 0)
+            pipeName += decimal(card);
+
+        if (positionalCount > 0 && positional[0] == "stats") {
+            // during a session the daemon answers on the stats pipe, and
+            // between sessions on the main one
+            String statsPipeName = VBICAP_STATS_PIPE_NAME;
+            if (card != 0)
+                statsPipeName += decimal(card);
+            NullTerminatedString statsName(statsPipeName);
+            AutoHandle h;
+            while (true) {
+                HANDLE pipe = CreateFileA(statsName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+                if (pipe != INVALID_HANDLE_VALUE) {
+                    h = pipe;
+                    break;
+                }
+                if (GetLastError() != ERROR_PIPE_BUSY) {
+                    h = File(pipeName, true).openPipe();
+                    break;
+                }
+                // another client is asking for them
+                WaitNamedPipeA(statsName, 1000);
+            }
+            h.write<int>(VBICAP_COMMAND_STATS);
+            VbiCaptureStats stats;
+            h.read(reinterpret_cast<Byte*>(&stats), sizeof(stats));
+            console.write(String("Fields: ") + decimal(stats.fields) +
+                "\nField rate: " + decimal(stats.fieldRateMilliHz) + "mHz" +
+                "\nJitter: " + decimal(stats.jitterMicroseconds) + "us" +
+                "\nMissed wakeups: " + decimal(stats.missedWakeups) +
+                "\nDMA errors: " + decimal(stats.dmaErrors) +
+                "\nRestarts: " + decimal(stats.restarts) +
+                "\nDropped: " + decimal(stats.droppedFields) +
+                "\nDiscontinuities: " + decimal(stats.discontinuities) +
+                "\nDamaged: " + decimal(stats.damagedFields) +
+                "\nLatency: " + decimal(stats.meanLatencyMicroseconds) + "us mean, " +
+                decimal(stats.maxLatencyMicroseconds) + "us max\n");
+            if (stats.scenarioFailures != 0)
+                throw Exception(decimal(stats.scenarioFailures) + " scenario expectations failed.");
+            return;
+        }
+
+        if (positionalCount > 0 && positional[0] == "record") {
+            if (positionalCount < 2)
+                throw Exception("Usage: vbicap_capture record <prefix> [fields]");
+            if (deltaThreshold >= 0)
+                throw Exception("The daemon doesn't delta code the files it records.");
+            NullTerminatedString prefix(positional[1]);
+            if (strlen(prefix) >= sizeof(request.pathPrefix) - 16)
+                throw Exception("Prefix too long.");
+            strcpy(request.pathPrefix, prefix);
+            if (positionalCount > 2)
+                request.fields = atoi(NullTerminatedString(positional[2]));
+
+            AutoHandle h = File(pipeName, true).openPipe();
+            h.write<int>(VBICAP_COMMAND_RECORD);
+            h.write(reinterpret_cast<Byte*>(&request), sizeof(request));
+            // the daemon replies when it has finished
+            VbiCaptureStats stats;
+            h.read(reinterpret_cast<Byte*>(&stats), sizeof(stats));
+            console.write(String("Recorded ") + decimal(stats.fields - stats.droppedFields) +
+                " fields, " + decimal(stats.droppedFields) + " dropped\n");
+            return;
+        }
+
+        int fields = 8;
+        if (positionalCount > 0)
+            fields = atoi(NullTerminatedString(positional[0]));
+        String fileName = "output.dat";
+        if (positionalCount > 1)
+            fileName = positional[1];
+        NullTerminatedString name(fileName);
+        size_t length = strlen(name);
+        size_t extensionLength = strlen(VBICAP_FILE_EXTENSION);
+        bool container = length >= extensionLength &&
+            _stricmp(static_cast<const char*>(name) + length - extensionLength, VBICAP_FILE_EXTENSION) == 0;
+        if (!container && deltaThreshold >= 0)
+            throw Exception("Delta coding needs a .vbi output file.");
+
+        AutoHandle h = File(pipeName, true).openPipe();
+        h.write<int>(VBICAP_COMMAND_CAPTURE_TAGGED);
+
+        // The geometry of the fields depends on how the daemon was started
+        VbiStreamHeader streamHeader;
+        h.read(reinterpret_cast<Byte*>(&streamHeader), sizeof(VbiStreamHeader));
+        if (streamHeader.magic != VBICAP_STREAM_MAGIC ||
+            streamHeader.headerBytes < sizeof(VbiStreamHeader))
+            throw Exception("Unexpected response from vbicap.");
+        Array<Byte> extra(streamHeader.headerBytes - sizeof(VbiStreamHeader) + 1);
+        if (streamHeader.headerBytes > sizeof(VbiStreamHeader))
+            h.read(&extra[0], streamHeader.headerBytes - sizeof(VbiStreamHeader));
+
+        AutoHandle out;
+        VbiFileWriter writer;
+        if (container) {
+            if (!writer.open(name, streamHeader, deltaThreshold))
+                throw Exception("Can't create output file.");
+        }
+        else
+            out = File(fileName).openWrite();
+        Array<Byte> buffer(streamHeader.linesPerField * streamHeader.bytesPerLine);
+        // the decoded picture of each field, if the daemon sends them
+        Array<Byte> video(streamHeader.videoWidth*2*streamHeader.videoLines + 1);
+        // clipped samples, from the levels records if the daemon sends them
+        long long clippedLow = 0;
+        long long clippedHigh = 0;
+        int measuredFields = 0;
+        for (int i = 0; i < fields; ++i) {
+            VbiFieldHeader fieldHeader;
+            h.read(reinterpret_cast<Byte*>(&fieldHeader), sizeof(VbiFieldHeader));
+            while (fieldHeader.magic == VBICAP_LEVELS_MAGIC || fieldHeader.magic == VBICAP_BURST_MAGIC ||
+                fieldHeader.magic == VBICAP_VIDEO_MAGIC || fieldHeader.magic == VBICAP_AUDIO_MAGIC) {
+                bool ok = true;
+                if (fieldHeader.magic == VBICAP_LEVELS_MAGIC) {
+                    if (fieldHeader.dataBytes != sizeof(VbiFieldLevels))
+                        throw Exception("Lost synchronisation with vbicap.");
+                    VbiFieldLevels levels;
+                    h.read(reinterpret_cast<Byte*>(&levels), sizeof(VbiFieldLevels));
+                    clippedLow += levels.clippedLow;
+                    clippedHigh += levels.clippedHigh;
+                    ++measuredFields;
+                    ok = !container || writer.writeLevels(fieldHeader.sequence, levels);
+                }
+                else if (fieldHeader.magic == VBICAP_VIDEO_MAGIC) {
+                    if (fieldHeader.dataBytes != streamHeader.videoWidth*2*streamHeader.videoLines)
+                        throw Exception("Lost synchronisation with vbicap.");
+                    h.read(&video[0], fieldHeader.dataBytes);
+                    ok = !container || writer.writeVideo(fieldHeader.sequence, &video[0], fieldHeader.dataBytes);
+                }
+                else if (fieldHeader.magic == VBICAP_AUDIO_MAGIC) {
+                    if (fieldHeader.dataBytes < sizeof(VbiAudioHeader) || fieldHeader.dataBytes > 0x100000)
+                        throw Exception("Lost synchronisation with vbicap.");
+                    Array<Byte> audio(fieldHeader.dataBytes);
+                    h.read(&audio[0], fieldHeader.dataBytes);
+                    const VbiAudioHeader* audioHeader = reinterpret_cast<const VbiAudioHeader*>(&audio[0]);
+                    if (audioHeader->samples > (fieldHeader.dataBytes - sizeof(VbiAudioHeader))/sizeof(int16_t))
+                        throw Exception("Lost synchronisation with vbicap.");
+                    // only the samples are kept, not the rest of the daemon's buffer
+                    ok = !container || writer.writeAudio(fieldHeader.sequence, audioHeader->position,
+                        reinterpret_cast<const int16_t*>(&audio[sizeof(VbiAudioHeader)]), audioHeader->samples);
+                }
+                else {
+                    if (fieldHeader.dataBytes < sizeof(uint32_t) || fieldHeader.dataBytes > 0x100000)
+                        throw Exception("Lost synchronisation with vbicap.");
+                    Array<Byte> table(fieldHeader.dataBytes);
+                    h.read(&table[0], fieldHeader.dataBytes);
+                    uint32_t lines = *reinterpret_cast<const uint32_t*>(&table[0]);
+                    if (lines > (fieldHeader.dataBytes - sizeof(uint32_t))/sizeof(VbiBurstLine))
+                        throw Exception("Lost synchronisation with vbicap.");
+                    ok = !container || writer.writeBursts(fieldHeader.sequence,
+                        reinterpret_cast<const VbiBurstLine*>(&table[sizeof(uint32_t)]), lines);
+                }
+                if (!ok)
+                    throw Exception("Can't write output file.");
+                h.read(reinterpret_cast<Byte*>(&fieldHeader), sizeof(VbiFieldHeader));
+            }
+            if (fieldHeader.magic != VBICAP_FIELD_MAGIC)
+                throw Exception("Lost synchronisation with vbicap.");
+            if (fieldHeader.dataBytes > static_cast<uint32_t>(buffer.count()))
+                throw Exception("Field larger than the stream header said.");
+            h.read(&buffer[0], fieldHeader.dataBytes);
+            if ((fieldHeader.flags & VBICAP_FIELD_DISCONTINUITY) != 0)
+                console.write(String("Fields lost before field ") + decimal(i) + "\n");
+            if ((fieldHeader.flags & VBICAP_FIELD_DAMAGED) != 0)
+                console.write(String("Field ") + decimal(i) + " damaged\n");
+            if (container) {
+                if (fieldHeader.dataBytes != static_cast<uint32_t>(buffer.count()))
+                    throw Exception("Short field from vbicap.");
+                if (!writer.writeField(fieldHeader, &buffer[0]))
+                    throw Exception("Can't write output file.");
+            }
+            else
+                out.write(&buffer[0], fieldHeader.dataBytes);
+        }
+        if (clippedLow + clippedHigh != 0) {
+            console.write(String("Clipped samples per field: ") + decimal(static_cast<int>(clippedLow/measuredFields)) +
+                " low, " + decimal(static_cast<int>(clippedHigh/measuredFields)) + " high\n");
+        }
+        if (container && deltaThreshold >= 0) {
+            long long whole = static_cast<long long>(fields)*(buffer.count() + sizeof(VbiFieldHeader));
+            console.write(String("Stored ") + decimal(static_cast<int>(writer.bytesWritten()/1024)) +
+                " KiB (" + decimal(static_cast<int>(whole/1024)) + " KiB without deltas)\n");
         }
     }
 };
\ No newline at end of file
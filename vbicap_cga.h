@@ -0,0 +1,261 @@
+#ifndef INCLUDED_VBICAP_CGA_H
+#define INCLUDED_VBICAP_CGA_H
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "vbicap_calibration.h"
+
+// ----------------------------------------------------------------------------
+// Decoding composite samples back to CGA pixels
+//
+// A CGA pixel lasts a whole number of hdots (quarter carrier cycles, so 2
+// samples), and the samples of a pixel of colour c at carrier phase p are
+// close to the calibrated level of c at p. Each carrier cycle of 8 samples
+// is therefore close to one of a small set of patterns: every combination
+// of the palette's colours for the pixels in the cycle. The decoder works on
+// the sums of the two samples of each hdot and finds the pattern with the
+// nearest 4 sums to each cycle.
+//
+// To avoid searching every time, each of the 4 sums of a cycle is quantised
+// to 4 bits, between the lowest and highest sums of any pattern at that
+// position, giving a 16-bit key into a 128KiB table. The first time a key is
+// seen the nearest pattern is found by searching, and stored in the table if
+// it's the nearest for every cycle with that key (which can be checked
+// exactly, since the difference of two squared distances is linear in the
+// sums). Otherwise the table points to a list of the patterns which could be
+// nearest for that key, and only those are searched.
+
+#define VBI_CGA_UNKNOWN         0xffff
+#define VBI_CGA_CANDIDATES      0x8000
+#define VBI_CGA_MAX_CANDIDATES  0x7fff
+#define VBI_CGA_END             0xff
+
+class VbiCgaDecoder
+{
+public:
+    // palette is the colours that can appear (e.g. black and the foreground
+    // colour in 640-pixel mode), pixelSamples the length of a pixel in
+    // samples (2 for 640-pixel mode, 4 for 320-pixel mode, 8 for 160-pixel
+    // or 40-column modes). Cycles start at samples whose index in the field
+    // is align modulo 8, and the calibration's phase 0 is at samples whose
+    // index is phaseZero modulo 8.
+    VbiCgaDecoder(const VbiCalibration& calibration, const int* palette, int colours,
+        int pixelSamples, int phaseZero = 0, int align = 0)
+      : _pixelSamples(pixelSamples), _align(align & 6), _lookups(0), _searches(0)
+    {
+        _pixelsPerCycle = 8/pixelSamples;
+        _patterns = 1;
+        for (int i = 0; i < _pixelsPerCycle; ++i)
+            _patterns *= colours;
+        _valid = (pixelSamples == 2 || pixelSamples == 4 || pixelSamples == 8) &&
+            colours > 0 && _patterns < VBI_CGA_END;
+        for (int i = 0; i < colours && _valid; ++i)
+            _valid = palette[i] >= 0 && palette[i] < VBI_CALIBRATION_COLOURS && calibration.present[palette[i]];
+        if (!_valid)
+            return;
+
+        // The sums of each pattern, in 1/16ths of a sample level
+        _colours.resize(_patterns*_pixelsPerCycle);
+        _sums.resize(_patterns*4);
+        int phase = (_align - phaseZero) & 7;
+        for (int k = 0; k < _patterns; ++k) {
+            int digits = k;
+            for (int j = 0; j < _pixelsPerCycle; ++j) {
+                _colours[k*_pixelsPerCycle + j] = static_cast<uint8_t>(palette[digits % colours]);
+                digits /= colours;
+            }
+            for (int h = 0; h < 4; ++h) {
+                int colour = _colours[k*_pixelsPerCycle + h*2/pixelSamples];
+                double sum = calibration.raw(colour, phase + h*2) + calibration.raw(colour, phase + h*2 + 1);
+                _sums[k*4 + h] = static_cast<int>(floor(sum*16 + 0.5));
+            }
+        }
+
+        // The quantiser for each hdot of the cycle, and the range of sums
+        // which map to each of its 16 steps
+        for (int h = 0; h < 4; ++h) {
+            int lo = 510*16, hi = 0;
+            for (int k = 0; k < _patterns; ++k) {
+                lo = _sums[k*4 + h] < lo ? _sums[k*4 + h] : lo;
+                hi = _sums[k*4 + h] > hi ? _sums[k*4 + h] : hi;
+            }
+            lo = clamp(lo/16, 0, 510);
+            hi = clamp((hi + 15)/16, 0, 510);
+            int range = hi - lo > 16 ? hi - lo : 16;
+            // the vector quantiser handles both halves of a register alike
+            _offset[h] = _offset[h + 4] = static_cast<short>(lo);
+            _range[h] = _range[h + 4] = static_cast<short>(range);
+            _scale[h] = _scale[h + 4] = static_cast<short>(4096/range);
+            for (int q = 0; q < 16; ++q) {
+                _stepLow[h][q] = 511;
+                _stepHigh[h][q] = -1;
+            }
+            for (int v = 0; v <= 510; ++v) {
+                int q = quantise(h, v);
+                _stepLow[h][q] = v < _stepLow[h][q] ? v : _stepLow[h][q];
+                _stepHigh[h][q] = v > _stepHigh[h][q] ? v : _stepHigh[h][q];
+            }
+        }
+        _table.assign(65536, VBI_CGA_UNKNOWN);
+    }
+
+    bool valid() const { return _valid; }
+
+    // Decode count samples into count/2 pixel colours, one per hdot. The
+    // hdots before the first whole cycle and after the last are set to 0.
+    void decode(const uint8_t* samples, int count, uint8_t* pixels)
+    {
+        for (int i = 0; i < _align/2; ++i)
+            pixels[i] = 0;
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i fifteen = _mm_set1_epi16(15);
+        const __m128i minusOne = _mm_set1_epi16(-1);
+        const __m128i offset = _mm_loadu_si128(reinterpret_cast<const __m128i*>(_offset));
+        const __m128i scale = _mm_loadu_si128(reinterpret_cast<const __m128i*>(_scale));
+        const __m128i limit = _mm_loadu_si128(reinterpret_cast<const __m128i*>(_range));
+        const __m128i weights = _mm_set_epi16(0, 0, 0, 0, 4096, 256, 16, 1);
+        int sums[4];
+        int i = _align;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(samples + i)), zero);
+            __m128i s32 = _mm_madd_epi16(v, ones);
+            __m128i s = _mm_packs_epi32(s32, s32);
+            __m128i d = _mm_min_epi16(_mm_max_epi16(_mm_sub_epi16(s, offset), minusOne), limit);
+            __m128i q = _mm_srai_epi16(_mm_mullo_epi16(d, scale), 8);
+            q = _mm_min_epi16(_mm_max_epi16(q, zero), fifteen);
+            // pack the 4-bit steps into a 16-bit key
+            __m128i k = _mm_madd_epi16(q, weights);
+            k = _mm_add_epi32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(2, 3, 0, 1)));
+            int key = _mm_cvtsi128_si32(k);
+
+            int pattern = _table[key];
+            ++_lookups;
+            if (pattern == VBI_CGA_UNKNOWN || (pattern & VBI_CGA_CANDIDATES) != 0) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), s32);
+                if (pattern == VBI_CGA_UNKNOWN)
+                    pattern = fill(sums, key);
+                else
+                    pattern = search(sums, &_candidates[pattern & ~VBI_CGA_CANDIDATES]);
+            }
+            const uint8_t* c = &_colours[pattern*_pixelsPerCycle];
+            uint8_t* p = pixels + i/2;
+            for (int h = 0; h < 4; ++h)
+                p[h] = c[h*2/_pixelSamples];
+        }
+        for (i /= 2; i < count/2; ++i)
+            pixels[i] = 0;
+    }
+
+    // How many cycles have been decoded, and how many of those needed a
+    // search (of all the patterns or of a key's candidates)
+    long long lookups() const { return _lookups; }
+    long long searches() const { return _searches; }
+
+private:
+    static int clamp(int v, int lo, int hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+    // The same as the vectorised quantiser in decode()
+    int quantise(int h, int v) const
+    {
+        int d = clamp(v - _offset[h], -1, _range[h]);
+        return clamp((d*_scale[h]) >> 8, 0, 15);
+    }
+
+    long long distance(const int* sums, int pattern) const
+    {
+        long long d = 0;
+        for (int h = 0; h < 4; ++h) {
+            long long e = sums[h]*16 - _sums[pattern*4 + h];
+            d += e*e;
+        }
+        return d;
+    }
+
+    // Find the nearest of a list of patterns
+    int search(const int* sums, const uint8_t* candidates)
+    {
+        ++_searches;
+        int best = candidates[0];
+        long long bestDistance = distance(sums, best);
+        for (++candidates; *candidates != VBI_CGA_END; ++candidates) {
+            long long d = distance(sums, *candidates);
+            if (d < bestDistance) {
+                bestDistance = d;
+                best = *candidates;
+            }
+        }
+        return best;
+    }
+
+    // Find the nearest pattern the first time a key is seen, and fill in the
+    // table entry for the key
+    int fill(const int* sums, int key)
+    {
+        ++_searches;
+        int best = 0;
+        long long bestDistance = distance(sums, 0);
+        for (int k = 1; k < _patterns; ++k) {
+            long long d = distance(sums, k);
+            if (d < bestDistance) {
+                bestDistance = d;
+                best = k;
+            }
+        }
+        size_t start = _candidates.size();
+        if (start > VBI_CGA_MAX_CANDIDATES)
+            return best;  // no room, so this key will always be searched
+
+        // best is nearer than another pattern for every cycle with this key
+        // if the smallest value over the key's box of
+        //   |x - other|^2 - |x - best|^2
+        //     = sum(other^2 - best^2 - 2*x*(other - best))
+        // is positive. The patterns for which it isn't are the candidates.
+        _candidates.push_back(static_cast<uint8_t>(best));
+        for (int k = 0; k < _patterns; ++k) {
+            if (k == best)
+                continue;
+            long long m = 0;
+            for (int h = 0; h < 4; ++h) {
+                int q = (key >> (h*4)) & 15;
+                long long b = _sums[best*4 + h];
+                long long o = _sums[k*4 + h];
+                long long x = 16*(o > b ? _stepHigh[h][q] : _stepLow[h][q]);
+                m += o*o - b*b - 2*x*(o - b);
+            }
+            if (m <= 0)
+                _candidates.push_back(static_cast<uint8_t>(k));
+        }
+        if (_candidates.size() == start + 1) {
+            _candidates.pop_back();
+            _table[key] = static_cast<uint16_t>(best);
+        }
+        else {
+            _candidates.push_back(VBI_CGA_END);
+            _table[key] = static_cast<uint16_t>(VBI_CGA_CANDIDATES | start);
+        }
+        return best;
+    }
+
+    int _pixelSamples;
+    int _pixelsPerCycle;
+    int _align;
+    int _patterns;
+    bool _valid;
+    std::vector<uint8_t> _colours;  // the colour of each pixel of each pattern
+    std::vector<int> _sums;         // 4 hdot sums for each pattern
+    short _offset[8];
+    short _range[8];
+    short _scale[8];
+    int _stepLow[4][16];
+    int _stepHigh[4][16];
+    std::vector<uint16_t> _table;
+    std::vector<uint8_t> _candidates;  // lists of patterns, each ended by VBI_CGA_END
+    long long _lookups;
+    long long _searches;
+};
+
+#endif // INCLUDED_VBICAP_CGA_H
@@ -0,0 +1,138 @@
+#ifndef INCLUDED_VBICAP_CLIENT_H
+#define INCLUDED_VBICAP_CLIENT_H
+
+#include <stdint.h>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// In-process client library
+//
+// vbicap_client.dll connects to the daemon for a card and hands its fields
+// to the caller as read-only views, so that a program that wants the samples
+// doesn't have to speak the protocol or copy them out of a pipe. With the
+// shared transport (VBICAP_COMMAND_CAPTURE_SHARED) each view is into the
+// daemon's ring, where the daemon copied the field out of the DMA buffers.
+// With the pipe transport (a tagged stream, for daemons which don't support
+// rings) the library reads the fields into slots of its own.
+//
+// The caller gets each field with vbiClientNext() or from the callback of
+// vbiClientRun(), and must give it back with vbiClientRelease() before its
+// slot can be reused. Fields can be held for a while (and released in any
+// order), but while the caller holds the slot the daemon wants next, the
+// daemon drops fields, and the next field the caller gets is marked
+// VBICAP_FIELD_DISCONTINUITY.
+//
+// The interface is plain C so that it can be used from any language or
+// compiler. VbiClientSession below wraps it for C++.
+
+#ifdef VBICAP_CLIENT_EXPORTS
+#define VBICAP_CLIENT_API __declspec(dllexport)
+#else
+#define VBICAP_CLIENT_API __declspec(dllimport)
+#endif
+
+#define VBICAP_TRANSPORT_AUTO    0   // shared if the daemon can, otherwise pipe
+#define VBICAP_TRANSPORT_SHARED  1
+#define VBICAP_TRANSPORT_PIPE    2
+
+// vbiClientNext() results
+#define VBICAP_NEXT_FIELD    1
+#define VBICAP_NEXT_TIMEOUT  0
+#define VBICAP_NEXT_OVER     (-1)  // the session ended or the daemon went away
+#define VBICAP_NEXT_HELD     (-2)  // pipe transport only: every slot is held
+
+// vbiClientRun() callback results
+#define VBICAP_CALLBACK_STOP     0  // release the field and return
+#define VBICAP_CALLBACK_RELEASE  1  // release the field and carry on
+#define VBICAP_CALLBACK_KEEP     2  // carry on; the caller releases the field later
+
+#define VBICAP_WAIT_FOREVER  0xffffffff
+
+typedef struct VbiClient VbiClient;
+
+typedef struct
+{
+    const VbiFieldHeader* header;
+    const uint8_t* data;           // header->dataBytes bytes of samples
+    const VbiFieldLevels* levels;  // NULL unless the daemon was started with levels=1
+    const VbiBurstLine* bursts;    // NULL unless the daemon was started with burst=1
+    uint32_t burstLines;
+    const uint8_t* video;          // NULL unless the daemon was started with video=1
+                                   // (see VBICAP_VIDEO_MAGIC)
+    const VbiAudioHeader* audio;   // NULL unless the daemon was started with audio=1;
+                                   // audio->samples samples follow it
+    uint32_t slot;                 // which slot the field is in
+} VbiClientField;
+
+typedef int (*VbiClientCallback)(void* context, const VbiClientField* field);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Connect to the daemon for card (0 for the first) with the given transport
+// and, for the shared transport, ask for a ring of slots slots (0 for the
+// daemon's default). The pipe transport always has slots slots (4 if 0).
+// Returns NULL if the daemon isn't running or can't use the transport.
+VBICAP_CLIENT_API VbiClient* vbiClientOpen(int card, int transport, uint32_t slots);
+
+// VBICAP_TRANSPORT_SHARED or VBICAP_TRANSPORT_PIPE
+VBICAP_CLIENT_API int vbiClientTransport(const VbiClient* client);
+
+VBICAP_CLIENT_API const VbiStreamHeader* vbiClientStreamHeader(const VbiClient* client);
+
+// Wait up to timeoutMs milliseconds for the next field and fill in *field.
+// Returns one of the VBICAP_NEXT_* values.
+VBICAP_CLIENT_API int vbiClientNext(VbiClient* client, VbiClientField* field, uint32_t timeoutMs);
+
+// Give back a field from vbiClientNext() or vbiClientRun(). Its views are
+// invalid afterwards.
+VBICAP_CLIENT_API void vbiClientRelease(VbiClient* client, const VbiClientField* field);
+
+// Call callback for each field until it returns VBICAP_CALLBACK_STOP or the
+// session is over. Returns VBICAP_CALLBACK_STOP, VBICAP_NEXT_OVER or
+// VBICAP_NEXT_HELD.
+VBICAP_CLIENT_API int vbiClientRun(VbiClient* client, VbiClientCallback callback, void* context);
+
+// Disconnect, which ends the session. Fields still held become invalid.
+VBICAP_CLIENT_API void vbiClientClose(VbiClient* client);
+
+#ifdef __cplusplus
+}
+
+class VbiClientSession
+{
+public:
+    VbiClientSession(int card = 0, int transport = VBICAP_TRANSPORT_AUTO, uint32_t slots = 0)
+      : _client(vbiClientOpen(card, transport, slots)) { }
+    ~VbiClientSession() { if (_client != NULL) vbiClientClose(_client); }
+
+    bool ok() const { return _client != NULL; }
+    int transport() const { return vbiClientTransport(_client); }
+    const VbiStreamHeader& streamHeader() const { return *vbiClientStreamHeader(_client); }
+
+    int next(VbiClientField* field, uint32_t timeoutMs = VBICAP_WAIT_FOREVER)
+    {
+        return vbiClientNext(_client, field, timeoutMs);
+    }
+    void release(const VbiClientField& field) { vbiClientRelease(_client, &field); }
+
+    // f is called as f(const VbiClientField&) and returns a
+    // VBICAP_CALLBACK_* value.
+    template<class F> int run(F f) { return vbiClientRun(_client, call<F>, &f); }
+
+private:
+    VbiClientSession(const VbiClientSession&);
+    VbiClientSession& operator=(const VbiClientSession&);
+
+    template<class F> static int call(void* context, const VbiClientField* field)
+    {
+        return (*static_cast<F*>(context))(*field);
+    }
+
+    VbiClient* _client;
+};
+#endif
+
+#endif // INCLUDED_VBICAP_CLIENT_H
@@ -0,0 +1,412 @@
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "../vbicap_client.h"
+
+// ----------------------------------------------------------------------------
+// vbicap_client.dll
+//
+// The library doesn't use alfe, so that it can be linked into programs built
+// with other compilers and runtimes, and no exception gets out of it.
+
+#define VBI_CLIENT_PIPE_SLOTS     4
+// how often a wait for a field checks that the daemon is still there
+#define VBI_CLIENT_POLL_MS        100
+// how long to wait for the daemon to listen again after refusing a command
+#define VBI_CLIENT_RECONNECT_MS   2000
+// the largest record (other than a field) accepted from the pipe
+#define VBI_CLIENT_MAX_RECORD     0x100000
+
+struct VbiClient
+{
+public:
+    VbiClient()
+      : _pipe(INVALID_HANDLE_VALUE),
+        _transport(VBICAP_TRANSPORT_PIPE),
+        _mapping(NULL),
+        _event(NULL),
+        _ring(NULL),
+        _slots(NULL),
+        _slotData(NULL),
+        _taken(0)
+    {
+        memset(&_streamHeader, 0, sizeof(_streamHeader));
+    }
+
+    ~VbiClient()
+    {
+        // the daemon ends the session when the pipe closes
+        if (_pipe != INVALID_HANDLE_VALUE)
+            CloseHandle(_pipe);
+        closeShared();
+    }
+
+    bool open(int card, int transport, uint32_t slots)
+    {
+        _snprintf(_pipeName, sizeof(_pipeName), card == 0 ? "%s" : "%s%d", VBICAP_PIPE_NAME, card);
+        _pipeName[sizeof(_pipeName) - 1] = 0;
+        if (!connect(false))
+            return false;
+        if (transport != VBICAP_TRANSPORT_PIPE) {
+            if (openShared(slots))
+                return true;
+            if (transport == VBICAP_TRANSPORT_SHARED)
+                return false;
+            // The daemon doesn't know the command (or couldn't make a ring)
+            // and has hung up, so ask it again for a tagged stream
+            CloseHandle(_pipe);
+            _pipe = INVALID_HANDLE_VALUE;
+            closeShared();
+            if (!connect(true))
+                return false;
+        }
+        return openPipe(slots);
+    }
+
+    int transport() const { return _transport; }
+    const VbiStreamHeader* streamHeader() const { return &_streamHeader; }
+
+    int next(VbiClientField* field, uint32_t timeoutMs)
+    {
+        return _transport == VBICAP_TRANSPORT_SHARED ? nextShared(field, timeoutMs) : nextPipe(field, timeoutMs);
+    }
+
+    void release(const VbiClientField* field)
+    {
+        if (_transport == VBICAP_TRANSPORT_SHARED) {
+            if (field->slot >= _ring->slots)
+                return;
+            VbiRingSlot* slot = &_slots[field->slot];
+            // finish reading the field before the daemon can overwrite it
+            MemoryBarrier();
+            slot->released = slot->published;
+        }
+        else if (field->slot < _held.size())
+            _held[field->slot] = false;
+    }
+
+private:
+    bool connect(bool retry)
+    {
+        DWORD start = GetTickCount();
+        while (true) {
+            _pipe = CreateFileA(_pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+            if (_pipe != INVALID_HANDLE_VALUE)
+                return true;
+            DWORD error = GetLastError();
+            if (error == ERROR_PIPE_BUSY)
+                WaitNamedPipeA(_pipeName, VBI_CLIENT_POLL_MS);
+            else if (retry && error == ERROR_FILE_NOT_FOUND)
+                Sleep(1);  // the daemon hasn't created the next instance yet
+            else
+                return false;
+            if (GetTickCount() - start >= VBI_CLIENT_RECONNECT_MS)
+                return false;
+        }
+    }
+
+    bool readPipe(void* data, DWORD bytes)
+    {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        while (bytes > 0) {
+            DWORD bytesRead;
+            if (ReadFile(_pipe, p, bytes, &bytesRead, NULL) == 0 || bytesRead == 0)
+                return false;
+            p += bytesRead;
+            bytes -= bytesRead;
+        }
+        return true;
+    }
+
+    bool writePipe(const void* data, DWORD bytes)
+    {
+        DWORD bytesWritten;
+        return WriteFile(_pipe, data, bytes, &bytesWritten, NULL) != 0 && bytesWritten == bytes;
+    }
+
+    // True if the daemon is still at the other end of the pipe, with the
+    // number of bytes waiting to be read in *available
+    bool pipeConnected(DWORD* available)
+    {
+        *available = 0;
+        return PeekNamedPipe(_pipe, NULL, 0, NULL, available, NULL) != 0;
+    }
+
+    // Whether a wait that started at start can go on, and for how long
+    static bool remaining(DWORD start, uint32_t timeoutMs, DWORD* wait)
+    {
+        *wait = VBI_CLIENT_POLL_MS;
+        if (timeoutMs == VBICAP_WAIT_FOREVER)
+            return true;
+        DWORD elapsed = GetTickCount() - start;
+        if (elapsed >= timeoutMs)
+            return false;
+        if (timeoutMs - elapsed < *wait)
+            *wait = timeoutMs - elapsed;
+        return true;
+    }
+
+    // Fill in field for the field whose VbiFieldHeader is fieldOffset bytes
+    // into the slot at base, after its records
+    static void describe(const uint8_t* base, uint32_t fieldOffset, uint32_t slot, VbiClientField* field)
+    {
+        field->levels = NULL;
+        field->bursts = NULL;
+        field->burstLines = 0;
+        field->video = NULL;
+        field->audio = NULL;
+        uint32_t offset = 0;
+        while (offset + sizeof(VbiFieldHeader) <= fieldOffset) {
+            const VbiFieldHeader* record = reinterpret_cast<const VbiFieldHeader*>(base + offset);
+            const uint8_t* data = base + offset + sizeof(VbiFieldHeader);
+            if (record->dataBytes > fieldOffset - offset - sizeof(VbiFieldHeader))
+                break;
+            if (record->magic == VBICAP_LEVELS_MAGIC && record->dataBytes == sizeof(VbiFieldLevels))
+                field->levels = reinterpret_cast<const VbiFieldLevels*>(data);
+            if (record->magic == VBICAP_BURST_MAGIC && record->dataBytes >= sizeof(uint32_t)) {
+                uint32_t lines = *reinterpret_cast<const uint32_t*>(data);
+                uint32_t capacity = (record->dataBytes - sizeof(uint32_t))/sizeof(VbiBurstLine);
+                field->bursts = reinterpret_cast<const VbiBurstLine*>(data + sizeof(uint32_t));
+                field->burstLines = lines < capacity ? lines : capacity;
+            }
+            if (record->magic == VBICAP_VIDEO_MAGIC)
+                field->video = data;
+            if (record->magic == VBICAP_AUDIO_MAGIC && record->dataBytes >= sizeof(VbiAudioHeader)) {
+                const VbiAudioHeader* audio = reinterpret_cast<const VbiAudioHeader*>(data);
+                if (audio->samples <= (record->dataBytes - sizeof(VbiAudioHeader))/sizeof(int16_t))
+                    field->audio = audio;
+            }
+            offset += sizeof(VbiFieldHeader) + record->dataBytes;
+        }
+        field->header = reinterpret_cast<const VbiFieldHeader*>(base + fieldOffset);
+        field->data = base + fieldOffset + sizeof(VbiFieldHeader);
+        field->slot = slot;
+    }
+
+    // ------------------------------------------------------------------------
+    // Shared transport
+    //
+    // The header and slot states are mapped read-write, since the client
+    // releases slots there, but the slots themselves read-only.
+
+    bool openShared(uint32_t slots)
+    {
+        int command = VBICAP_COMMAND_CAPTURE_SHARED;
+        VbiSharedRequest request;
+        request.slots = slots;
+        VbiSharedReply reply;
+        if (!writePipe(&command, sizeof(command)) || !writePipe(&request, sizeof(request)) ||
+            !readPipe(&reply, sizeof(reply)) || reply.ok == 0)
+            return false;
+        reply.mapping[sizeof(reply.mapping) - 1] = 0;
+        reply.event[sizeof(reply.event) - 1] = 0;
+        _mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, reply.mapping);
+        _event = OpenEventA(SYNCHRONIZE, FALSE, reply.event);
+        if (_mapping == NULL || _event == NULL)
+            return false;
+
+        // Find out where the slots start, then map the two parts
+        const VbiRingHeader* header = static_cast<const VbiRingHeader*>(
+            MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, sizeof(VbiRingHeader)));
+        if (header == NULL)
+            return false;
+        VbiRingHeader ring = *header;
+        UnmapViewOfFile(header);
+        if (ring.magic != VBICAP_RING_MAGIC || ring.slots == 0 ||
+            ring.firstSlot < sizeof(VbiRingHeader) + ring.slots*sizeof(VbiRingSlot) ||
+            ring.fieldOffset + sizeof(VbiFieldHeader) > ring.slotBytes)
+            return false;
+        _ring = static_cast<VbiRingHeader*>(MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, ring.firstSlot));
+        _slotData = static_cast<const uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, ring.firstSlot,
+            static_cast<SIZE_T>(ring.slots)*ring.slotBytes));
+        if (_ring == NULL || _slotData == NULL)
+            return false;
+        _slots = reinterpret_cast<VbiRingSlot*>(_ring + 1);
+        _streamHeader = _ring->streamHeader;
+        _transport = VBICAP_TRANSPORT_SHARED;
+        return true;
+    }
+
+    void closeShared()
+    {
+        if (_slotData != NULL)
+            UnmapViewOfFile(_slotData);
+        if (_ring != NULL)
+            UnmapViewOfFile(_ring);
+        if (_event != NULL)
+            CloseHandle(_event);
+        if (_mapping != NULL)
+            CloseHandle(_mapping);
+        _slotData = NULL;
+        _ring = NULL;
+        _slots = NULL;
+        _event = NULL;
+        _mapping = NULL;
+        _transport = VBICAP_TRANSPORT_PIPE;
+    }
+
+    // The field is taken straight from the ring. The event is only waited
+    // on when the client has caught up with the daemon.
+    int nextShared(VbiClientField* field, uint32_t timeoutMs)
+    {
+        DWORD start = GetTickCount();
+        while (_ring->published == _taken) {
+            if (_ring->over != 0) {
+                // the last fields are published before over is set
+                MemoryBarrier();
+                if (_ring->published != _taken)
+                    break;
+                return VBICAP_NEXT_OVER;
+            }
+            DWORD available, wait;
+            if (!pipeConnected(&available))
+                return VBICAP_NEXT_OVER;
+            if (!remaining(start, timeoutMs, &wait))
+                return VBICAP_NEXT_TIMEOUT;
+            WaitForSingleObject(_event, wait);
+        }
+        // read the field only after seeing it published
+        MemoryBarrier();
+        uint32_t slot = _taken % _ring->slots;
+        ++_taken;
+        describe(_slotData + static_cast<size_t>(slot)*_ring->slotBytes, _ring->fieldOffset, slot, field);
+        return VBICAP_NEXT_FIELD;
+    }
+
+    // ------------------------------------------------------------------------
+    // Pipe transport
+    //
+    // Each slot is a buffer laid out like a slot of a ring, into which the
+    // records and field are read from the tagged stream.
+
+    bool openPipe(uint32_t slots)
+    {
+        int command = VBICAP_COMMAND_CAPTURE_TAGGED;
+        if (!writePipe(&command, sizeof(command)) || !readPipe(&_streamHeader, sizeof(VbiStreamHeader)) ||
+            _streamHeader.magic != VBICAP_STREAM_MAGIC || _streamHeader.headerBytes < sizeof(VbiStreamHeader))
+            return false;
+        for (uint32_t i = sizeof(VbiStreamHeader); i < _streamHeader.headerBytes; ++i) {
+            uint8_t extra;
+            if (!readPipe(&extra, 1))
+                return false;
+        }
+        _buffers.resize(slots != 0 ? slots : VBI_CLIENT_PIPE_SLOTS);
+        _held.assign(_buffers.size(), false);
+        _transport = VBICAP_TRANSPORT_PIPE;
+        return true;
+    }
+
+    int nextPipe(VbiClientField* field, uint32_t timeoutMs)
+    {
+        size_t slot = 0;
+        while (slot < _held.size() && _held[slot])
+            ++slot;
+        if (slot == _held.size())
+            return VBICAP_NEXT_HELD;
+
+        // A synchronous pipe can't time out, so wait for the field to start
+        // arriving and then read it all
+        if (timeoutMs != VBICAP_WAIT_FOREVER) {
+            DWORD start = GetTickCount();
+            while (true) {
+                DWORD available, wait;
+                if (!pipeConnected(&available))
+                    return VBICAP_NEXT_OVER;
+                if (available != 0)
+                    break;
+                if (!remaining(start, timeoutMs, &wait))
+                    return VBICAP_NEXT_TIMEOUT;
+                Sleep(1);
+            }
+        }
+
+        std::vector<uint8_t>& buffer = _buffers[slot];
+        uint32_t offset = 0;
+        while (true) {
+            VbiFieldHeader header;
+            if (!readPipe(&header, sizeof(header)))
+                return VBICAP_NEXT_OVER;
+            bool isField = (header.magic == VBICAP_FIELD_MAGIC);
+            if (!isField && (header.dataBytes > VBI_CLIENT_MAX_RECORD || (header.magic != VBICAP_LEVELS_MAGIC &&
+                header.magic != VBICAP_BURST_MAGIC && header.magic != VBICAP_VIDEO_MAGIC &&
+                header.magic != VBICAP_AUDIO_MAGIC && header.magic != VBICAP_PAD_MAGIC)))
+                return VBICAP_NEXT_OVER;  // lost synchronisation
+            size_t end = offset + sizeof(VbiFieldHeader) + header.dataBytes;
+            if (buffer.size() < end)
+                buffer.resize(end);
+            memcpy(&buffer[offset], &header, sizeof(header));
+            if (header.dataBytes != 0 && !readPipe(&buffer[offset + sizeof(VbiFieldHeader)], header.dataBytes))
+                return VBICAP_NEXT_OVER;
+            if (isField)
+                break;
+            offset = static_cast<uint32_t>(end);
+        }
+        _held[slot] = true;
+        describe(&buffer[0], offset, static_cast<uint32_t>(slot), field);
+        return VBICAP_NEXT_FIELD;
+    }
+
+    char _pipeName[64];
+    HANDLE _pipe;
+    int _transport;
+    VbiStreamHeader _streamHeader;
+
+    HANDLE _mapping;
+    HANDLE _event;
+    VbiRingHeader* _ring;   // the header and slot states
+    VbiRingSlot* _slots;
+    const uint8_t* _slotData;
+    uint32_t _taken;        // fields taken from the ring so far
+
+    std::vector<std::vector<uint8_t> > _buffers;
+    std::vector<bool> _held;
+};
+
+
+VbiClient* vbiClientOpen(int card, int transport, uint32_t slots)
+{
+    VbiClient* client = NULL;
+    try {
+        client = new VbiClient;
+        if (client->open(card, transport, slots))
+            return client;
+    }
+    catch (...) { }
+    delete client;
+    return NULL;
+}
+
+int vbiClientTransport(const VbiClient* client) { return client->transport(); }
+
+const VbiStreamHeader* vbiClientStreamHeader(const VbiClient* client) { return client->streamHeader(); }
+
+int vbiClientNext(VbiClient* client, VbiClientField* field, uint32_t timeoutMs)
+{
+    try {
+        return client->next(field, timeoutMs);
+    }
+    catch (...) {
+        return VBICAP_NEXT_OVER;
+    }
+}
+
+void vbiClientRelease(VbiClient* client, const VbiClientField* field) { client->release(field); }
+
+int vbiClientRun(VbiClient* client, VbiClientCallback callback, void* context)
+{
+    while (true) {
+        VbiClientField field;
+        int result = vbiClientNext(client, &field, VBICAP_WAIT_FOREVER);
+        if (result != VBICAP_NEXT_FIELD)
+            return result;
+        int action = callback(context, &field);
+        if (action != VBICAP_CALLBACK_KEEP)
+            client->release(&field);
+        if (action == VBICAP_CALLBACK_STOP)
+            return VBICAP_CALLBACK_STOP;
+    }
+}
+
+void vbiClientClose(VbiClient* client) { delete client; }
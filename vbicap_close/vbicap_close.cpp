@@ -1,15 +1,22 @@
 #include "alfe/main.h"
+#include "../vbicap_protocol.h"
+
+#include <stdlib.h>
 
 class Program : public ProgramBase
 {
 public:
     void run()
     {
-        String process = "0";
+        // vbicap_close [card]
+        int card = 0;
         if (_arguments.count() > 1)
-            process = _arguments[1];
+            card = atoi(NullTerminatedString(_arguments[1]));
+        String pipeName = VBICAP_PIPE_NAME;
+        if (card != 0)
+            pipeName += decimal(card);
 
-        AutoHandle h = File("\\\\.\\pipe\\vbicap", true).openPipe();
-        h.write<int>(0);                
+        AutoHandle h = File(pipeName, true).openPipe();
+        h.write<int>(VBICAP_COMMAND_STOP);                
     }
 };
\ No newline at end of file
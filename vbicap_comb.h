@@ -0,0 +1,216 @@
+#ifndef INCLUDED_VBICAP_COMB_H
+#define INCLUDED_VBICAP_COMB_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Motion-adaptive Y/C separation
+//
+// A field from the card is a continuous run of samples at 8 times the colour
+// carrier frequency, so the carrier has a period of exactly 8 samples and
+// each scanline is samplesPerLine samples (1824 for a CGA, which has 228
+// carrier cycles per line, or 1820 for broadcast NTSC). The chroma at each
+// sample is found by comparing it with a reference sample which has the
+// opposite carrier phase:
+//   the line comb uses the line above in the same field, and
+//   the frame comb uses the same place in the previous frame, frameLines
+//   lines earlier (262 for a CGA, 525 for interlaced NTSC, which makes it
+//   the field before last).
+// If the reference is in phase with the sample instead (as on a CGA, which
+// has a whole number of cycles per line and per frame) the average of the
+// two samples half a cycle either side of it is used.
+//
+// The frame comb is exact where the picture is static, but the line comb
+// smears fine detail vertically, so each sample gets a blend of the two
+// according to how much the luma (the sum over a carrier cycle, which
+// cancels the chroma) has changed there since the previous frame.
+
+#define VBI_COMB_LINE      0  // always use the line comb
+#define VBI_COMB_FRAME     1  // use the frame comb whenever there's a frame to compare with
+#define VBI_COMB_ADAPTIVE  2
+
+class VbiCombFilter
+{
+public:
+    // fieldSamples is the number of samples in each field passed to
+    // process(). motionThreshold is the change in the sum of a carrier
+    // cycle of samples which is taken to be noise; changes of twice that or
+    // more use the line comb alone.
+    VbiCombFilter(int fieldSamples, int samplesPerLine = 1824, int frameLines = 262,
+        int mode = VBI_COMB_ADAPTIVE, int motionThreshold = 24)
+      : _fieldSamples(fieldSamples), _samplesPerLine(samplesPerLine),
+        _mode(mode), _haveLast(false)
+    {
+        // two fields make a frame if it has a half line
+        _fieldsPerFrame = ((frameLines & 1) != 0 ? 2 : 1);
+        _lineInPhase = (samplesPerLine & 7) == 0;
+        _frameInPhase = ((samplesPerLine*frameLines) & 7) == 0;
+
+        // Each field of the history is kept with a copy of its first and
+        // last lines (rounded up to whole carrier cycles) either side of it,
+        // so that the line comb and the in-phase averages can read outside
+        // the field without any special cases.
+        _padding = (samplesPerLine + 8 + 15) & ~15;
+        _stride = (_padding*2 + fieldSamples + 15) & ~15;
+        _slots = _fieldsPerFrame + 1;
+        _history.resize(_slots*_stride + 16);
+        for (int i = 0; i < _slots; ++i)
+            _valid[i] = false;
+
+        if (motionThreshold < 1)
+            motionThreshold = 1;
+        if (motionThreshold > 1024)
+            motionThreshold = 1024;
+        _motionThreshold = motionThreshold;
+        _motionScale = 4096/motionThreshold;
+    }
+
+    // True if samplesPerLine and frameLines put every reference either in
+    // phase or in antiphase with the sample it's compared with.
+    static bool supported(int samplesPerLine, int frameLines)
+    {
+        return samplesPerLine > 8 && (samplesPerLine & 3) == 0 &&
+            ((samplesPerLine*frameLines) & 3) == 0;
+    }
+
+    // Separate a field into luma and chroma (each fieldSamples values, in
+    // sample units, with luma + chroma == field). sequence is the field's
+    // number in the session; after a gap the frame comb isn't used until a
+    // whole frame has been seen again.
+    void process(uint32_t sequence, const uint8_t* field, int16_t* luma, int16_t* chroma)
+    {
+        if (_haveLast && sequence != _lastSequence + 1) {
+            for (int i = 0; i < _slots; ++i)
+                _valid[i] = false;
+        }
+        _haveLast = true;
+        _lastSequence = sequence;
+
+        int slot = sequence % _slots;
+        uint8_t* current = store(slot, field);
+        int frameSlot = (sequence + _slots - _fieldsPerFrame) % _slots;
+        const uint8_t* frame = NULL;
+        if (_valid[frameSlot] && _mode != VBI_COMB_LINE)
+            frame = samples(frameSlot);
+        _valid[slot] = true;
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i sixteen = _mm_set1_epi16(16);
+        const __m128i threshold = _mm_set1_epi16(static_cast<short>(_motionThreshold));
+        const __m128i scale = _mm_set1_epi16(static_cast<short>(_motionScale));
+        int spl = _samplesPerLine;
+        int i = 0;
+        for (; i + 16 <= _fieldSamples; i += 16) {
+            const uint8_t* c = current + i;
+            const uint8_t* l = c - spl;
+            __m128i c8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c));
+            __m128i cLo = _mm_unpacklo_epi8(c8, zero);
+            __m128i cHi = _mm_unpackhi_epi8(c8, zero);
+            __m128i lineLo, lineHi;
+            reference(l, _lineInPhase, &lineLo, &lineHi);
+
+            __m128i kLo = sixteen, kHi = sixteen;
+            __m128i frameLo = zero, frameHi = zero;
+            if (frame != NULL) {
+                const uint8_t* f = frame + i;
+                reference(f, _frameInPhase, &frameLo, &frameHi);
+                if (_mode == VBI_COMB_FRAME) {
+                    kLo = zero;
+                    kHi = zero;
+                }
+                else {
+                    // luma change over each of the two carrier cycles
+                    __m128i f8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f));
+                    __m128i d = _mm_sub_epi16(_mm_sad_epu8(c8, zero), _mm_sad_epu8(f8, zero));
+                    d = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+                    d = _mm_min_epi16(_mm_subs_epu16(d, threshold), threshold);
+                    __m128i k = _mm_srli_epi16(_mm_mullo_epi16(d, scale), 8);
+                    k = _mm_shufflehi_epi16(_mm_shufflelo_epi16(k, 0), 0);
+                    kLo = _mm_min_epi16(_mm_unpacklo_epi64(k, k), sixteen);
+                    kHi = _mm_min_epi16(_mm_unpackhi_epi64(k, k), sixteen);
+                }
+            }
+            combine(cLo, lineLo, frameLo, kLo, luma + i, chroma + i);
+            combine(cHi, lineHi, frameHi, kHi, luma + i + 8, chroma + i + 8);
+        }
+        // the last few samples get the line comb
+        for (; i < _fieldSamples; ++i) {
+            const uint8_t* c = current + i;
+            const uint8_t* l = c - spl;
+            int r = _lineInPhase ? (l[-4] + l[4]) >> 1 : l[0];
+            chroma[i] = static_cast<int16_t>((c[0] - r) >> 1);
+            luma[i] = static_cast<int16_t>(c[0] - chroma[i]);
+        }
+    }
+
+private:
+    uint8_t* samples(int slot) { return &_history[slot*_stride + _padding]; }
+
+    // Copy a field into the history, with its padding
+    uint8_t* store(int slot, const uint8_t* field)
+    {
+        uint8_t* p = samples(slot);
+        memcpy(p, field, _fieldSamples);
+        // the padding is a whole number of carrier cycles, so copies of the
+        // first and last lines shifted by it have the right phase
+        int n = _padding < _fieldSamples ? _padding : _fieldSamples;
+        for (int i = 0; i < _padding; ++i) {
+            p[i - _padding] = field[i % n];
+            p[_fieldSamples + i] = field[_fieldSamples - n + i % n];
+        }
+        return p;
+    }
+
+    // Load the reference samples for 16 samples, inverting the carrier if
+    // they're in phase
+    static void reference(const uint8_t* p, bool inPhase, __m128i* lo, __m128i* hi)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        if (!inPhase) {
+            __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            *lo = _mm_unpacklo_epi8(r, zero);
+            *hi = _mm_unpackhi_epi8(r, zero);
+            return;
+        }
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p - 4));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4));
+        *lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)), 1);
+        *hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)), 1);
+    }
+
+    // Blend the two combs with k/16 of the line comb
+    static void combine(__m128i c, __m128i line, __m128i frame, __m128i k, int16_t* luma, int16_t* chroma)
+    {
+        __m128i lineChroma = _mm_srai_epi16(_mm_sub_epi16(c, line), 1);
+        __m128i frameChroma = _mm_srai_epi16(_mm_sub_epi16(c, frame), 1);
+        __m128i blend = _mm_add_epi16(_mm_mullo_epi16(lineChroma, k),
+            _mm_mullo_epi16(frameChroma, _mm_sub_epi16(_mm_set1_epi16(16), k)));
+        __m128i ch = _mm_srai_epi16(blend, 4);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(chroma), ch);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(luma), _mm_sub_epi16(c, ch));
+    }
+
+    int _fieldSamples;
+    int _samplesPerLine;
+    int _mode;
+    int _fieldsPerFrame;
+    bool _lineInPhase;
+    bool _frameInPhase;
+    int _motionThreshold;
+    int _motionScale;
+
+    // The last few fields, in a ring indexed by sequence number, as one
+    // block so that the current line and its references stay close
+    int _padding;
+    int _stride;
+    int _slots;
+    std::vector<uint8_t> _history;
+    bool _valid[3];
+    bool _haveLast;
+    uint32_t _lastSequence;
+};
+
+#endif // INCLUDED_VBICAP_COMB_H
@@ -0,0 +1,190 @@
+#include "alfe/main.h"
+#include "../vbicap_file.h"
+#include "../vbicap_average.h"
+#include "../vbicap_decimate.h"
+
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        // vbicap_convert <input> <output> [delta=<threshold>] [key=<fields>]
+        //     [average=<fields>] [reject=<threshold>] [decimate=<bits>]
+        // Converts between raw captures and .vbi files. Delta-coded .vbi
+        // input is always decoded. If the output is a .vbi file, delta=
+        // stores only the lines that changed since the previous field of the
+        // same parity (by more than threshold in some sample, so delta=0 is
+        // lossless), storing every key'th field of each parity whole.
+        // average= writes the average of each n fields of the same parity
+        // as 16-bit samples (see vbicap_average.h), leaving out samples more
+        // than reject= from the average so far. decimate= converts to 4
+        // samples per carrier cycle of 8 or 16 bits (see vbicap_decimate.h)
+        // before averaging.
+        if (_arguments.count() < 3) {
+            console.write("Usage: vbicap_convert <input> <output> [delta=<threshold>] [key=<fields>]\n"
+                "    [average=<fields>] [reject=<threshold>] [decimate=<bits>]\n");
+            return;
+        }
+        NullTerminatedString inputName(_arguments[1]);
+        NullTerminatedString outputName(_arguments[2]);
+        int deltaThreshold = -1;
+        int keyInterval = 600;
+        int averageFields = 1;
+        int averageReject = 0;
+        int decimateBits = 0;
+        for (int i = 3; i < _arguments.count(); ++i) {
+            NullTerminatedString option(_arguments[i]);
+            const char* o = option;
+            if (strncmp(o, "delta=", 6) == 0)
+                deltaThreshold = atoi(o + 6);
+            else if (strncmp(o, "key=", 4) == 0)
+                keyInterval = atoi(o + 4);
+            else if (strncmp(o, "average=", 8) == 0)
+                averageFields = atoi(o + 8);
+            else if (strncmp(o, "reject=", 7) == 0)
+                averageReject = atoi(o + 7);
+            else if (strncmp(o, "decimate=", 9) == 0)
+                decimateBits = atoi(o + 9);
+            else
+                throw Exception(String("Unknown option ") + _arguments[i]);
+        }
+        if (deltaThreshold > 255)
+            throw Exception("Delta threshold must be between 0 and 255.");
+        if (keyInterval < 1)
+            throw Exception("Key interval must be at least 1.");
+        if (averageFields < 1 || averageFields > 65535)
+            throw Exception("The number of fields to average must be between 1 and 65535.");
+        if (averageReject < 0 || averageReject > 255)
+            throw Exception("Rejection threshold must be between 0 and 255.");
+        if (decimateBits != 0 && decimateBits != 8 && decimateBits != 16)
+            throw Exception("Decimated samples must be 8 or 16 bits.");
+        bool averaging = averageFields > 1;
+        bool decimating = decimateBits != 0;
+        if (averaging && decimateBits == 16)
+            throw Exception("Averages are already 16-bit, so use decimate=8 with average.");
+
+        VbiFileReader reader;
+        if (!reader.open(inputName))
+            throw Exception(String("Can't open ") + _arguments[1]);
+        if (averaging && reader.streamHeader().sampleBits != 8)
+            throw Exception("Can't average fields which are already averages.");
+        if (decimating && (reader.streamHeader().sampleBits != 8 || reader.streamHeader().samplesPerCycle != 8 ||
+            (reader.streamHeader().bytesPerLine & 1) != 0))
+            throw Exception("Only 8-bit lines of an even number of samples at 8 per cycle can be decimated.");
+        VbiStreamHeader streamHeader = reader.streamHeader();
+        if (decimating)
+            streamHeader = vbiDecimatedStreamHeader(streamHeader, decimateBits);
+        if (averaging) {
+            // averages don't have the records of the fields averaged
+            streamHeader = vbiAveragedStreamHeader(streamHeader, averageFields);
+            streamHeader.videoWidth = 0;
+            streamHeader.videoLines = 0;
+            streamHeader.audioRate = 0;
+        }
+        if (streamHeader.sampleBits == 16 && deltaThreshold > 0)
+            throw Exception("16-bit samples can only be delta coded losslessly (delta=0).");
+        size_t length = strlen(outputName);
+        size_t extensionLength = strlen(VBICAP_FILE_EXTENSION);
+        bool container = length >= extensionLength &&
+            _stricmp(static_cast<const char*>(outputName) + length - extensionLength, VBICAP_FILE_EXTENSION) == 0;
+        if (!container && deltaThreshold >= 0)
+            throw Exception("Delta coding needs a .vbi output file.");
+
+        VbiFileWriter writer;
+        FILE* raw = NULL;
+        if (container) {
+            if (!writer.open(outputName, streamHeader, deltaThreshold, keyInterval))
+                throw Exception(String("Can't create ") + _arguments[2]);
+        }
+        else {
+            raw = fopen(outputName, "wb");
+            if (raw == NULL)
+                throw Exception(String("Can't create ") + _arguments[2]);
+        }
+
+        VbiFieldHeader header;
+        std::vector<uint8_t> field;
+        int fieldSamples = reader.fieldBytes();
+        std::unique_ptr<VbiDecimator> decimator;
+        std::vector<uint8_t> decimated;
+        std::vector<VbiBurstLine> bursts;
+        if (decimating) {
+            decimator.reset(new VbiDecimator(decimateBits));
+            decimated.resize(fieldSamples/2*(decimateBits/8));
+            fieldSamples /= 2;
+        }
+        std::unique_ptr<VbiFieldAverager> averager;
+        std::vector<uint16_t> average;
+        if (averaging) {
+            averager.reset(new VbiFieldAverager(fieldSamples, averageFields, averageReject));
+            average.resize(fieldSamples);
+        }
+        int fields = 0;
+        int written = 0;
+        while (reader.next(&header, &field)) {
+            ++fields;
+            const uint8_t* data = &field[0];
+            size_t dataBytes = field.size();
+            if (decimating) {
+                decimator->decimate(&decimated[0], &field[0], 1, reader.fieldBytes(), reader.fieldBytes());
+                data = &decimated[0];
+                dataBytes = decimated.size();
+                header.dataBytes = static_cast<uint32_t>(dataBytes);
+            }
+            if (averaging) {
+                uint32_t flags;
+                if (!averager->add(data, header.flags, &average[0], &flags))
+                    continue;
+                header.flags = flags;
+                header.dataBytes = static_cast<uint32_t>(average.size()*sizeof(uint16_t));
+                data = reinterpret_cast<const uint8_t*>(&average[0]);
+                dataBytes = header.dataBytes;
+            }
+            bool ok = true;
+            if (container && !averaging && reader.levels() != NULL)
+                ok = writer.writeLevels(header.sequence, *reader.levels());
+            if (container && !averaging && reader.bursts() != NULL) {
+                // burst positions are in the samples of the field written
+                bursts = *reader.bursts();
+                if (decimating && !bursts.empty())
+                    vbiDecimateBursts(&bursts[0], bursts.size());
+                ok = ok && writer.writeBursts(header.sequence, bursts.empty() ? NULL : &bursts[0],
+                    static_cast<uint32_t>(bursts.size()));
+            }
+            if (container && !averaging && reader.video() != NULL) {
+                ok = ok && writer.writeVideo(header.sequence, &(*reader.video())[0],
+                    static_cast<uint32_t>(reader.video()->size()));
+            }
+            if (container && !averaging && reader.audio() != NULL) {
+                const std::vector<int16_t>* audio = reader.audio();
+                ok = ok && writer.writeAudio(header.sequence, reader.audioPosition(),
+                    audio->empty() ? NULL : &(*audio)[0], static_cast<uint32_t>(audio->size()));
+            }
+            if (container)
+                ok = ok && writer.writeField(header, data);
+            else
+                ok = fwrite(data, 1, dataBytes, raw) == dataBytes;
+            if (!ok)
+                throw Exception(String("Can't write ") + _arguments[2]);
+            ++written;
+        }
+        if (raw != NULL)
+            fclose(raw);
+        long long whole = static_cast<long long>(written)*
+            (streamHeader.linesPerField*streamHeader.bytesPerLine + sizeof(VbiFieldHeader));
+        console.write(decimal(fields) + " fields converted");
+        if (averaging)
+            console.write(String(" to ") + decimal(written) + " averages");
+        if (decimating)
+            console.write(String(", decimated to ") + decimal(decimateBits) + "-bit samples at 4 per cycle");
+        if (container && deltaThreshold >= 0) {
+            console.write(String(", ") + decimal(static_cast<int>(writer.bytesWritten()/1024)) +
+                " KiB (" + decimal(static_cast<int>(whole/1024)) + " KiB without deltas)");
+        }
+        console.write("\n");
+    }
+};
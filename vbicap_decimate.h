@@ -0,0 +1,186 @@
+#ifndef INCLUDED_VBICAP_DECIMATE_H
+#define INCLUDED_VBICAP_DECIMATE_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Decimation from 8 to 4 samples per carrier cycle
+//
+// The card samples at 8 times the colour carrier frequency (28.6MHz), but a
+// CGA's pixel clock is 4 times the carrier and nothing much in a composite
+// signal is above 7MHz, so once it has been low-pass filtered every other
+// sample is enough. VbiDecimator filters with a 15-tap half-band filter
+// (flat to within 0.1% up to 4.3MHz, half gain at 7.2MHz and below 0.2% from
+// 10MHz) and only computes the samples it keeps, 8 at a time: output sample
+// n is centred on input sample 2n, so the carrier is at the same phase
+// relative to the first sample as before, at 4 samples per cycle.
+//
+// The lines of a field are filtered as one signal, as the burst tracker
+// treats them, and the ends of the field are extended by repeating the first
+// and last samples. Lines can be any distance apart in the input (so that
+// the daemon can decimate straight out of the DMA buffers); they're gathered
+// a block at a time into a buffer which stays in the cache. Output samples
+// are 8 bits, or 16 bits with 8 fractional bits like averaged fields.
+
+#define VBI_DECIMATE_REACH  7     // input samples used either side of the centre
+#define VBI_DECIMATE_BLOCK  4096  // input samples filtered at a time
+
+// The coefficients, with 14 fractional bits, of the centre sample and of
+// the pairs 1, 3, 5 and 7 samples either side (the even ones are 0). They
+// add up to 1.
+#define VBI_DECIMATE_C0  8188
+#define VBI_DECIMATE_C1  5030
+#define VBI_DECIMATE_C3  (-1249)
+#define VBI_DECIMATE_C5  383
+#define VBI_DECIMATE_C7  (-66)
+
+class VbiDecimator
+{
+public:
+    // bits is 8 or 16, the size of each output sample
+    VbiDecimator(int bits)
+      : _bits(bits), _block(VBI_DECIMATE_BLOCK + 2*VBI_DECIMATE_REACH) { }
+
+    int bits() const { return _bits; }
+
+    // Decimate a field of lines lines of width samples, the starts of
+    // which are stride bytes apart, to lines*width/2 samples at output.
+    void decimate(uint8_t* output, const uint8_t* input, int lines, int stride, int width)
+    {
+        int count = lines*width;
+        for (int start = 0; start < count; start += VBI_DECIMATE_BLOCK) {
+            int end = (count - start < VBI_DECIMATE_BLOCK ? count : start + VBI_DECIMATE_BLOCK);
+            gather(&_block[0], input, lines, stride, width, start - VBI_DECIMATE_REACH, end + VBI_DECIMATE_REACH);
+            filter(&_block[VBI_DECIMATE_REACH], (end - start)/2, output + (start/2)*(_bits/8));
+        }
+    }
+
+private:
+    // Copy samples [from, to) of the field to out, repeating the end
+    // samples for those outside it
+    static void gather(uint8_t* out, const uint8_t* input, int lines, int stride, int width, int from, int to)
+    {
+        int count = lines*width;
+        while (from < to) {
+            if (from < 0 || from >= count) {
+                int i = (from < 0 ? 0 : count - 1);
+                *out++ = input[(i/width)*stride + i%width];
+                ++from;
+                continue;
+            }
+            int offset = from%width;
+            int n = (width - offset < to - from ? width - offset : to - from);
+            memcpy(out, input + (from/width)*stride + offset, n);
+            out += n;
+            from += n;
+        }
+    }
+
+    // The filter centred on x[0], with 14 fractional bits
+    static int tap(const uint8_t* x)
+    {
+        return VBI_DECIMATE_C0*x[0] + VBI_DECIMATE_C1*(x[-1] + x[1]) + VBI_DECIMATE_C3*(x[-3] + x[3]) +
+            VBI_DECIMATE_C5*(x[-5] + x[5]) + VBI_DECIMATE_C7*(x[-7] + x[7]);
+    }
+
+    // Write the n samples centred on x[0], x[2], x[4]... to output. x must
+    // have VBI_DECIMATE_REACH samples before the first and after the last.
+    void filter(const uint8_t* x, int n, uint8_t* output)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i even = _mm_set1_epi16(0x00ff);
+        // coefficients for pairs of 16-bit lanes (centre, 1), (3, 5), (7, none)
+        const __m128i k01 = _mm_set_epi16(VBI_DECIMATE_C1, VBI_DECIMATE_C0, VBI_DECIMATE_C1, VBI_DECIMATE_C0,
+            VBI_DECIMATE_C1, VBI_DECIMATE_C0, VBI_DECIMATE_C1, VBI_DECIMATE_C0);
+        const __m128i k35 = _mm_set_epi16(VBI_DECIMATE_C5, VBI_DECIMATE_C3, VBI_DECIMATE_C5, VBI_DECIMATE_C3,
+            VBI_DECIMATE_C5, VBI_DECIMATE_C3, VBI_DECIMATE_C5, VBI_DECIMATE_C3);
+        const __m128i k7 = _mm_set_epi16(0, VBI_DECIMATE_C7, 0, VBI_DECIMATE_C7, 0, VBI_DECIMATE_C7, 0, VBI_DECIMATE_C7);
+        const bool wide = (_bits == 16);
+        const __m128i round = _mm_set1_epi32(wide ? 1 << 5 : 1 << 13);
+        // 16-bit results are packed with signed saturation, offset by 32768
+        const __m128i bias = _mm_set1_epi32(32768);
+        const __m128i flip = _mm_set1_epi16(static_cast<short>(0x8000));
+        int i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const uint8_t* c = x + 2*i;
+            // the samples at an even distance from c, 8 of each in 16-bit lanes
+            __m128i s0 = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c)), even);
+            __m128i s1 = _mm_add_epi16(
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c - 1)), even),
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c + 1)), even));
+            __m128i s3 = _mm_add_epi16(
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c - 3)), even),
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c + 3)), even));
+            __m128i s5 = _mm_add_epi16(
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c - 5)), even),
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c + 5)), even));
+            __m128i s7 = _mm_add_epi16(
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c - 7)), even),
+                _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c + 7)), even));
+            __m128i lo = _mm_add_epi32(_mm_add_epi32(
+                _mm_madd_epi16(_mm_unpacklo_epi16(s0, s1), k01),
+                _mm_madd_epi16(_mm_unpacklo_epi16(s3, s5), k35)),
+                _mm_madd_epi16(_mm_unpacklo_epi16(s7, zero), k7));
+            __m128i hi = _mm_add_epi32(_mm_add_epi32(
+                _mm_madd_epi16(_mm_unpackhi_epi16(s0, s1), k01),
+                _mm_madd_epi16(_mm_unpackhi_epi16(s3, s5), k35)),
+                _mm_madd_epi16(_mm_unpackhi_epi16(s7, zero), k7));
+            lo = _mm_add_epi32(lo, round);
+            hi = _mm_add_epi32(hi, round);
+            if (wide) {
+                lo = _mm_sub_epi32(_mm_srai_epi32(lo, 6), bias);
+                hi = _mm_sub_epi32(_mm_srai_epi32(hi, 6), bias);
+                __m128i v = _mm_xor_si128(_mm_packs_epi32(lo, hi), flip);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i*2), v);
+            }
+            else {
+                __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, 14), _mm_srai_epi32(hi, 14));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(output + i), _mm_packus_epi16(v, v));
+            }
+        }
+        for (; i < n; ++i) {
+            int v = tap(x + 2*i);
+            if (wide) {
+                v = (v + (1 << 5)) >> 6;
+                v = (v < 0 ? 0 : (v > 65535 ? 65535 : v));
+                uint16_t s = static_cast<uint16_t>(v);
+                memcpy(output + i*2, &s, 2);
+            }
+            else {
+                v = (v + (1 << 13)) >> 14;
+                output[i] = static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+            }
+        }
+    }
+
+    int _bits;
+    std::vector<uint8_t> _block;
+};
+
+// The stream header for decimated fields of an 8-bit source with 8 samples
+// per cycle. The burst positions of a decimated stream are halved as well
+// (see vbiDecimateBursts()).
+inline VbiStreamHeader vbiDecimatedStreamHeader(const VbiStreamHeader& source, int bits)
+{
+    VbiStreamHeader streamHeader = source;
+    streamHeader.bytesPerLine = source.bytesPerLine/2*(bits/8);
+    streamHeader.sampleBits = bits;
+    streamHeader.samplesPerCycle = 4;
+    return streamHeader;
+}
+
+// Convert the positions of a burst table measured before decimation to
+// positions in the decimated field. The phases, in fractions of a cycle,
+// stay the same.
+inline void vbiDecimateBursts(VbiBurstLine* lines, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        lines[i].position /= 2;
+}
+
+#endif // INCLUDED_VBICAP_DECIMATE_H
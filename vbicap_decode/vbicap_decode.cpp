@@ -0,0 +1,378 @@
+#include "alfe/main.h"
+#include "../vbicap_file.h"
+#include "../vbicap_comb.h"
+#include "../vbicap_cga.h"
+#include "../vbicap_burst.h"
+#include "../vbicap_frame.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        // vbicap_decode <input> <output.ppm> [field=<n>] [comb=line|frame|adaptive]
+        //     [line=<samples>] [frame=<lines>] [motion=<threshold>]
+        //     [black=<level>] [white=<level>] [hue=<degrees>] [saturation=<percent>]
+        //     [interlaced]
+        // Separates luma and chroma in every field of a capture (see
+        // vbicap_comb.h), reports how long that took, and writes field n
+        // (default the last one) as an RGB image at 4 times the colour
+        // carrier frequency horizontally. The defaults are for a CGA: 1824
+        // samples per line and 262 lines per frame. For broadcast NTSC use
+        // line=1820 frame=525.
+        //
+        // With interlaced it writes the frame made of field n and the field
+        // after it instead (see vbicap_frame.h), which must be of the other
+        // parity and follow it without a gap; without field=, the last such
+        // frame in the capture.
+        //
+        // With cga=<table> it instead finds the CGA pixels that produced
+        // the samples, using a table from vbicap_calibrate (see
+        // vbicap_cga.h). palette=<c>,<c>... gives the colours that can
+        // appear and pixel=<samples> the length of a pixel (2 for 640-pixel
+        // mode, 4 for 320-pixel mode, 8 for 160-pixel mode). phase=<n> is
+        // the index modulo 8 of the samples at the calibration's phase 0
+        // (phase=burst finds it from the colour burst of the first field,
+        // for tables measured with burst=), and align=<n> that of the
+        // samples where 8-sample carrier cycles start. The image shows the
+        // pixels in their RGBI colours, and pixels=<file> also writes them
+        // as one byte per hdot.
+        if (_arguments.count() < 3) {
+            console.write("Usage: vbicap_decode <input> <output.ppm> [field=<n>] [comb=line|frame|adaptive]\n"
+                "    [line=<samples>] [frame=<lines>] [motion=<threshold>] [black=<level>]\n"
+                "    [white=<level>] [hue=<degrees>] [saturation=<percent>] [interlaced]\n"
+                "    [cga=<table> [palette=<c>,<c>...] [pixel=<samples>] [phase=<n>|burst] [align=<n>]\n"
+                "    [pixels=<file>]]\n");
+            return;
+        }
+        NullTerminatedString inputName(_arguments[1]);
+        NullTerminatedString outputName(_arguments[2]);
+        int wantedField = -1;
+        int mode = VBI_COMB_ADAPTIVE;
+        int samplesPerLine = 1824;
+        int frameLines = 262;
+        int motion = 24;
+        double black = 60;
+        double white = 200;
+        double hue = 0;
+        double saturation = 100;
+        bool interlaced = false;
+        String cgaTable;
+        bool cga = false;
+        int palette[VBI_CALIBRATION_COLOURS] = { 0, 15 };
+        int colours = 2;
+        int pixelSamples = 2;
+        int phaseZero = 0;
+        bool burstPhase = false;
+        int align = 0;
+        String pixelsName;
+        bool writePixels = false;
+        for (int i = 3; i < _arguments.count(); ++i) {
+            NullTerminatedString option(_arguments[i]);
+            const char* o = option;
+            if (strncmp(o, "field=", 6) == 0)
+                wantedField = atoi(o + 6);
+            else if (strcmp(o, "comb=line") == 0)
+                mode = VBI_COMB_LINE;
+            else if (strcmp(o, "comb=frame") == 0)
+                mode = VBI_COMB_FRAME;
+            else if (strcmp(o, "comb=adaptive") == 0)
+                mode = VBI_COMB_ADAPTIVE;
+            else if (strncmp(o, "line=", 5) == 0)
+                samplesPerLine = atoi(o + 5);
+            else if (strncmp(o, "frame=", 6) == 0)
+                frameLines = atoi(o + 6);
+            else if (strncmp(o, "motion=", 7) == 0)
+                motion = atoi(o + 7);
+            else if (strncmp(o, "black=", 6) == 0)
+                black = atof(o + 6);
+            else if (strncmp(o, "white=", 6) == 0)
+                white = atof(o + 6);
+            else if (strncmp(o, "hue=", 4) == 0)
+                hue = atof(o + 4);
+            else if (strncmp(o, "saturation=", 11) == 0)
+                saturation = atof(o + 11);
+            else if (strcmp(o, "interlaced") == 0)
+                interlaced = true;
+            else if (strncmp(o, "cga=", 4) == 0) {
+                cgaTable = o + 4;
+                cga = true;
+            }
+            else if (strncmp(o, "palette=", 8) == 0) {
+                const char* p = o + 8;
+                for (colours = 0; colours < VBI_CALIBRATION_COLOURS && *p != 0; ++colours) {
+                    char* end;
+                    palette[colours] = strtol(p, &end, 10);
+                    if (end == p)
+                        throw Exception("The palette is a list of colours separated by commas.");
+                    p = (*end == ',' ? end + 1 : end);
+                }
+            }
+            else if (strncmp(o, "pixel=", 6) == 0)
+                pixelSamples = atoi(o + 6);
+            else if (strcmp(o, "phase=burst") == 0)
+                burstPhase = true;
+            else if (strncmp(o, "phase=", 6) == 0)
+                phaseZero = atoi(o + 6);
+            else if (strncmp(o, "align=", 6) == 0)
+                align = atoi(o + 6);
+            else if (strncmp(o, "pixels=", 7) == 0) {
+                pixelsName = o + 7;
+                writePixels = true;
+            }
+            else
+                throw Exception(String("Unknown option ") + _arguments[i]);
+        }
+        if (!VbiCombFilter::supported(samplesPerLine, frameLines))
+            throw Exception("Lines and frames must be a multiple of 4 samples long.");
+        if (white <= black)
+            throw Exception("White level must be above black level.");
+        if (interlaced && cga)
+            throw Exception("CGA pixels can't be woven into frames.");
+
+        VbiFileReader reader;
+        if (!reader.open(inputName))
+            throw Exception(String("Can't open ") + _arguments[1]);
+        if (reader.streamHeader().sampleBits != 8)
+            throw Exception("Averaged (16-bit) captures can't be decoded yet.");
+        if (reader.streamHeader().samplesPerCycle != 8)
+            throw Exception("Decimated captures can't be decoded yet.");
+        int fieldSamples = reader.fieldBytes();
+        VbiCombFilter comb(fieldSamples, samplesPerLine, frameLines, mode, motion);
+        std::vector<int16_t> luma(fieldSamples);
+        std::vector<int16_t> chroma(fieldSamples);
+
+        VbiCalibration calibration;
+        if (cga && !calibration.load(NullTerminatedString(cgaTable)))
+            throw Exception(String("Can't load calibration table ") + cgaTable);
+        if (cga && burstPhase) {
+            phaseZero = burstPhaseZero(inputName);
+            console.write(String("Phase 0 at samples ") + decimal(phaseZero) + " modulo 8\n");
+        }
+        VbiCgaDecoder cgaDecoder(calibration, palette, colours, pixelSamples, phaseZero, align);
+        if (cga && !cgaDecoder.valid())
+            throw Exception("The pixel length must be 2, 4 or 8 and the palette's colours must all be in the calibration table.");
+        std::vector<uint8_t> pixels(fieldSamples/2);
+
+        int width = samplesPerLine/2;
+        int height = fieldSamples/samplesPerLine;
+        RgbConversion conversion(black, white, hue, saturation);
+
+        // With interlaced, each field is converted to RGB as it's separated
+        // and paired into frames, keeping the latest. There can be a field
+        // waiting to be paired, two in the latest frame and one just
+        // converted.
+        VbiStreamHeader imageHeader;
+        vbiDefaultStreamHeader(&imageHeader, height, width*3);
+        VbiFrameAssembler assembler(imageHeader, width*3);
+        std::vector<uint8_t> images[4];
+        std::vector<int> freeImages;
+        for (int i = 0; i < 4; ++i) {
+            images[i].resize(width*3*height);
+            freeImages.push_back(i);
+        }
+        VbiFrame frame;
+        int frameField = -1;  // the number of the first field of frame
+
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        LONGLONG ticks = 0;
+        VbiFieldHeader header;
+        std::vector<uint8_t> field;
+        int fields = 0;
+        bool found = false;
+        while (reader.next(&header, &field)) {
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            if (cga)
+                cgaDecoder.decode(&field[0], fieldSamples, &pixels[0]);
+            else
+                comb.process(header.sequence, &field[0], &luma[0], &chroma[0]);
+            QueryPerformanceCounter(&end);
+            ticks += end.QuadPart - start.QuadPart;
+            if (interlaced) {
+                int image = freeImages.back();
+                freeImages.pop_back();
+                toRgb(&luma[0], &chroma[0], fieldSamples, samplesPerLine, conversion, &images[image][0]);
+                VbiFrameField f;
+                f.data = &images[image][0];
+                f.sequence = header.sequence;
+                f.flags = header.flags;
+                f.context = &images[image];
+                VbiFrameField unused[2];
+                int unusedCount;
+                const VbiFrame* completed = assembler.add(f, unused, &unusedCount);
+                for (int i = 0; i < unusedCount; ++i)
+                    freeImages.push_back(imageIndex(images, unused[i]));
+                if (completed != NULL) {
+                    if (frameField >= 0) {
+                        freeImages.push_back(imageIndex(images, frame.field(0)));
+                        freeImages.push_back(imageIndex(images, frame.field(1)));
+                    }
+                    frame = *completed;
+                    frameField = fields - 1;
+                }
+            }
+            ++fields;
+            if (wantedField >= 0 && fields - 1 == wantedField + (interlaced ? 1 : 0)) {
+                found = true;
+                break;
+            }
+        }
+        if (fields == 0 || (wantedField >= 0 && !found))
+            throw Exception("Not enough fields in the capture.");
+        if (interlaced && (frameField < 0 || (wantedField >= 0 && frameField != wantedField)))
+            throw Exception("The fields don't make a frame.");
+
+        double microseconds = static_cast<double>(ticks)*1000000.0/static_cast<double>(frequency.QuadPart)/fields;
+        console.write(decimal(fields) + (cga ? " fields decoded, " : " fields separated, ") +
+            decimal(static_cast<int>(microseconds)) + "us per field (" +
+            decimal(static_cast<int>(16683.0/microseconds)) + " times real time)\n");
+        if (cga) {
+            long long lookups = cgaDecoder.lookups();
+            console.write(String("Cycles searched: ") +
+                decimal(static_cast<int>(cgaDecoder.searches()*1000/(lookups > 0 ? lookups : 1))) + "/1000\n");
+            if (writePixels) {
+                FILE* f = fopen(NullTerminatedString(pixelsName), "wb");
+                if (f == NULL || fwrite(&pixels[0], 1, pixels.size(), f) != pixels.size())
+                    throw Exception(String("Can't write ") + pixelsName);
+                fclose(f);
+            }
+            writeRgbi(outputName, &pixels[0], width, height, samplesPerLine/2);
+            return;
+        }
+
+        FILE* out = fopen(outputName, "wb");
+        if (out == NULL)
+            throw Exception(String("Can't create ") + _arguments[2]);
+        if (!interlaced)
+            toRgb(&luma[0], &chroma[0], fieldSamples, samplesPerLine, conversion, &images[0][0]);
+        int lines = (interlaced ? frame.lines() : height);
+        fprintf(out, "P6\n%i %i\n255\n", width, lines);
+        for (int y = 0; y < lines; ++y) {
+            const uint8_t* row = (interlaced ? frame.line(y) : &images[0][y*width*3]);
+            if (fwrite(row, 1, width*3, out) != static_cast<size_t>(width*3))
+                throw Exception(String("Can't write ") + _arguments[2]);
+        }
+        fclose(out);
+    }
+
+private:
+    // How to turn separated luma and chroma into RGB
+    struct RgbConversion
+    {
+        RgbConversion(double black, double white, double hue, double saturation)
+          : black(black), range(white - black)
+        {
+            // demodulate the chroma over a carrier cycle centred on each pixel
+            for (int i = 0; i < 8; ++i) {
+                double phase = (i*45.0 + hue)*3.14159265358979/180.0;
+                cosTable[i] = cos(phase);
+                sinTable[i] = sin(phase);
+            }
+            chromaScale = saturation/100.0*2.0/8.0/range;
+        }
+
+        double black;
+        double range;
+        double chromaScale;
+        double cosTable[8];
+        double sinTable[8];
+    };
+
+    // Convert a separated field to RGB pixels at 4 times the colour carrier
+    // frequency, samplesPerLine/2*3 bytes per line
+    void toRgb(const int16_t* luma, const int16_t* chroma, int fieldSamples, int samplesPerLine,
+        const RgbConversion& conversion, uint8_t* image)
+    {
+        int width = samplesPerLine/2;
+        int height = fieldSamples/samplesPerLine;
+        for (int y = 0; y < height; ++y) {
+            uint8_t* row = image + y*width*3;
+            for (int x = 0; x < width; ++x) {
+                int s = y*samplesPerLine + x*2;
+                double Y = ((luma[s] + luma[s + 1])*0.5 - conversion.black)/conversion.range;
+                double I = 0, Q = 0;
+                for (int j = -4; j < 4; ++j) {
+                    int t = s + j;
+                    if (t < 0 || t >= fieldSamples)
+                        continue;
+                    I += chroma[t]*conversion.cosTable[t & 7];
+                    Q += chroma[t]*conversion.sinTable[t & 7];
+                }
+                I *= conversion.chromaScale;
+                Q *= conversion.chromaScale;
+                double rgb[3] = {
+                    Y + 0.956*I + 0.621*Q,
+                    Y - 0.272*I - 0.647*Q,
+                    Y - 1.106*I + 1.703*Q };
+                for (int c = 0; c < 3; ++c) {
+                    double v = rgb[c]*255.0 + 0.5;
+                    row[x*3 + c] = static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+                }
+            }
+        }
+    }
+
+    // Which of images a field converted for pairing is in
+    static int imageIndex(const std::vector<uint8_t>* images, const VbiFrameField& field)
+    {
+        return static_cast<int>(static_cast<const std::vector<uint8_t>*>(field.context) - images);
+    }
+
+    // The index modulo 8 of the samples at phase 0 of the colour burst,
+    // averaged over the lines of the first field of a capture
+    int burstPhaseZero(const char* name)
+    {
+        VbiFileReader reader;
+        VbiFieldHeader header;
+        std::vector<uint8_t> field;
+        if (!reader.open(name) || !reader.next(&header, &field))
+            throw Exception(String("Can't read ") + name);
+        std::vector<VbiBurstLine> lines;
+        const std::vector<VbiBurstLine>* bursts = reader.bursts();
+        if (bursts == NULL) {
+            VbiBurstTracker tracker;
+            tracker.track(&field[0], reader.fieldBytes(), &lines);
+            bursts = &lines;
+        }
+        double re = 0, im = 0;
+        for (size_t i = 0; i < bursts->size(); ++i) {
+            double a = VbiBurstTracker::radians((*bursts)[i]);
+            re += (*bursts)[i].amplitude*cos(a);
+            im += (*bursts)[i].amplitude*sin(a);
+        }
+        if (re == 0 && im == 0)
+            throw Exception("No colour burst found in the first field.");
+        // peaks of the burst are at samples a*8/(2*pi) modulo 8
+        int phase = static_cast<int>(floor(atan2(im, re)*8/(2*3.14159265358979) + 0.5));
+        return phase & 7;
+    }
+
+    // Write CGA pixels as an image in their RGBI colours
+    void writeRgbi(const char* name, const uint8_t* pixels, int width, int height, int stride)
+    {
+        FILE* out = fopen(name, "wb");
+        if (out == NULL)
+            throw Exception(String("Can't create ") + name);
+        fprintf(out, "P6\n%i %i\n255\n", width, height);
+        std::vector<uint8_t> row(width*3);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int c = pixels[y*stride + x];
+                int i = (c & 8) != 0 ? 0x55 : 0;
+                row[x*3] = static_cast<uint8_t>(((c & 4) != 0 ? 0xaa : 0) + i);
+                // colour 6 is brown rather than dark yellow
+                row[x*3 + 1] = static_cast<uint8_t>(((c & 2) != 0 ? (c == 6 ? 0x55 : 0xaa) : 0) + i);
+                row[x*3 + 2] = static_cast<uint8_t>(((c & 1) != 0 ? 0xaa : 0) + i);
+            }
+            if (fwrite(&row[0], 1, row.size(), out) != row.size())
+                throw Exception(String("Can't write ") + name);
+        }
+        fclose(out);
+    }
+};
\ No newline at end of file
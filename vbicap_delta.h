@@ -0,0 +1,204 @@
+#ifndef INCLUDED_VBICAP_DELTA_H
+#define INCLUDED_VBICAP_DELTA_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Temporal delta coding of fields
+//
+// Most of what we capture is a static screen, so most lines of a field are
+// the same as in the previous field of the same parity. A field stored with
+// VBICAP_FIELD_DELTA has a payload of:
+//   VbiDeltaHeader
+//   a bitmap with one bit per line (LSB first, padded to a multiple of 4
+//     bytes), set for the lines stored in this record
+//   the stored lines, in order
+// Lines that aren't stored are the same as in the reference field. If the
+// encoder's threshold is 0 the reconstruction is exact; otherwise lines that
+// differ from the reference by no more than the threshold in any sample are
+// treated as unchanged.
+
+typedef struct
+{
+    uint32_t referenceSequence;  // sequence number of the reference field
+    uint32_t storedLines;        // 0 means the field is the same as the reference
+} VbiDeltaHeader;
+
+inline int vbiDeltaBitmapBytes(int lines) { return ((lines + 31)/32)*4; }
+
+// True if any sample of the two lines differs by more than threshold.
+inline bool vbiLineDiffers(const uint8_t* a, const uint8_t* b, int bytes, int threshold)
+{
+    __m128i t = _mm_set1_epi8(static_cast<char>(threshold));
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        // |x - y| with unsigned saturating arithmetic, then the amount by
+        // which it exceeds the threshold
+        __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+        __m128i over = _mm_subs_epu8(d, t);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xffff)
+            return true;
+    }
+    for (; i < bytes; ++i) {
+        int d = a[i] - b[i];
+        if (d > threshold || -d > threshold)
+            return true;
+    }
+    return false;
+}
+
+class VbiDeltaEncoder
+{
+public:
+    // Every keyInterval fields of each parity are stored whole, so that a
+    // damaged file can be resynchronised.
+    VbiDeltaEncoder(int linesPerField, int bytesPerLine, int threshold, int keyInterval)
+      : _lines(linesPerField), _bytesPerLine(bytesPerLine), _threshold(threshold),
+        _keyInterval(keyInterval)
+    {
+        for (int i = 0; i < 2; ++i) {
+            _references[i].valid = false;
+            _references[i].data.resize(linesPerField*bytesPerLine);
+        }
+    }
+
+    // Encode a field. If it's worth storing as a delta, fills in payload and
+    // returns VBICAP_FIELD_DELTA. Otherwise returns 0 and the field should be
+    // stored as it is.
+    uint32_t encode(uint32_t sequence, uint32_t flags, const uint8_t* field, std::vector<uint8_t>* payload)
+    {
+        Reference* r = &_references[(flags & VBICAP_FIELD_ODD) != 0 ? 1 : 0];
+        int fieldBytes = _lines*_bytesPerLine;
+        if (!r->valid || r->sinceKey >= _keyInterval) {
+            memcpy(&r->data[0], field, fieldBytes);
+            r->valid = true;
+            r->sequence = sequence;
+            r->sinceKey = 0;
+            return 0;
+        }
+
+        int bitmapBytes = vbiDeltaBitmapBytes(_lines);
+        payload->reserve(sizeof(VbiDeltaHeader) + bitmapBytes + fieldBytes);
+        payload->resize(sizeof(VbiDeltaHeader) + bitmapBytes);
+        memset(&(*payload)[sizeof(VbiDeltaHeader)], 0, bitmapBytes);
+        int stored = 0;
+        for (int line = 0; line < _lines; ++line) {
+            const uint8_t* p = field + line*_bytesPerLine;
+            uint8_t* q = &r->data[line*_bytesPerLine];
+            if (!vbiLineDiffers(p, q, _bytesPerLine, _threshold))
+                continue;
+            (*payload)[sizeof(VbiDeltaHeader) + line/8] |= 1 << (line & 7);
+            payload->insert(payload->end(), p, p + _bytesPerLine);
+            // keep the reference the same as what the decoder will have
+            memcpy(q, p, _bytesPerLine);
+            ++stored;
+        }
+        VbiDeltaHeader* header = reinterpret_cast<VbiDeltaHeader*>(&(*payload)[0]);
+        header->referenceSequence = r->sequence;
+        header->storedLines = stored;
+        r->sequence = sequence;
+        ++r->sinceKey;
+        if (static_cast<int>(payload->size()) >= fieldBytes) {
+            // nothing to gain - store the field whole, which the decoder
+            // will then use as its reference
+            memcpy(&r->data[0], field, fieldBytes);
+            r->sinceKey = 0;
+            return 0;
+        }
+        return VBICAP_FIELD_DELTA;
+    }
+
+private:
+    struct Reference
+    {
+        bool valid;
+        uint32_t sequence;
+        int sinceKey;
+        std::vector<uint8_t> data;
+    };
+
+    int _lines;
+    int _bytesPerLine;
+    int _threshold;
+    int _keyInterval;
+    Reference _references[2];  // by parity
+};
+
+class VbiDeltaDecoder
+{
+public:
+    VbiDeltaDecoder(int linesPerField, int bytesPerLine)
+      : _lines(linesPerField), _bytesPerLine(bytesPerLine)
+    {
+        for (int i = 0; i < 2; ++i) {
+            _references[i].valid = false;
+            _references[i].data.resize(linesPerField*bytesPerLine);
+        }
+    }
+
+    // Reconstruct a field into field (linesPerField*bytesPerLine bytes).
+    // Returns false if the reference field isn't available, e.g. because the
+    // file was cut, or the payload is corrupt.
+    bool decode(const VbiFieldHeader& header, const uint8_t* payload, uint8_t* field)
+    {
+        Reference* r = &_references[(header.flags & VBICAP_FIELD_ODD) != 0 ? 1 : 0];
+        int fieldBytes = _lines*_bytesPerLine;
+        if ((header.flags & VBICAP_FIELD_DELTA) == 0) {
+            if (header.dataBytes != static_cast<uint32_t>(fieldBytes))
+                return false;
+            memcpy(field, payload, fieldBytes);
+            memcpy(&r->data[0], payload, fieldBytes);
+            r->valid = true;
+            r->sequence = header.sequence;
+            return true;
+        }
+        int bitmapBytes = vbiDeltaBitmapBytes(_lines);
+        if (header.dataBytes < sizeof(VbiDeltaHeader) + bitmapBytes)
+            return false;
+        const VbiDeltaHeader* delta = reinterpret_cast<const VbiDeltaHeader*>(payload);
+        if (!r->valid || delta->referenceSequence != r->sequence ||
+            static_cast<uint64_t>(header.dataBytes) != sizeof(VbiDeltaHeader) + bitmapBytes +
+            static_cast<uint64_t>(delta->storedLines)*_bytesPerLine)
+            return false;
+        // the lines copied are the ones marked in the bitmap, so there must
+        // be as many of them as the payload has room for
+        const uint8_t* bitmap = payload + sizeof(VbiDeltaHeader);
+        uint32_t marked = 0;
+        for (int line = 0; line < _lines; ++line)
+            marked += (bitmap[line/8] >> (line & 7)) & 1;
+        if (marked != delta->storedLines)
+            return false;
+        const uint8_t* p = bitmap + bitmapBytes;
+        for (int line = 0; line < _lines; ++line) {
+            if ((bitmap[line/8] & (1 << (line & 7))) == 0)
+                continue;
+            memcpy(&r->data[line*_bytesPerLine], p, _bytesPerLine);
+            p += _bytesPerLine;
+        }
+        memcpy(field, &r->data[0], fieldBytes);
+        r->sequence = header.sequence;
+        return true;
+    }
+
+private:
+    struct Reference
+    {
+        bool valid;
+        uint32_t sequence;
+        std::vector<uint8_t> data;
+    };
+
+    int _lines;
+    int _bytesPerLine;
+    Reference _references[2];  // by parity
+};
+
+#endif // INCLUDED_VBICAP_DELTA_H
@@ -0,0 +1,376 @@
+#ifndef INCLUDED_VBICAP_FILE_H
+#define INCLUDED_VBICAP_FILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+#include "vbicap_delta.h"
+
+// ----------------------------------------------------------------------------
+// Reading and writing capture files
+//
+// A capture is either a .vbi file (the tagged stream, see vbicap_protocol.h)
+// or a raw file of fields with no headers, like output.dat. VbiFileReader
+// reads either and always returns whole fields, undoing any delta coding.
+
+// Fill in a stream header for a raw file with the default geometry
+inline void vbiDefaultStreamHeader(VbiStreamHeader* header, int linesPerField, int bytesPerLine)
+{
+    memset(header, 0, sizeof(VbiStreamHeader));
+    header->magic = VBICAP_STREAM_MAGIC;
+    header->version = VBICAP_STREAM_VERSION;
+    header->headerBytes = sizeof(VbiStreamHeader);
+    header->linesPerField = linesPerField;
+    header->bytesPerLine = bytesPerLine;
+    header->fieldLines = linesPerField;
+    header->fieldSamples = bytesPerLine;
+    header->sampleBits = 8;
+    header->averagedFields = 1;
+    header->samplesPerCycle = 8;
+}
+
+class VbiFileReader
+{
+public:
+    VbiFileReader() : _file(NULL), _fileBytes(0), _raw(false), _fields(0), _decoder(0, 0), _haveLevels(false),
+        _levelsSequence(0), _haveBursts(false), _burstsSequence(0), _haveVideo(false), _videoSequence(0),
+        _haveAudio(false), _audioSequence(0) { }
+    ~VbiFileReader() { close(); }
+
+    // Open a capture. If it doesn't start with a stream header it's taken to
+    // be raw fields of linesPerField lines of bytesPerLine bytes.
+    bool open(const char* path, int linesPerField = 450, int bytesPerLine = 1024)
+    {
+        close();
+        _file = fopen(path, "rb");
+        if (_file == NULL)
+            return false;
+        _fields = 0;
+        _fseeki64(_file, 0, SEEK_END);
+        _fileBytes = _ftelli64(_file);
+        _fseeki64(_file, 0, SEEK_SET);
+        memset(&_header, 0, sizeof(_header));
+        size_t got = fread(&_header, 1, sizeof(uint32_t)*3, _file);
+        if (got == sizeof(uint32_t)*3 && _header.magic == VBICAP_STREAM_MAGIC) {
+            // older versions have shorter headers
+            uint32_t bytes = _header.headerBytes;
+            if (bytes < sizeof(uint32_t)*5) {
+                close();
+                return false;
+            }
+            size_t keep = (bytes < sizeof(VbiStreamHeader) ? bytes : sizeof(VbiStreamHeader));
+            if (fread(reinterpret_cast<uint8_t*>(&_header) + sizeof(uint32_t)*3, 1,
+                keep - sizeof(uint32_t)*3, _file) != keep - sizeof(uint32_t)*3) {
+                close();
+                return false;
+            }
+            if (!skip(bytes - keep)) {
+                close();
+                return false;
+            }
+            if (_header.fieldLines == 0) {
+                _header.fieldLines = _header.linesPerField;
+                _header.fieldSamples = _header.bytesPerLine;
+            }
+            if (_header.sampleBits == 0) {
+                _header.sampleBits = 8;
+                _header.averagedFields = 1;
+            }
+            if (_header.samplesPerCycle == 0)
+                _header.samplesPerCycle = 8;
+            _raw = false;
+        }
+        else {
+            _fseeki64(_file, 0, SEEK_SET);
+            vbiDefaultStreamHeader(&_header, linesPerField, bytesPerLine);
+            _raw = true;
+        }
+        _decoder = VbiDeltaDecoder(_header.linesPerField, _header.bytesPerLine);
+        return true;
+    }
+
+    void close()
+    {
+        if (_file != NULL)
+            fclose(_file);
+        _file = NULL;
+    }
+
+    const VbiStreamHeader& streamHeader() const { return _header; }
+    int fieldBytes() const { return _header.linesPerField*_header.bytesPerLine; }
+
+    // Read the next field into field, which is resized to fieldBytes().
+    // header->dataBytes is the size of the whole field and VBICAP_FIELD_DELTA
+    // is never set. Returns false at the end of the file or if a field can't
+    // be reconstructed.
+    bool next(VbiFieldHeader* header, std::vector<uint8_t>* field)
+    {
+        field->resize(fieldBytes());
+        if (_raw) {
+            if (fread(&(*field)[0], 1, fieldBytes(), _file) != static_cast<size_t>(fieldBytes()))
+                return false;
+            header->magic = VBICAP_FIELD_MAGIC;
+            header->sequence = _fields;
+            header->flags = ((_fields & 1) != 0 ? VBICAP_FIELD_ODD : 0);
+            header->dataBytes = fieldBytes();
+            ++_fields;
+            return true;
+        }
+        _haveLevels = false;
+        _haveBursts = false;
+        _haveVideo = false;
+        _haveAudio = false;
+        while (true) {
+            if (fread(header, 1, sizeof(VbiFieldHeader), _file) != sizeof(VbiFieldHeader))
+                return false;
+            if (header->magic == VBICAP_LEVELS_MAGIC && header->dataBytes == sizeof(VbiFieldLevels)) {
+                if (fread(&_levels, 1, sizeof(VbiFieldLevels), _file) != sizeof(VbiFieldLevels))
+                    return false;
+                _haveLevels = true;
+                _levelsSequence = header->sequence;
+            }
+            else if (header->magic == VBICAP_BURST_MAGIC && header->dataBytes >= sizeof(uint32_t)) {
+                uint32_t lines;
+                if (fread(&lines, 1, sizeof(uint32_t), _file) != sizeof(uint32_t) ||
+                    lines > (header->dataBytes - sizeof(uint32_t))/sizeof(VbiBurstLine))
+                    return false;
+                _bursts.resize(lines);
+                if (lines != 0 && fread(&_bursts[0], sizeof(VbiBurstLine), lines, _file) != lines)
+                    return false;
+                if (!skip(header->dataBytes - sizeof(uint32_t) - lines*sizeof(VbiBurstLine)))
+                    return false;
+                _haveBursts = true;
+                _burstsSequence = header->sequence;
+            }
+            else if (header->magic == VBICAP_VIDEO_MAGIC && header->dataBytes == videoBytes()) {
+                _video.resize(videoBytes());
+                if (videoBytes() != 0 && fread(&_video[0], 1, videoBytes(), _file) != videoBytes())
+                    return false;
+                _haveVideo = true;
+                _videoSequence = header->sequence;
+            }
+            else if (header->magic == VBICAP_AUDIO_MAGIC && header->dataBytes >= sizeof(VbiAudioHeader)) {
+                if (fread(&_audioHeader, 1, sizeof(VbiAudioHeader), _file) != sizeof(VbiAudioHeader) ||
+                    _audioHeader.samples > (header->dataBytes - sizeof(VbiAudioHeader))/sizeof(int16_t))
+                    return false;
+                _audio.resize(_audioHeader.samples);
+                if (_audioHeader.samples != 0 &&
+                    fread(&_audio[0], sizeof(int16_t), _audioHeader.samples, _file) != _audioHeader.samples)
+                    return false;
+                if (!skip(header->dataBytes - sizeof(VbiAudioHeader) - _audioHeader.samples*sizeof(int16_t)))
+                    return false;
+                _haveAudio = true;
+                _audioSequence = header->sequence;
+            }
+            else if (header->magic == VBICAP_PAD_MAGIC || header->magic == VBICAP_LEVELS_MAGIC ||
+                header->magic == VBICAP_BURST_MAGIC || header->magic == VBICAP_VIDEO_MAGIC ||
+                header->magic == VBICAP_AUDIO_MAGIC) {
+                if (!skip(header->dataBytes))
+                    return false;
+            }
+            else
+                break;
+        }
+        if (header->magic != VBICAP_FIELD_MAGIC)
+            return false;
+        _haveLevels = _haveLevels && _levelsSequence == header->sequence;
+        _haveBursts = _haveBursts && _burstsSequence == header->sequence;
+        _haveVideo = _haveVideo && _videoSequence == header->sequence;
+        _haveAudio = _haveAudio && _audioSequence == header->sequence;
+        // a delta coded field is never bigger than the whole field with the
+        // delta header and bitmap in front
+        uint64_t wholeBytes = static_cast<uint64_t>(_header.linesPerField)*_header.bytesPerLine;
+        if ((header->flags & VBICAP_FIELD_DELTA) != 0) {
+            if (header->dataBytes > sizeof(VbiDeltaHeader) + vbiDeltaBitmapBytes(_header.linesPerField) + wholeBytes)
+                return false;
+        }
+        else if (header->dataBytes != wholeBytes)
+            return false;
+        if (header->dataBytes == 0)
+            return false;
+        _payload.resize(header->dataBytes);
+        if (fread(&_payload[0], 1, header->dataBytes, _file) != header->dataBytes)
+            return false;
+        if (!_decoder.decode(*header, &_payload[0], &(*field)[0]))
+            return false;
+        header->flags &= ~VBICAP_FIELD_DELTA;
+        header->dataBytes = fieldBytes();
+        ++_fields;
+        return true;
+    }
+
+    // The signal levels of the field read last, or NULL if the file didn't
+    // have them
+    const VbiFieldLevels* levels() const { return _haveLevels ? &_levels : NULL; }
+
+    // The colour bursts of the lines of the field read last (see
+    // vbicap_burst.h), or NULL if the file didn't have them
+    const std::vector<VbiBurstLine>* bursts() const { return _haveBursts ? &_bursts : NULL; }
+
+    // The size of the decoded picture of each field, if the capture has one
+    uint32_t videoBytes() const { return _header.videoWidth*2*_header.videoLines; }
+
+    // The decoded picture of the field read last (see VBICAP_VIDEO_MAGIC),
+    // or NULL if the file didn't have it
+    const std::vector<uint8_t>* video() const { return _haveVideo ? &_video : NULL; }
+
+    // The audio samples that came with the field read last (see
+    // VBICAP_AUDIO_MAGIC), or NULL if the file didn't have them, and the
+    // position of the first of them in the capture
+    const std::vector<int16_t>* audio() const { return _haveAudio ? &_audio : NULL; }
+    uint32_t audioPosition() const { return _audioHeader.position; }
+
+private:
+    // Skip bytes of the file, failing if that would go past its end
+    bool skip(uint64_t bytes)
+    {
+        long long position = _ftelli64(_file);
+        if (position < 0 || position > _fileBytes ||
+            bytes > static_cast<uint64_t>(_fileBytes - position))
+            return false;
+        return _fseeki64(_file, static_cast<long long>(bytes), SEEK_CUR) == 0;
+    }
+
+    FILE* _file;
+    long long _fileBytes;
+    bool _raw;
+    uint32_t _fields;
+    VbiStreamHeader _header;
+    VbiDeltaDecoder _decoder;
+    std::vector<uint8_t> _payload;
+    VbiFieldLevels _levels;
+    bool _haveLevels;
+    uint32_t _levelsSequence;
+    std::vector<VbiBurstLine> _bursts;
+    bool _haveBursts;
+    uint32_t _burstsSequence;
+    std::vector<uint8_t> _video;
+    bool _haveVideo;
+    uint32_t _videoSequence;
+    std::vector<int16_t> _audio;
+    VbiAudioHeader _audioHeader;
+    bool _haveAudio;
+    uint32_t _audioSequence;
+};
+
+class VbiFileWriter
+{
+public:
+    VbiFileWriter() : _file(NULL), _encoder(NULL), _bytesWritten(0) { }
+    ~VbiFileWriter() { close(); }
+
+    // Create a .vbi file. If deltaThreshold is non-negative, fields are delta
+    // coded against the previous field of the same parity, treating lines
+    // that differ by no more than deltaThreshold in every sample as unchanged
+    // (so 0 is lossless).
+    bool open(const char* path, const VbiStreamHeader& header, int deltaThreshold = -1, int keyInterval = 600)
+    {
+        close();
+        _file = fopen(path, "wb");
+        if (_file == NULL)
+            return false;
+        _header = header;
+        _header.headerBytes = sizeof(VbiStreamHeader);
+        _header.version = VBICAP_STREAM_VERSION;
+        if (deltaThreshold >= 0) {
+            _encoder = new VbiDeltaEncoder(header.linesPerField, header.bytesPerLine,
+                deltaThreshold, keyInterval);
+        }
+        _bytesWritten = 0;
+        return write(&_header, sizeof(VbiStreamHeader));
+    }
+
+    void close()
+    {
+        if (_file != NULL)
+            fclose(_file);
+        _file = NULL;
+        delete _encoder;
+        _encoder = NULL;
+    }
+
+    // Write a whole field, delta coding it if enabled.
+    bool writeField(const VbiFieldHeader& header, const uint8_t* field)
+    {
+        VbiFieldHeader h = header;
+        const uint8_t* data = field;
+        if (_encoder != NULL && _encoder->encode(h.sequence, h.flags, field, &_payload) != 0) {
+            h.flags |= VBICAP_FIELD_DELTA;
+            h.dataBytes = static_cast<uint32_t>(_payload.size());
+            data = &_payload[0];
+        }
+        return write(&h, sizeof(VbiFieldHeader)) && write(data, h.dataBytes);
+    }
+
+    // Write the signal levels of the field with the given sequence number,
+    // which must be written next.
+    bool writeLevels(uint32_t sequence, const VbiFieldLevels& levels)
+    {
+        VbiFieldHeader h;
+        h.magic = VBICAP_LEVELS_MAGIC;
+        h.sequence = sequence;
+        h.flags = 0;
+        h.dataBytes = sizeof(VbiFieldLevels);
+        return write(&h, sizeof(VbiFieldHeader)) && write(&levels, sizeof(VbiFieldLevels));
+    }
+
+    // Write the colour bursts of the lines of the field with the given
+    // sequence number, which must be written next.
+    bool writeBursts(uint32_t sequence, const VbiBurstLine* lines, uint32_t count)
+    {
+        VbiFieldHeader h;
+        h.magic = VBICAP_BURST_MAGIC;
+        h.sequence = sequence;
+        h.flags = 0;
+        h.dataBytes = static_cast<uint32_t>(sizeof(uint32_t) + count*sizeof(VbiBurstLine));
+        return write(&h, sizeof(VbiFieldHeader)) && write(&count, sizeof(uint32_t)) &&
+            (count == 0 || write(lines, count*sizeof(VbiBurstLine)));
+    }
+
+    // Write the decoded picture of the field with the given sequence
+    // number, which must be written next.
+    bool writeVideo(uint32_t sequence, const uint8_t* video, uint32_t bytes)
+    {
+        VbiFieldHeader h;
+        h.magic = VBICAP_VIDEO_MAGIC;
+        h.sequence = sequence;
+        h.flags = 0;
+        h.dataBytes = bytes;
+        return write(&h, sizeof(VbiFieldHeader)) && (bytes == 0 || write(video, bytes));
+    }
+
+    // Write the audio samples that came with the field with the given
+    // sequence number, which must be written next.
+    bool writeAudio(uint32_t sequence, uint32_t position, const int16_t* samples, uint32_t count)
+    {
+        VbiFieldHeader h;
+        h.magic = VBICAP_AUDIO_MAGIC;
+        h.sequence = sequence;
+        h.flags = 0;
+        h.dataBytes = static_cast<uint32_t>(sizeof(VbiAudioHeader) + count*sizeof(int16_t));
+        VbiAudioHeader a;
+        a.position = position;
+        a.samples = count;
+        return write(&h, sizeof(VbiFieldHeader)) && write(&a, sizeof(VbiAudioHeader)) &&
+            (count == 0 || write(samples, count*sizeof(int16_t)));
+    }
+
+    long long bytesWritten() const { return _bytesWritten; }
+
+private:
+    bool write(const void* data, size_t bytes)
+    {
+        _bytesWritten += bytes;
+        return fwrite(data, 1, bytes, _file) == bytes;
+    }
+
+    FILE* _file;
+    VbiStreamHeader _header;
+    VbiDeltaEncoder* _encoder;
+    std::vector<uint8_t> _payload;
+    long long _bytesWritten;
+};
+
+#endif // INCLUDED_VBICAP_FILE_H
@@ -0,0 +1,156 @@
+#ifndef INCLUDED_VBICAP_FRAME_H
+#define INCLUDED_VBICAP_FRAME_H
+
+#include <emmintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Interlaced frames
+//
+// An interlaced frame is two consecutive fields of opposite parity, with the
+// scanlines of the second between those of the first. VbiFrameAssembler
+// pairs the fields of a stream (from the VBICAP_FIELD_ODD flag and the
+// sequence numbers) and hands out each frame as a VbiFrame: a view of the
+// scanlines of the two field buffers in frame order, so the samples aren't
+// copied. Each field is cut into scanlines of lineSamples samples (1820 for
+// broadcast NTSC), as the comb filter and the previews treat it.
+//
+// The daemon sets VBICAP_FIELD_ODD from the slot of its DMA ring the field
+// was captured into rather than from a field counter: the RISC program syncs
+// on VRE before each even slot and VRO before each odd one, so the slots
+// alternate in parity as the fields do.
+//
+// A field can only be paired with the one after it: if the one after it is
+// missing (the sequence number skips, or the field is marked
+// VBICAP_FIELD_DISCONTINUITY because the daemon lost fields before it) or has
+// the same parity, the first field is given back unpaired, and pairing
+// starts again from the next field that can start a frame. So a gap never
+// makes a frame from fields of different frames.
+//
+// The assembler doesn't own the field buffers. Fields stay in use while
+// they're waiting to be paired or in a frame, and add() says when each can be
+// given back (with vbiClientRelease() for fields from the client library,
+// which must return VBICAP_CALLBACK_KEEP for them).
+
+typedef struct
+{
+    const uint8_t* data;  // the samples
+    uint32_t sequence;    // from the field's VbiFieldHeader
+    uint32_t flags;
+    void* context;        // for the caller, e.g. the VbiClientField it came from
+} VbiFrameField;
+
+class VbiFrame
+{
+public:
+    // The field whose scanlines come first (0) or second (1)
+    const VbiFrameField& field(int i) const { return _fields[i]; }
+
+    int lines() const { return _lines; }
+    int lineBytes() const { return _lineBytes; }
+
+    // The samples of scanline y of the frame
+    const uint8_t* line(int y) const { return _fields[y & 1].data + (y >> 1)*_lineBytes; }
+
+    // Copy the frame to output (lines()*lineBytes() bytes), one scanline
+    // after another. Only needed by code that can't work through line().
+    // The frame is written straight to memory rather than through the
+    // cache, since it's usually too big to stay there anyway.
+    void weave(uint8_t* output) const
+    {
+        for (int y = 0; y < _lines; ++y, output += _lineBytes) {
+            const uint8_t* in = line(y);
+            int i = 0;
+            if ((reinterpret_cast<uintptr_t>(output) & 15) == 0) {
+                for (; i + 64 <= _lineBytes; i += 64) {
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16));
+                    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 32));
+                    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 48));
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(output + i), a);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(output + i + 16), b);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(output + i + 32), c);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(output + i + 48), d);
+                }
+            }
+            memcpy(output + i, in + i, _lineBytes - i);
+        }
+        _mm_sfence();
+    }
+
+private:
+    friend class VbiFrameAssembler;
+
+    VbiFrameField _fields[2];
+    int _lines;
+    int _lineBytes;
+};
+
+class VbiFrameAssembler
+{
+public:
+    // Frames of fields with the given stream header, cut into scanlines of
+    // lineSamples samples. With oddFirst the odd fields' scanlines come first.
+    VbiFrameAssembler(const VbiStreamHeader& streamHeader, int lineSamples, bool oddFirst = false)
+      : _firstParity(oddFirst ? VBICAP_FIELD_ODD : 0), _waiting(false)
+    {
+        _frame._lineBytes = lineSamples*(streamHeader.sampleBits/8);
+        int fieldBytes = streamHeader.linesPerField*streamHeader.bytesPerLine;
+        _frame._lines = (_frame._lineBytes == 0 ? 0 : fieldBytes/_frame._lineBytes*2);
+    }
+
+    // Add the next field of the stream. If it completes a frame, returns a
+    // view of it, which is valid until the next call; its two fields can be
+    // given back once the caller is done with the frame. Otherwise returns
+    // NULL. The fields which won't be part of a frame and can be given back
+    // now (the field that was waiting, if field can't be paired with it,
+    // and field itself if it can't start a frame) are written to unused,
+    // which must have room for 2, and their number to *unusedCount.
+    const VbiFrame* add(const VbiFrameField& field, VbiFrameField* unused, int* unusedCount)
+    {
+        *unusedCount = 0;
+        bool first = ((field.flags & VBICAP_FIELD_ODD) == _firstParity);
+        if (_waiting) {
+            bool follows = (field.sequence == _first.sequence + 1 &&
+                (field.flags & VBICAP_FIELD_DISCONTINUITY) == 0);
+            if (!first && follows) {
+                _waiting = false;
+                _frame._fields[0] = _first;
+                _frame._fields[1] = field;
+                return &_frame;
+            }
+            unused[(*unusedCount)++] = _first;
+            _waiting = false;
+        }
+        if (first) {
+            _first = field;
+            _waiting = true;
+        }
+        else
+            unused[(*unusedCount)++] = field;
+        return NULL;
+    }
+
+    // Give up on the field waiting to be paired, if there is one (at the
+    // end of a stream). Returns false if there isn't.
+    bool flush(VbiFrameField* unused)
+    {
+        if (!_waiting)
+            return false;
+        *unused = _first;
+        _waiting = false;
+        return true;
+    }
+
+private:
+    uint32_t _firstParity;
+    bool _waiting;
+    VbiFrameField _first;
+    VbiFrame _frame;
+};
+
+#endif // INCLUDED_VBICAP_FRAME_H
@@ -0,0 +1,134 @@
+#ifndef INCLUDED_VBICAP_LEVELS_H
+#define INCLUDED_VBICAP_LEVELS_H
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vbicap_protocol.h"
+#include "vbicap_burst.h"
+
+// ----------------------------------------------------------------------------
+// Signal level statistics
+//
+// VbiLevelMeter measures a field of 8-bit samples cheaply enough to do it for
+// every field as it's captured: a histogram of the samples (which includes
+// the clipped ones, at 0 and 255), and the sync tip level, blanking level and
+// colour burst amplitude after each horizontal sync pulse (found as
+// described in vbicap_burst.h). The tip is the mean of the middle half of
+// the pulse, and the blanking level the mean over the burst, which averages
+// out over whole cycles.
+
+class VbiLevelMeter
+{
+public:
+    VbiLevelMeter() { reset(); }
+
+    // Forget the fields measured so far (see total()).
+    void reset()
+    {
+        memset(_histogram, 0, sizeof(_histogram));
+        _fields = 0;
+        _pulses = 0;
+        _syncTip = 0;
+        _blanking = 0;
+        _burst = 0;
+    }
+
+    void measure(const uint8_t* samples, int count, VbiFieldLevels* levels)
+    {
+        histogram(samples, count, levels->histogram);
+        levels->clippedLow = levels->histogram[0];
+        levels->clippedHigh = levels->histogram[255];
+        for (int i = 0; i < 256; ++i)
+            _histogram[i] += levels->histogram[i];
+        ++_fields;
+
+        int threshold = vbiSyncThreshold(levels->histogram, count);
+        int pulses = 0;
+        double syncTip = 0, blanking = 0, burst = 0;
+        int start;
+        for (int end = 0; (end = vbiNextSync(samples, end, count, threshold, &start)) >= 0;) {
+            ++pulses;
+            int width = end - start;
+            syncTip += static_cast<double>(sum(samples + start + width/4, width/2))/(width/2);
+            int burstStart = end + VBI_BURST_START;
+            blanking += static_cast<double>(sum(samples + burstStart, VBI_BURST_SAMPLES))/VBI_BURST_SAMPLES;
+            double re, im;
+            vbiCorrelateBurst(samples, burstStart, &re, &im);
+            burst += 2*sqrt(re*re + im*im)/VBI_BURST_SAMPLES;
+        }
+        levels->syncPulses = pulses;
+        levels->syncTip = (pulses == 0 ? 0 : static_cast<uint32_t>(syncTip*256/pulses + 0.5));
+        levels->blanking = (pulses == 0 ? 0 : static_cast<uint32_t>(blanking*256/pulses + 0.5));
+        levels->burstAmplitude = (pulses == 0 ? 0 : static_cast<uint32_t>(burst*256/pulses + 0.5));
+        _pulses += pulses;
+        _syncTip += syncTip;
+        _blanking += blanking;
+        _burst += burst;
+    }
+
+    // The levels of all the fields measured since reset(), with the
+    // histogram in samples per field. Returns false if there weren't any.
+    bool total(VbiFieldLevels* levels) const
+    {
+        if (_fields == 0)
+            return false;
+        for (int i = 0; i < 256; ++i)
+            levels->histogram[i] = static_cast<uint32_t>((_histogram[i] + _fields/2)/_fields);
+        levels->clippedLow = levels->histogram[0];
+        levels->clippedHigh = levels->histogram[255];
+        levels->syncPulses = static_cast<uint32_t>(_pulses/_fields);
+        levels->syncTip = (_pulses == 0 ? 0 : static_cast<uint32_t>(_syncTip*256/_pulses + 0.5));
+        levels->blanking = (_pulses == 0 ? 0 : static_cast<uint32_t>(_blanking*256/_pulses + 0.5));
+        levels->burstAmplitude = (_pulses == 0 ? 0 : static_cast<uint32_t>(_burst*256/_pulses + 0.5));
+        return true;
+    }
+
+private:
+    // Count the samples at each level, into 4 tables so that runs of the
+    // same level don't wait on the previous increment
+    static void histogram(const uint8_t* samples, int count, uint32_t* h)
+    {
+        uint32_t tables[4][256];
+        memset(tables, 0, sizeof(tables));
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            uint32_t v;
+            memcpy(&v, samples + i, 4);
+            ++tables[0][v & 0xff];
+            ++tables[1][(v >> 8) & 0xff];
+            ++tables[2][(v >> 16) & 0xff];
+            ++tables[3][v >> 24];
+        }
+        for (; i < count; ++i)
+            ++tables[0][samples[i]];
+        for (int j = 0; j < 256; ++j)
+            h[j] = tables[0][j] + tables[1][j] + tables[2][j] + tables[3][j];
+    }
+
+    static int sum(const uint8_t* samples, int count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i total = zero;
+        int i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+            total = _mm_add_epi64(total, _mm_sad_epu8(x, zero));
+        }
+        int s = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+        for (; i < count; ++i)
+            s += samples[i];
+        return s;
+    }
+
+    long long _histogram[256];
+    long long _fields;
+    long long _pulses;
+    double _syncTip;
+    double _blanking;
+    double _burst;
+};
+
+#endif // INCLUDED_VBICAP_LEVELS_H
@@ -0,0 +1,118 @@
+#ifndef INCLUDED_VBICAP_PREVIEW_H
+#define INCLUDED_VBICAP_PREVIEW_H
+
+#include <emmintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "vbicap_protocol.h"
+
+// ----------------------------------------------------------------------------
+// Preview images
+//
+// VbiPreviewer makes a small luma image of a field for monitoring, cheaply
+// enough to do for every field: each pixel is the mean of a box of
+// VBI_PREVIEW_BOX_SAMPLES samples (two carrier cycles, so the chroma cancels
+// out) on each of VBI_PREVIEW_BOX_LINES scanlines, summed 16 at a time. The
+// field is taken as one signal, as the burst tracker treats it, cut into
+// scanlines of lineSamples samples (1824 for a CGA, 1820 for broadcast
+// NTSC). The image isn't aligned with sync, so the blanking shows up as dark
+// bands wherever it falls.
+
+#define VBI_PREVIEW_BOX_SAMPLES  16
+#define VBI_PREVIEW_BOX_LINES    2
+
+class VbiPreviewer
+{
+public:
+    // A previewer for fields of count samples
+    VbiPreviewer(int count, int lineSamples)
+      : _lineSamples(lineSamples),
+        _width(lineSamples/VBI_PREVIEW_BOX_SAMPLES),
+        _height(count/lineSamples/VBI_PREVIEW_BOX_LINES),
+        _sums(_width) { }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    // Make the preview of a field of lines lines of width samples, the
+    // starts of which are stride bytes apart, in image (width()*height()
+    // bytes). Rows beyond the end of a field shorter than the one given to
+    // the constructor are black.
+    void make(const uint8_t* field, int lines, int stride, int width, uint8_t* image)
+    {
+        int rows = static_cast<int>(static_cast<int64_t>(lines)*width/_lineSamples/VBI_PREVIEW_BOX_LINES);
+        if (rows > _height)
+            rows = _height;
+        memset(image + rows*_width, 0, (_height - rows)*_width);
+        const __m128i zero = _mm_setzero_si128();
+        for (int row = 0; row < rows; ++row, image += _width) {
+            memset(&_sums[0], 0, _width*sizeof(int));
+            for (int k = 0; k < VBI_PREVIEW_BOX_LINES; ++k) {
+                int start = (row*VBI_PREVIEW_BOX_LINES + k)*_lineSamples;
+                for (int x = 0; x < _width; ++x) {
+                    int i = start + x*VBI_PREVIEW_BOX_SAMPLES;
+                    int offset = i%width;
+                    const uint8_t* p = field + (i/width)*stride + offset;
+                    if (offset + VBI_PREVIEW_BOX_SAMPLES <= width) {
+                        __m128i s = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), zero);
+                        _sums[x] += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+                    }
+                    else {
+                        // the box is split between lines of the input
+                        for (int j = 0; j < VBI_PREVIEW_BOX_SAMPLES; ++j, ++i)
+                            _sums[x] += field[(i/width)*stride + i%width];
+                    }
+                }
+            }
+            const int n = VBI_PREVIEW_BOX_SAMPLES*VBI_PREVIEW_BOX_LINES;
+            for (int x = 0; x < _width; ++x)
+                image[x] = static_cast<uint8_t>((_sums[x] + n/2)/n);
+        }
+    }
+
+private:
+    int _lineSamples;
+    int _width;
+    int _height;
+    std::vector<int> _sums;
+};
+
+// Copy the latest preview out of a mapped preview board (see
+// VbiPreviewHeader) of mappedBytes bytes into image, which is resized to
+// fit, its size into *width and *height and its field's flags into *flags.
+// Returns the sequence number of the preview copied, or 0 if there isn't one
+// yet, the daemon kept replacing it or it doesn't fit in the mapping.
+inline uint32_t vbiCopyPreview(const VbiPreviewHeader* header, size_t mappedBytes,
+    std::vector<uint8_t>* image, uint32_t* width, uint32_t* height, uint32_t* flags)
+{
+    if (mappedBytes <= sizeof(VbiPreviewHeader))
+        return 0;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(header + 1);
+    for (int attempt = 0; attempt < 4; ++attempt) {
+        uint32_t before = header->sequence;
+        if (before == 0)
+            return 0;
+        if ((before & 1) != 0)
+            continue;
+        _mm_mfence();
+        uint32_t w = header->width;
+        uint32_t h = header->height;
+        uint64_t bytes = static_cast<uint64_t>(w)*h;
+        if (bytes == 0 || bytes > mappedBytes - sizeof(VbiPreviewHeader))
+            continue;
+        image->resize(static_cast<size_t>(bytes));
+        memcpy(&(*image)[0], data, static_cast<size_t>(bytes));
+        *flags = header->flags;
+        _mm_mfence();
+        if (header->sequence == before) {
+            *width = w;
+            *height = h;
+            return before;
+        }
+    }
+    return 0;
+}
+
+#endif // INCLUDED_VBICAP_PREVIEW_H
@@ -0,0 +1,140 @@
+#include "alfe/main.h"
+#include "../vbicap_preview.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        // vbicap_preview <prefix> [cards=<n>] [seconds=<n>] [interval=<ms>]
+        // Watches the previews published by the daemons for cards 0 to n-1
+        // (started with preview=<n>, see PreviewBoard in vbicap.cpp) and
+        // writes the latest one from each card to <prefix>_<card>.pgm
+        // whenever it changes. Boards are polled every interval
+        // milliseconds (default 100), so the daemons never wait for or
+        // signal the monitor. Runs for the given number of seconds (default
+        // 10, or 0 to run until stopped) and reports how many previews it
+        // saw from each card.
+        if (_arguments.count() < 2) {
+            console.write("Usage: vbicap_preview <prefix> [cards=<n>] [seconds=<n>] [interval=<ms>]\n");
+            return;
+        }
+        NullTerminatedString prefix(_arguments[1]);
+        int cards = 1;
+        int seconds = 10;
+        int interval = 100;
+        for (int i = 2; i < _arguments.count(); ++i) {
+            NullTerminatedString option(_arguments[i]);
+            const char* o = option;
+            if (strncmp(o, "cards=", 6) == 0)
+                cards = atoi(o + 6);
+            else if (strncmp(o, "seconds=", 8) == 0)
+                seconds = atoi(o + 8);
+            else if (strncmp(o, "interval=", 9) == 0)
+                interval = atoi(o + 9);
+            else
+                throw Exception(String("Unknown option ") + _arguments[i]);
+        }
+        if (cards < 1 || cards > 16)
+            throw Exception("cards must be between 1 and 16.");
+        if (interval < 1)
+            throw Exception("interval must be at least 1.");
+
+        std::vector<Board> boards(cards);
+        DWORD start = GetTickCount();
+        do {
+            for (int card = 0; card < cards; ++card)
+                poll(&boards[card], card, prefix);
+            Sleep(interval);
+        } while (seconds == 0 || GetTickCount() - start < static_cast<DWORD>(seconds)*1000);
+
+        for (int card = 0; card < cards; ++card) {
+            Board* board = &boards[card];
+            if (board->seen == 0) {
+                console.write(String("Card ") + decimal(card) + ": no previews\n");
+                continue;
+            }
+            console.write(String("Card ") + decimal(card) + ": " + decimal(board->seen) + " previews of " +
+                decimal(board->width) + "x" + decimal(board->height) + ", " +
+                decimal(board->damaged) + " of damaged fields\n");
+        }
+    }
+
+private:
+    struct Board
+    {
+        Board() : mapping(NULL), header(NULL), bytes(0), width(0), height(0), sequence(0), seen(0), damaged(0) { }
+        ~Board() { close(); }
+
+        void close()
+        {
+            if (header != NULL)
+                UnmapViewOfFile(header);
+            if (mapping != NULL)
+                CloseHandle(mapping);
+            header = NULL;
+            mapping = NULL;
+        }
+
+        HANDLE mapping;
+        const VbiPreviewHeader* header;
+        size_t bytes;  // of the view
+        std::vector<uint8_t> image;
+        uint32_t width;  // of the image copied last
+        uint32_t height;
+        uint32_t sequence;
+        int seen;
+        int damaged;
+    };
+
+    // Open card's board if it isn't open yet, and write its preview if
+    // there's a new one
+    void poll(Board* board, int card, const char* prefix)
+    {
+        if (board->header == NULL) {
+            char name[64];
+            _snprintf(name, sizeof(name), card == 0 ? "%s" : "%s%d", VBICAP_PREVIEW_NAME, card);
+            name[sizeof(name) - 1] = 0;
+            board->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+            if (board->mapping == NULL)
+                return;
+            board->header = static_cast<const VbiPreviewHeader*>(MapViewOfFile(board->mapping, FILE_MAP_READ, 0, 0, 0));
+            MEMORY_BASIC_INFORMATION information;
+            if (board->header == NULL || VirtualQuery(board->header, &information, sizeof(information)) == 0) {
+                board->close();
+                return;
+            }
+            board->bytes = information.RegionSize;
+        }
+        // the daemon writes the magic last, so try again later if it
+        // hasn't yet
+        if (board->header->magic != VBICAP_PREVIEW_MAGIC)
+            return;
+        uint32_t flags;
+        uint32_t sequence = vbiCopyPreview(board->header, board->bytes, &board->image,
+            &board->width, &board->height, &flags);
+        if (sequence == 0 || sequence == board->sequence)
+            return;
+        board->sequence = sequence;
+        ++board->seen;
+        if ((flags & VBICAP_FIELD_DAMAGED) != 0)
+            ++board->damaged;
+
+        char name[MAX_PATH];
+        _snprintf(name, sizeof(name), "%s_%d.pgm", prefix, card);
+        name[sizeof(name) - 1] = 0;
+        FILE* out = fopen(name, "wb");
+        if (out == NULL)
+            throw Exception(String("Can't create ") + name);
+        fprintf(out, "P5\n%u %u\n255\n", board->width, board->height);
+        size_t bytes = board->image.size();
+        bool written = (fwrite(&board->image[0], 1, bytes, out) == bytes);
+        fclose(out);
+        if (!written)
+            throw Exception(String("Can't write ") + name);
+    }
+};
@@ -0,0 +1,296 @@
+#ifndef INCLUDED_VBICAP_PROTOCOL_H
+#define INCLUDED_VBICAP_PROTOCOL_H
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Protocol spoken between the vbicap daemon and its clients
+//
+// A client connects to VBICAP_PIPE_NAME and writes a single int command. For
+// VBICAP_COMMAND_CAPTURE the daemon then writes raw fields back-to-back until
+// the client disconnects. For VBICAP_COMMAND_CAPTURE_TAGGED it first writes a
+// VbiStreamHeader and then each field as a VbiFieldHeader followed by
+// dataBytes bytes of samples, so that the client can tell which fields were
+// lost or damaged. For VBICAP_COMMAND_STATS it writes a VbiCaptureStats for
+// the capture session in progress (so far) or, between sessions, the most
+// recent one, and disconnects. During a session VBICAP_PIPE_NAME is busy, and
+// the daemon answers VBICAP_COMMAND_STATS (only) on VBICAP_STATS_PIPE_NAME
+// instead; between sessions that pipe doesn't exist.
+//
+// For VBICAP_COMMAND_RECORD the client follows the command with a
+// VbiRecordRequest and the daemon writes the fields to .vbi files itself.
+// When the requested number of fields has been recorded it writes a
+// VbiCaptureStats and disconnects; if the client disconnects first, the
+// recording stops.
+//
+// For VBICAP_COMMAND_CAPTURE_SHARED the client follows the command with a
+// VbiSharedRequest and the daemon replies with a VbiSharedReply naming a
+// file mapping holding a ring of fields (see VbiRingHeader) and an event
+// that it signals whenever it publishes one, so that the client can read
+// the fields where the daemon put them instead of copying them out of the
+// pipe. The pipe stays open for the rest of the session, which ends when
+// the client disconnects. Daemons which don't know the command disconnect
+// without replying.
+//
+// The daemon for card 0 listens on VBICAP_PIPE_NAME. A daemon started with
+// card=n for another card listens on VBICAP_PIPE_NAME followed by n, and
+// likewise for VBICAP_STATS_PIPE_NAME.
+
+#define VBICAP_PIPE_NAME "\\\\.\\pipe\\vbicap"
+#define VBICAP_STATS_PIPE_NAME "\\\\.\\pipe\\vbicap_stats"
+
+#define VBICAP_COMMAND_STOP            0
+#define VBICAP_COMMAND_CAPTURE         1
+#define VBICAP_COMMAND_CAPTURE_TAGGED  2
+#define VBICAP_COMMAND_STATS           3
+#define VBICAP_COMMAND_RECORD          4
+#define VBICAP_COMMAND_CAPTURE_SHARED  5
+
+#define VBICAP_STREAM_MAGIC    0x43494256  // "VBIC"
+#define VBICAP_FIELD_MAGIC     0x444c4946  // "FILD"
+#define VBICAP_PAD_MAGIC       0x44444150  // "PADD"
+#define VBICAP_LEVELS_MAGIC    0x4c56454c  // "LEVL"
+#define VBICAP_BURST_MAGIC     0x54535242  // "BRST"
+#define VBICAP_RING_MAGIC      0x474e4952  // "RING"
+#define VBICAP_VIDEO_MAGIC     0x45444956  // "VIDE"
+#define VBICAP_AUDIO_MAGIC     0x49445541  // "AUDI"
+#define VBICAP_STREAM_VERSION  6
+
+// A .vbi capture file is the tagged stream exactly as the daemon sends it,
+// except that it may also contain padding records: a VbiFieldHeader with
+// magic VBICAP_PAD_MAGIC followed by dataBytes bytes to be skipped. The
+// daemon's recorder uses them to keep each field on a page boundary.
+//
+// If the daemon was started with levels=1, each field of a tagged stream or
+// recording is preceded by a levels record: a VbiFieldHeader with magic
+// VBICAP_LEVELS_MAGIC and the field's sequence number, followed by a
+// VbiFieldLevels measured from the field (from the last field averaged, if
+// fields are averaged). Readers that don't want them skip them like padding.
+//
+// Similarly, with burst=1 each field is preceded by a burst record: a
+// VbiFieldHeader with magic VBICAP_BURST_MAGIC and the field's sequence
+// number, followed by a uint32_t number of lines and a VbiBurstLine for each
+// line. dataBytes may be more than that needs; the rest is unused.
+//
+// With video=1 the card decodes the picture as well, and each field is
+// preceded by a video record: a VbiFieldHeader with magic
+// VBICAP_VIDEO_MAGIC and the field's sequence number, followed by the
+// card's decoding of the same field, videoLines lines of videoWidth pixels
+// in YUV 4:2:2 (Y0 U Y1 V for each pair of pixels). The card can't send
+// both raw samples and pixels for a line, so the field itself then only has
+// the lines of the vertical blanking interval before the picture.
+//
+// With audio=1 a Bt878's audio function is captured too, and each field is
+// preceded by an audio record: a VbiFieldHeader with magic
+// VBICAP_AUDIO_MAGIC and the field's sequence number, followed by a
+// VbiAudioHeader and its samples, 16-bit signed little-endian mono at
+// audioRate samples per second. These are the samples the card finished
+// between the previous field and this one being delivered, so the sample
+// at position + samples in a record is the one being captured at about the
+// time the field completed (to within the card's block of audio and the
+// daemon's delay in noticing the field). A jump in position means samples
+// were lost. dataBytes may be more than the record needs; the rest is
+// unused.
+#define VBICAP_FILE_EXTENSION  ".vbi"
+
+typedef struct
+{
+    uint32_t magic;          // VBICAP_STREAM_MAGIC
+    uint32_t version;        // VBICAP_STREAM_VERSION
+    uint32_t headerBytes;    // sizeof(VbiStreamHeader) as sent
+    uint32_t linesPerField;  // lines of each field sent
+    uint32_t bytesPerLine;   // bytes of each line sent
+
+    // Version 2: where the lines sent are within the full field captured by
+    // the card, which is fieldLines lines of fieldSamples samples starting
+    // vdelay lines after vertical sync and hdelay samples after horizontal
+    // sync.
+    uint32_t firstLine;
+    uint32_t firstSample;
+    uint32_t fieldLines;
+    uint32_t fieldSamples;
+    uint32_t vdelay;
+    uint32_t hdelay;
+
+    // Version 3: each sample is sampleBits bits. Fields averaged over time
+    // (averagedFields fields of the same parity each) are 16 bits per sample,
+    // little-endian with 8 fractional bits, so that bytesPerLine is twice
+    // the number of samples per line. Otherwise this is 8 and 1.
+    uint32_t sampleBits;
+    uint32_t averagedFields;
+
+    // Version 4: samples per cycle of the colour carrier, 8 as captured or 4
+    // if the fields were decimated (see vbicap_decimate.h). firstSample,
+    // fieldSamples and hdelay are always in the card's samples.
+    uint32_t samplesPerCycle;
+
+    // Version 5: the size of the decoded picture in the video record before
+    // each field, or 0 if there isn't one.
+    uint32_t videoWidth;
+    uint32_t videoLines;
+
+    // Version 6: the nominal sample rate of the audio records, in samples
+    // per second, or 0 if there aren't any.
+    uint32_t audioRate;
+} VbiStreamHeader;
+
+// the field is odd (the first field after a vertical resync is even)
+#define VBICAP_FIELD_ODD            (1<<0)
+// one or more fields were lost immediately before this one
+#define VBICAP_FIELD_DISCONTINUITY  (1<<1)
+// the FIFO overflowed or had to resync while this field was captured
+#define VBICAP_FIELD_DAMAGED        (1<<2)
+// the data is a delta against an earlier field (see vbicap_delta.h). Only
+// used in .vbi files, never sent by the daemon.
+#define VBICAP_FIELD_DELTA          (1<<3)
+// the input (0-3 for MUX0-MUX3) the field was captured from, if the daemon
+// was started with inputs= to switch between several. The first field of
+// each turn of an input is marked VBICAP_FIELD_DISCONTINUITY, since the
+// fields of the other inputs and the fields captured while the card
+// settled after switching were left out.
+#define VBICAP_FIELD_INPUT_SHIFT    4
+#define VBICAP_FIELD_INPUT          (3<<VBICAP_FIELD_INPUT_SHIFT)
+
+typedef struct
+{
+    uint32_t magic;          // VBICAP_FIELD_MAGIC
+    uint32_t sequence;       // index of this field in the session
+    uint32_t flags;          // VBICAP_FIELD_*
+    uint32_t dataBytes;      // number of bytes of samples following the header
+} VbiFieldHeader;
+
+// Signal levels of a field (see vbicap_levels.h). Levels are in 1/256ths of
+// a sample level. The sync tip, blanking and burst are measured after each
+// horizontal sync pulse found, and are 0 if none were found.
+typedef struct
+{
+    uint32_t histogram[256];     // samples at each level
+    uint32_t clippedLow;         // samples at 0
+    uint32_t clippedHigh;        // samples at 255
+    uint32_t syncPulses;         // horizontal sync pulses measured
+    uint32_t syncTip;            // mean level of the bottom of the sync pulses
+    uint32_t blanking;           // mean level of the back porch
+    uint32_t burstAmplitude;     // mean amplitude (half peak-to-peak) of the colour burst
+} VbiFieldLevels;
+
+// The colour burst of a line (see vbicap_burst.h)
+typedef struct
+{
+    uint32_t position;           // index in the field of the first sample after the hsync
+    uint16_t phase;              // in 1/65536ths of a carrier cycle; the burst peaks at
+                                 // samples whose index is phase*n/65536 modulo n, for
+                                 // n samples per cycle
+    uint16_t amplitude;          // half the burst's peak-to-peak, in 1/256ths of a level
+} VbiBurstLine;
+
+// The start of an audio record's data
+typedef struct
+{
+    uint32_t position;           // index in the session of the first sample
+    uint32_t samples;            // number of samples following
+} VbiAudioHeader;
+
+typedef struct
+{
+    uint32_t fields;             // fields delivered to the client
+    uint32_t fieldRateMilliHz;   // measured field rate
+    uint32_t jitterMicroseconds; // RMS error of the field clock's predictions
+    uint32_t missedWakeups;      // wakeups that found the field not yet complete
+    uint32_t dmaErrors;          // INT_STAT error bits seen
+    uint32_t restarts;           // RISC engine restarts
+    uint32_t droppedFields;      // fields not recorded because the disk (or a
+                                 // shared ring's client) fell behind
+    uint32_t discontinuities;    // fields delivered with VBICAP_FIELD_DISCONTINUITY
+    uint32_t damagedFields;      // fields delivered with VBICAP_FIELD_DAMAGED
+    uint32_t maxLatencyMicroseconds;   // from a field's completion to its delivery
+    uint32_t meanLatencyMicroseconds;
+    uint32_t scenarioFailures;   // expectations of the fault injection scenario not met
+} VbiCaptureStats;
+
+typedef struct
+{
+    uint32_t fields;             // fields to record, 0 to record until the client disconnects
+    uint32_t segmentMegabytes;   // start a new file after this many MiB, 0 for the default
+    uint32_t segmentSeconds;     // start a new file after this many seconds, 0 for no limit
+    char pathPrefix[260];        // files are named <pathPrefix>_<n>.vbi, with n
+                                 // as 6 digits (<pathPrefix>_000000.vbi first);
+                                 // the daemon disconnects if they wouldn't be
+                                 // in one of its record directories
+} VbiRecordRequest;
+
+typedef struct
+{
+    uint32_t slots;              // slots in the ring, 0 for the default
+} VbiSharedRequest;
+
+typedef struct
+{
+    uint32_t ok;                 // 0 if the ring couldn't be created
+    char mapping[64];            // name of the file mapping
+    char event[64];              // name of the auto-reset event
+} VbiSharedReply;
+
+// The file mapping of a shared capture starts with a VbiRingHeader and an
+// array of a VbiRingSlot for each slot. The slots themselves start at
+// firstSlot, which is a multiple of VBICAP_RING_ALIGNMENT so that the client
+// can map them read-only, and are slotBytes apart. Each holds a field as it
+// would appear in a tagged stream: the records (levels, burst) if any, then
+// the VbiFieldHeader at fieldOffset, then the samples.
+//
+// The nth field published (counting from 0) goes in slot n % slots. The
+// daemon fills in the slot, sets its published to n + 1, and then sets the
+// header's published to n + 1. When the client has finished with the field
+// it sets the slot's released to the slot's published. The daemon only
+// reuses a slot once it has been released; if the next slot hasn't been, the
+// field is dropped and the next one published is marked as a discontinuity.
+// When the session ends the daemon sets over and signals the event.
+#define VBICAP_RING_ALIGNMENT  0x10000
+
+typedef struct
+{
+    uint32_t magic;              // VBICAP_RING_MAGIC
+    uint32_t slots;
+    uint32_t firstSlot;          // offset of the first slot in the mapping
+    uint32_t slotBytes;
+    uint32_t fieldOffset;        // offset of the VbiFieldHeader in each slot
+    volatile uint32_t published; // fields published so far
+    volatile uint32_t over;      // nonzero once no more will be
+    uint32_t reserved;
+    VbiStreamHeader streamHeader;
+} VbiRingHeader;
+
+typedef struct
+{
+    volatile uint32_t published;
+    volatile uint32_t released;
+} VbiRingSlot;
+
+// A daemon started with preview=<n> publishes a small luma image of every
+// nth field it captures (see vbicap_preview.h) in a file mapping named
+// VBICAP_PREVIEW_NAME, followed by the card number for cards other than 0,
+// for any number of monitors to map read-only. The mapping exists for as
+// long as the daemon runs; previews are only made during capture sessions.
+// It holds a VbiPreviewHeader followed by the image, width*height bytes
+// from the top left. The daemon makes sequence odd while it replaces the
+// image and even (and non-zero) once it has, so a monitor copies the image
+// and keeps the copy if sequence was the same even number before and after.
+// The size of the image can change between runs of the daemon (while
+// sequence is odd), so a monitor reads width and height along with the image
+// and checks them against the size of its view. The magic is written after
+// the rest of the header. There's no event; monitors poll sequence.
+#define VBICAP_PREVIEW_NAME   "Local\\vbicap_preview"
+#define VBICAP_PREVIEW_MAGIC  0x57565250  // "PRVW"
+
+typedef struct
+{
+    uint32_t magic;              // VBICAP_PREVIEW_MAGIC
+    uint32_t width;              // pixels per row
+    uint32_t height;             // rows
+    uint32_t boxSamples;         // samples averaged into each pixel along a scanline
+    uint32_t boxLines;           // and scanlines
+    uint32_t lineSamples;        // samples per scanline
+    volatile uint32_t sequence;  // twice the number of previews published
+    uint32_t flags;              // VBICAP_FIELD_* flags of the field shown
+} VbiPreviewHeader;
+
+#endif // INCLUDED_VBICAP_PROTOCOL_H
@@ -0,0 +1,263 @@
+#ifndef INCLUDED_VBICAP_SPECTRUM_H
+#define INCLUDED_VBICAP_SPECTRUM_H
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Power spectra of scanlines
+//
+// VbiSpectrum measures the average power spectrum of each band of scanlines
+// over the fields of a capture, for finding interference and checking what
+// the card's filters (LNOTCH, LDEC, the SCLOOP chroma filters) do. As for the
+// comb filter and the previews, a field is taken as one signal cut into
+// scanlines of lineSamples samples; the part of each scanline from left to
+// left + samples is multiplied by a Hann window, padded with zeros to a
+// power of two and Fourier transformed.
+//
+// The transforms are done 8 scanlines at a time: the scanlines are paired
+// up as the real and imaginary parts of 4 complex signals, which go through
+// a radix-2 FFT together, one in each lane of an SSE register, and are
+// separated again afterwards. The bit reversal order, window and twiddle
+// factors are worked out once in a VbiSpectrumPlan, which can be shared by
+// the VbiSpectrum of each thread, and the spectra of several VbiSpectrum
+// objects (of different parts of a capture, say) can be merged.
+//
+// Powers are scaled so that a sine wave of amplitude a levels (of an 8-bit
+// sample) in the middle of a bin gives a power of a*a, and a constant level
+// c gives c*c in bin 0.
+
+#define VBI_SPECTRUM_BATCH  8  // scanlines transformed together
+
+class VbiSpectrumPlan
+{
+public:
+    VbiSpectrumPlan(int samples)
+      : _samples(samples)
+    {
+        const double pi = 3.14159265358979;
+        _size = 1;
+        _bits = 0;
+        while (_size < samples) {
+            _size <<= 1;
+            ++_bits;
+        }
+        _reversed.resize(_size);
+        for (int i = 0; i < _size; ++i) {
+            int r = 0;
+            for (int b = 0; b < _bits; ++b)
+                r |= ((i >> b) & 1) << (_bits - 1 - b);
+            _reversed[i] = r;
+        }
+        _window.resize(samples);
+        double sum = 0;
+        for (int i = 0; i < samples; ++i) {
+            _window[i] = static_cast<float>(0.5 - 0.5*cos(2*pi*(i + 0.5)/samples));
+            sum += _window[i];
+        }
+        // the twiddles for the butterflies of span 2*half are at half to
+        // 2*half - 1, each repeated for the 4 lanes
+        _twiddles.resize(_size*8 + 4);
+        float* t = aligned(&_twiddles[0]);
+        for (int half = 1; half < _size; half <<= 1) {
+            for (int j = 0; j < half; ++j) {
+                float re = static_cast<float>(cos(pi*j/half));
+                float im = static_cast<float>(-sin(pi*j/half));
+                for (int lane = 0; lane < 4; ++lane) {
+                    t[(half + j)*8 + lane] = re;
+                    t[(half + j)*8 + 4 + lane] = im;
+                }
+            }
+        }
+        _scale = 4/(sum*sum);
+    }
+
+    // The samples windowed, and the size of the transform
+    int samples() const { return _samples; }
+    int size() const { return _size; }
+    // The number of bins in a spectrum, from 0 to half the sample rate
+    int bins() const { return _size/2 + 1; }
+
+private:
+    friend class VbiSpectrum;
+
+    static float* aligned(float* p)
+    {
+        return reinterpret_cast<float*>((reinterpret_cast<uintptr_t>(p) + 15) & ~static_cast<uintptr_t>(15));
+    }
+    const float* twiddles() const { return aligned(const_cast<float*>(&_twiddles[0])); }
+
+    int _samples;
+    int _size;
+    int _bits;
+    double _scale;
+    std::vector<int> _reversed;
+    std::vector<float> _window;
+    std::vector<float> _twiddles;
+};
+
+class VbiSpectrum
+{
+public:
+    // The spectra of fields of count samples cut into scanlines of
+    // lineSamples samples, each windowed from left as planned, averaged over
+    // bands of bandLines scanlines (the last band may have fewer).
+    VbiSpectrum(const VbiSpectrumPlan& plan, int count, int lineSamples, int left, int bandLines)
+      : _plan(plan), _lineSamples(lineSamples), _left(left),
+        _lines(count/lineSamples), _bandLines(bandLines), _fields(0)
+    {
+        _bands = (_lines + bandLines - 1)/bandLines;
+        _sums.resize(_bands*plan.bins());
+        _work.resize(plan.size()*8 + 4);
+        _power.resize(VBI_SPECTRUM_BATCH*plan.bins());
+    }
+
+    int lines() const { return _lines; }
+    int bands() const { return _bands; }
+    int fields() const { return _fields; }
+
+    // Add the spectra of the scanlines of a field of 8-bit or 16-bit (with
+    // 8 fractional bits) samples
+    void add(const uint8_t* field, int sampleBits)
+    {
+        for (int line = 0; line < _lines; line += VBI_SPECTRUM_BATCH) {
+            int n = (_lines - line < VBI_SPECTRUM_BATCH ? _lines - line : VBI_SPECTRUM_BATCH);
+            load(field, sampleBits, line, n);
+            transform();
+            separate();
+            for (int i = 0; i < n; ++i) {
+                double* sums = &_sums[((line + i)/_bandLines)*_plan.bins()];
+                const float* power = &_power[i*_plan.bins()];
+                for (int k = 0; k < _plan.bins(); ++k)
+                    sums[k] += power[k];
+            }
+        }
+        ++_fields;
+    }
+
+    // Add the fields measured by another VbiSpectrum of the same shape
+    void merge(const VbiSpectrum& other)
+    {
+        for (size_t i = 0; i < _sums.size(); ++i)
+            _sums[i] += other._sums[i];
+        _fields += other._fields;
+    }
+
+    // The average power in bin k of the scanlines of a band
+    double power(int band, int k) const
+    {
+        int first = band*_bandLines;
+        int lines = (_lines - first < _bandLines ? _lines - first : _bandLines);
+        if (_fields == 0 || lines <= 0)
+            return 0;
+        double scale = _plan._scale/(static_cast<double>(_fields)*lines);
+        // bin 0 has no negative frequency to share its power with
+        if (k == 0)
+            scale /= 4;
+        return _sums[band*_plan.bins() + k]*scale;
+    }
+
+private:
+    // The real part of lane i of the transform input is scanline first + i
+    // and the imaginary part is scanline first + 4 + i, placed in bit
+    // reversed order. Missing scanlines are left as zeros.
+    void load(const uint8_t* field, int sampleBits, int first, int n)
+    {
+        int size = _plan.size();
+        float* re = VbiSpectrumPlan::aligned(&_work[0]);
+        float* im = re + size*4;
+        memset(re, 0, size*8*sizeof(float));
+        const float* window = &_plan._window[0];
+        const int* reversed = &_plan._reversed[0];
+        int samples = _plan.samples();
+        for (int i = 0; i < n; ++i) {
+            float* out = (i < 4 ? re : im) + (i & 3);
+            int start = (first + i)*_lineSamples + _left;
+            if (sampleBits == 16) {
+                const uint8_t* p = field + start*2;
+                for (int j = 0; j < samples; ++j)
+                    out[reversed[j]*4] = window[j]*(p[j*2] + p[j*2 + 1]*256)*(1.0f/256);
+            }
+            else {
+                const uint8_t* p = field + start;
+                for (int j = 0; j < samples; ++j)
+                    out[reversed[j]*4] = window[j]*p[j];
+            }
+        }
+    }
+
+    // Radix-2 decimation in time on the 4 lanes at once
+    void transform()
+    {
+        int size = _plan.size();
+        float* re = VbiSpectrumPlan::aligned(&_work[0]);
+        float* im = re + size*4;
+        const float* twiddles = _plan.twiddles();
+        for (int half = 1; half < size; half <<= 1) {
+            for (int start = 0; start < size; start += half*2) {
+                for (int j = 0; j < half; ++j) {
+                    __m128 wr = _mm_load_ps(twiddles + (half + j)*8);
+                    __m128 wi = _mm_load_ps(twiddles + (half + j)*8 + 4);
+                    int a = (start + j)*4;
+                    int b = a + half*4;
+                    __m128 br = _mm_load_ps(re + b);
+                    __m128 bi = _mm_load_ps(im + b);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+                    __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+                    __m128 ar = _mm_load_ps(re + a);
+                    __m128 ai = _mm_load_ps(im + a);
+                    _mm_store_ps(re + b, _mm_sub_ps(ar, tr));
+                    _mm_store_ps(im + b, _mm_sub_ps(ai, ti));
+                    _mm_store_ps(re + a, _mm_add_ps(ar, tr));
+                    _mm_store_ps(im + a, _mm_add_ps(ai, ti));
+                }
+            }
+        }
+    }
+
+    // Split each lane's transform Z into those of its real part X and
+    // imaginary part Y, using X[k] = (Z[k] + conj(Z[-k]))/2 and
+    // Y[k] = (Z[k] - conj(Z[-k]))/2i, and write their powers to _power.
+    void separate()
+    {
+        int size = _plan.size();
+        int bins = _plan.bins();
+        const float* re = VbiSpectrumPlan::aligned(&_work[0]);
+        const float* im = re + size*4;
+        float x[4];
+        float y[4];
+        for (int k = 0; k < bins; ++k) {
+            int m = (size - k) & (size - 1);
+            __m128 zr = _mm_load_ps(re + k*4);
+            __m128 zi = _mm_load_ps(im + k*4);
+            __m128 cr = _mm_load_ps(re + m*4);
+            __m128 ci = _mm_load_ps(im + m*4);
+            __m128 xr = _mm_add_ps(zr, cr);
+            __m128 xi = _mm_sub_ps(zi, ci);
+            __m128 yr = _mm_add_ps(zi, ci);
+            __m128 yi = _mm_sub_ps(cr, zr);
+            _mm_storeu_ps(x, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(xr, xr), _mm_mul_ps(xi, xi)), _mm_set1_ps(0.25f)));
+            _mm_storeu_ps(y, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(yr, yr), _mm_mul_ps(yi, yi)), _mm_set1_ps(0.25f)));
+            for (int lane = 0; lane < 4; ++lane) {
+                _power[lane*bins + k] = x[lane];
+                _power[(lane + 4)*bins + k] = y[lane];
+            }
+        }
+    }
+
+    const VbiSpectrumPlan& _plan;
+    int _lineSamples;
+    int _left;
+    int _lines;
+    int _bandLines;
+    int _bands;
+    int _fields;
+    std::vector<double> _sums;
+    std::vector<float> _work;
+    std::vector<float> _power;
+};
+
+#endif // INCLUDED_VBICAP_SPECTRUM_H
@@ -0,0 +1,254 @@
+#include "alfe/main.h"
+#include "../vbicap_file.h"
+#include "../vbicap_spectrum.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define FIELDS_PER_BATCH  16  // fields handed to a worker at a time
+
+// A batch of fields read from the capture, waiting for or being analysed by
+// a worker
+struct Batch
+{
+    std::vector<std::vector<uint8_t> > fields;
+    int count;
+};
+
+// The reader fills empty batches and queues them for the workers, which give
+// them back once they're done with them. Reading a capture can't be shared
+// out (delta coded fields depend on the ones before), but transforming the
+// fields is much slower than reading them, so one reader keeps the workers
+// busy.
+class BatchQueue
+{
+public:
+    BatchQueue(int batches) : _batches(batches)
+    {
+        InitializeCriticalSection(&_lock);
+        _emptySemaphore = CreateSemaphore(NULL, batches, batches, NULL);
+        IF_NULL_THROW(_emptySemaphore);
+        _fullSemaphore = CreateSemaphore(NULL, 0, batches + MAXIMUM_WAIT_OBJECTS, NULL);
+        IF_NULL_THROW(_fullSemaphore);
+        for (int i = 0; i < batches; ++i)
+            _empty.push_back(&_batches[i]);
+    }
+    ~BatchQueue()
+    {
+        CloseHandle(_fullSemaphore);
+        CloseHandle(_emptySemaphore);
+        DeleteCriticalSection(&_lock);
+    }
+
+    // Wait for a batch to fill
+    Batch* empty() { return take(_emptySemaphore, &_empty); }
+    void fill(Batch* batch) { give(_fullSemaphore, &_full, batch); }
+
+    // Wait for a batch to analyse. NULL means there are no more.
+    Batch* full() { return take(_fullSemaphore, &_full); }
+    void done(Batch* batch) { give(_emptySemaphore, &_empty, batch); }
+
+private:
+    Batch* take(HANDLE semaphore, std::vector<Batch*>* list)
+    {
+        WaitForSingleObject(semaphore, INFINITE);
+        EnterCriticalSection(&_lock);
+        Batch* batch = list->front();
+        list->erase(list->begin());
+        LeaveCriticalSection(&_lock);
+        return batch;
+    }
+    void give(HANDLE semaphore, std::vector<Batch*>* list, Batch* batch)
+    {
+        EnterCriticalSection(&_lock);
+        list->push_back(batch);
+        LeaveCriticalSection(&_lock);
+        ReleaseSemaphore(semaphore, 1, NULL);
+    }
+
+    std::vector<Batch> _batches;
+    std::vector<Batch*> _empty;
+    std::vector<Batch*> _full;
+    CRITICAL_SECTION _lock;
+    HANDLE _emptySemaphore;
+    HANDLE _fullSemaphore;
+};
+
+// Each worker adds the fields it's given to a spectrum of its own, and the
+// spectra are merged at the end.
+struct Worker
+{
+    BatchQueue* queue;
+    VbiSpectrum* spectrum;
+    int sampleBits;
+};
+
+static DWORD WINAPI worker(LPVOID parameter)
+{
+    Worker* work = static_cast<Worker*>(parameter);
+    for (;;) {
+        Batch* batch = work->queue->full();
+        if (batch == NULL)
+            break;
+        for (int i = 0; i < batch->count; ++i)
+            work->spectrum->add(&batch->fields[i][0], work->sampleBits);
+        work->queue->done(batch);
+    }
+    return 0;
+}
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        // vbicap_spectrum <input> <output.csv> [line=<samples>] [left=<sample>]
+        //     [samples=<n>] [band=<lines>] [fields=<n>] [threads=<n>]
+        // Measures the average power spectrum of each band of band lines
+        // (default 1, so each scanline) over the fields of a capture (see
+        // vbicap_spectrum.h). Each field is cut into scanlines of line
+        // samples (default 1824 for a CGA at 8 samples per carrier cycle,
+        // or 1820 for broadcast NTSC), and samples samples (default all of
+        // them) from left of each scanline are transformed. Only the first
+        // n fields are used if fields is given. The output has a row for
+        // each frequency bin, with the frequency in MHz and then the power
+        // of each band in dB (0dB is a sine wave with an amplitude of one
+        // level of an 8-bit sample).
+        if (_arguments.count() < 3) {
+            console.write("Usage: vbicap_spectrum <input> <output.csv> [line=<samples>] [left=<sample>]\n"
+                "    [samples=<n>] [band=<lines>] [fields=<n>] [threads=<n>]\n");
+            return;
+        }
+        NullTerminatedString inputName(_arguments[1]);
+        NullTerminatedString outputName(_arguments[2]);
+        int line = 0;
+        int left = 0;
+        int samples = 0;
+        int band = 1;
+        int maxFields = 0;
+        int threads = 0;
+        for (int i = 3; i < _arguments.count(); ++i) {
+            NullTerminatedString argument(_arguments[i]);
+            const char* a = argument;
+            if (strncmp(a, "line=", 5) == 0)
+                line = atoi(a + 5);
+            else if (strncmp(a, "left=", 5) == 0)
+                left = atoi(a + 5);
+            else if (strncmp(a, "samples=", 8) == 0)
+                samples = atoi(a + 8);
+            else if (strncmp(a, "band=", 5) == 0)
+                band = atoi(a + 5);
+            else if (strncmp(a, "fields=", 7) == 0)
+                maxFields = atoi(a + 7);
+            else if (strncmp(a, "threads=", 8) == 0)
+                threads = atoi(a + 8);
+            else
+                throw Exception(String("Unknown option ") + _arguments[i]);
+        }
+
+        VbiFileReader reader;
+        if (!reader.open(inputName))
+            throw Exception(String("Can't read ") + _arguments[1]);
+        const VbiStreamHeader& streamHeader = reader.streamHeader();
+        int sampleBits = streamHeader.sampleBits;
+        if (sampleBits != 8 && sampleBits != 16)
+            throw Exception("Samples must be 8 or 16 bits.");
+        if (line == 0)
+            line = 1824*streamHeader.samplesPerCycle/8;
+        if (samples == 0)
+            samples = line - left;
+        int count = reader.fieldBytes()/(sampleBits/8);
+        if (line <= 0 || line > count)
+            throw Exception("line must be between 1 and the number of samples in a field.");
+        if (left < 0 || samples <= 0 || left + samples > line)
+            throw Exception("The samples transformed must be within a line.");
+        if (band < 1)
+            throw Exception("band must be at least 1.");
+
+        if (threads <= 0) {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            threads = info.dwNumberOfProcessors;
+        }
+        if (threads > MAXIMUM_WAIT_OBJECTS)
+            threads = MAXIMUM_WAIT_OBJECTS;
+
+        LARGE_INTEGER frequency, start, end;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        VbiSpectrumPlan plan(samples);
+        std::vector<VbiSpectrum> spectra(threads, VbiSpectrum(plan, count, line, left, band));
+        // enough batches for each worker to have one while the next is read
+        BatchQueue queue(threads*2);
+        std::vector<Worker> work(threads);
+        std::vector<HANDLE> handles;
+        for (int i = 0; i < threads; ++i) {
+            work[i].queue = &queue;
+            work[i].spectrum = &spectra[i];
+            work[i].sampleBits = sampleBits;
+            HANDLE thread = CreateThread(NULL, 0, worker, &work[i], 0, NULL);
+            IF_NULL_THROW(thread);
+            handles.push_back(thread);
+        }
+        int fields = 0;
+        bool more = true;
+        VbiFieldHeader header;
+        while (more) {
+            Batch* batch = queue.empty();
+            batch->fields.resize(FIELDS_PER_BATCH);
+            batch->count = 0;
+            while (batch->count < FIELDS_PER_BATCH) {
+                if ((maxFields != 0 && fields == maxFields) || !reader.next(&header, &batch->fields[batch->count])) {
+                    more = false;
+                    break;
+                }
+                ++batch->count;
+                ++fields;
+            }
+            queue.fill(batch);
+        }
+        for (int i = 0; i < threads; ++i)
+            queue.fill(NULL);
+        WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], TRUE, INFINITE);
+        for (size_t i = 0; i < handles.size(); ++i)
+            CloseHandle(handles[i]);
+        for (int i = 1; i < threads; ++i)
+            spectra[0].merge(spectra[i]);
+        QueryPerformanceCounter(&end);
+        double seconds = static_cast<double>(end.QuadPart - start.QuadPart)/static_cast<double>(frequency.QuadPart);
+        if (fields == 0)
+            throw Exception(String("No fields in ") + _arguments[1]);
+
+        const VbiSpectrum& spectrum = spectra[0];
+        FILE* out = fopen(outputName, "w");
+        if (out == NULL)
+            throw Exception(String("Can't create ") + _arguments[2]);
+        fprintf(out, "MHz");
+        for (int b = 0; b < spectrum.bands(); ++b)
+            fprintf(out, ",line %i", b*band);
+        fprintf(out, "\n");
+        // the sample rate is samplesPerCycle times the colour carrier
+        double binMHz = 315.0/88*streamHeader.samplesPerCycle/plan.size();
+        for (int k = 0; k < plan.bins(); ++k) {
+            fprintf(out, "%.4f", k*binMHz);
+            for (int b = 0; b < spectrum.bands(); ++b) {
+                double power = spectrum.power(b, k);
+                fprintf(out, ",%.2f", power > 1e-12 ? 10*log10(power) : -120.0);
+            }
+            fprintf(out, "\n");
+        }
+        bool written = (ferror(out) == 0);
+        fclose(out);
+        if (!written)
+            throw Exception(String("Can't write ") + _arguments[2]);
+
+        double lines = static_cast<double>(fields)*spectrum.lines();
+        console.write(decimal(fields) + " fields (" + decimal(static_cast<int>(lines)) + " lines) in " +
+            decimal(static_cast<int>(seconds*1000)) + "ms on " + decimal(threads) + " threads (" +
+            decimal(static_cast<int>(fields/(seconds > 0 ? seconds : 1))) + " fields/s, " +
+            decimal(static_cast<int>(lines/(seconds > 0 ? seconds : 1))) + " lines/s)\n");
+    }
+};